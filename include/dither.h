@@ -0,0 +1,3 @@
+
+LIQ_PRIVATE void liq_bayer_thresholds(float thresholds[], unsigned int size);
+LIQ_PRIVATE bool liq_blue_noise_thresholds(float thresholds[], unsigned int size, void* (*malloc)(size_t), void (*free)(void*));
@@ -0,0 +1,13 @@
+#ifndef HISTSPILL_H
+#define HISTSPILL_H
+
+#include <stddef.h>
+
+struct histspill;
+
+LIQ_PRIVATE struct histspill *histspill_create(void* (*malloc)(size_t), void (*free)(void*));
+LIQ_PRIVATE bool histspill_write(struct histspill *spill, struct acolorhash_table *acht);
+LIQ_PRIVATE histogram *histspill_to_hist(struct histspill *spill, unsigned int maxcolors, unsigned int ignorebits, const float max_perceptual_weight, const float gamma_lut[256], size_t memory_limit);
+LIQ_PRIVATE void histspill_destroy(struct histspill *spill);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+/* nearest_candidate() reads the channel arrays in blocks, so they're padded to a multiple of this */
+#define LIQ_CANDIDATES_BLOCK 8
+
+typedef enum liq_simd_level {
+    LIQ_SIMD_NONE = 0,
+    LIQ_SIMD_SSE,
+    LIQ_SIMD_AVX2,
+    LIQ_SIMD_AVX512,
+} liq_simd_level;
+
+/*
+ Inner loops of the library, in the version for one instruction set.
+ Every version gives exactly the same results as the plain C one.
+ */
+struct liq_kernels {
+    liq_simd_level level;
+    const char *name;
+
+    // position of the color closest to px (lowest one on ties) among count colors given one channel per array.
+    // Arrays are 16-byte aligned and padded to a multiple of LIQ_CANDIDATES_BLOCK with colors that never match.
+    unsigned int (*nearest_candidate)(const float a[], const float r[], const float g[], const float b[], unsigned int count, f_pixel px, float *diff);
+
+    // to_f() of a row of pixels
+    void (*to_f_row)(const float gamma_lut[], f_pixel out[], const rgba_pixel in[], unsigned int width);
+
+    // one row of the noise and edges maps from the row and its neighbours above and below
+    void (*contrast_maps_row)(const f_pixel prev_row[], const f_pixel curr_row[], const f_pixel next_row[], unsigned int cols, unsigned char noise[], unsigned char edges[]);
+
+    // one row of liq_max3()/liq_min3(): every pixel becomes the maximum/minimum of itself and its four neighbours
+    void (*max3_row)(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], unsigned int width);
+    void (*min3_row)(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], unsigned int width);
+};
+
+LIQ_PRIVATE const struct liq_kernels *liq_kernels(void);
+LIQ_PRIVATE const struct liq_kernels *liq_kernels_for_level(liq_simd_level level);
+
+#endif
@@ -12,6 +12,8 @@
 #define LIQ_VERSION 20401
 #define LIQ_VERSION_STRING "2.4.1"
 
+#define LIQ_LUT_SIZE (1<<24) /* one palette index for every opaque RGB color */
+
 #ifndef LIQ_PRIVATE
 #if defined(__GNUC__) || defined (__llvm__)
 #define LIQ_PRIVATE __attribute__((visibility("hidden")))
@@ -30,7 +32,10 @@ extern "C" {
 #include "mediancut.h"
 #include "nearest.h"
 #include "blur.h"
+#include "dither.h"
 #include "viter.h"
+#include "histspill.h"
+#include "kernels.h"
 
 typedef struct liq_attr liq_attr;
 typedef struct liq_image liq_image;
@@ -49,6 +54,14 @@ typedef void liq_log_callback_function(const liq_attr*, const char *message, voi
 typedef void liq_log_flush_callback_function(const liq_attr*, void* user_info);
 typedef void liq_image_get_rgba_row_callback(liq_color row_out[], int row, int width, void* user_info);
 
+typedef enum liq_dither_mode {
+    LIQ_DITHER_FLOYD_STEINBERG = 0, /* error diffusion, the default */
+    LIQ_DITHER_BAYER_2X2,
+    LIQ_DITHER_BAYER_4X4,
+    LIQ_DITHER_BAYER_8X8,
+    LIQ_DITHER_BLUE_NOISE,          /* 64x64 tile of blue noise thresholds */
+} liq_dither_mode;
+
 struct liq_attr {
     const char *magic_header;
     void* (*malloc)(size_t);
@@ -61,6 +74,8 @@ struct liq_attr {
     unsigned int voronoi_iterations, feedback_loop_trials;
     bool last_index_transparent, use_contrast_maps, use_dither_map, fast_palette;
     unsigned int speed;
+    unsigned int max_threads; /* 0 uses every thread OpenMP offers */
+    size_t histogram_memory_limit; /* bytes of colors kept in memory before spilling to temporary files, 0 never spills */
     liq_log_callback_function *log_callback;
     void *log_callback_user_info;
     liq_log_flush_callback_function *log_flush_callback;
@@ -82,8 +97,10 @@ struct liq_image {
     liq_image_get_rgba_row_callback *row_callback;
     void *row_callback_user_info;
     float min_opaque_val;
+    unsigned int max_threads;
     f_pixel fixed_colors[256];
     unsigned short fixed_colors_count;
+    histogram *hist; /* made ahead by liq_image_make_histogram, used up by the next scoring */
     bool free_pixels, free_rows, free_rows_internal;
     float gamma_lut[256];
 };
@@ -109,8 +126,14 @@ struct liq_result {
 
     liq_remapping_result *remapping;
     colormap *palette;
+    struct nearest_map *fixed_nearest;
+    const unsigned char *fixed_lut;
     liq_palette int_palette;
     float dither_level;
+    liq_dither_mode dither_mode;
+    float *dither_thresholds; /* dither_thresholds_size squared, for ordered modes */
+    unsigned int dither_thresholds_size;
+    unsigned int dither_seed;
     double gamma, palette_error;
     int min_posterization_output;
     bool use_dither_map, fast_palette;
@@ -147,6 +170,10 @@ LIQ_EXPORT liq_error liq_set_quality(liq_attr* attr, int minimum, int maximum);
 LIQ_EXPORT int liq_get_min_quality(const liq_attr* attr);
 LIQ_EXPORT int liq_get_max_quality(const liq_attr* attr);
 LIQ_EXPORT void liq_set_last_index_transparent(liq_attr* attr, int is_last);
+LIQ_EXPORT liq_error liq_set_max_threads(liq_attr* attr, int threads);
+LIQ_EXPORT int liq_get_max_threads(const liq_attr* attr);
+LIQ_EXPORT liq_error liq_set_histogram_memory_limit(liq_attr* attr, int megabytes);
+LIQ_EXPORT int liq_get_histogram_memory_limit(const liq_attr* attr);
 
 LIQ_EXPORT void liq_set_log_callback(liq_attr*, liq_log_callback_function*, void* user_info);
 LIQ_EXPORT void liq_set_log_flush_callback(liq_attr*, liq_log_flush_callback_function*, void* user_info);
@@ -158,14 +185,20 @@ LIQ_EXPORT liq_image *liq_image_create_custom(liq_attr *attr, liq_image_get_rgba
 
 LIQ_EXPORT liq_error liq_image_set_memory_ownership(liq_image *image, int ownership_flags);
 LIQ_EXPORT liq_error liq_image_add_fixed_color(liq_image *img, liq_color color);
+LIQ_EXPORT liq_error liq_image_set_max_threads(liq_image *img, int threads);
 LIQ_EXPORT int liq_image_get_width(const liq_image *img);
 LIQ_EXPORT int liq_image_get_height(const liq_image *img);
 LIQ_EXPORT void liq_image_destroy(liq_image *img);
+LIQ_EXPORT liq_error liq_image_convert_f_pixels(liq_image *input_image);
 
 LIQ_EXPORT liq_result *liq_quantize_image(liq_attr *options, liq_image *input_image);
 LIQ_EXPORT liq_error liq_image_quantize(liq_image *const input_image, liq_attr *const options, liq_result **result);
+LIQ_EXPORT liq_error liq_image_make_histogram(liq_image *const input_image, liq_attr *const options);
+LIQ_EXPORT liq_error liq_image_score_fixed_palettes(liq_image *const input_image, liq_attr *const options, const liq_color colors[], int palette_size, int palettes_count, double errors[]);
 
 LIQ_EXPORT liq_error liq_set_dithering_level(liq_result *res, float dither_level);
+LIQ_EXPORT liq_error liq_set_dithering_mode(liq_result *res, liq_dither_mode mode);
+LIQ_EXPORT liq_error liq_set_dithering_seed(liq_result *res, unsigned int seed);
 LIQ_EXPORT liq_error liq_set_output_gamma(liq_result* res, double gamma);
 LIQ_EXPORT double liq_get_output_gamma(const liq_result *result);
 
@@ -174,8 +207,16 @@ LIQ_EXPORT const liq_palette *liq_get_palette(liq_result *result);
 LIQ_EXPORT liq_error liq_write_remapped_image(liq_result *result, liq_image *input_image, void *buffer, size_t buffer_size);
 LIQ_EXPORT liq_error liq_write_remapped_image_rows(liq_result *result, liq_image *input_image, unsigned char **row_pointers);
 
+LIQ_EXPORT liq_result *liq_result_create_fixed(liq_attr *attr, const liq_color colors[], int colors_count, double gamma);
+LIQ_EXPORT liq_error liq_write_remapped_image_fixed(const liq_result *result, liq_image *input_image, void *buffer, size_t buffer_size, double *remapping_error);
+LIQ_EXPORT liq_error liq_write_remapped_image_fixed_rows(const liq_result *result, liq_image *input_image, unsigned char **row_pointers, double *remapping_error);
+LIQ_EXPORT liq_error liq_write_remapped_image_fixed_alpha(const liq_result *result, liq_image *input_image, void *buffer, size_t buffer_size, void *alpha_buffer, size_t alpha_buffer_size, double *remapping_error);
+LIQ_EXPORT liq_error liq_result_build_lut(const liq_result *result, unsigned char *lut, size_t lut_size);
+LIQ_EXPORT liq_error liq_result_set_lut(liq_result *result, const unsigned char *lut, size_t lut_size);
+
 LIQ_EXPORT double liq_get_quantization_error(liq_result *result);
 LIQ_EXPORT int liq_get_quantization_quality(liq_result *result);
+LIQ_EXPORT int liq_mse_to_quality(double mse);
 
 LIQ_EXPORT void liq_result_destroy(liq_result *);
 
@@ -0,0 +1,22 @@
+/*
+ * lut.h
+ *
+ *  Direct color to palette index lookup tables, cached on disk per palette.
+ */
+
+#ifndef LUT_H
+#define LUT_H
+
+#include <stddef.h>
+#include "libimagequant.h"
+
+typedef struct {
+    unsigned char* table;
+    size_t mappedSize;
+    void* mapping;
+} PaletteLut;
+
+int open_palette_lut(const char* cacheDirectory, const liq_result* fixedResult, PaletteLut** paletteLut);
+void close_palette_lut(PaletteLut* paletteLut);
+
+#endif /* LUT_H */
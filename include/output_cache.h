@@ -0,0 +1,30 @@
+/*
+ * output_cache.h
+ *
+ *  A size bounded on-disk cache of finished outputs, keyed by a hash of the
+ *  input file, the palette file and the output options.
+ */
+
+#ifndef OUTPUT_CACHE_H
+#define OUTPUT_CACHE_H
+
+#include <stdint.h>
+#include "remap_job.h"
+
+typedef struct OutputCache OutputCache;
+
+typedef struct {
+    int hits;
+    int misses;
+    int evictions;
+    uint64_t size;          /* bytes held by the cache directory */
+} OutputCacheStats;
+
+int open_output_cache(const char* cacheDirectory, uint64_t maxSize, const unsigned char* paletteData, size_t paletteSize, OutputCache** outputCache);
+uint64_t output_cache_key(const OutputCache* outputCache, const remap_output outputs[], int outputCount, const unsigned char* input, size_t inputSize);
+int output_cache_get(OutputCache* outputCache, uint64_t key, int outputCount, remap_png_result results[]);
+int output_cache_put(OutputCache* outputCache, uint64_t key, int outputCount, const remap_png_result results[]);
+void output_cache_get_stats(OutputCache* outputCache, OutputCacheStats* stats);
+void close_output_cache(OutputCache* outputCache);
+
+#endif /* OUTPUT_CACHE_H */
@@ -8,6 +8,8 @@
 #ifndef PALETTE_H
 #define PALETTE_H
 
+#include <stddef.h>
+
 typedef struct {
     unsigned char R;
     unsigned char G;
@@ -24,6 +26,7 @@ typedef enum {
 } PaletteFormat;
 
 int read_palette(const char* fileName, Color** colorPalette, int* paletteCount, int* transparentIndex);
+int read_palette_memory(const unsigned char* data, size_t size, Color** colorPalette, int* paletteCount, int* transparentIndex);
 int write_palette(const char* fileName, Color* colorPalette, int paletteCount, int transparentIndex, PaletteFormat paletteFormat);
 
 #endif /* PALETTE_H */
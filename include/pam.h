@@ -220,6 +220,18 @@ union rgba_as_int {
     unsigned int l;
 };
 
+/* mask posterizes all 4 channels in one go, filling the dropped low bits with copies of the high ones */
+inline static unsigned int pam_posterize(const unsigned int color, const unsigned int ignorebits)
+{
+    if (!ignorebits) return color;
+
+    const unsigned int channel_mask = 255U>>ignorebits<<ignorebits;
+    const unsigned int channel_hmask = (255U>>ignorebits) ^ 0xFFU;
+    const unsigned int posterize_mask = channel_mask << 24 | channel_mask << 16 | channel_mask << 8 | channel_mask;
+    const unsigned int posterize_high_mask = channel_hmask << 24 | channel_hmask << 16 | channel_hmask << 8 | channel_hmask;
+    return (color & posterize_mask) | ((color & posterize_high_mask) >> (8-ignorebits));
+}
+
 typedef struct {
     f_pixel acolor;
     float adjusted_weight,   // perceptual weight changed to tweak how mediancut selects colors
@@ -259,28 +271,31 @@ struct acolorhist_arr_item {
     float perceptual_weight;
 };
 
-struct acolorhist_arr_head {
-    unsigned int used, capacity;
-    struct {
-        union rgba_as_int color;
-        float perceptual_weight;
-    } inline1, inline2;
-    struct acolorhist_arr_item *other_items;
+struct acolorhash_slot {
+    union rgba_as_int color;
+    unsigned int index; // 1 + position of the color in items, 0 if the slot is empty
 };
 
+/* open addressing table of slots pointing into items, which are kept in the order colors were first seen */
 struct acolorhash_table {
-    struct mempool *mempool;
+    void* (*malloc)(size_t);
+    void (*free)(void*);
     unsigned int ignorebits, maxcolors, colors, cols, rows;
-    unsigned int hash_size;
-    unsigned int freestackp;
-    struct acolorhist_arr_item *freestack[512];
-    struct acolorhist_arr_head buckets[];
+    unsigned int hash_mask; // number of slots - 1, a power of two minus one
+    unsigned int hash_seed;
+    unsigned int capacity;  // of items
+    struct acolorhash_slot *slots;
+    struct acolorhist_arr_item *items;
+    bool out_of_memory; // set when counting failed for want of memory rather than for too many colors
 };
 
 LIQ_PRIVATE void pam_freeacolorhash(struct acolorhash_table *acht);
 LIQ_PRIVATE struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors, unsigned int surface, unsigned int ignorebits, void* (*malloc)(size_t), void (*free)(void*));
 LIQ_PRIVATE histogram *pam_acolorhashtoacolorhist(const struct acolorhash_table *acht, const double gamma, const float gamma_lut[256], void* (*malloc)(size_t), void (*free)(void*));
 LIQ_PRIVATE bool pam_computeacolorhash(struct acolorhash_table *acht, const rgba_pixel *const pixels[], unsigned int cols, unsigned int rows, const unsigned char *importance_map);
+LIQ_PRIVATE bool pam_reposterizeacolorhash(struct acolorhash_table *acht);
+LIQ_PRIVATE bool pam_mergeacolorhash(struct acolorhash_table *acht, const struct acolorhash_table *src);
+LIQ_PRIVATE void pam_clearacolorhash(struct acolorhash_table *acht);
 
 LIQ_PRIVATE void pam_freeacolorhist(histogram *h);
 
@@ -0,0 +1,45 @@
+/*
+ * pngstream.h
+ *
+ *  Row by row PNG reading and writing, so images never have to fit in memory.
+ */
+
+#ifndef PNGSTREAM_H
+#define PNGSTREAM_H
+
+#include <stdio.h>
+#include <zlib.h>
+#include "lodepng.h"
+
+typedef struct {
+    FILE* file;
+    z_stream zstream;
+    unsigned int width;
+    unsigned int height;
+    LodePNGColorMode color;
+    size_t rowSize;
+    unsigned int rowsRead;
+    unsigned char* scanline;
+    unsigned char* previousScanline;
+    unsigned char* input;
+    unsigned int chunkRemaining;
+    int streamEnded;
+} PngReader;
+
+typedef struct {
+    FILE* file;
+    z_stream zstream;
+    size_t rowSize;
+    unsigned char* scanline;
+    unsigned char* output;
+} PngWriter;
+
+int png_reader_open(const char* fileName, PngReader** reader);
+int png_reader_read_rgba_rows(PngReader* reader, unsigned char* rgbaRows, unsigned int rowCount);
+void png_reader_close(PngReader* reader);
+
+int png_writer_open(const char* fileName, unsigned int width, unsigned int height, const LodePNGColorMode* color, PngWriter** writer);
+int png_writer_write_row(PngWriter* writer, const unsigned char* row);
+int png_writer_close(PngWriter* writer);
+
+#endif /* PNGSTREAM_H */
@@ -0,0 +1,130 @@
+/*
+ * remap_job.h
+ *
+ *  Reentrant remapping of in-memory RGBA images to a fixed palette.
+ *
+ *  A remap_palette is created once and can be shared by any number of
+ *  concurrent remap_job_run calls. Everything a job needs is passed in or
+ *  returned, there is no global state.
+ */
+
+#ifndef REMAP_JOB_H
+#define REMAP_JOB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "palette.h"
+#include "lodepng.h"
+#include "stats.h"
+
+#define REMAP_SLOT_SIZE 16
+#define REMAP_MAX_SLOTS 16
+#define REMAP_SLOT_AUTO -2
+#define REMAP_MAX_OUTPUTS 16
+#define REMAP_MAX_TILE_SIZE 64
+
+#define REMAP_MASK_NONE 0
+#define REMAP_MASK_RGBA 32   /* white where the input has color, the input's alpha */
+
+#define REMAP_FORMAT_PNG 0
+#define REMAP_FORMAT_RAW 1       /* packed rows of 1, 2, 4 or 8 bit indices */
+#define REMAP_FORMAT_SNES 2      /* 4 bit planar 8x8 tiles */
+#define REMAP_FORMAT_GBA 3       /* 4 bit 8x8 tiles, left pixel in the low nibble */
+#define REMAP_FORMAT_GENESIS 4   /* 4 bit 8x8 tiles, left pixel in the high nibble */
+
+#define REMAP_DITHER_NONE 0
+#define REMAP_DITHER_BAYER2 1    /* ordered dithering with a 2x2, 4x4 or 8x8 Bayer matrix */
+#define REMAP_DITHER_BAYER4 2
+#define REMAP_DITHER_BAYER8 3
+#define REMAP_DITHER_BLUE_NOISE 4 /* ordered dithering with a 64x64 blue noise tile */
+
+#define REMAP_RAW_VERSION 1
+#define REMAP_RAW_HEADER_SIZE 20 /* "RMAP", version, format, bits, 0, width, height, colors, first color */
+#define REMAP_RAW_TILE_BYTES 32
+
+typedef struct remap_palette remap_palette;
+
+typedef struct {
+    int rangeMin;       /* first palette color the image may use */
+    int rangeMax;       /* last palette color, -1 for the end of the palette */
+    int paletteSlot;    /* 16 color slot, -1 for none or REMAP_SLOT_AUTO to pick the best */
+    bool countColors;   /* count the distinct colors of the input */
+    bool alpha;         /* return the alpha of every pixel, taken during the remap */
+    int tileSize;       /* pick a slot for every tileSize x tileSize tile, 0 for none */
+    int threads;        /* threads the job may use, 0 for every core */
+    int dither;         /* REMAP_DITHER_NONE or an ordered dithering mode */
+} remap_options;
+
+typedef struct {
+    unsigned char* indices;             /* width * height palette indices, relative to rangeMin */
+    unsigned char* alpha;               /* width * height alpha values, only when asked for */
+    int width;
+    int height;
+    int rangeMin;                       /* range actually used, after applying the slot */
+    int rangeMax;
+    int paletteSlot;                    /* slot used, -1 if none */
+    int slotCount;                      /* slots scored for REMAP_SLOT_AUTO, 0 otherwise */
+    double slotErrors[REMAP_MAX_SLOTS];
+    unsigned char* tileSlots;           /* slot of each tile, row by row, only for tiles */
+    int tileSize;
+    int tilesWide;
+    int tilesHigh;
+    int inputColors;                    /* distinct input colors, -1 if not counted */
+    double mse;
+    int quality;
+    remap_stats stats;                  /* time spent in each stage of the job */
+} remap_result;
+
+typedef struct {
+    remap_options options;
+    int bitDepth;                       /* 4 or 8, 1 and 2 for raw too, slots and tiles are always written at 4 */
+    int maskBits;                       /* REMAP_MASK_NONE, 1, 8 or REMAP_MASK_RGBA */
+    int format;                         /* REMAP_FORMAT_PNG or one of the raw formats, masks are always PNG */
+} remap_output;
+
+typedef struct {
+    LodePNGColorType inputColorType;
+    unsigned int inputBitDepth;
+    remap_result result;
+    unsigned char* png;                 /* the output in its format, not always a PNG */
+    size_t pngSize;
+    unsigned char* maskPng;             /* only when a mask was asked for */
+    size_t maskPngSize;
+} remap_png_result;
+
+typedef struct {
+    unsigned int* seen;
+    unsigned char (*composite)[256];
+    int count;
+} color_counter;
+
+remap_palette* remap_palette_create(const Color* colors, int colorCount);
+int remap_palette_set_lut_directory(remap_palette* palette, const char* cacheDirectory);
+void remap_palette_destroy(remap_palette* palette);
+
+void remap_options_init(remap_options* options);
+int remap_options_resolve(const remap_palette* palette, remap_options* options);
+
+int remap_job_run(remap_palette* palette, const remap_options* options, const unsigned char* rgbaImage, int width, int height, remap_result* result);
+int remap_job_run_multi(remap_palette* palette, const remap_options options[], int count, const unsigned char* rgbaImage, int width, int height, remap_result results[]);
+void remap_result_free(remap_result* result);
+
+int remap_job_run_png(remap_palette* palette, const remap_options* options, int bitDepth, int maskBits, const unsigned char* png, size_t pngSize, remap_png_result* result);
+int remap_job_run_png_outputs(remap_palette* palette, const remap_output outputs[], int outputCount, const unsigned char* png, size_t pngSize, remap_png_result results[]);
+void remap_png_result_free(remap_png_result* result);
+
+void remap_set_output_palette(const remap_palette* palette, int rangeMin, int rangeMax, int bitDepth, LodePNGColorMode* colorMode);
+void remap_pack_row(const unsigned char* indices, int width, int rangeMin, int bitDepth, unsigned char* outputRow);
+void remap_mask_pixels(const unsigned char* rgbaPixels, unsigned char* maskPixels, size_t pixelCount);
+void remap_set_mask_mode(int maskBits, LodePNGColorMode* colorMode);
+void remap_pack_mask_row(const unsigned char* alpha, int width, int maskBits, unsigned char* outputRow);
+int remap_encode_png(const remap_palette* palette, const remap_result* result, int bitDepth, unsigned char** png, size_t* pngSize);
+int remap_encode_raw(const remap_palette* palette, const remap_result* result, int format, int bitDepth, unsigned char** data, size_t* dataSize);
+int remap_encode_mask_png(const unsigned char* rgbaImage, int width, int height, unsigned char** png, size_t* pngSize);
+int remap_encode_alpha_mask_png(const unsigned char* alpha, int width, int height, int maskBits, unsigned char** png, size_t* pngSize);
+
+int color_counter_init(color_counter* counter);
+int color_counter_add(color_counter* counter, const unsigned char* pixels, size_t pixelCount);
+void color_counter_free(color_counter* counter);
+
+#endif /* REMAP_JOB_H */
@@ -0,0 +1,24 @@
+/*
+ * remap_sequence.h
+ *
+ *  Remapping of animation frames that reuses the previous frame's indices.
+ *
+ *  Only the pixels that differ from the previous frame are looked up, the
+ *  others keep their index. The output is the same as remapping every frame
+ *  on its own, except that REMAP_SLOT_AUTO picks one slot for the sequence
+ *  from the first frame.
+ */
+
+#ifndef REMAP_SEQUENCE_H
+#define REMAP_SEQUENCE_H
+
+#include "remap_job.h"
+
+typedef struct remap_sequence remap_sequence;
+
+remap_sequence* remap_sequence_create(remap_palette* palette, const remap_options* options);
+int remap_sequence_next(remap_sequence* sequence, const unsigned char* rgbaImage, int width, int height, remap_result* result, size_t* changedPixels);
+int remap_sequence_next_png(remap_sequence* sequence, int bitDepth, int maskBits, const unsigned char* png, size_t pngSize, remap_png_result* result, size_t* changedPixels);
+void remap_sequence_destroy(remap_sequence* sequence);
+
+#endif /* REMAP_SEQUENCE_H */
@@ -0,0 +1,47 @@
+/*
+ * remap_server.h
+ *
+ *  A long-running remap service on a Unix domain socket, and its client.
+ *
+ *  Requests carry a PNG and either the palette file contents or the id of a
+ *  palette the server has already seen. Parsed palettes and their searches are
+ *  kept in a small LRU cache, and requests are served by a fixed worker pool.
+ */
+
+#ifndef REMAP_SERVER_H
+#define REMAP_SERVER_H
+
+#include <stdint.h>
+#include "remap_job.h"
+
+#define REMAP_SERVER_OK 0
+#define REMAP_SERVER_ERROR 1
+#define REMAP_SERVER_UNKNOWN_PALETTE 2
+
+typedef struct {
+    remap_options options;
+    int bitDepth;
+    int maskBits;                       /* REMAP_MASK_NONE, 1, 8 or REMAP_MASK_RGBA */
+    uint64_t paletteId;                 /* used when no palette data is sent */
+    const unsigned char* paletteData;   /* palette file contents, in any format read_palette knows */
+    size_t paletteSize;
+    const unsigned char* png;
+    size_t pngSize;
+} remap_request;
+
+typedef struct {
+    int status;                         /* REMAP_SERVER_OK, REMAP_SERVER_ERROR or REMAP_SERVER_UNKNOWN_PALETTE */
+    uint64_t paletteId;                 /* can be sent instead of the palette data from now on */
+    char message[256];
+    remap_png_result output;            /* output.result.indices isn't sent */
+} remap_response;
+
+uint64_t remap_palette_id(const unsigned char* paletteData, size_t paletteSize);
+
+int remap_server_run(const char* socketPath, int workerCount, int threadsPerJob, int cacheSize, const char* lutDirectory, int idleTimeout);
+
+int remap_client_connect(const char* socketPath);
+int remap_client_request(int clientSocket, const remap_request* request, remap_response* response);
+void remap_response_free(remap_response* response);
+
+#endif /* REMAP_SERVER_H */
@@ -0,0 +1,40 @@
+/*
+ * stats.h
+ *
+ *  Wall and CPU time per remap stage, and peak memory use.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+typedef enum {
+    REMAP_STAGE_LOAD,
+    REMAP_STAGE_DECODE,
+    REMAP_STAGE_COUNT_COLORS,
+    REMAP_STAGE_HISTOGRAM,
+    REMAP_STAGE_QUANTIZE,
+    REMAP_STAGE_REMAP,
+    REMAP_STAGE_ENCODE,
+    REMAP_STAGE_SAVE,
+    REMAP_STAGE_LAST
+} remap_stage;
+
+typedef struct {
+    double wall;        /* seconds */
+    double cpu;         /* seconds of process CPU time, all threads */
+} stage_time;
+
+typedef struct {
+    stage_time stages[REMAP_STAGE_LAST];
+} remap_stats;
+
+const char* stats_stage_name(remap_stage stage);
+
+void stats_start(stage_time* start);
+void stats_stop(remap_stats* stats, remap_stage stage, const stage_time* start);
+void stats_add(remap_stats* total, const remap_stats* stats);
+stage_time stats_total(const remap_stats* stats);
+
+long stats_peak_memory_kb(void);
+
+#endif /* STATS_H */
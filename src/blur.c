@@ -48,25 +48,13 @@ static void transposing_1d_blur(unsigned char *restrict src, unsigned char *rest
  */
 LIQ_PRIVATE void liq_max3(unsigned char *src, unsigned char *dst, unsigned int width, unsigned int height)
 {
+    const struct liq_kernels *const kernels = liq_kernels();
     for(unsigned int j=0; j < height; j++) {
         const unsigned char *row = src + j*width,
         *prevrow = src + (j > 1 ? j-1 : 0)*width,
         *nextrow = src + MIN(height-1,j+1)*width;
 
-        unsigned char prev,curr=row[0],next=row[0];
-
-        for(unsigned int i=0; i < width-1; i++) {
-            prev=curr;
-            curr=next;
-            next=row[i+1];
-
-            unsigned char t1 = MAX(prev,next);
-            unsigned char t2 = MAX(nextrow[i],prevrow[i]);
-            *dst++ = MAX(curr,MAX(t1,t2));
-        }
-        unsigned char t1 = MAX(curr,next);
-        unsigned char t2 = MAX(nextrow[width-1],prevrow[width-1]);
-        *dst++ = MAX(t1,t2);
+        kernels->max3_row(prevrow, row, nextrow, dst + j*width, width);
     }
 }
 
@@ -75,25 +63,13 @@ LIQ_PRIVATE void liq_max3(unsigned char *src, unsigned char *dst, unsigned int w
  */
 LIQ_PRIVATE void liq_min3(unsigned char *src, unsigned char *dst, unsigned int width, unsigned int height)
 {
+    const struct liq_kernels *const kernels = liq_kernels();
     for(unsigned int j=0; j < height; j++) {
         const unsigned char *row = src + j*width,
         *prevrow = src + (j > 1 ? j-1 : 0)*width,
         *nextrow = src + MIN(height-1,j+1)*width;
 
-        unsigned char prev,curr=row[0],next=row[0];
-
-        for(unsigned int i=0; i < width-1; i++) {
-            prev=curr;
-            curr=next;
-            next=row[i+1];
-
-            unsigned char t1 = MIN(prev,next);
-            unsigned char t2 = MIN(nextrow[i],prevrow[i]);
-            *dst++ = MIN(curr,MIN(t1,t2));
-        }
-        unsigned char t1 = MIN(curr,next);
-        unsigned char t2 = MIN(nextrow[width-1],prevrow[width-1]);
-        *dst++ = MIN(t1,t2);
+        kernels->min3_row(prevrow, row, nextrow, dst + j*width, width);
     }
 }
 
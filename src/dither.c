@@ -0,0 +1,150 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "libimagequant.h"
+#include "pam.h"
+#include "dither.h"
+
+/*
+ Threshold matrices for ordered dithering, tiled over the image.
+ A threshold is in -0.5..0.5 and says how far, in units of the distance between palette colors,
+ the pixel at that position is pushed before it's mapped.
+ */
+
+static const unsigned char bayer8[8*8] = {
+     0, 32,  8, 40,  2, 34, 10, 42,
+    48, 16, 56, 24, 50, 18, 58, 26,
+    12, 44,  4, 36, 14, 46,  6, 38,
+    60, 28, 52, 20, 62, 30, 54, 22,
+     3, 35, 11, 43,  1, 33,  9, 41,
+    51, 19, 59, 27, 49, 17, 57, 25,
+    15, 47,  7, 39, 13, 45,  5, 37,
+    63, 31, 55, 23, 61, 29, 53, 21,
+};
+
+/**
+ * Bayer matrix of size 2, 4 or 8. The top left corner of the 8x8 matrix is the smaller matrix times 4 or 16.
+ */
+LIQ_PRIVATE void liq_bayer_thresholds(float thresholds[], unsigned int size)
+{
+    assert(size == 2 || size == 4 || size == 8);
+    const unsigned int scale = 64 / (size*size);
+    for(unsigned int y=0; y < size; y++) {
+        for(unsigned int x=0; x < size; x++) {
+            thresholds[y*size + x] = (bayer8[y*8 + x] / scale + 0.5f) / (size*size) - 0.5f;
+        }
+    }
+}
+
+#define BLUE_NOISE_RADIUS 6
+#define BLUE_NOISE_SIGMA 1.5f
+
+/* adds (or with a negative sign removes) a point's gaussian to the energy of its neighborhood, wrapping around */
+static void blue_noise_toggle(float energy[], const float kernel[], const unsigned int size, const unsigned int point, const float sign)
+{
+    const unsigned int mask = size-1, px = point % size, py = point / size;
+    const int width = 2*BLUE_NOISE_RADIUS+1;
+    for(int dy=-BLUE_NOISE_RADIUS; dy <= BLUE_NOISE_RADIUS; dy++) {
+        float *const row = energy + ((py + dy) & mask) * size;
+        const float *const krow = kernel + (dy + BLUE_NOISE_RADIUS) * width + BLUE_NOISE_RADIUS;
+        for(int dx=-BLUE_NOISE_RADIUS; dx <= BLUE_NOISE_RADIUS; dx++) {
+            row[(px + dx) & mask] += sign * krow[dx];
+        }
+    }
+}
+
+/* tightest cluster is the point with the highest energy, largest void the empty spot with the lowest */
+static unsigned int blue_noise_find(const float energy[], const unsigned char points[], const unsigned int count, const bool tightest_cluster)
+{
+    unsigned int best = 0;
+    float best_energy = tightest_cluster ? -1.f : INFINITY;
+    for(unsigned int i=0; i < count; i++) {
+        if (points[i] != tightest_cluster) continue;
+        if (tightest_cluster ? energy[i] > best_energy : energy[i] < best_energy) {
+            best_energy = energy[i];
+            best = i;
+        }
+    }
+    return best;
+}
+
+/**
+ * Blue noise of size x size (a power of 2) made with Ulichney's void-and-cluster method:
+ * points of a random pattern are moved from the tightest clusters to the largest voids until
+ * they're evenly spread, then every position gets its rank in the order points are taken away
+ * from that pattern, or added to it.
+ */
+LIQ_PRIVATE bool liq_blue_noise_thresholds(float thresholds[], unsigned int size, void* (*malloc)(size_t), void (*free)(void*))
+{
+    assert(size >= 2*BLUE_NOISE_RADIUS+1 && !(size & (size-1)));
+    const unsigned int count = size*size;
+    const int width = 2*BLUE_NOISE_RADIUS+1;
+
+    float kernel[(2*BLUE_NOISE_RADIUS+1)*(2*BLUE_NOISE_RADIUS+1)];
+    for(int dy=-BLUE_NOISE_RADIUS; dy <= BLUE_NOISE_RADIUS; dy++) {
+        for(int dx=-BLUE_NOISE_RADIUS; dx <= BLUE_NOISE_RADIUS; dx++) {
+            kernel[(dy + BLUE_NOISE_RADIUS) * width + dx + BLUE_NOISE_RADIUS] = expf(-(dx*dx + dy*dy) / (2.f*BLUE_NOISE_SIGMA*BLUE_NOISE_SIGMA));
+        }
+    }
+
+    float *const energy = malloc(2 * count * sizeof(energy[0]));
+    unsigned char *const points = malloc(2 * count);
+    if (!energy || !points) {
+        if (energy) free(energy);
+        if (points) free(points);
+        return false;
+    }
+    float *const initial_energy = energy + count;
+    unsigned char *const initial_points = points + count;
+    memset(energy, 0, count * sizeof(energy[0]));
+    memset(points, 0, count);
+
+    // a fixed seed, so every run gets the same texture
+    const unsigned int initial_count = count / 10;
+    unsigned int seed = 12345;
+    for(unsigned int placed = 0; placed < initial_count;) {
+        seed = seed * 1103515245U + 12345U;
+        const unsigned int point = (seed >> 8) % count;
+        if (!points[point]) {
+            points[point] = 1;
+            blue_noise_toggle(energy, kernel, size, point, 1.f);
+            placed++;
+        }
+    }
+
+    // spreads the points out: stops once the point taken from the tightest cluster is the one that fills the largest void
+    for(unsigned int i=0; i < count; i++) {
+        const unsigned int cluster = blue_noise_find(energy, points, count, true);
+        points[cluster] = 0;
+        blue_noise_toggle(energy, kernel, size, cluster, -1.f);
+
+        const unsigned int hole = blue_noise_find(energy, points, count, false);
+        points[hole] = 1;
+        blue_noise_toggle(energy, kernel, size, hole, 1.f);
+        if (hole == cluster) break;
+    }
+    memcpy(initial_energy, energy, count * sizeof(energy[0]));
+    memcpy(initial_points, points, count);
+
+    for(unsigned int rank = initial_count; rank-- > 0;) {
+        const unsigned int cluster = blue_noise_find(energy, points, count, true);
+        points[cluster] = 0;
+        blue_noise_toggle(energy, kernel, size, cluster, -1.f);
+        thresholds[cluster] = (rank + 0.5f) / count - 0.5f;
+    }
+
+    memcpy(energy, initial_energy, count * sizeof(energy[0]));
+    memcpy(points, initial_points, count);
+    for(unsigned int rank = initial_count; rank < count; rank++) {
+        const unsigned int hole = blue_noise_find(energy, points, count, false);
+        points[hole] = 1;
+        blue_noise_toggle(energy, kernel, size, hole, 1.f);
+        thresholds[hole] = (rank + 0.5f) / count - 0.5f;
+    }
+
+    free(energy);
+    free(points);
+    return true;
+}
@@ -0,0 +1,385 @@
+/*
+ Histogram of colors that don't fit in memory at once.
+
+ Whenever the color table gets full its colors are sorted and appended to a temporary file as a run,
+ and the table starts over. In the end the runs are merged, summing the weights of colors found in
+ several of them, into one histogram.
+
+ Runs are sorted by the bits of the four channels interleaved, highest first, so colors that
+ posterization at any level makes the same are next to each other: if there are more colors than
+ the histogram may hold, the merge picks the lowest level that leaves few enough and posterizes
+ colors as they stream by, without sorting them again.
+
+ Every run being merged needs a read buffer, so when there are more runs than the memory limit has
+ buffers for, runs are first merged a few at a time into longer runs appended to the file.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "libimagequant.h"
+#include "pam.h"
+#include "histspill.h"
+
+#define HISTSPILL_READ_ITEMS 4096 /* items buffered for each run while merging */
+
+struct histspill_run {
+    uint64_t start, count; // in items
+};
+
+struct histspill_reader {
+    uint64_t next, end;
+    unsigned int pos, count;
+    struct acolorhist_arr_item buf[HISTSPILL_READ_ITEMS];
+};
+
+struct histspill {
+    void* (*malloc)(size_t);
+    void (*free)(void*);
+    int fd;
+    uint64_t items;
+    unsigned int runs_count, runs_capacity;
+    struct histspill_run *runs;
+
+    // merge state
+    struct histspill_reader *readers;
+    struct acolorhist_arr_item *write_buf;
+    unsigned int *heap, heap_size;
+    bool failed;
+};
+
+/* spreads 8 bits out to every 4th bit */
+inline static unsigned int histspill_spread(unsigned int x)
+{
+    x = (x | x << 12) & 0x000F000FU;
+    x = (x | x << 6) & 0x03030303U;
+    x = (x | x << 3) & 0x11111111U;
+    return x;
+}
+
+inline static unsigned int histspill_gather(unsigned int x)
+{
+    x &= 0x11111111U;
+    x = (x | x >> 3) & 0x03030303U;
+    x = (x | x >> 6) & 0x000F000FU;
+    x = (x | x >> 12) & 0xFFU;
+    return x;
+}
+
+inline static unsigned int histspill_key(const rgba_pixel px)
+{
+    return histspill_spread(px.a) << 3 | histspill_spread(px.b) << 2 | histspill_spread(px.g) << 1 | histspill_spread(px.r);
+}
+
+inline static rgba_pixel histspill_color(const unsigned int key)
+{
+    return (rgba_pixel){
+        .r = histspill_gather(key),
+        .g = histspill_gather(key >> 1),
+        .b = histspill_gather(key >> 2),
+        .a = histspill_gather(key >> 3),
+    };
+}
+
+static int histspill_compare_items(const void *ap, const void *bp)
+{
+    const unsigned int a = ((const struct acolorhist_arr_item*)ap)->color.l,
+                       b = ((const struct acolorhist_arr_item*)bp)->color.l;
+    return (a > b) - (a < b);
+}
+
+LIQ_PRIVATE struct histspill *histspill_create(void* (*malloc)(size_t), void (*free)(void*))
+{
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !dir[0]) dir = "/tmp";
+
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s/liq-histogram-XXXXXX", dir) >= (int)sizeof(path)) {
+        return NULL;
+    }
+
+    struct histspill *spill = malloc(sizeof(*spill));
+    if (!spill) return NULL;
+
+    *spill = (struct histspill){
+        .malloc = malloc,
+        .free = free,
+        .fd = mkstemp(path),
+    };
+    if (spill->fd < 0) {
+        free(spill);
+        return NULL;
+    }
+    unlink(path); // the file goes away with the descriptor, however the process ends
+
+    return spill;
+}
+
+static bool histspill_write_items(struct histspill *spill, const struct acolorhist_arr_item *items, unsigned int count)
+{
+    const char *data = (const char *)items;
+    size_t left = count * sizeof(items[0]);
+    off_t offset = spill->items * sizeof(items[0]);
+    while (left) {
+        const ssize_t written = pwrite(spill->fd, data, left, offset);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        data += written; left -= written; offset += written;
+    }
+    spill->items += count;
+    return true;
+}
+
+static bool histspill_add_run(struct histspill *spill, uint64_t start)
+{
+    if (spill->runs_count == spill->runs_capacity) {
+        const unsigned int capacity = spill->runs_capacity ? spill->runs_capacity * 2 : 16;
+        struct histspill_run *runs = spill->malloc(capacity * sizeof(runs[0]));
+        if (!runs) return false;
+        if (spill->runs) {
+            memcpy(runs, spill->runs, spill->runs_count * sizeof(runs[0]));
+            spill->free(spill->runs);
+        }
+        spill->runs = runs;
+        spill->runs_capacity = capacity;
+    }
+
+    spill->runs[spill->runs_count++] = (struct histspill_run){
+        .start = start,
+        .count = spill->items - start,
+    };
+    return true;
+}
+
+/*
+ Appends the colors of the table to the file as one sorted run and empties the table.
+ The table's items are reused to hold the sort keys, so spilling needs no memory of its own.
+ */
+LIQ_PRIVATE bool histspill_write(struct histspill *spill, struct acolorhash_table *acht)
+{
+    if (!acht->colors) return true;
+
+    struct acolorhist_arr_item *const items = acht->items;
+    for(unsigned int i=0; i < acht->colors; i++) {
+        items[i].color.l = histspill_key(items[i].color.rgba);
+    }
+    qsort(items, acht->colors, sizeof(items[0]), histspill_compare_items);
+
+    const uint64_t start = spill->items;
+    if (!histspill_write_items(spill, items, acht->colors) || !histspill_add_run(spill, start)) return false;
+
+    pam_clearacolorhash(acht);
+    return true;
+}
+
+static bool histspill_reader_fill(struct histspill *spill, struct histspill_reader *r)
+{
+    const uint64_t count = MIN(r->end - r->next, HISTSPILL_READ_ITEMS);
+    char *data = (char *)r->buf;
+    size_t left = count * sizeof(r->buf[0]);
+    off_t offset = r->next * sizeof(r->buf[0]);
+    while (left) {
+        const ssize_t got = pread(spill->fd, data, left, offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        data += got; left -= got; offset += got;
+    }
+    r->next += count;
+    r->pos = 0;
+    r->count = count;
+    return true;
+}
+
+inline static unsigned int histspill_reader_key(const struct histspill *spill, const unsigned int i)
+{
+    const struct histspill_reader *r = &spill->readers[i];
+    return r->buf[r->pos].color.l;
+}
+
+static void histspill_sift_down(struct histspill *spill, unsigned int i)
+{
+    unsigned int *const heap = spill->heap;
+    for(;;) {
+        unsigned int smallest = i;
+        const unsigned int left = 2*i+1, right = 2*i+2;
+        if (left < spill->heap_size && histspill_reader_key(spill, heap[left]) < histspill_reader_key(spill, heap[smallest])) smallest = left;
+        if (right < spill->heap_size && histspill_reader_key(spill, heap[right]) < histspill_reader_key(spill, heap[smallest])) smallest = right;
+        if (smallest == i) return;
+
+        const unsigned int tmp = heap[i]; heap[i] = heap[smallest]; heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+/* positions count runs from the first one at their first items */
+static bool histspill_merge_start(struct histspill *spill, unsigned int first, unsigned int count)
+{
+    spill->heap_size = 0;
+    for(unsigned int i=0; i < count; i++) {
+        struct histspill_reader *r = &spill->readers[i];
+        r->next = spill->runs[first + i].start;
+        r->end = spill->runs[first + i].start + spill->runs[first + i].count;
+        if (!histspill_reader_fill(spill, r)) return false;
+        spill->heap[spill->heap_size++] = i;
+    }
+    for(unsigned int i = spill->heap_size/2; i-- > 0;) {
+        histspill_sift_down(spill, i);
+    }
+    return true;
+}
+
+/* next item of all runs in order of keys, false at the end or on a read error */
+static bool histspill_merge_next(struct histspill *spill, struct acolorhist_arr_item *item)
+{
+    if (!spill->heap_size) return false;
+
+    struct histspill_reader *r = &spill->readers[spill->heap[0]];
+    *item = r->buf[r->pos++];
+
+    if (r->pos == r->count) {
+        if (r->next == r->end) {
+            spill->heap[0] = spill->heap[--spill->heap_size];
+        } else if (!histspill_reader_fill(spill, r)) {
+            spill->failed = true;
+            spill->heap_size = 0;
+            return true;
+        }
+    }
+    histspill_sift_down(spill, 0);
+    return true;
+}
+
+/*
+ Merges runs fan_in at a time into runs appended to the file, adding up the weights of equal colors,
+ until at most fan_in runs are left. Every pass divides the number of runs by fan_in.
+ */
+static bool histspill_reduce_runs(struct histspill *spill, unsigned int fan_in)
+{
+    unsigned int first = 0;
+    while (spill->runs_count - first > fan_in) {
+        const uint64_t start = spill->items;
+        unsigned int buffered = 0;
+        struct acolorhist_arr_item item;
+
+        if (!histspill_merge_start(spill, first, fan_in)) return false;
+        first += fan_in;
+
+        while (histspill_merge_next(spill, &item)) {
+            if (buffered && spill->write_buf[buffered-1].color.l == item.color.l) {
+                spill->write_buf[buffered-1].perceptual_weight += item.perceptual_weight;
+                continue;
+            }
+            if (buffered == HISTSPILL_READ_ITEMS) {
+                if (!histspill_write_items(spill, spill->write_buf, buffered)) return false;
+                buffered = 0;
+            }
+            spill->write_buf[buffered++] = item;
+        }
+        if (spill->failed || !histspill_write_items(spill, spill->write_buf, buffered) || !histspill_add_run(spill, start)) return false;
+    }
+
+    // the runs merged so far aren't needed anymore
+    spill->runs_count -= first;
+    memmove(spill->runs, spill->runs + first, spill->runs_count * sizeof(spill->runs[0]));
+    return true;
+}
+
+/*
+ Merges all runs into a histogram of at most maxcolors colors, posterized by at least ignorebits.
+ The first pass counts how many colors every posterization level would leave,
+ the second one adds up the colors of the level picked.
+ The merge buffers are kept within memory_limit, merging runs in several passes if need be.
+ */
+LIQ_PRIVATE histogram *histspill_to_hist(struct histspill *spill, unsigned int maxcolors, unsigned int ignorebits, const float max_perceptual_weight, const float gamma_lut[256], size_t memory_limit)
+{
+    // a read buffer for each run merged at once, and a write buffer for the merged run
+    const size_t buffers = memory_limit / sizeof(spill->readers[0]);
+    const unsigned int fan_in = buffers > 3 ? MIN(buffers - 1, MAX(1, spill->runs_count)) : 2;
+
+    spill->readers = spill->malloc(fan_in * sizeof(spill->readers[0]));
+    spill->heap = spill->malloc(fan_in * sizeof(spill->heap[0]));
+    if (!spill->readers || !spill->heap) return NULL;
+
+    if (spill->runs_count > fan_in) {
+        spill->write_buf = spill->malloc(HISTSPILL_READ_ITEMS * sizeof(spill->write_buf[0]));
+        if (!spill->write_buf || !histspill_reduce_runs(spill, fan_in)) return NULL;
+    }
+
+    uint64_t counts[8] = {0};
+    unsigned int last_prefix[8];
+    struct acolorhist_arr_item item;
+
+    if (!histspill_merge_start(spill, 0, spill->runs_count)) return NULL;
+    for(bool first = true; histspill_merge_next(spill, &item); first = false) {
+        for(unsigned int level = ignorebits; level < 8; level++) {
+            const unsigned int prefix = item.color.l >> (4*level);
+            if (first || prefix != last_prefix[level]) {
+                last_prefix[level] = prefix;
+                counts[level]++;
+            }
+        }
+    }
+    if (spill->failed) return NULL;
+
+    while (ignorebits < 7 && counts[ignorebits] > maxcolors) {
+        ignorebits++;
+    }
+
+    histogram *hist = spill->malloc(sizeof(hist[0]));
+    if (!hist) return NULL;
+    *hist = (histogram){
+        .achv = spill->malloc(MAX(1, counts[ignorebits]) * sizeof(hist->achv[0])),
+        .free = spill->free,
+        .ignorebits = ignorebits,
+    };
+    if (!hist->achv) {
+        spill->free(hist);
+        return NULL;
+    }
+
+    double total_weight = 0;
+    unsigned int size = 0;
+    const unsigned int shift = 4*ignorebits;
+    float weight = 0;
+    unsigned int key = 0;
+
+    if (!histspill_merge_start(spill, 0, spill->runs_count)) {
+        pam_freeacolorhist(hist);
+        return NULL;
+    }
+    for(bool first = true;; first = false) {
+        const bool more = histspill_merge_next(spill, &item);
+        if (!first && (!more || item.color.l >> shift != key >> shift)) {
+            const union rgba_as_int px = {histspill_color(key)};
+            hist->achv[size].acolor = to_f(gamma_lut, (union rgba_as_int){.l = pam_posterize(px.l, ignorebits)}.rgba);
+            total_weight += hist->achv[size].adjusted_weight = hist->achv[size].perceptual_weight = MIN(weight, max_perceptual_weight);
+            size++;
+            weight = 0;
+        }
+        if (!more) break;
+        key = item.color.l;
+        weight += item.perceptual_weight;
+    }
+    if (spill->failed) {
+        pam_freeacolorhist(hist);
+        return NULL;
+    }
+
+    hist->size = size;
+    hist->total_perceptual_weight = total_weight;
+    return hist;
+}
+
+LIQ_PRIVATE void histspill_destroy(struct histspill *spill)
+{
+    close(spill->fd);
+    if (spill->runs) spill->free(spill->runs);
+    if (spill->readers) spill->free(spill->readers);
+    if (spill->heap) spill->free(spill->heap);
+    if (spill->write_buf) spill->free(spill->write_buf);
+    spill->free(spill);
+}
@@ -0,0 +1,574 @@
+/*
+ Inner loops in versions for several x86 instruction sets. The best version the CPU can run is picked
+ when the library is loaded, so one build makes full use of both old and new machines.
+
+ Every version does the same float operations in the same order as the plain C one, only on more values
+ at once, so all of them give exactly the same results (this file is built with FMA contraction off).
+ */
+
+#include <string.h>
+
+#include "libimagequant.h"
+#include "pam.h"
+#include "kernels.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#  define LIQ_KERNELS_X86 1
+#  include <immintrin.h>
+#  define TARGET_SSE __attribute__((target("sse2")))
+#  define TARGET_AVX2 __attribute__((target("avx2")))
+#  define TARGET_AVX512 __attribute__((target("avx2,avx512f,avx512bw")))
+#else
+#  define LIQ_KERNELS_X86 0
+#endif
+
+static unsigned int nearest_candidate_stdc(const float a[], const float r[], const float g[], const float b[], const unsigned int count, const f_pixel px, float *diff)
+{
+    unsigned int ind=0;
+    float best = INFINITY;
+
+    for(unsigned int j=0; j < count; j++) {
+        const float alphas = a[j] - px.a;
+        const float dist = colordifference_ch(px.r, r[j], alphas) +
+                           colordifference_ch(px.g, g[j], alphas) +
+                           colordifference_ch(px.b, b[j], alphas);
+        if (dist < best) {
+            best = dist;
+            ind = j;
+        }
+    }
+
+    *diff = best;
+    return ind;
+}
+
+static void to_f_row_stdc(const float gamma_lut[], f_pixel out[], const rgba_pixel in[], const unsigned int width)
+{
+    for(unsigned int i=0; i < width; i++) {
+        out[i] = to_f(gamma_lut, in[i]);
+    }
+}
+
+ALWAYS_INLINE static void contrast_maps_pixel(const f_pixel prev, const f_pixel curr, const f_pixel next, const f_pixel prevl, const f_pixel nextl, unsigned char *noise, unsigned char *edges);
+inline static void contrast_maps_pixel(const f_pixel prev, const f_pixel curr, const f_pixel next, const f_pixel prevl, const f_pixel nextl, unsigned char *noise, unsigned char *edges)
+{
+    // contrast is difference between pixels neighbouring horizontally and vertically
+    const float a = fabsf(prev.a+next.a - curr.a*2.f),
+                r = fabsf(prev.r+next.r - curr.r*2.f),
+                g = fabsf(prev.g+next.g - curr.g*2.f),
+                b = fabsf(prev.b+next.b - curr.b*2.f);
+
+    const float a1 = fabsf(prevl.a+nextl.a - curr.a*2.f),
+                r1 = fabsf(prevl.r+nextl.r - curr.r*2.f),
+                g1 = fabsf(prevl.g+nextl.g - curr.g*2.f),
+                b1 = fabsf(prevl.b+nextl.b - curr.b*2.f);
+
+    const float horiz = MAX(MAX(a,r),MAX(g,b));
+    const float vert = MAX(MAX(a1,r1),MAX(g1,b1));
+    const float edge = MAX(horiz,vert);
+    float z = edge - fabsf(horiz-vert)*.5f;
+    z = 1.f - MAX(z,MIN(horiz,vert));
+    z *= z; // noise is amplified
+    z *= z;
+
+    z *= 256.f;
+    *noise = z < 256 ? z : 255;
+    z = (1.f-edge)*256.f;
+    *edges = z < 256 ? z : 255;
+}
+
+/* pixels start..end-1 of a row, the first and last pixel of the row are their own missing neighbours */
+static void contrast_maps_pixels(const f_pixel prev_row[], const f_pixel curr_row[], const f_pixel next_row[], const unsigned int cols, unsigned char noise[], unsigned char edges[], const unsigned int start, const unsigned int end)
+{
+    for(unsigned int i=start; i < end; i++) {
+        contrast_maps_pixel(curr_row[i > 0 ? i-1 : 0], curr_row[i], curr_row[MIN(cols-1,i+1)], prev_row[i], next_row[i], &noise[i], &edges[i]);
+    }
+}
+
+static void contrast_maps_row_stdc(const f_pixel prev_row[], const f_pixel curr_row[], const f_pixel next_row[], const unsigned int cols, unsigned char noise[], unsigned char edges[])
+{
+    contrast_maps_pixels(prev_row, curr_row, next_row, cols, noise, edges, 0, cols);
+}
+
+/* pixels start..end-1 of a liq_max3()/liq_min3() row */
+ALWAYS_INLINE static void extreme3_pixels(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], const unsigned int width, const unsigned int start, const unsigned int end, const bool lighten);
+inline static void extreme3_pixels(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], const unsigned int width, const unsigned int start, const unsigned int end, const bool lighten)
+{
+    for(unsigned int i=start; i < end; i++) {
+        const unsigned char prev = row[i > 0 ? i-1 : 0], curr = row[i], next = row[MIN(width-1,i+1)];
+        if (lighten) {
+            const unsigned char t1 = MAX(prev,next);
+            const unsigned char t2 = MAX(nextrow[i],prevrow[i]);
+            dst[i] = MAX(curr,MAX(t1,t2));
+        } else {
+            const unsigned char t1 = MIN(prev,next);
+            const unsigned char t2 = MIN(nextrow[i],prevrow[i]);
+            dst[i] = MIN(curr,MIN(t1,t2));
+        }
+    }
+}
+
+static void max3_row_stdc(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], const unsigned int width)
+{
+    extreme3_pixels(prevrow, row, nextrow, dst, width, 0, width, true);
+}
+
+static void min3_row_stdc(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], const unsigned int width)
+{
+    extreme3_pixels(prevrow, row, nextrow, dst, width, 0, width, false);
+}
+
+static const struct liq_kernels kernels_stdc = {
+    .level = LIQ_SIMD_NONE,
+    .name = "none",
+    .nearest_candidate = nearest_candidate_stdc,
+    .to_f_row = to_f_row_stdc,
+    .contrast_maps_row = contrast_maps_row_stdc,
+    .max3_row = max3_row_stdc,
+    .min3_row = min3_row_stdc,
+};
+
+#if LIQ_KERNELS_X86
+
+/* SSE2: 4 floats or 16 bytes at once. There's no gather, so colors are converted with plain C */
+
+TARGET_SSE inline static __m128 colordifference_ch_sse(const __m128 x, const __m128 y, const __m128 alphas)
+{
+    const __m128 black = _mm_sub_ps(x, y), white = _mm_add_ps(black, alphas);
+    return _mm_add_ps(_mm_mul_ps(black, black), _mm_mul_ps(white, white));
+}
+
+TARGET_SSE static unsigned int nearest_candidate_sse(const float a[], const float r[], const float g[], const float b[], const unsigned int count, const f_pixel px, float *diff)
+{
+    if (count < LIQ_CANDIDATES_BLOCK) {
+        return nearest_candidate_stdc(a, r, g, b, count, px, diff); // mostly padding
+    }
+
+    unsigned int ind=0;
+    float best = INFINITY;
+    const __m128 vpx_a = _mm_set1_ps(px.a), vpx_r = _mm_set1_ps(px.r), vpx_g = _mm_set1_ps(px.g), vpx_b = _mm_set1_ps(px.b);
+
+    for(unsigned int start=0; start < count; start += 8) {
+        const __m128 vbest = _mm_set1_ps(best);
+        __m128 dist[2];
+        int closer = 0;
+
+        for(unsigned int k=0; k < 2; k++) {
+            const __m128 alphas = _mm_sub_ps(_mm_load_ps(a + start + 4*k), vpx_a);
+            dist[k] = colordifference_ch_sse(vpx_r, _mm_load_ps(r + start + 4*k), alphas);
+            dist[k] = _mm_add_ps(dist[k], colordifference_ch_sse(vpx_g, _mm_load_ps(g + start + 4*k), alphas));
+            dist[k] = _mm_add_ps(dist[k], colordifference_ch_sse(vpx_b, _mm_load_ps(b + start + 4*k), alphas));
+            closer |= _mm_movemask_ps(_mm_cmplt_ps(dist[k], vbest));
+        }
+        // the block can't have a new best match
+        if (!closer) continue;
+
+        __m128 block_min = _mm_min_ps(dist[0], dist[1]);
+        block_min = _mm_min_ps(block_min, _mm_shuffle_ps(block_min, block_min, _MM_SHUFFLE(2,3,0,1)));
+        block_min = _mm_min_ps(block_min, _mm_shuffle_ps(block_min, block_min, _MM_SHUFFLE(1,0,3,2)));
+
+        // first candidate of the block with the smallest difference
+        const int lowest = _mm_movemask_ps(_mm_cmpeq_ps(dist[0], block_min)) | _mm_movemask_ps(_mm_cmpeq_ps(dist[1], block_min)) << 4;
+        best = _mm_cvtss_f32(block_min);
+        ind = start + __builtin_ctz(lowest);
+    }
+
+    *diff = best;
+    return ind;
+}
+
+TARGET_SSE static void contrast_maps_row_sse(const f_pixel prev_row[], const f_pixel curr_row[], const f_pixel next_row[], const unsigned int cols, unsigned char noise[], unsigned char edges[])
+{
+    const __m128 sign = _mm_set1_ps(-0.f), two = _mm_set1_ps(2.f), half = _mm_set1_ps(.5f), one = _mm_set1_ps(1.f),
+                 max_byte = _mm_set1_ps(256.f), clamped = _mm_set1_ps(255.f);
+    const __m128i low_byte = _mm_set1_epi32(0xFF);
+
+    unsigned int i = 1;
+    contrast_maps_pixels(prev_row, curr_row, next_row, cols, noise, edges, 0, MIN(1, cols));
+
+    // 4 pixels at once, every one with both horizontal neighbours in the row
+    for(; i + 4 < cols; i += 4) {
+        __m128 horiz[4], vert[4];
+        for(unsigned int k=0; k < 4; k++) {
+            const __m128 curr2 = _mm_mul_ps(_mm_loadu_ps((const float*)&curr_row[i+k]), two);
+            horiz[k] = _mm_andnot_ps(sign, _mm_sub_ps(_mm_add_ps(_mm_loadu_ps((const float*)&curr_row[i+k-1]), _mm_loadu_ps((const float*)&curr_row[i+k+1])), curr2));
+            vert[k] = _mm_andnot_ps(sign, _mm_sub_ps(_mm_add_ps(_mm_loadu_ps((const float*)&prev_row[i+k]), _mm_loadu_ps((const float*)&next_row[i+k])), curr2));
+        }
+        // channels of the 4 pixels to separate vectors
+        _MM_TRANSPOSE4_PS(horiz[0], horiz[1], horiz[2], horiz[3]);
+        _MM_TRANSPOSE4_PS(vert[0], vert[1], vert[2], vert[3]);
+
+        const __m128 h = _mm_max_ps(_mm_max_ps(horiz[0], horiz[1]), _mm_max_ps(horiz[2], horiz[3]));
+        const __m128 v = _mm_max_ps(_mm_max_ps(vert[0], vert[1]), _mm_max_ps(vert[2], vert[3]));
+        const __m128 edge = _mm_max_ps(h, v);
+        __m128 z = _mm_sub_ps(edge, _mm_mul_ps(_mm_andnot_ps(sign, _mm_sub_ps(h, v)), half));
+        z = _mm_sub_ps(one, _mm_max_ps(z, _mm_min_ps(h, v)));
+        z = _mm_mul_ps(z, z);
+        z = _mm_mul_ps(z, z);
+        z = _mm_mul_ps(z, max_byte);
+        const __m128 e = _mm_mul_ps(_mm_sub_ps(one, edge), max_byte);
+
+        // z < 256 ? z : 255, converted like a float to unsigned char is in C on x86 (low byte of the int)
+        const __m128 z_fits = _mm_cmplt_ps(z, max_byte), e_fits = _mm_cmplt_ps(e, max_byte);
+        const __m128i zi = _mm_and_si128(_mm_cvttps_epi32(_mm_or_ps(_mm_and_ps(z_fits, z), _mm_andnot_ps(z_fits, clamped))), low_byte);
+        const __m128i ei = _mm_and_si128(_mm_cvttps_epi32(_mm_or_ps(_mm_and_ps(e_fits, e), _mm_andnot_ps(e_fits, clamped))), low_byte);
+        const __m128i zb = _mm_packus_epi16(_mm_packs_epi32(zi, zi), _mm_setzero_si128());
+        const __m128i eb = _mm_packus_epi16(_mm_packs_epi32(ei, ei), _mm_setzero_si128());
+        const int zbytes = _mm_cvtsi128_si32(zb), ebytes = _mm_cvtsi128_si32(eb);
+        memcpy(&noise[i], &zbytes, 4);
+        memcpy(&edges[i], &ebytes, 4);
+    }
+
+    contrast_maps_pixels(prev_row, curr_row, next_row, cols, noise, edges, i, cols);
+}
+
+TARGET_SSE inline static void extreme3_row_sse(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], const unsigned int width, const bool lighten)
+{
+    unsigned int i = 1;
+    extreme3_pixels(prevrow, row, nextrow, dst, width, 0, MIN(1, width), lighten);
+
+    for(; i + 16 < width; i += 16) {
+        const __m128i prev = _mm_loadu_si128((const __m128i*)&row[i-1]), curr = _mm_loadu_si128((const __m128i*)&row[i]),
+                      next = _mm_loadu_si128((const __m128i*)&row[i+1]),
+                      above = _mm_loadu_si128((const __m128i*)&prevrow[i]), below = _mm_loadu_si128((const __m128i*)&nextrow[i]);
+        const __m128i res = lighten ?
+            _mm_max_epu8(curr, _mm_max_epu8(_mm_max_epu8(prev, next), _mm_max_epu8(below, above))) :
+            _mm_min_epu8(curr, _mm_min_epu8(_mm_min_epu8(prev, next), _mm_min_epu8(below, above)));
+        _mm_storeu_si128((__m128i*)&dst[i], res);
+    }
+
+    extreme3_pixels(prevrow, row, nextrow, dst, width, i, width, lighten);
+}
+
+TARGET_SSE static void max3_row_sse(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], const unsigned int width)
+{
+    extreme3_row_sse(prevrow, row, nextrow, dst, width, true);
+}
+
+TARGET_SSE static void min3_row_sse(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], const unsigned int width)
+{
+    extreme3_row_sse(prevrow, row, nextrow, dst, width, false);
+}
+
+/* AVX2: 8 floats or 32 bytes at once, and gathers from the gamma table */
+
+TARGET_AVX2 inline static __m256 colordifference_ch_avx2(const __m256 x, const __m256 y, const __m256 alphas)
+{
+    const __m256 black = _mm256_sub_ps(x, y), white = _mm256_add_ps(black, alphas);
+    return _mm256_add_ps(_mm256_mul_ps(black, black), _mm256_mul_ps(white, white));
+}
+
+TARGET_AVX2 static unsigned int nearest_candidate_avx2(const float a[], const float r[], const float g[], const float b[], const unsigned int count, const f_pixel px, float *diff)
+{
+    if (count < LIQ_CANDIDATES_BLOCK) {
+        return nearest_candidate_stdc(a, r, g, b, count, px, diff);
+    }
+
+    unsigned int ind=0;
+    float best = INFINITY;
+    const __m256 vpx_a = _mm256_set1_ps(px.a), vpx_r = _mm256_set1_ps(px.r), vpx_g = _mm256_set1_ps(px.g), vpx_b = _mm256_set1_ps(px.b);
+
+    for(unsigned int start=0; start < count; start += 8) {
+        const __m256 alphas = _mm256_sub_ps(_mm256_loadu_ps(a + start), vpx_a);
+        __m256 dist = colordifference_ch_avx2(vpx_r, _mm256_loadu_ps(r + start), alphas);
+        dist = _mm256_add_ps(dist, colordifference_ch_avx2(vpx_g, _mm256_loadu_ps(g + start), alphas));
+        dist = _mm256_add_ps(dist, colordifference_ch_avx2(vpx_b, _mm256_loadu_ps(b + start), alphas));
+        if (!_mm256_movemask_ps(_mm256_cmp_ps(dist, _mm256_set1_ps(best), _CMP_LT_OQ))) continue;
+
+        __m256 block_min = _mm256_min_ps(dist, _mm256_permute2f128_ps(dist, dist, 1));
+        block_min = _mm256_min_ps(block_min, _mm256_shuffle_ps(block_min, block_min, _MM_SHUFFLE(2,3,0,1)));
+        block_min = _mm256_min_ps(block_min, _mm256_shuffle_ps(block_min, block_min, _MM_SHUFFLE(1,0,3,2)));
+
+        const int lowest = _mm256_movemask_ps(_mm256_cmp_ps(dist, block_min, _CMP_EQ_OQ));
+        best = _mm256_cvtss_f32(block_min);
+        ind = start + __builtin_ctz(lowest);
+    }
+
+    *diff = best;
+    return ind;
+}
+
+TARGET_AVX2 static void to_f_row_avx2(const float gamma_lut[], f_pixel out[], const rgba_pixel in[], const unsigned int width)
+{
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+    const __m256 max_alpha = _mm256_set1_ps(255.f);
+
+    unsigned int i=0;
+    for(; i + 8 <= width; i += 8) {
+        const __m256i px = _mm256_loadu_si256((const __m256i*)&in[i]);
+        const __m256 a = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(px, 24)), max_alpha);
+        const __m256 r = _mm256_mul_ps(_mm256_i32gather_ps(gamma_lut, _mm256_and_si256(px, low_byte), 4), a);
+        const __m256 g = _mm256_mul_ps(_mm256_i32gather_ps(gamma_lut, _mm256_and_si256(_mm256_srli_epi32(px, 8), low_byte), 4), a);
+        const __m256 b = _mm256_mul_ps(_mm256_i32gather_ps(gamma_lut, _mm256_and_si256(_mm256_srli_epi32(px, 16), low_byte), 4), a);
+
+        // back to one pixel after another: pixel n, n+4 in each of p0..p3
+        const __m256 ar_lo = _mm256_unpacklo_ps(a, r), ar_hi = _mm256_unpackhi_ps(a, r),
+                     gb_lo = _mm256_unpacklo_ps(g, b), gb_hi = _mm256_unpackhi_ps(g, b);
+        const __m256 p0 = _mm256_shuffle_ps(ar_lo, gb_lo, _MM_SHUFFLE(1,0,1,0)), p1 = _mm256_shuffle_ps(ar_lo, gb_lo, _MM_SHUFFLE(3,2,3,2)),
+                     p2 = _mm256_shuffle_ps(ar_hi, gb_hi, _MM_SHUFFLE(1,0,1,0)), p3 = _mm256_shuffle_ps(ar_hi, gb_hi, _MM_SHUFFLE(3,2,3,2));
+        float *const dst = (float*)&out[i];
+        _mm256_storeu_ps(dst, _mm256_permute2f128_ps(p0, p1, 0x20));
+        _mm256_storeu_ps(dst + 8, _mm256_permute2f128_ps(p2, p3, 0x20));
+        _mm256_storeu_ps(dst + 16, _mm256_permute2f128_ps(p0, p1, 0x31));
+        _mm256_storeu_ps(dst + 24, _mm256_permute2f128_ps(p2, p3, 0x31));
+    }
+
+    to_f_row_stdc(gamma_lut, out + i, in + i, width - i);
+}
+
+TARGET_AVX2 static void contrast_maps_row_avx2(const f_pixel prev_row[], const f_pixel curr_row[], const f_pixel next_row[], const unsigned int cols, unsigned char noise[], unsigned char edges[])
+{
+    const __m256 sign = _mm256_set1_ps(-0.f), two = _mm256_set1_ps(2.f), half = _mm256_set1_ps(.5f), one = _mm256_set1_ps(1.f),
+                 max_byte = _mm256_set1_ps(256.f), clamped = _mm256_set1_ps(255.f);
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+
+    unsigned int i = 1;
+    contrast_maps_pixels(prev_row, curr_row, next_row, cols, noise, edges, 0, MIN(1, cols));
+
+    // 8 pixels at once, 2 in each vector
+    for(; i + 8 < cols; i += 8) {
+        __m256 horiz[4], vert[4];
+        for(unsigned int k=0; k < 4; k++) {
+            const unsigned int col = i + 2*k;
+            const __m256 curr2 = _mm256_mul_ps(_mm256_loadu_ps((const float*)&curr_row[col]), two);
+            horiz[k] = _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_add_ps(_mm256_loadu_ps((const float*)&curr_row[col-1]), _mm256_loadu_ps((const float*)&curr_row[col+1])), curr2));
+            vert[k] = _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_add_ps(_mm256_loadu_ps((const float*)&prev_row[col]), _mm256_loadu_ps((const float*)&next_row[col])), curr2));
+        }
+
+        // largest channel of every pixel, in order of pixels 0 2 4 6 1 3 5 7
+        __m256 h, v;
+        {
+            const __m256 t0 = _mm256_unpacklo_ps(horiz[0], horiz[1]), t1 = _mm256_unpackhi_ps(horiz[0], horiz[1]),
+                         t2 = _mm256_unpacklo_ps(horiz[2], horiz[3]), t3 = _mm256_unpackhi_ps(horiz[2], horiz[3]);
+            h = _mm256_max_ps(_mm256_max_ps(_mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1,0,1,0)), _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3,2,3,2))),
+                              _mm256_max_ps(_mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1,0,1,0)), _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3,2,3,2))));
+        }
+        {
+            const __m256 t0 = _mm256_unpacklo_ps(vert[0], vert[1]), t1 = _mm256_unpackhi_ps(vert[0], vert[1]),
+                         t2 = _mm256_unpacklo_ps(vert[2], vert[3]), t3 = _mm256_unpackhi_ps(vert[2], vert[3]);
+            v = _mm256_max_ps(_mm256_max_ps(_mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1,0,1,0)), _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3,2,3,2))),
+                              _mm256_max_ps(_mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1,0,1,0)), _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3,2,3,2))));
+        }
+
+        const __m256 edge = _mm256_max_ps(h, v);
+        __m256 z = _mm256_sub_ps(edge, _mm256_mul_ps(_mm256_andnot_ps(sign, _mm256_sub_ps(h, v)), half));
+        z = _mm256_sub_ps(one, _mm256_max_ps(z, _mm256_min_ps(h, v)));
+        z = _mm256_mul_ps(z, z);
+        z = _mm256_mul_ps(z, z);
+        z = _mm256_mul_ps(z, max_byte);
+        const __m256 e = _mm256_mul_ps(_mm256_sub_ps(one, edge), max_byte);
+
+        // z < 256 ? z : 255, converted like a float to unsigned char is in C on x86 (low byte of the int)
+        const __m256i zi = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_blendv_ps(clamped, z, _mm256_cmp_ps(z, max_byte, _CMP_LT_OQ))), low_byte);
+        const __m256i ei = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_blendv_ps(clamped, e, _mm256_cmp_ps(e, max_byte, _CMP_LT_OQ))), low_byte);
+
+        // bytes of pixels 0 2 4 6 in the low half and 1 3 5 7 in the high half, interleaved back
+        const __m256i zw = _mm256_packs_epi32(zi, zi), ew = _mm256_packs_epi32(ei, ei);
+        const __m256i zb = _mm256_packus_epi16(zw, zw), eb = _mm256_packus_epi16(ew, ew);
+        _mm_storel_epi64((__m128i*)&noise[i], _mm_unpacklo_epi8(_mm256_castsi256_si128(zb), _mm256_extracti128_si256(zb, 1)));
+        _mm_storel_epi64((__m128i*)&edges[i], _mm_unpacklo_epi8(_mm256_castsi256_si128(eb), _mm256_extracti128_si256(eb, 1)));
+    }
+
+    contrast_maps_pixels(prev_row, curr_row, next_row, cols, noise, edges, i, cols);
+}
+
+TARGET_AVX2 inline static void extreme3_row_avx2(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], const unsigned int width, const bool lighten)
+{
+    unsigned int i = 1;
+    extreme3_pixels(prevrow, row, nextrow, dst, width, 0, MIN(1, width), lighten);
+
+    for(; i + 32 < width; i += 32) {
+        const __m256i prev = _mm256_loadu_si256((const __m256i*)&row[i-1]), curr = _mm256_loadu_si256((const __m256i*)&row[i]),
+                      next = _mm256_loadu_si256((const __m256i*)&row[i+1]),
+                      above = _mm256_loadu_si256((const __m256i*)&prevrow[i]), below = _mm256_loadu_si256((const __m256i*)&nextrow[i]);
+        const __m256i res = lighten ?
+            _mm256_max_epu8(curr, _mm256_max_epu8(_mm256_max_epu8(prev, next), _mm256_max_epu8(below, above))) :
+            _mm256_min_epu8(curr, _mm256_min_epu8(_mm256_min_epu8(prev, next), _mm256_min_epu8(below, above)));
+        _mm256_storeu_si256((__m256i*)&dst[i], res);
+    }
+
+    extreme3_pixels(prevrow, row, nextrow, dst, width, i, width, lighten);
+}
+
+TARGET_AVX2 static void max3_row_avx2(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], const unsigned int width)
+{
+    extreme3_row_avx2(prevrow, row, nextrow, dst, width, true);
+}
+
+TARGET_AVX2 static void min3_row_avx2(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], const unsigned int width)
+{
+    extreme3_row_avx2(prevrow, row, nextrow, dst, width, false);
+}
+
+/* AVX-512: 16 floats or 64 bytes at once. Contrast maps are limited by the shuffles, so they keep the AVX2 version */
+
+TARGET_AVX512 inline static __m512 colordifference_ch_avx512(const __m512 x, const __m512 y, const __m512 alphas)
+{
+    const __m512 black = _mm512_sub_ps(x, y), white = _mm512_add_ps(black, alphas);
+    return _mm512_add_ps(_mm512_mul_ps(black, black), _mm512_mul_ps(white, white));
+}
+
+TARGET_AVX512 static unsigned int nearest_candidate_avx512(const float a[], const float r[], const float g[], const float b[], const unsigned int count, const f_pixel px, float *diff)
+{
+    if (count < LIQ_CANDIDATES_BLOCK) {
+        return nearest_candidate_stdc(a, r, g, b, count, px, diff);
+    }
+
+    unsigned int ind=0;
+    float best = INFINITY;
+    const __m512 vpx_a = _mm512_set1_ps(px.a), vpx_r = _mm512_set1_ps(px.r), vpx_g = _mm512_set1_ps(px.g), vpx_b = _mm512_set1_ps(px.b);
+    const __m512 never = _mm512_set1_ps(INFINITY);
+
+    for(unsigned int start=0; start < count; start += 16) {
+        // the last block may be shorter, and its missing candidates must not match
+        const __mmask16 valid = count - start >= 16 ? 0xFFFF : (1U << (count - start)) - 1;
+        const __m512 alphas = _mm512_sub_ps(_mm512_maskz_loadu_ps(valid, a + start), vpx_a);
+        __m512 dist = colordifference_ch_avx512(vpx_r, _mm512_maskz_loadu_ps(valid, r + start), alphas);
+        dist = _mm512_add_ps(dist, colordifference_ch_avx512(vpx_g, _mm512_maskz_loadu_ps(valid, g + start), alphas));
+        dist = _mm512_add_ps(dist, colordifference_ch_avx512(vpx_b, _mm512_maskz_loadu_ps(valid, b + start), alphas));
+        dist = _mm512_mask_blend_ps(valid, never, dist);
+        if (!_mm512_cmp_ps_mask(dist, _mm512_set1_ps(best), _CMP_LT_OQ)) continue;
+
+        const float block_min = _mm512_reduce_min_ps(dist);
+        const unsigned int lowest = _mm512_cmp_ps_mask(dist, _mm512_set1_ps(block_min), _CMP_EQ_OQ);
+        best = block_min;
+        ind = start + __builtin_ctz(lowest);
+    }
+
+    *diff = best;
+    return ind;
+}
+
+TARGET_AVX512 static void to_f_row_avx512(const float gamma_lut[], f_pixel out[], const rgba_pixel in[], const unsigned int width)
+{
+    const __m512i low_byte = _mm512_set1_epi32(0xFF);
+    const __m512 max_alpha = _mm512_set1_ps(255.f);
+
+    unsigned int i=0;
+    for(; i + 16 <= width; i += 16) {
+        const __m512i px = _mm512_loadu_si512(&in[i]);
+        const __m512 a = _mm512_div_ps(_mm512_cvtepi32_ps(_mm512_srli_epi32(px, 24)), max_alpha);
+        const __m512 r = _mm512_mul_ps(_mm512_i32gather_ps(_mm512_and_si512(px, low_byte), gamma_lut, 4), a);
+        const __m512 g = _mm512_mul_ps(_mm512_i32gather_ps(_mm512_and_si512(_mm512_srli_epi32(px, 8), low_byte), gamma_lut, 4), a);
+        const __m512 b = _mm512_mul_ps(_mm512_i32gather_ps(_mm512_and_si512(_mm512_srli_epi32(px, 16), low_byte), gamma_lut, 4), a);
+
+        // pixel n, n+4, n+8, n+12 in each of p0..p3, then 4 consecutive pixels in each vector
+        const __m512 ar_lo = _mm512_unpacklo_ps(a, r), ar_hi = _mm512_unpackhi_ps(a, r),
+                     gb_lo = _mm512_unpacklo_ps(g, b), gb_hi = _mm512_unpackhi_ps(g, b);
+        const __m512 p0 = _mm512_shuffle_ps(ar_lo, gb_lo, _MM_SHUFFLE(1,0,1,0)), p1 = _mm512_shuffle_ps(ar_lo, gb_lo, _MM_SHUFFLE(3,2,3,2)),
+                     p2 = _mm512_shuffle_ps(ar_hi, gb_hi, _MM_SHUFFLE(1,0,1,0)), p3 = _mm512_shuffle_ps(ar_hi, gb_hi, _MM_SHUFFLE(3,2,3,2));
+        const __m512 q0 = _mm512_shuffle_f32x4(p0, p1, 0x44), q1 = _mm512_shuffle_f32x4(p2, p3, 0x44),
+                     q2 = _mm512_shuffle_f32x4(p0, p1, 0xEE), q3 = _mm512_shuffle_f32x4(p2, p3, 0xEE);
+        float *const dst = (float*)&out[i];
+        _mm512_storeu_ps(dst, _mm512_shuffle_f32x4(q0, q1, 0x88));
+        _mm512_storeu_ps(dst + 16, _mm512_shuffle_f32x4(q0, q1, 0xDD));
+        _mm512_storeu_ps(dst + 32, _mm512_shuffle_f32x4(q2, q3, 0x88));
+        _mm512_storeu_ps(dst + 48, _mm512_shuffle_f32x4(q2, q3, 0xDD));
+    }
+
+    to_f_row_stdc(gamma_lut, out + i, in + i, width - i);
+}
+
+TARGET_AVX512 inline static void extreme3_row_avx512(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], const unsigned int width, const bool lighten)
+{
+    unsigned int i = 1;
+    extreme3_pixels(prevrow, row, nextrow, dst, width, 0, MIN(1, width), lighten);
+
+    for(; i + 64 < width; i += 64) {
+        const __m512i prev = _mm512_loadu_si512(&row[i-1]), curr = _mm512_loadu_si512(&row[i]), next = _mm512_loadu_si512(&row[i+1]),
+                      above = _mm512_loadu_si512(&prevrow[i]), below = _mm512_loadu_si512(&nextrow[i]);
+        const __m512i res = lighten ?
+            _mm512_max_epu8(curr, _mm512_max_epu8(_mm512_max_epu8(prev, next), _mm512_max_epu8(below, above))) :
+            _mm512_min_epu8(curr, _mm512_min_epu8(_mm512_min_epu8(prev, next), _mm512_min_epu8(below, above)));
+        _mm512_storeu_si512(&dst[i], res);
+    }
+
+    extreme3_pixels(prevrow, row, nextrow, dst, width, i, width, lighten);
+}
+
+TARGET_AVX512 static void max3_row_avx512(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], const unsigned int width)
+{
+    extreme3_row_avx512(prevrow, row, nextrow, dst, width, true);
+}
+
+TARGET_AVX512 static void min3_row_avx512(const unsigned char prevrow[], const unsigned char row[], const unsigned char nextrow[], unsigned char dst[], const unsigned int width)
+{
+    extreme3_row_avx512(prevrow, row, nextrow, dst, width, false);
+}
+
+static const struct liq_kernels kernels_sse = {
+    .level = LIQ_SIMD_SSE,
+    .name = "sse",
+    .nearest_candidate = nearest_candidate_sse,
+    .to_f_row = to_f_row_stdc,
+    .contrast_maps_row = contrast_maps_row_sse,
+    .max3_row = max3_row_sse,
+    .min3_row = min3_row_sse,
+};
+
+static const struct liq_kernels kernels_avx2 = {
+    .level = LIQ_SIMD_AVX2,
+    .name = "avx2",
+    .nearest_candidate = nearest_candidate_avx2,
+    .to_f_row = to_f_row_avx2,
+    .contrast_maps_row = contrast_maps_row_avx2,
+    .max3_row = max3_row_avx2,
+    .min3_row = min3_row_avx2,
+};
+
+static const struct liq_kernels kernels_avx512 = {
+    .level = LIQ_SIMD_AVX512,
+    .name = "avx512",
+    .nearest_candidate = nearest_candidate_avx512,
+    .to_f_row = to_f_row_avx512,
+    .contrast_maps_row = contrast_maps_row_avx2,
+    .max3_row = max3_row_avx512,
+    .min3_row = min3_row_avx512,
+};
+
+#endif
+
+static const struct liq_kernels *selected_kernels = &kernels_stdc;
+
+/*
+ Kernels for the given instruction set, or NULL if the CPU (or the compiler) can't run them.
+ */
+LIQ_PRIVATE const struct liq_kernels *liq_kernels_for_level(const liq_simd_level level)
+{
+    switch (level) {
+        case LIQ_SIMD_NONE:
+            return &kernels_stdc;
+#if LIQ_KERNELS_X86
+        case LIQ_SIMD_SSE:
+            return __builtin_cpu_supports("sse2") ? &kernels_sse : NULL;
+        case LIQ_SIMD_AVX2:
+            return __builtin_cpu_supports("avx2") ? &kernels_avx2 : NULL;
+        case LIQ_SIMD_AVX512:
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") ? &kernels_avx512 : NULL;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+#if LIQ_KERNELS_X86
+__attribute__((constructor)) static void liq_select_kernels(void)
+{
+    __builtin_cpu_init();
+    for(int level = LIQ_SIMD_AVX512; level > LIQ_SIMD_NONE; level--) {
+        const struct liq_kernels *kernels = liq_kernels_for_level(level);
+        if (kernels) {
+            selected_kernels = kernels;
+            return;
+        }
+    }
+}
+#endif
+
+/*
+ Kernels for the best instruction set of this CPU, picked when the library was loaded.
+ */
+LIQ_PRIVATE const struct liq_kernels *liq_kernels(void)
+{
+    return selected_kernels;
+}
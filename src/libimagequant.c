@@ -52,6 +52,13 @@ static const rgba_pixel *liq_image_get_row_rgba(liq_image *input_image, unsigned
 static const f_pixel *liq_image_get_row_f(liq_image *input_image, unsigned int row);
 static void liq_remapping_result_destroy(liq_remapping_result *result);
 
+/* number of threads a parallel loop may use: the caller's limit (0 for none) within what OpenMP offers */
+inline static unsigned int liq_thread_count(const unsigned int max_threads)
+{
+    const unsigned int available = omp_get_max_threads();
+    return max_threads && max_threads < available ? max_threads : available;
+}
+
 static void liq_verbose_printf(const liq_attr *context, const char *fmt, ...)
 {
     if (context->log_callback) {
@@ -276,6 +283,48 @@ LIQ_EXPORT void liq_set_last_index_transparent(liq_attr* attr, int is_last)
     attr->last_index_transparent = !!is_last;
 }
 
+/*
+ Limits the threads each call working on images created from these attributes may use, so that
+ several jobs running at once can share the cores. 0 (the default) uses all of them.
+ */
+LIQ_EXPORT liq_error liq_set_max_threads(liq_attr* attr, int threads)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return LIQ_INVALID_POINTER;
+    if (threads < 0) return LIQ_VALUE_OUT_OF_RANGE;
+
+    attr->max_threads = threads;
+    return LIQ_OK;
+}
+
+LIQ_EXPORT int liq_get_max_threads(const liq_attr *attr)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return -1;
+
+    return liq_thread_count(attr->max_threads);
+}
+
+/*
+ Caps the memory the table of distinct colors may use while the histogram is made. When it fills up,
+ its colors are written to a temporary file in $TMPDIR and counting goes on, so images with more colors
+ than fit in memory, e.g. fed row by row with liq_image_create_custom(), can still be quantized.
+ 0 (the default) keeps all colors in memory.
+ */
+LIQ_EXPORT liq_error liq_set_histogram_memory_limit(liq_attr* attr, int megabytes)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return LIQ_INVALID_POINTER;
+    if (megabytes < 0) return LIQ_VALUE_OUT_OF_RANGE;
+
+    attr->histogram_memory_limit = (size_t)megabytes << 20;
+    return LIQ_OK;
+}
+
+LIQ_EXPORT int liq_get_histogram_memory_limit(const liq_attr *attr)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return -1;
+
+    return attr->histogram_memory_limit >> 20;
+}
+
 LIQ_EXPORT void liq_set_log_callback(liq_attr *attr, liq_log_callback_function *callback, void* user_info)
 {
     if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return;
@@ -422,6 +471,7 @@ static liq_image *liq_image_create_internal(liq_attr *attr, rgba_pixel* rows[],
         .row_callback = row_callback,
         .row_callback_user_info = row_callback_user_info,
         .min_opaque_val = attr->min_opaque_val,
+        .max_threads = attr->max_threads,
     };
     to_f_set_gamma(img->gamma_lut, img->gamma);
 
@@ -573,9 +623,7 @@ static void convert_row_to_f(liq_image *img, f_pixel *row_f_pixels, const unsign
 
     const rgba_pixel *const row_pixels = liq_image_get_row_rgba(img, row);
 
-    for(unsigned int col=0; col < img->width; col++) {
-        row_f_pixels[col] = to_f(gamma_lut, row_pixels[col]);
-    }
+    liq_kernels()->to_f_row(gamma_lut, row_f_pixels, row_pixels, img->width);
 }
 
 static const f_pixel *liq_image_get_row_f(liq_image *img, unsigned int row)
@@ -596,13 +644,47 @@ static const f_pixel *liq_image_get_row_f(liq_image *img, unsigned int row)
             return liq_image_get_row_f(img, row);
         }
 
-        for(unsigned int i=0; i < img->height; i++) {
+        // user callbacks may not be reentrant, rows are only converted in parallel when they're in memory
+        const int height = img->height;
+        const unsigned int threads = img->rows ? liq_thread_count(img->max_threads) : 1;
+        #if __GNUC__ >= 9
+        #pragma omp parallel for if (img->width*img->height > 3000) num_threads(threads) \
+            schedule(static) default(none) shared(img,height)
+        #endif
+        for(int i=0; i < height; i++) {
             convert_row_to_f(img, &img->f_pixels[i*img->width], i, img->gamma_lut);
         }
     }
     return img->f_pixels + img->width * row;
 }
 
+/*
+ Converts the whole image to floats up front, so several remaps of it (which may then run concurrently)
+ share one conversion instead of each converting every row. Images too large to cache are left alone.
+ */
+LIQ_EXPORT liq_error liq_image_convert_f_pixels(liq_image *input_image)
+{
+    if (!CHECK_STRUCT_TYPE(input_image, liq_image)) return LIQ_INVALID_POINTER;
+
+    if (!input_image->f_pixels && !input_image->temp_f_row && !liq_image_should_use_low_memory(input_image, false)) {
+        liq_image_get_row_f(input_image, 0);
+    }
+
+    return input_image->f_pixels ? LIQ_OK : LIQ_OUT_OF_MEMORY;
+}
+
+/*
+ Overrides the thread limit the image got from its attributes, for calls on this image only.
+ */
+LIQ_EXPORT liq_error liq_image_set_max_threads(liq_image *input_image, int threads)
+{
+    if (!CHECK_STRUCT_TYPE(input_image, liq_image)) return LIQ_INVALID_POINTER;
+    if (threads < 0) return LIQ_VALUE_OUT_OF_RANGE;
+
+    input_image->max_threads = threads;
+    return LIQ_OK;
+}
+
 LIQ_EXPORT int liq_image_get_width(const liq_image *input_image)
 {
     if (!CHECK_STRUCT_TYPE(input_image, liq_image)) return -1;
@@ -669,6 +751,10 @@ LIQ_EXPORT void liq_image_destroy(liq_image *input_image)
         input_image->free(input_image->temp_f_row);
     }
 
+    if (input_image->hist) {
+        pam_freeacolorhist(input_image->hist);
+    }
+
     input_image->magic_header = liq_freed_magic;
     input_image->free(input_image);
 }
@@ -707,11 +793,75 @@ LIQ_EXPORT liq_error liq_set_dithering_level(liq_result *res, float dither_level
         res->remapping = NULL;
     }
 
-    if (res->dither_level < 0 || res->dither_level > 1.0f) return LIQ_VALUE_OUT_OF_RANGE;
+    if (dither_level < 0 || dither_level > 1.0f) return LIQ_VALUE_OUT_OF_RANGE;
     res->dither_level = dither_level;
     return LIQ_OK;
 }
 
+/*
+ Picks how images are dithered when the dithering level is above 0. Ordered modes push each pixel by a threshold
+ that depends only on its position, so unlike Floyd-Steinberg they can be split between threads any way
+ and also work for results of liq_result_create_fixed().
+ */
+LIQ_EXPORT liq_error liq_set_dithering_mode(liq_result *res, liq_dither_mode mode)
+{
+    if (!CHECK_STRUCT_TYPE(res, liq_result)) return LIQ_INVALID_POINTER;
+
+    unsigned int size;
+    switch(mode) {
+        case LIQ_DITHER_FLOYD_STEINBERG: size = 0; break;
+        case LIQ_DITHER_BAYER_2X2: size = 2; break;
+        case LIQ_DITHER_BAYER_4X4: size = 4; break;
+        case LIQ_DITHER_BAYER_8X8: size = 8; break;
+        case LIQ_DITHER_BLUE_NOISE: size = 64; break;
+        default: return LIQ_VALUE_OUT_OF_RANGE;
+    }
+
+    float *thresholds = NULL;
+    if (size) {
+        thresholds = res->malloc(size * size * sizeof(thresholds[0]));
+        if (!thresholds) return LIQ_OUT_OF_MEMORY;
+        if (mode == LIQ_DITHER_BLUE_NOISE) {
+            if (!liq_blue_noise_thresholds(thresholds, size, res->malloc, res->free)) {
+                res->free(thresholds);
+                return LIQ_OUT_OF_MEMORY;
+            }
+        } else {
+            liq_bayer_thresholds(thresholds, size);
+        }
+    }
+
+    if (res->remapping) {
+        liq_remapping_result_destroy(res->remapping);
+        res->remapping = NULL;
+    }
+
+    if (res->dither_thresholds) {
+        res->free(res->dither_thresholds);
+    }
+    res->dither_mode = mode;
+    res->dither_thresholds = thresholds;
+    res->dither_thresholds_size = size;
+    return LIQ_OK;
+}
+
+/*
+ Seeds the noise Floyd-Steinberg dithering starts from (0 by default). The same seed gives the same output
+ however many images are dithered at once.
+ */
+LIQ_EXPORT liq_error liq_set_dithering_seed(liq_result *res, unsigned int seed)
+{
+    if (!CHECK_STRUCT_TYPE(res, liq_result)) return LIQ_INVALID_POINTER;
+
+    if (res->remapping) {
+        liq_remapping_result_destroy(res->remapping);
+        res->remapping = NULL;
+    }
+
+    res->dither_seed = seed;
+    return LIQ_OK;
+}
+
 static liq_remapping_result *liq_remapping_result_create(liq_result *result)
 {
     if (!CHECK_STRUCT_TYPE(result, liq_result)) {
@@ -763,6 +913,14 @@ LIQ_EXPORT void liq_result_destroy(liq_result *res)
         liq_remapping_result_destroy(res->remapping);
     }
 
+    if (res->fixed_nearest) {
+        nearest_free(res->fixed_nearest);
+    }
+
+    if (res->dither_thresholds) {
+        res->free(res->dither_thresholds);
+    }
+
     pam_freecolormap(res->palette);
 
     res->magic_header = liq_freed_magic;
@@ -799,6 +957,11 @@ LIQ_EXPORT int liq_get_quantization_quality(liq_result *result)
     return result->palette_error;
 }
 
+LIQ_EXPORT int liq_mse_to_quality(double mse)
+{
+    return mse_to_quality(mse);
+}
+
 static int compare_popularity(const void *ch1, const void *ch2)
 {
     const float v1 = ((const colormap_item*)ch1)->popularity;
@@ -917,12 +1080,12 @@ static float remap_to_palette(liq_image *const input_image, unsigned char *const
 
     struct nearest_map *const n = nearest_init(map, fast);
 
-    const unsigned int max_threads = omp_get_max_threads();
+    const unsigned int max_threads = liq_thread_count(input_image->max_threads);
     viter_state average_color[(VITER_CACHE_LINE_GAP+map->colors) * max_threads];
     viter_init(map, max_threads, average_color);
 
     #if __GNUC__ >= 9
-    #pragma omp parallel for if (rows*cols > 3000) \
+    #pragma omp parallel for if (rows*cols > 3000) num_threads(max_threads) \
         schedule(static) default(none) shared(input_image,output_pixels,map,min_opaque_val,rows,cols,n,average_color) reduction(+:remapping_error)
     #endif
     for(int row = 0; row < rows; ++row) {
@@ -946,6 +1109,164 @@ static float remap_to_palette(liq_image *const input_image, unsigned char *const
     return remapping_error / (input_image->width * input_image->height);
 }
 
+/*
+ Remap-only counterpart of remap_to_palette() for palettes made entirely of fixed colors:
+ nothing is learned from the image, so the colormap and the search structure stay read-only
+ and can be shared by concurrent calls.
+ */
+/*
+ If alpha isn't NULL, it receives the alpha of every pixel (width*height bytes) from the same pass.
+ */
+static float remap_to_fixed_palette(liq_image *const input_image, unsigned char *const *const output_pixels, unsigned char *const alpha, const colormap *const map, const struct nearest_map *const n, const unsigned char *const lut)
+{
+    const int rows = input_image->height;
+    const unsigned int cols = input_image->width;
+    const float min_opaque_val = input_image->min_opaque_val;
+    const unsigned int threads = liq_thread_count(input_image->max_threads);
+    double remapping_error=0;
+
+    // rows are used only once, so unless they're already cached, they're converted into a per-thread buffer
+    f_pixel *temp_f_rows = NULL;
+    if (!input_image->f_pixels && !lut) {
+        temp_f_rows = input_image->malloc(sizeof(temp_f_rows[0]) * cols * threads);
+        if (!temp_f_rows) return -1;
+    }
+
+    #if __GNUC__ >= 9
+    #pragma omp parallel for if (rows*cols > 3000) num_threads(threads) \
+        schedule(static) default(none) shared(input_image,output_pixels,alpha,min_opaque_val,rows,cols,map,n,lut,temp_f_rows) reduction(+:remapping_error)
+    #endif
+    for(int row = 0; row < rows; ++row) {
+        if (lut) {
+            // opaque colors are looked up directly, the rest falls back to the search
+            const rgba_pixel *const row_pixels = liq_image_get_row_rgba(input_image, row);
+            unsigned int last_match=0;
+            for(unsigned int col = 0; col < cols; ++col) {
+                const rgba_pixel px = row_pixels[col];
+                const f_pixel fpx = to_f(input_image->gamma_lut, px);
+                float diff;
+                if (px.a == 255) {
+                    last_match = lut[px.r << 16 | px.g << 8 | px.b];
+                    diff = colordifference(fpx, map->palette[last_match].acolor);
+                } else {
+                    last_match = nearest_search(n, fpx, last_match, min_opaque_val, &diff);
+                }
+                output_pixels[row][col] = last_match;
+                remapping_error += diff;
+                if (alpha) alpha[(size_t)row * cols + col] = px.a;
+            }
+            continue;
+        }
+
+        const f_pixel *row_pixels;
+        if (temp_f_rows) {
+            f_pixel *const row_for_thread = temp_f_rows + cols * omp_get_thread_num();
+            convert_row_to_f(input_image, row_for_thread, row, input_image->gamma_lut);
+            row_pixels = row_for_thread;
+        } else {
+            row_pixels = input_image->f_pixels + cols * row;
+        }
+
+        unsigned int last_match=0;
+        for(unsigned int col = 0; col < cols; ++col) {
+            float diff;
+            output_pixels[row][col] = last_match = nearest_search(n, row_pixels[col], last_match, min_opaque_val, &diff);
+            remapping_error += diff;
+            if (alpha) alpha[(size_t)row * cols + col] = row_pixels[col].a * 255.f + 0.5f;
+        }
+    }
+
+    if (temp_f_rows) {
+        input_image->free(temp_f_rows);
+    }
+
+    return remapping_error / (input_image->width * input_image->height);
+}
+
+/* typical distance between a palette color and the nearest other one, in a single channel */
+static float palette_spread(const colormap *map)
+{
+    double sum = 0;
+    unsigned int count = 0;
+    for(unsigned int i=0; i < map->colors; i++) {
+        float best = INFINITY;
+        for(unsigned int j=0; j < map->colors; j++) {
+            const float diff = colordifference(map->palette[i].acolor, map->palette[j].acolor);
+            if (diff > 0) best = MIN(best, diff);
+        }
+        if (best < INFINITY) {
+            sum += sqrtf(best / 2.f); // opaque colors d apart in one channel differ by 2*d*d
+            count++;
+        }
+    }
+    return count ? sum / count : 0;
+}
+
+/*
+ Ordered dithering: each pixel is pushed by the threshold of its position in a tiled size x size matrix,
+ scaled to the spacing of the palette colors, and mapped to the nearest color. No pixel depends on another,
+ so rows are shared between threads like in remap_to_fixed_palette().
+ The error is that of the mapped colors against the original pixels.
+ */
+static float remap_to_palette_ordered(liq_image *const input_image, unsigned char *const *const output_pixels, unsigned char *const alpha, const colormap *const map, const struct nearest_map *const n, const float *const thresholds, const unsigned int size, const float dither_level, const unsigned char *const dither_map)
+{
+    const int rows = input_image->height;
+    const unsigned int cols = input_image->width;
+    const float min_opaque_val = input_image->min_opaque_val;
+    const unsigned int threads = liq_thread_count(input_image->max_threads);
+    const unsigned int size_mask = size - 1; // sizes are powers of 2
+    const float strength = palette_spread(map) * dither_level * (dither_map ? 1.f/255.f : 1.f);
+    double remapping_error=0;
+
+    f_pixel *temp_f_rows = NULL;
+    if (!input_image->f_pixels) {
+        temp_f_rows = input_image->malloc(sizeof(temp_f_rows[0]) * cols * threads);
+        if (!temp_f_rows) return -1;
+    }
+
+    #if __GNUC__ >= 9
+    #pragma omp parallel for if (rows*cols > 3000) num_threads(threads) \
+        schedule(static) default(none) shared(input_image,output_pixels,alpha,min_opaque_val,rows,cols,map,n,thresholds,size,size_mask,strength,dither_map,temp_f_rows) reduction(+:remapping_error)
+    #endif
+    for(int row = 0; row < rows; ++row) {
+        const f_pixel *row_pixels;
+        if (temp_f_rows) {
+            f_pixel *const row_for_thread = temp_f_rows + cols * omp_get_thread_num();
+            convert_row_to_f(input_image, row_for_thread, row, input_image->gamma_lut);
+            row_pixels = row_for_thread;
+        } else {
+            row_pixels = input_image->f_pixels + cols * row;
+        }
+        const float *const threshold_row = thresholds + (row & size_mask) * size;
+
+        unsigned int last_match=0;
+        for(unsigned int col = 0; col < cols; ++col) {
+            const f_pixel px = row_pixels[col];
+            // colors are premultiplied, so the push is too
+            float offset = threshold_row[col & size_mask] * strength * px.a;
+            if (dither_map) {
+                offset *= dither_map[(size_t)row * cols + col];
+            }
+            const f_pixel spx = {
+                .a = px.a,
+                .r = MIN(px.a, MAX(0.f, px.r + offset)),
+                .g = MIN(px.a, MAX(0.f, px.g + offset)),
+                .b = MIN(px.a, MAX(0.f, px.b + offset)),
+            };
+
+            output_pixels[row][col] = last_match = nearest_search(n, spx, last_match, min_opaque_val, NULL);
+            remapping_error += colordifference(px, map->palette[last_match].acolor);
+            if (alpha) alpha[(size_t)row * cols + col] = px.a * 255.f + 0.5f;
+        }
+    }
+
+    if (temp_f_rows) {
+        input_image->free(temp_f_rows);
+    }
+
+    return remapping_error / (input_image->width * input_image->height);
+}
+
 inline static f_pixel get_dithered_pixel(const float dither_level, const float max_dither_error, const f_pixel thiserr, const f_pixel px)
 {
     /* Use Floyd-Steinberg errors to adjust actual color. */
@@ -986,47 +1307,21 @@ inline static f_pixel get_dithered_pixel(const float dither_level, const float m
      };
 }
 
-/**
-  Uses edge/noise map to apply dithering only to flat areas. Dithering on edges creates jagged lines, and noisy areas are "naturally" dithered.
-
-  If output_image_is_remapped is true, only pixels noticeably changed by error diffusion will be written to output image.
+/*
+ Dithers rows first_row..end_row-1, starting the error diffusion at warmup_row, with thiserr holding the
+ initial error of 2*(cols+2) pixels.
  */
-static void remap_to_palette_floyd(liq_image *input_image, unsigned char *const output_pixels[], const colormap *map, const float max_dither_error, const bool use_dither_map, const bool output_image_is_remapped, float base_dithering_level)
+static void remap_to_palette_floyd_stripe(liq_image *input_image, unsigned char *const output_pixels[], const colormap *map, const struct nearest_map *n, const unsigned char *dither_map, const float max_dither_error, const bool output_image_is_remapped, const float base_dithering_level, f_pixel *restrict thiserr, const unsigned int warmup_row, const unsigned int first_row, const unsigned int end_row)
 {
-    const unsigned int rows = input_image->height, cols = input_image->width;
-    const unsigned char *dither_map = use_dither_map ? (input_image->dither_map ? input_image->dither_map : input_image->edges) : NULL;
+    const unsigned int cols = input_image->width;
     const float min_opaque_val = input_image->min_opaque_val;
-
     const colormap_item *acolormap = map->palette;
+    f_pixel *restrict nexterr = thiserr + (cols + 2);
 
-    struct nearest_map *const n = nearest_init(map, false);
-
-    /* Initialize Floyd-Steinberg error vectors. */
-    f_pixel *restrict thiserr, *restrict nexterr;
-    thiserr = input_image->malloc((cols + 2) * sizeof(*thiserr) * 2); // +2 saves from checking out of bounds access
-    nexterr = thiserr + (cols + 2);
-    srand(12345); /* deterministic dithering is better for comparing results */
-    if (!thiserr) return;
-
-    for (unsigned int col = 0; col < cols + 2; ++col) {
-        const double rand_max = RAND_MAX;
-        thiserr[col].r = ((double)rand() - rand_max/2.0)/rand_max/255.0;
-        thiserr[col].g = ((double)rand() - rand_max/2.0)/rand_max/255.0;
-        thiserr[col].b = ((double)rand() - rand_max/2.0)/rand_max/255.0;
-        thiserr[col].a = ((double)rand() - rand_max/2.0)/rand_max/255.0;
-    }
-
-    // response to this value is non-linear and without it any value < 0.8 would give almost no dithering
-    base_dithering_level = 1.0 - (1.0-base_dithering_level)*(1.0-base_dithering_level)*(1.0-base_dithering_level);
-
-    if (dither_map) {
-        base_dithering_level *= 1.0/255.0; // convert byte to float
-    }
-    base_dithering_level *= 15.0/16.0; // prevent small errors from accumulating
-
-    bool fs_direction = true;
+    // rows alternate direction, and the parity is kept the same as if the whole image was dithered in one go
+    bool fs_direction = !(warmup_row & 1);
     unsigned int last_match=0;
-    for (unsigned int row = 0; row < rows; ++row) {
+    for (unsigned int row = warmup_row; row < end_row; ++row) {
         memset(nexterr, 0, (cols + 2) * sizeof(*nexterr));
 
         unsigned int col = (fs_direction) ? 0 : (cols - 1);
@@ -1040,8 +1335,13 @@ static void remap_to_palette_floyd(liq_image *input_image, unsigned char *const
 
             const f_pixel spx = get_dithered_pixel(dither_level, max_dither_error, thiserr[col + 1], row_pixels[col]);
 
-            const unsigned int guessed_match = output_image_is_remapped ? output_pixels[row][col] : last_match;
-            output_pixels[row][col] = last_match = nearest_search(n, spx, guessed_match, min_opaque_val, NULL);
+            if (row < first_row) {
+                // warm-up rows belong to the stripe above, only the error they leave behind is needed
+                last_match = nearest_search(n, spx, last_match, min_opaque_val, NULL);
+            } else {
+                const unsigned int guessed_match = output_image_is_remapped ? output_pixels[row][col] : last_match;
+                output_pixels[row][col] = last_match = nearest_search(n, spx, guessed_match, min_opaque_val, NULL);
+            }
 
             const f_pixel xp = acolormap[last_match].acolor;
             f_pixel err = {
@@ -1123,7 +1423,82 @@ static void remap_to_palette_floyd(liq_image *input_image, unsigned char *const
         fs_direction = !fs_direction;
     }
 
-    input_image->free(MIN(thiserr, nexterr)); // MIN because pointers were swapped
+}
+
+/* next of a sequence of errors within +-1/2 of a 1/255 step, from a 32-bit LCG */
+inline static float dither_noise(uint32_t *state)
+{
+    *state = *state * 1664525U + 1013904223U;
+    return ((*state >> 8) / 16777216.f - 0.5f) / 255.f;
+}
+
+/**
+  Uses edge/noise map to apply dithering only to flat areas. Dithering on edges creates jagged lines, and noisy areas are "naturally" dithered.
+
+  If output_image_is_remapped is true, only pixels noticeably changed by error diffusion will be written to output image.
+
+  Large images are split into horizontal stripes dithered in parallel. Error can't flow across the seam
+  between stripes, so each stripe first runs the diffusion over the last rows of the stripe above without
+  writing them, and starts from the error they leave behind. Stripes depend only on the number of threads,
+  so the output is the same for the same thread count, and one thread gives the serial result.
+ */
+static void remap_to_palette_floyd(liq_image *input_image, unsigned char *const output_pixels[], const colormap *map, const float max_dither_error, const bool use_dither_map, const bool output_image_is_remapped, float base_dithering_level, const unsigned int seed)
+{
+    const unsigned int rows = input_image->height, cols = input_image->width;
+    const unsigned char *dither_map = use_dither_map ? (input_image->dither_map ? input_image->dither_map : input_image->edges) : NULL;
+
+    if (!liq_image_get_row_f(input_image, 0)) { // trigger lazy conversion
+        return;
+    }
+
+    // user callbacks may not be reentrant, stripes are only dithered in parallel when rows are in memory
+    const unsigned int min_stripe_rows = 64, warmup_rows = 8;
+    const int stripes = (input_image->f_pixels || input_image->rows) && rows*cols > 512*512 ?
+        MAX(1, MIN(liq_thread_count(input_image->max_threads), rows / min_stripe_rows)) : 1;
+
+    struct nearest_map *const n = nearest_init(map, false);
+
+    /* Initialize Floyd-Steinberg error vectors. */
+    const size_t stripe_err_size = (cols + 2) * 2; // +2 saves from checking out of bounds access
+    f_pixel *restrict errors = input_image->malloc(stripe_err_size * sizeof(errors[0]) * stripes);
+    if (!errors) {
+        nearest_free(n);
+        return;
+    }
+
+    // deterministic dithering is better for comparing results, and the state is the call's own,
+    // so concurrent remaps don't change each other's noise
+    uint32_t random_state = seed;
+    for (unsigned int col = 0; col < cols + 2; ++col) {
+        errors[col].r = dither_noise(&random_state);
+        errors[col].g = dither_noise(&random_state);
+        errors[col].b = dither_noise(&random_state);
+        errors[col].a = dither_noise(&random_state);
+    }
+    for (int i=1; i < stripes; i++) {
+        memcpy(errors + i*stripe_err_size, errors, (cols + 2) * sizeof(errors[0]));
+    }
+
+    // response to this value is non-linear and without it any value < 0.8 would give almost no dithering
+    base_dithering_level = 1.0 - (1.0-base_dithering_level)*(1.0-base_dithering_level)*(1.0-base_dithering_level);
+
+    if (dither_map) {
+        base_dithering_level *= 1.0/255.0; // convert byte to float
+    }
+    base_dithering_level *= 15.0/16.0; // prevent small errors from accumulating
+
+    #if __GNUC__ >= 9
+    #pragma omp parallel for num_threads(stripes) schedule(static, 1) default(none) \
+        shared(input_image,output_pixels,map,n,dither_map,max_dither_error,output_image_is_remapped,base_dithering_level,errors,stripe_err_size,stripes,rows,warmup_rows)
+    #endif
+    for (int i=0; i < stripes; i++) {
+        const unsigned int first_row = (unsigned long)rows * i / stripes, end_row = (unsigned long)rows * (i+1) / stripes;
+        const unsigned int warmup_row = first_row > warmup_rows ? first_row - warmup_rows : 0;
+        remap_to_palette_floyd_stripe(input_image, output_pixels, map, n, dither_map, max_dither_error, output_image_is_remapped, base_dithering_level,
+            errors + i*stripe_err_size, warmup_row, first_row, end_row);
+    }
+
+    input_image->free(errors);
     nearest_free(n);
 }
 
@@ -1142,23 +1517,61 @@ static void remove_fixed_colors_from_histogram(histogram *hist, const liq_image
     }
 }
 
-/* histogram contains information how many times each color is present in the image, weighted by importance_map */
-static histogram *get_histogram(liq_image *input_image, const liq_attr *options)
+/*
+ Adds all rows of an image held in memory to the table. Large images are split into bands of rows
+ that are counted in parallel, each into a table of its own, and the tables are merged in order,
+ so the histogram is the same as from one pass over the rows.
+ */
+static bool compute_histogram_rows(struct acolorhash_table *acht, liq_image *input_image, const liq_attr *options)
 {
-    unsigned int ignorebits=MAX(options->min_posterization_output, options->min_posterization_input);
     const unsigned int cols = input_image->width, rows = input_image->height;
+    const rgba_pixel *const *const pixels = (const rgba_pixel *const *)input_image->rows;
+    const unsigned char *const noise = input_image->noise;
+    const int bands = rows*cols > 512*512 ? MIN(liq_thread_count(input_image->max_threads), rows) : 1;
 
-    if (!input_image->noise && options->use_contrast_maps) {
-        contrast_maps(input_image);
+    if (bands < 2) {
+        return pam_computeacolorhash(acht, pixels, cols, rows, noise);
     }
 
-   /*
-    ** Step 2: attempt to make a histogram of the colors, unclustered.
-    ** If at first we don't succeed, increase ignorebits to increase color
-    ** coherence and try again.
-    */
+    struct acolorhash_table *band_tables[bands];
+    bool band_ok[bands];
 
-    unsigned int maxcolors = options->max_histogram_entries;
+    band_tables[0] = acht;
+    for(int i=1; i < bands; i++) {
+        band_tables[i] = pam_allocacolorhash(acht->maxcolors, rows*cols, acht->ignorebits, options->malloc, options->free);
+    }
+
+    #if __GNUC__ >= 9
+    #pragma omp parallel for num_threads(bands) \
+        schedule(static, 1) default(none) shared(band_tables,band_ok,bands,pixels,noise,rows,cols)
+    #endif
+    for(int i=0; i < bands; i++) {
+        const unsigned int first_row = (unsigned long)rows * i / bands, end_row = (unsigned long)rows * (i+1) / bands;
+        band_ok[i] = band_tables[i] && pam_computeacolorhash(band_tables[i], pixels + first_row, cols, end_row - first_row, noise ? noise + (size_t)first_row * cols : NULL);
+    }
+
+    bool added_ok = band_ok[0];
+    for(int i=1; i < bands; i++) {
+        // a band short of memory mustn't be taken for one with too many colors
+        if (!band_tables[i] || band_tables[i]->out_of_memory) {
+            acht->out_of_memory = true;
+        }
+        added_ok = added_ok && band_ok[i] && pam_mergeacolorhash(acht, band_tables[i]);
+        if (band_tables[i]) pam_freeacolorhash(band_tables[i]);
+    }
+    return added_ok;
+}
+
+/*
+ Counts colors in a table of at most max_histogram_entries colors.
+ If at first we don't succeed, increase ignorebits to increase color coherence.
+ Up to 4 bits the colors found so far are posterized in place and counting goes on,
+ beyond that it starts over. Running out of memory gives NULL instead.
+ */
+static struct acolorhash_table *compute_histogram_table(liq_image *input_image, const liq_attr *options, unsigned int ignorebits)
+{
+    const unsigned int cols = input_image->width, rows = input_image->height;
+    const unsigned int maxcolors = options->max_histogram_entries;
 
     struct acolorhash_table *acht;
     const bool all_rows_at_once = liq_image_can_use_rows(input_image);
@@ -1171,14 +1584,18 @@ static histogram *get_histogram(liq_image *input_image, const liq_attr *options)
         for(unsigned int row=0; row < rows; row++) {
             bool added_ok;
             if (all_rows_at_once) {
-                added_ok = pam_computeacolorhash(acht, (const rgba_pixel *const *)input_image->rows, cols, rows, input_image->noise);
+                added_ok = compute_histogram_rows(acht, input_image, options);
                 if (added_ok) break;
             } else {
                 const rgba_pixel* rows_p[1] = { liq_image_get_row_rgba(input_image, row) };
                 added_ok = pam_computeacolorhash(acht, rows_p, cols, 1, input_image->noise ? &input_image->noise[row * cols] : NULL);
             }
+            if (!added_ok && acht->out_of_memory) {
+                pam_freeacolorhash(acht);
+                return NULL;
+            }
             if (!added_ok) {
-                ignorebits++;
+                ignorebits = MAX(ignorebits, acht->ignorebits) + 1;
                 liq_verbose_printf(options, "  too many colors! Scaling colors to improve clustering... %d", ignorebits);
                 pam_freeacolorhash(acht);
                 acht = NULL;
@@ -1187,6 +1604,89 @@ static histogram *get_histogram(liq_image *input_image, const liq_attr *options)
         }
     } while(!acht);
 
+    if (acht->ignorebits > ignorebits) {
+        liq_verbose_printf(options, "  too many colors! Scaled colors in place to improve clustering... %d", acht->ignorebits);
+    }
+    return acht;
+}
+
+/*
+ Counts colors row by row in a table that fits options->histogram_memory_limit, spilling it to a
+ temporary file whenever the next row might not fit. The spilled runs are merged into the histogram,
+ posterized only as much as max_histogram_entries requires.
+ */
+static histogram *compute_spilled_histogram(liq_image *input_image, const liq_attr *options, const unsigned int ignorebits)
+{
+    const unsigned int cols = input_image->width, rows = input_image->height;
+    // each color has an item, and up to 4 slots right after the table grows
+    const size_t bytes_per_color = sizeof(struct acolorhist_arr_item) + 4*sizeof(struct acolorhash_slot);
+    const unsigned int table_colors = MAX(2*cols, MIN(options->histogram_memory_limit / bytes_per_color, 1U<<28));
+
+    struct acolorhash_table *acht = pam_allocacolorhash(table_colors, rows*cols, ignorebits, options->malloc, options->free);
+    if (!acht) return NULL;
+
+    struct histspill *spill = NULL;
+    histogram *hist = NULL;
+    for(unsigned int row=0; row < rows; row++) {
+        if (acht->colors + cols > acht->maxcolors) {
+            if (!spill) spill = histspill_create(options->malloc, options->free);
+            if (!spill || !histspill_write(spill, acht)) goto done;
+        }
+
+        const rgba_pixel* rows_p[1] = { liq_image_get_row_rgba(input_image, row) };
+        // a table that can hold the row is never posterized, and has to stay at the level of the spilled runs
+        if (!pam_computeacolorhash(acht, rows_p, cols, 1, input_image->noise ? &input_image->noise[row * cols] : NULL) ||
+            acht->ignorebits != ignorebits) {
+            goto done;
+        }
+    }
+
+    if (!spill && acht->colors <= options->max_histogram_entries) {
+        hist = pam_acolorhashtoacolorhist(acht, input_image->gamma, input_image->gamma_lut, options->malloc, options->free);
+        goto done;
+    }
+
+    if (!spill) spill = histspill_create(options->malloc, options->free);
+    if (!spill || !histspill_write(spill, acht)) goto done;
+    pam_freeacolorhash(acht);
+    acht = NULL;
+
+    /* Limit perceptual weight to 1/10th of the image surface area to prevent
+       a single color from dominating all others. */
+    hist = histspill_to_hist(spill, options->max_histogram_entries, ignorebits, 0.1f * cols * rows, input_image->gamma_lut, options->histogram_memory_limit);
+    if (hist && hist->ignorebits > ignorebits) {
+        liq_verbose_printf(options, "  too many colors! Scaled colors while merging to improve clustering... %d", hist->ignorebits);
+    }
+
+done:
+    if (spill) histspill_destroy(spill);
+    if (acht) pam_freeacolorhash(acht);
+    return hist;
+}
+
+/* histogram contains information how many times each color is present in the image, weighted by importance_map */
+static histogram *get_histogram(liq_image *input_image, const liq_attr *options)
+{
+    unsigned int ignorebits=MAX(options->min_posterization_output, options->min_posterization_input);
+
+    if (!input_image->noise && options->use_contrast_maps) {
+        contrast_maps(input_image);
+    }
+
+   /*
+    ** Step 2: attempt to make a histogram of the colors, unclustered.
+    */
+
+    struct acolorhash_table *acht = NULL;
+    histogram *hist = NULL;
+    if (options->histogram_memory_limit) {
+        hist = compute_spilled_histogram(input_image, options, ignorebits);
+        if (!hist) return NULL;
+    } else {
+        acht = compute_histogram_table(input_image, options, ignorebits);
+        if (!acht) return NULL;
+    }
+
     if (input_image->noise) {
         input_image->free(input_image->noise);
         input_image->noise = NULL;
@@ -1196,8 +1696,10 @@ static histogram *get_histogram(liq_image *input_image, const liq_attr *options)
         liq_image_free_rgba_source(input_image); // bow can free the RGBA source if copy has been made in f_pixels
     }
 
-    histogram *hist = pam_acolorhashtoacolorhist(acht, input_image->gamma, input_image->gamma_lut, options->malloc, options->free);
-    pam_freeacolorhash(acht);
+    if (acht) {
+        hist = pam_acolorhashtoacolorhist(acht, input_image->gamma, input_image->gamma_lut, options->malloc, options->free);
+        pam_freeacolorhash(acht);
+    }
     if (hist) {
         liq_verbose_printf(options, "  made histogram...%d colors found", hist->size);
         remove_fixed_colors_from_histogram(hist, input_image, options->target_mse);
@@ -1206,6 +1708,103 @@ static histogram *get_histogram(liq_image *input_image, const liq_attr *options)
     return hist;
 }
 
+/*
+ Computes the same error as quantizing with the given colors as fixed colors would report,
+ i.e. weighted histogram error where colors that match a fixed color closely enough are ignored.
+ */
+static double fixed_palette_error(const histogram *hist, const liq_image *input_image, const liq_attr *options, const liq_color colors[], const unsigned int colors_count)
+{
+    const float max_difference = MAX(options->target_mse/2.0, 2.0/256.0/256.0);
+
+    colormap *map = pam_colormap(colors_count, options->malloc, options->free);
+    if (!map) return -1;
+
+    for(unsigned int i=0; i < colors_count; i++) {
+        map->palette[i] = (colormap_item){
+            .acolor = to_f(input_image->gamma_lut, (rgba_pixel){
+                .r = colors[i].r,
+                .g = colors[i].g,
+                .b = colors[i].b,
+                .a = colors[i].a,
+            }),
+            .fixed = true,
+        };
+    }
+
+    struct nearest_map *const n = nearest_init(map, options->fast_palette);
+
+    double total_diff=0;
+    unsigned int last_match=0;
+    for(unsigned int j=0; j < hist->size; j++) {
+        float diff;
+        last_match = nearest_search(n, hist->achv[j].acolor, last_match, options->min_opaque_val, &diff);
+        if (diff >= max_difference) {
+            total_diff += diff * hist->achv[j].perceptual_weight;
+        }
+    }
+
+    nearest_free(n);
+    pam_freecolormap(map);
+
+    return total_diff / hist->total_perceptual_weight;
+}
+
+/*
+ Makes the histogram liq_image_score_fixed_palettes scores against, so its time can be told apart.
+ The next scoring with the same options uses it up.
+ */
+LIQ_EXPORT liq_error liq_image_make_histogram(liq_image *const input_image, liq_attr *const options)
+{
+    if (!CHECK_STRUCT_TYPE(options, liq_attr)) return LIQ_INVALID_POINTER;
+    if (!CHECK_STRUCT_TYPE(input_image, liq_image)) return LIQ_INVALID_POINTER;
+    if (input_image->fixed_colors_count) return LIQ_VALUE_OUT_OF_RANGE; // they would be removed from the histogram
+
+    if (!input_image->hist) {
+        input_image->hist = get_histogram(input_image, options);
+        if (!input_image->hist) {
+            return LIQ_OUT_OF_MEMORY;
+        }
+    }
+    return LIQ_OK;
+}
+
+/*
+ Scores palettes_count consecutive palettes of palette_size colors each against one histogram of the image.
+ errors[] receives the palette error each palette would have as the image's fixed colors.
+ */
+LIQ_EXPORT liq_error liq_image_score_fixed_palettes(liq_image *const input_image, liq_attr *const options, const liq_color colors[], int palette_size, int palettes_count, double errors[])
+{
+    if (!CHECK_STRUCT_TYPE(options, liq_attr)) return LIQ_INVALID_POINTER;
+    if (!CHECK_STRUCT_TYPE(input_image, liq_image)) return LIQ_INVALID_POINTER;
+    if (!CHECK_USER_POINTER((void*)colors) || !CHECK_USER_POINTER(errors)) return LIQ_INVALID_POINTER;
+    if (palette_size < 1 || palette_size > 256 || palettes_count < 1) return LIQ_VALUE_OUT_OF_RANGE;
+    if (input_image->fixed_colors_count) return LIQ_VALUE_OUT_OF_RANGE; // they would be removed from the shared histogram
+
+    liq_error error = liq_image_make_histogram(input_image, options);
+    if (error != LIQ_OK) {
+        return error;
+    }
+    histogram *hist = input_image->hist;
+    input_image->hist = NULL;
+
+    const unsigned int threads = liq_thread_count(input_image->max_threads);
+
+    #if __GNUC__ >= 9
+    #pragma omp parallel for if (palettes_count > 1) num_threads(threads) \
+        schedule(dynamic) default(none) shared(hist,input_image,options,colors,palette_size,palettes_count,errors)
+    #endif
+    for(int i=0; i < palettes_count; i++) {
+        errors[i] = fixed_palette_error(hist, input_image, options, &colors[i*palette_size], palette_size);
+    }
+
+    pam_freeacolorhist(hist);
+
+    for(int i=0; i < palettes_count; i++) {
+        if (errors[i] < 0) return LIQ_OUT_OF_MEMORY;
+    }
+    return LIQ_OK;
+}
+
 static void modify_alpha(liq_image *input_image, rgba_pixel *const row_pixels)
 {
     /* IE6 makes colors with even slightest transparency completely transparent,
@@ -1249,47 +1848,27 @@ static void contrast_maps(liq_image *image)
         return;
     }
 
+    const struct liq_kernels *const kernels = liq_kernels();
     const f_pixel *curr_row, *prev_row, *next_row;
     curr_row = prev_row = next_row = liq_image_get_row_f(image, 0);
 
-    for (int j=0; j < rows; j++) {
+    if (image->f_pixels) {
+        // every row is in memory, so rows don't depend on each other
+        const f_pixel *const f_pixels = image->f_pixels;
+        const unsigned int threads = liq_thread_count(image->max_threads);
+        #if __GNUC__ >= 9
+        #pragma omp parallel for if (rows*cols > 3000) num_threads(threads) \
+            schedule(static) default(none) shared(kernels,f_pixels,noise,edges,rows,cols)
+        #endif
+        for (int j=0; j < rows; j++) {
+            kernels->contrast_maps_row(f_pixels + cols*MAX(0,j-1), f_pixels + cols*j, f_pixels + cols*MIN(rows-1,j+1), cols, &noise[j*cols], &edges[j*cols]);
+        }
+    } else for (int j=0; j < rows; j++) {
         prev_row = curr_row;
         curr_row = next_row;
         next_row = liq_image_get_row_f(image, MIN(rows-1,j+1));
 
-        f_pixel prev, curr = curr_row[0], next=curr;
-        for (int i=0; i < cols; i++) {
-            prev=curr;
-            curr=next;
-            next = curr_row[MIN(cols-1,i+1)];
-
-            // contrast is difference between pixels neighbouring horizontally and vertically
-            const float a = fabsf(prev.a+next.a - curr.a*2.f),
-                        r = fabsf(prev.r+next.r - curr.r*2.f),
-                        g = fabsf(prev.g+next.g - curr.g*2.f),
-                        b = fabsf(prev.b+next.b - curr.b*2.f);
-
-            const f_pixel prevl = prev_row[i];
-            const f_pixel nextl = next_row[i];
-
-            const float a1 = fabsf(prevl.a+nextl.a - curr.a*2.f),
-                        r1 = fabsf(prevl.r+nextl.r - curr.r*2.f),
-                        g1 = fabsf(prevl.g+nextl.g - curr.g*2.f),
-                        b1 = fabsf(prevl.b+nextl.b - curr.b*2.f);
-
-            const float horiz = MAX(MAX(a,r),MAX(g,b));
-            const float vert = MAX(MAX(a1,r1),MAX(g1,b1));
-            const float edge = MAX(horiz,vert);
-            float z = edge - fabsf(horiz-vert)*.5f;
-            z = 1.f - MAX(z,MIN(horiz,vert));
-            z *= z; // noise is amplified
-            z *= z;
-
-            z *= 256.f;
-            noise[j*cols+i] = z < 256 ? z : 255;
-            z = (1.f-edge)*256.f;
-            edges[j*cols+i] = z < 256 ? z : 255;
-        }
+        kernels->contrast_maps_row(prev_row, curr_row, next_row, cols, &noise[j*cols], &edges[j*cols]);
     }
 
     // noise areas are shrunk and then expanded to remove thin edges from the map
@@ -1324,10 +1903,15 @@ static void contrast_maps(liq_image *image)
 static void update_dither_map(unsigned char *const *const row_pointers, liq_image *input_image)
 {
     const unsigned int width = input_image->width;
-    const unsigned int height = input_image->height;
+    const int height = input_image->height;
     unsigned char *const edges = input_image->edges;
 
-    for(unsigned int row=0; row < height; row++) {
+    // each row only writes its own part of the map, and only reads the remapped rows
+    #if __GNUC__ >= 9
+    #pragma omp parallel for if (width*height > 3000) num_threads(liq_thread_count(input_image->max_threads)) \
+        schedule(static) default(none) shared(row_pointers,input_image,width,height,edges)
+    #endif
+    for(int row=0; row < height; row++) {
         unsigned char lastpixel = row_pointers[row][0];
         unsigned int lastcol=0;
 
@@ -1430,7 +2014,7 @@ static colormap *find_best_palette(histogram *hist, const liq_attr *options, con
         // and histogram weights are adjusted based on remapping error to give more weight to poorly matched colors
 
         const bool first_run_of_target_mse = !acolormap && target_mse > 0;
-        double total_error = viter_do_iteration(hist, newmap, options->min_opaque_val, first_run_of_target_mse ? NULL : adjust_histogram_callback, !acolormap || options->fast_palette);
+        double total_error = viter_do_iteration(hist, newmap, options->min_opaque_val, first_run_of_target_mse ? NULL : adjust_histogram_callback, !acolormap || options->fast_palette, liq_thread_count(options->max_threads));
 
         // goal is to increase quality or to reduce number of colors used if quality is good enough
         if (!acolormap || total_error < least_error || (total_error <= target_mse && newmap->colors < max_colors)) {
@@ -1515,7 +2099,7 @@ static liq_result *pngquant_quantize(histogram *hist, const liq_attr *options, c
             double previous_palette_error = MAX_DIFF;
 
             for(unsigned int i=0; i < iterations; i++) {
-                palette_error = viter_do_iteration(hist, acolormap, options->min_opaque_val, NULL, i==0 || options->fast_palette);
+                palette_error = viter_do_iteration(hist, acolormap, options->min_opaque_val, NULL, i==0 || options->fast_palette, liq_thread_count(options->max_threads));
 
                 if (fabs(previous_palette_error-palette_error) < iteration_limit) {
                     break;
@@ -1613,6 +2197,15 @@ LIQ_EXPORT liq_error liq_write_remapped_image_rows(liq_result *quant, liq_image
     if (result->dither_level == 0) {
         set_rounded_palette(&result->int_palette, result->palette, result->gamma, result->gamma_lut, quant->min_posterization_output);
         remapping_error = remap_to_palette(input_image, row_pointers, result->palette, quant->fast_palette);
+    } else if (quant->dither_thresholds) {
+        set_rounded_palette(&result->int_palette, result->palette, result->gamma, result->gamma_lut, quant->min_posterization_output);
+
+        const unsigned char *dither_map = result->use_dither_map ? (input_image->dither_map ? input_image->dither_map : input_image->edges) : NULL;
+        struct nearest_map *const n = nearest_init(result->palette, quant->fast_palette);
+        const float error = remap_to_palette_ordered(input_image, row_pointers, NULL, result->palette, n,
+            quant->dither_thresholds, quant->dither_thresholds_size, result->dither_level, dither_map);
+        nearest_free(n);
+        if (error < 0) return LIQ_OUT_OF_MEMORY;
     } else {
         const bool generate_dither_map = result->use_dither_map && (input_image->edges && !input_image->dither_map);
         if (generate_dither_map) {
@@ -1625,7 +2218,7 @@ LIQ_EXPORT liq_error liq_write_remapped_image_rows(liq_result *quant, liq_image
         set_rounded_palette(&result->int_palette, result->palette, result->gamma, result->gamma_lut, quant->min_posterization_output);
 
         remap_to_palette_floyd(input_image, row_pointers, result->palette,
-            MAX(remapping_error*2.4, 16.f/256.f), result->use_dither_map, generate_dither_map, result->dither_level);
+            MAX(remapping_error*2.4, 16.f/256.f), result->use_dither_map, generate_dither_map, result->dither_level, quant->dither_seed);
     }
 
     // remapping error from dithered image is absurd, so always non-dithered value is used
@@ -1638,6 +2231,177 @@ LIQ_EXPORT liq_error liq_write_remapped_image_rows(liq_result *quant, liq_image
     return LIQ_OK;
 }
 
+/*
+ Creates a result from a palette of fixed colors without looking at any image.
+ Remapping with liq_write_remapped_image_fixed() doesn't modify the result, so it can be shared between threads.
+ */
+LIQ_EXPORT liq_result *liq_result_create_fixed(liq_attr *attr, const liq_color colors[], int colors_count, double gamma)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return NULL;
+    if (!CHECK_USER_POINTER((void*)colors)) return NULL;
+    if (colors_count < 1 || colors_count > 256) {
+        liq_log_error(attr, "fixed palette must have 1-256 colors");
+        return NULL;
+    }
+    if (gamma < 0 || gamma > 1.0) {
+        liq_log_error(attr, "gamma must be >= 0 and <= 1 (try 1/gamma instead)");
+        return NULL;
+    }
+
+    colormap *map = pam_colormap(colors_count, attr->malloc, attr->free);
+    if (!map) return NULL;
+
+    liq_result *result = attr->malloc(sizeof(liq_result));
+    if (!result) {
+        pam_freecolormap(map);
+        return NULL;
+    }
+    *result = (liq_result){
+        .magic_header = liq_result_magic,
+        .malloc = attr->malloc,
+        .free = attr->free,
+        .palette = map,
+        .palette_error = -1,
+        .fast_palette = attr->fast_palette,
+        .use_dither_map = attr->use_dither_map,
+        .gamma = gamma ? gamma : 0.45455,
+        .min_posterization_output = attr->min_posterization_output,
+    };
+    to_f_set_gamma(result->gamma_lut, result->gamma);
+
+    result->int_palette.count = colors_count;
+    for(int i=0; i < colors_count; i++) {
+        map->palette[i] = (colormap_item){
+            .acolor = to_f(result->gamma_lut, (rgba_pixel){
+                .r = colors[i].r,
+                .g = colors[i].g,
+                .b = colors[i].b,
+                .a = colors[i].a,
+            }),
+            .fixed = true,
+        };
+        result->int_palette.entries[i] = colors[i];
+    }
+
+    result->fixed_nearest = nearest_init(map, result->fast_palette);
+    return result;
+}
+
+static liq_error write_remapped_image_fixed_rows(const liq_result *result, liq_image *input_image, unsigned char **row_pointers, unsigned char *alpha, double *remapping_error);
+
+LIQ_EXPORT liq_error liq_write_remapped_image_fixed(const liq_result *result, liq_image *input_image, void *buffer, size_t buffer_size, double *remapping_error)
+{
+    return liq_write_remapped_image_fixed_alpha(result, input_image, buffer, buffer_size, NULL, 0, remapping_error);
+}
+
+/*
+ Like liq_write_remapped_image_fixed(), and also copies the alpha of every pixel into alpha_buffer
+ (if not NULL) while remapping, so masks don't need another pass over the image.
+ */
+LIQ_EXPORT liq_error liq_write_remapped_image_fixed_alpha(const liq_result *result, liq_image *input_image, void *buffer, size_t buffer_size, void *alpha_buffer, size_t alpha_buffer_size, double *remapping_error)
+{
+    if (!CHECK_STRUCT_TYPE(result, liq_result)) {
+        return LIQ_INVALID_POINTER;
+    }
+    if (!CHECK_STRUCT_TYPE(input_image, liq_image)) {
+        return LIQ_INVALID_POINTER;
+    }
+    if (!CHECK_USER_POINTER(buffer)) {
+        return LIQ_INVALID_POINTER;
+    }
+
+    const size_t required_size = input_image->width * input_image->height;
+    if (buffer_size < required_size) {
+        return LIQ_BUFFER_TOO_SMALL;
+    }
+    if (alpha_buffer && alpha_buffer_size < required_size) {
+        return LIQ_BUFFER_TOO_SMALL;
+    }
+
+    unsigned char **rows = malloc(input_image->height * sizeof(unsigned char *));
+    if (!rows) return LIQ_OUT_OF_MEMORY;
+    unsigned char *buffer_bytes = buffer;
+    for(unsigned int i=0; i < input_image->height; i++) {
+        rows[i] = &buffer_bytes[input_image->width * i];
+    }
+
+    liq_error err = write_remapped_image_fixed_rows(result, input_image, rows, alpha_buffer, remapping_error);
+    free(rows);
+    return err;
+}
+
+LIQ_EXPORT liq_error liq_write_remapped_image_fixed_rows(const liq_result *result, liq_image *input_image, unsigned char **row_pointers, double *remapping_error)
+{
+    return write_remapped_image_fixed_rows(result, input_image, row_pointers, NULL, remapping_error);
+}
+
+static liq_error write_remapped_image_fixed_rows(const liq_result *result, liq_image *input_image, unsigned char **row_pointers, unsigned char *alpha, double *remapping_error)
+{
+    if (!CHECK_STRUCT_TYPE(result, liq_result)) return LIQ_INVALID_POINTER;
+    if (!CHECK_STRUCT_TYPE(input_image, liq_image)) return LIQ_INVALID_POINTER;
+    for(unsigned int i=0; i < input_image->height; i++) {
+        if (!CHECK_USER_POINTER(row_pointers+i) || !CHECK_USER_POINTER(row_pointers[i])) return LIQ_INVALID_POINTER;
+    }
+
+    if (!result->fixed_nearest) return LIQ_NOT_READY; // not created with liq_result_create_fixed()
+    if (input_image->gamma != result->gamma) return LIQ_VALUE_OUT_OF_RANGE;
+
+    // Floyd-Steinberg would need the result to be writable, so only ordered dithering applies here
+    const float error = result->dither_level > 0 && result->dither_thresholds ?
+        remap_to_palette_ordered(input_image, row_pointers, alpha, result->palette, result->fixed_nearest, result->dither_thresholds, result->dither_thresholds_size, result->dither_level, NULL) :
+        remap_to_fixed_palette(input_image, row_pointers, alpha, result->palette, result->fixed_nearest, result->fixed_lut);
+    if (error < 0) return LIQ_OUT_OF_MEMORY;
+
+    if (remapping_error) *remapping_error = error;
+    return LIQ_OK;
+}
+
+/*
+ Fills lut with the palette index of every opaque RGB color (index = r<<16 | g<<8 | b),
+ exactly as liq_write_remapped_image_fixed() would map it.
+ */
+LIQ_EXPORT liq_error liq_result_build_lut(const liq_result *result, unsigned char *lut, size_t lut_size)
+{
+    if (!CHECK_STRUCT_TYPE(result, liq_result)) return LIQ_INVALID_POINTER;
+    if (!CHECK_USER_POINTER(lut)) return LIQ_INVALID_POINTER;
+    if (lut_size < LIQ_LUT_SIZE) return LIQ_BUFFER_TOO_SMALL;
+    if (!result->fixed_nearest) return LIQ_NOT_READY;
+
+    const struct nearest_map *const n = result->fixed_nearest;
+    const float *const gamma_lut = result->gamma_lut;
+
+    #if __GNUC__ >= 9
+    #pragma omp parallel for \
+        schedule(dynamic) default(none) shared(lut,n,gamma_lut)
+    #endif
+    for(int r=0; r < 256; r++) {
+        unsigned int last_match=0;
+        for(unsigned int g=0; g < 256; g++) {
+            unsigned char *const lut_row = lut + (r << 16 | g << 8);
+            for(unsigned int b=0; b < 256; b++) {
+                const f_pixel px = to_f(gamma_lut, (rgba_pixel){.r=r, .g=g, .b=b, .a=255});
+                lut_row[b] = last_match = nearest_search(n, px, last_match, 1.f, NULL);
+            }
+        }
+    }
+
+    return LIQ_OK;
+}
+
+/*
+ Makes liq_write_remapped_image_fixed() use a table from liq_result_build_lut() for opaque pixels.
+ The table isn't copied and must outlive the result. NULL removes it.
+ */
+LIQ_EXPORT liq_error liq_result_set_lut(liq_result *result, const unsigned char *lut, size_t lut_size)
+{
+    if (!CHECK_STRUCT_TYPE(result, liq_result)) return LIQ_INVALID_POINTER;
+    if (lut && lut_size < LIQ_LUT_SIZE) return LIQ_BUFFER_TOO_SMALL;
+    if (!result->fixed_nearest) return LIQ_NOT_READY;
+
+    result->fixed_lut = lut;
+    return LIQ_OK;
+}
+
 LIQ_EXPORT int liq_version() {
     return LIQ_VERSION;
 }
@@ -0,0 +1,180 @@
+/*
+ * lut.c
+ *
+ *  Direct color to palette index lookup tables, cached on disk per palette.
+ *
+ *  A cache file is a small header followed by the LIQ_LUT_SIZE byte table and
+ *  is named after a hash of everything the table depends on, so a palette edit
+ *  simply misses the cache. Files are written under a temporary name and renamed
+ *  into place, which keeps concurrent processes from seeing partial tables.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lut.h"
+
+#define LUT_FORMAT_VERSION 1
+
+static unsigned char lutHeader[] = { 'R', 'L', 'U', 'T' };
+
+typedef struct {
+    unsigned char magic[4];
+    uint32_t version;
+    uint64_t key;
+} LutFileHeader;
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static uint64_t palette_lut_key(const liq_result* fixedResult) {
+    const liq_palette* palette = liq_get_palette((liq_result*)fixedResult);
+    uint32_t version = LUT_FORMAT_VERSION;
+    double gamma = liq_get_output_gamma(fixedResult);
+    unsigned char fastPalette = fixedResult->fast_palette;
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = fnv1a(hash, &version, sizeof(version));
+    hash = fnv1a(hash, &palette->count, sizeof(palette->count));
+    hash = fnv1a(hash, palette->entries, palette->count * sizeof(liq_color));
+    hash = fnv1a(hash, &gamma, sizeof(gamma));
+    hash = fnv1a(hash, &fastPalette, sizeof(fastPalette));
+
+    return hash;
+}
+
+static int map_palette_lut(const char* fileName, uint64_t key, PaletteLut* paletteLut) {
+    int fd = open(fileName, O_RDONLY);
+
+    if (fd == -1)
+        return EXIT_FAILURE;
+
+    struct stat fileStat;
+    size_t fileSize = sizeof(LutFileHeader) + LIQ_LUT_SIZE;
+
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size != (off_t)fileSize) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    void* mapping = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+        return EXIT_FAILURE;
+
+    const LutFileHeader* header = mapping;
+
+    if (memcmp(header->magic, lutHeader, sizeof(lutHeader)) != 0 || header->version != LUT_FORMAT_VERSION || header->key != key) {
+        munmap(mapping, fileSize);
+        return EXIT_FAILURE;
+    }
+
+    paletteLut->mapping = mapping;
+    paletteLut->mappedSize = fileSize;
+    paletteLut->table = (unsigned char*)mapping + sizeof(LutFileHeader);
+
+    return EXIT_SUCCESS;
+}
+
+static int write_palette_lut(const char* fileName, uint64_t key, const unsigned char* table) {
+    size_t tempLength = strlen(fileName) + 32;
+    char* tempFileName = (char*)malloc(tempLength);
+
+    if (tempFileName == NULL)
+        return EXIT_FAILURE;
+
+    snprintf(tempFileName, tempLength, "%s.%ld.tmp", fileName, (long)getpid());
+
+    FILE* file = fopen(tempFileName, "wb");
+
+    if (file == NULL) {
+        free(tempFileName);
+        return EXIT_FAILURE;
+    }
+
+    LutFileHeader header = { .version = LUT_FORMAT_VERSION, .key = key };
+    memcpy(header.magic, lutHeader, sizeof(lutHeader));
+
+    int written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(table, 1, LIQ_LUT_SIZE, file) == LIQ_LUT_SIZE;
+
+    if (fclose(file) != 0 || !written || rename(tempFileName, fileName) != 0) {
+        remove(tempFileName);
+        free(tempFileName);
+        return EXIT_FAILURE;
+    }
+
+    free(tempFileName);
+
+    return EXIT_SUCCESS;
+}
+
+int open_palette_lut(const char* cacheDirectory, const liq_result* fixedResult, PaletteLut** paletteLut) {
+    int result = EXIT_FAILURE;
+    uint64_t key = palette_lut_key(fixedResult);
+    size_t fileNameLength = strlen(cacheDirectory) + 32;
+    char* fileName = (char*)malloc(fileNameLength);
+    *paletteLut = (PaletteLut*)calloc(1, sizeof(PaletteLut));
+
+    if (fileName == NULL || *paletteLut == NULL)
+        goto open_palette_lut_exit;
+
+    snprintf(fileName, fileNameLength, "%s/%016llx.lut", cacheDirectory, (unsigned long long)key);
+
+    if (map_palette_lut(fileName, key, *paletteLut) == EXIT_SUCCESS) {
+        result = EXIT_SUCCESS;
+        goto open_palette_lut_exit;
+    }
+
+    (*paletteLut)->table = (unsigned char*)malloc(LIQ_LUT_SIZE);
+
+    if ((*paletteLut)->table == NULL)
+        goto open_palette_lut_exit;
+
+    if (liq_result_build_lut(fixedResult, (*paletteLut)->table, LIQ_LUT_SIZE) != LIQ_OK) {
+        fprintf(stderr, "Failed to build lookup table\n");
+        goto open_palette_lut_exit;
+    }
+
+    // a cache that can't be written only costs the next run a rebuild
+    if ((mkdir(cacheDirectory, 0777) != 0 && errno != EEXIST) || write_palette_lut(fileName, key, (*paletteLut)->table) != EXIT_SUCCESS)
+        fprintf(stderr, "Warning: could not write lookup table '%s'\n", fileName);
+
+    result = EXIT_SUCCESS;
+
+open_palette_lut_exit:
+    if (result != EXIT_SUCCESS) {
+        close_palette_lut(*paletteLut);
+        *paletteLut = NULL;
+    }
+
+    free(fileName);
+
+    return result;
+}
+
+void close_palette_lut(PaletteLut* paletteLut) {
+    if (paletteLut == NULL)
+        return;
+
+    if (paletteLut->mapping != NULL)
+        munmap(paletteLut->mapping, paletteLut->mappedSize);
+    else
+        free(paletteLut->table);
+
+    free(paletteLut);
+}
@@ -5,6 +5,10 @@
 #include "mempool.h"
 #include <stdlib.h>
 
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
 struct sorttmp {
     float radius;
     unsigned int index;
@@ -15,7 +19,9 @@ struct head {
     f_pixel vantage_point;
     float radius;
     unsigned int num_candidates;
-    f_pixel *candidates_color;
+    // candidate colors one channel per array, as nearest_candidate() kernels take them, so a block of them is
+    // compared to a pixel with a few vector operations. Padded with a color that's never the best match.
+    float *candidates_a, *candidates_r, *candidates_g, *candidates_b;
     unsigned short *candidates_index;
 };
 
@@ -23,6 +29,10 @@ struct nearest_map {
     const colormap *map;
     float nearest_other_color_dist[256];
     mempool mempool;
+    unsigned int (*nearest_candidate)(const float a[], const float r[], const float g[], const float b[], unsigned int count, f_pixel px, float *diff);
+    unsigned int num_heads;
+    // vantage points and radii of all heads one channel per array, padded with heads that are never selected
+    float *vantage_a, *vantage_r, *vantage_g, *vantage_b, *vantage_radius;
     struct head heads[];
 };
 
@@ -63,19 +73,31 @@ static struct head build_head(f_pixel px, const colormap *map, unsigned int num_
 
     num_candidates = MIN(colorsused, num_candidates);
 
+    const unsigned int padded = (num_candidates + LIQ_CANDIDATES_BLOCK-1) & ~(LIQ_CANDIDATES_BLOCK-1);
+    float *const channels = mempool_alloc(m, 4 * padded * sizeof(channels[0]), 0);
     struct head h = {
-        .candidates_color = mempool_alloc(m, num_candidates * sizeof(h.candidates_color[0]), 0),
+        .candidates_a = channels,
+        .candidates_r = channels + padded,
+        .candidates_g = channels + 2*padded,
+        .candidates_b = channels + 3*padded,
         .candidates_index = mempool_alloc(m, num_candidates * sizeof(h.candidates_index[0]), 0),
         .vantage_point = px,
         .num_candidates = num_candidates,
     };
+    for(unsigned int i=0; i < padded; i++) {
+        const f_pixel color = i < num_candidates ? map->palette[colors[i].index].acolor : (f_pixel){.a=0, .r=1e3f, .g=1e3f, .b=1e3f};
+        h.candidates_a[i] = color.a;
+        h.candidates_r[i] = color.r;
+        h.candidates_g[i] = color.g;
+        h.candidates_b[i] = color.b;
+    }
     for(unsigned int i=0; i < num_candidates; i++) {
-        h.candidates_color[i] = map->palette[colors[i].index].acolor;
         h.candidates_index[i] = colors[i].index;
     }
     // if all colors within this radius are included in candidates, then there cannot be any other better match
     // farther away from the vantage point than half of the radius. Due to alpha channel must assume pessimistic radius.
-    h.radius = min_colordifference(px, h.candidates_color[num_candidates-1])/4.0f; // /4 = half of radius, but radius is squared
+    const f_pixel farthest = map->palette[colors[num_candidates-1].index].acolor;
+    h.radius = min_colordifference(px, farthest)/4.0f; // /4 = half of radius, but radius is squared
 
     for(unsigned int i=0; i < num_candidates; i++) {
         // divide again as that's matching certain subset within radius-limited subset
@@ -121,6 +143,7 @@ LIQ_PRIVATE struct nearest_map *nearest_init(const colormap *map, bool fast)
     }
 
     centroids->map = map;
+    centroids->nearest_candidate = liq_kernels()->nearest_candidate;
 
     unsigned int skipped=0;
     assert(map->colors > 0);
@@ -148,6 +171,22 @@ LIQ_PRIVATE struct nearest_map *nearest_init(const colormap *map, bool fast)
     centroids->heads[h] = build_head((f_pixel){0,0,0,0}, map, map->colors, &centroids->mempool, error_margin, skip_index, &skipped);
     centroids->heads[h].radius = MAX_DIFF;
 
+    const unsigned int num_heads = centroids->num_heads = h+1, padded = (num_heads + LIQ_CANDIDATES_BLOCK-1) & ~(LIQ_CANDIDATES_BLOCK-1);
+    float *const channels = mempool_alloc(&centroids->mempool, 5 * padded * sizeof(channels[0]), 0);
+    centroids->vantage_a = channels;
+    centroids->vantage_r = channels + padded;
+    centroids->vantage_g = channels + 2*padded;
+    centroids->vantage_b = channels + 3*padded;
+    centroids->vantage_radius = channels + 4*padded;
+    for(unsigned int i=0; i < padded; i++) {
+        const f_pixel vantage_point = i < num_heads ? centroids->heads[i].vantage_point : (f_pixel){0,0,0,0};
+        centroids->vantage_a[i] = vantage_point.a;
+        centroids->vantage_r[i] = vantage_point.r;
+        centroids->vantage_g[i] = vantage_point.g;
+        centroids->vantage_b[i] = vantage_point.b;
+        centroids->vantage_radius[i] = i < num_heads ? centroids->heads[i].radius : -1.f;
+    }
+
     // get_subset_palette could have created a copy
     if (subset_palette != map->subset_palette) {
         pam_freecolormap(subset_palette);
@@ -156,6 +195,24 @@ LIQ_PRIVATE struct nearest_map *nearest_init(const colormap *map, bool fast)
     return centroids;
 }
 
+#ifdef __SSE__
+ALWAYS_INLINE static __m128 colordifference_ch_sse(const __m128 x, const __m128 y, const __m128 alphas);
+inline static __m128 colordifference_ch_sse(const __m128 x, const __m128 y, const __m128 alphas)
+{
+    const __m128 black = _mm_sub_ps(x, y), white = _mm_add_ps(black, alphas);
+    return _mm_add_ps(_mm_mul_ps(black, black), _mm_mul_ps(white, white));
+}
+#endif
+
+ALWAYS_INLINE static unsigned int nearest_in_head(const struct nearest_map *centroids, const struct head *h, const f_pixel px, float *diff);
+inline static unsigned int nearest_in_head(const struct nearest_map *centroids, const struct head *h, const f_pixel px, float *diff)
+{
+    float dist;
+    const unsigned int ind = centroids->nearest_candidate(h->candidates_a, h->candidates_r, h->candidates_g, h->candidates_b, h->num_candidates, px, &dist);
+    if (diff) *diff = dist;
+    return h->candidates_index[ind];
+}
+
 LIQ_PRIVATE unsigned int nearest_search(const struct nearest_map *centroids, const f_pixel px, int likely_colormap_index, const float min_opaque_val, float *diff)
 {
     const struct head *const heads = centroids->heads;
@@ -167,26 +224,37 @@ LIQ_PRIVATE unsigned int nearest_search(const struct nearest_map *centroids, con
         return likely_colormap_index;
     }
 
+#ifdef __SSE__
+    if (centroids->num_heads == 1) {
+        return nearest_in_head(centroids, &heads[0], px, diff);
+    }
+
+    const __m128 vpx_a = _mm_set1_ps(px.a), vpx_r = _mm_set1_ps(px.r), vpx_g = _mm_set1_ps(px.g), vpx_b = _mm_set1_ps(px.b);
+
+    for(unsigned int start=0; /* last head will always be selected */ ; start += 4) {
+        const __m128 alphas = _mm_sub_ps(_mm_load_ps(centroids->vantage_a + start), vpx_a);
+        __m128 vantage_point_dist = colordifference_ch_sse(vpx_r, _mm_load_ps(centroids->vantage_r + start), alphas);
+        vantage_point_dist = _mm_add_ps(vantage_point_dist, colordifference_ch_sse(vpx_g, _mm_load_ps(centroids->vantage_g + start), alphas));
+        vantage_point_dist = _mm_add_ps(vantage_point_dist, colordifference_ch_sse(vpx_b, _mm_load_ps(centroids->vantage_b + start), alphas));
+
+        const int within = _mm_movemask_ps(_mm_cmple_ps(vantage_point_dist, _mm_load_ps(centroids->vantage_radius + start)));
+        if (within) {
+            unsigned int i = start;
+            while (!(within & (1 << (i - start)))) i++;
+            assert(heads[i].num_candidates);
+            return nearest_in_head(centroids, &heads[i], px, diff);
+        }
+    }
+#else
     for(unsigned int i=0; /* last head will always be selected */ ; i++) {
         float vantage_point_dist = colordifference(px, heads[i].vantage_point);
 
         if (vantage_point_dist <= heads[i].radius) {
             assert(heads[i].num_candidates);
-            unsigned int ind=0;
-            float dist = colordifference(px, heads[i].candidates_color[0]);
-
-            for(unsigned int j=1; j < heads[i].num_candidates; j++) {
-                float newdist = colordifference(px, heads[i].candidates_color[j]);
-
-                if (newdist < dist) {
-                    dist = newdist;
-                    ind = j;
-                }
-            }
-            if (diff) *diff = dist;
-            return heads[i].candidates_index[ind];
+            return nearest_in_head(centroids, &heads[i], px, diff);
         }
     }
+#endif
 }
 
 LIQ_PRIVATE void nearest_free(struct nearest_map *centroids)
@@ -0,0 +1,400 @@
+/*
+ * output_cache.c
+ *
+ *  A size bounded on-disk cache of finished outputs, keyed by a hash of the
+ *  input file, the palette file and the output options.
+ *
+ *  An entry is one file holding the encoded outputs of one input together with
+ *  what the report needs, so a hit skips decoding, remapping and encoding. Like
+ *  the lookup tables, entries are written under a temporary name and renamed
+ *  into place. Hits touch their entry, and when the directory grows past its
+ *  limit the least recently used entries are removed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "output_cache.h"
+
+#define OUTPUT_CACHE_FORMAT_VERSION 1
+#define OUTPUT_CACHE_EXTENSION ".rmc"
+
+static unsigned char cacheHeader[] = { 'R', 'M', 'C', 'E' };
+
+typedef struct {
+    unsigned char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t outputCount;
+} CacheFileHeader;
+
+typedef struct {
+    int32_t inputColorType;
+    int32_t inputBitDepth;
+    int32_t width;
+    int32_t height;
+    int32_t rangeMin;
+    int32_t rangeMax;
+    int32_t paletteSlot;
+    int32_t slotCount;
+    int32_t tileSize;
+    int32_t tilesWide;
+    int32_t tilesHigh;
+    int32_t inputColors;
+    int32_t quality;
+    double mse;
+    double slotErrors[REMAP_MAX_SLOTS];
+    uint64_t pngSize;
+    uint64_t maskPngSize;
+} CachedOutput;
+
+struct OutputCache {
+    char* directory;
+    uint64_t maxSize;
+    uint64_t paletteKey;
+    OutputCacheStats stats;
+    pthread_mutex_t lock;
+};
+
+typedef struct {
+    char name[32];
+    struct timespec lastUsed;
+    uint64_t size;
+} CacheEntry;
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static int is_entry_name(const char* name) {
+    size_t length = strlen(name);
+
+    return length == 16 + strlen(OUTPUT_CACHE_EXTENSION) && strcmp(name + 16, OUTPUT_CACHE_EXTENSION) == 0 && strspn(name, "0123456789abcdef") == 16;
+}
+
+static void get_entry_file_name(const OutputCache* outputCache, uint64_t key, char* fileName, size_t fileNameLength) {
+    snprintf(fileName, fileNameLength, "%s/%016llx" OUTPUT_CACHE_EXTENSION, outputCache->directory, (unsigned long long)key);
+}
+
+static int compare_entries(const void* a, const void* b) {
+    const CacheEntry* entryA = a, *entryB = b;
+
+    // entries used within the same second are still ordered by use
+    if (entryA->lastUsed.tv_sec != entryB->lastUsed.tv_sec)
+        return entryA->lastUsed.tv_sec < entryB->lastUsed.tv_sec ? -1 : 1;
+
+    if (entryA->lastUsed.tv_nsec != entryB->lastUsed.tv_nsec)
+        return entryA->lastUsed.tv_nsec < entryB->lastUsed.tv_nsec ? -1 : 1;
+
+    return strcmp(entryA->name, entryB->name);
+}
+
+/*
+ * Lists the entries in the cache directory and their total size. Called with
+ * the lock held, or before the cache is shared.
+ */
+static int scan_entries(OutputCache* outputCache, CacheEntry** entries, int* entryCount) {
+    DIR* dir = opendir(outputCache->directory);
+    int capacity = 0;
+
+    *entries = NULL;
+    *entryCount = 0;
+    outputCache->stats.size = 0;
+
+    if (dir == NULL)
+        return EXIT_FAILURE;
+
+    struct dirent* dirEntry;
+    while ((dirEntry = readdir(dir)) != NULL) {
+        char fileName[PATH_MAX];
+        struct stat fileStat;
+
+        if (!is_entry_name(dirEntry->d_name))
+            continue;
+
+        snprintf(fileName, sizeof(fileName), "%s/%s", outputCache->directory, dirEntry->d_name);
+        if (stat(fileName, &fileStat) != 0)
+            continue;
+
+        if (*entryCount == capacity) {
+            int newCapacity = capacity ? capacity * 2 : 256;
+            CacheEntry* newEntries = (CacheEntry*)realloc(*entries, newCapacity * sizeof(CacheEntry));
+            if (newEntries == NULL)
+                break;
+            *entries = newEntries;
+            capacity = newCapacity;
+        }
+
+        CacheEntry* entry = &(*entries)[(*entryCount)++];
+        strcpy(entry->name, dirEntry->d_name);
+        entry->lastUsed = fileStat.st_mtim;
+        entry->size = fileStat.st_size;
+        outputCache->stats.size += entry->size;
+    }
+
+    closedir(dir);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Removes the least recently used entries until the cache fits its limit.
+ */
+static void evict_entries(OutputCache* outputCache) {
+    CacheEntry* entries;
+    int entryCount;
+
+    if (scan_entries(outputCache, &entries, &entryCount) == EXIT_FAILURE)
+        return;
+
+    qsort(entries, entryCount, sizeof(CacheEntry), compare_entries);
+
+    for (int i = 0; i < entryCount && outputCache->stats.size > outputCache->maxSize; i++) {
+        char fileName[PATH_MAX];
+
+        snprintf(fileName, sizeof(fileName), "%s/%s", outputCache->directory, entries[i].name);
+        if (remove(fileName) == 0 || errno == ENOENT) {
+            outputCache->stats.size -= entries[i].size;
+            outputCache->stats.evictions++;
+        }
+    }
+
+    free(entries);
+}
+
+int open_output_cache(const char* cacheDirectory, uint64_t maxSize, const unsigned char* paletteData, size_t paletteSize, OutputCache** outputCache) {
+    CacheEntry* entries;
+    int entryCount;
+
+    *outputCache = (OutputCache*)calloc(1, sizeof(OutputCache));
+
+    if (*outputCache == NULL)
+        return EXIT_FAILURE;
+
+    (*outputCache)->directory = strdup(cacheDirectory);
+    (*outputCache)->maxSize = maxSize;
+    (*outputCache)->paletteKey = fnv1a(0xcbf29ce484222325ULL, paletteData, paletteSize);
+
+    if ((*outputCache)->directory == NULL || (mkdir(cacheDirectory, 0777) != 0 && errno != EEXIST)
+        || scan_entries(*outputCache, &entries, &entryCount) == EXIT_FAILURE) {
+        perror(cacheDirectory);
+        free((*outputCache)->directory);
+        free(*outputCache);
+        *outputCache = NULL;
+        return EXIT_FAILURE;
+    }
+
+    free(entries);
+    pthread_mutex_init(&(*outputCache)->lock, NULL);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Everything that decides the outputs of an input goes into its key: the input
+ * and palette files, and each output's options in order.
+ */
+uint64_t output_cache_key(const OutputCache* outputCache, const remap_output outputs[], int outputCount, const unsigned char* input, size_t inputSize) {
+    uint32_t version = OUTPUT_CACHE_FORMAT_VERSION;
+    uint64_t size = inputSize;
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = fnv1a(hash, &version, sizeof(version));
+    hash = fnv1a(hash, &outputCache->paletteKey, sizeof(outputCache->paletteKey));
+    hash = fnv1a(hash, &size, sizeof(size));
+    hash = fnv1a(hash, input, inputSize);
+
+    for (int i = 0; i < outputCount; i++) {
+        const remap_options* options = &outputs[i].options;
+        int32_t settings[] = {
+            options->rangeMin, options->rangeMax, options->paletteSlot, options->countColors, options->tileSize,
+            outputs[i].bitDepth, outputs[i].maskBits, outputs[i].format, options->dither
+        };
+        hash = fnv1a(hash, settings, sizeof(settings));
+    }
+
+    return hash;
+}
+
+static int read_cached_output(FILE* file, remap_png_result* result) {
+    CachedOutput cached;
+    size_t tileCount;
+
+    if (fread(&cached, sizeof(cached), 1, file) != 1 || cached.slotCount < 0 || cached.slotCount > REMAP_MAX_SLOTS
+        || cached.width <= 0 || cached.height <= 0 || cached.tilesWide < 0 || cached.tilesHigh < 0)
+        return EXIT_FAILURE;
+
+    *result = (remap_png_result) {
+        .inputColorType = (LodePNGColorType)cached.inputColorType,
+        .inputBitDepth = cached.inputBitDepth,
+        .result = {
+            .width = cached.width,
+            .height = cached.height,
+            .rangeMin = cached.rangeMin,
+            .rangeMax = cached.rangeMax,
+            .paletteSlot = cached.paletteSlot,
+            .slotCount = cached.slotCount,
+            .tileSize = cached.tileSize,
+            .tilesWide = cached.tilesWide,
+            .tilesHigh = cached.tilesHigh,
+            .inputColors = cached.inputColors,
+            .mse = cached.mse,
+            .quality = cached.quality
+        },
+        .pngSize = cached.pngSize,
+        .maskPngSize = cached.maskPngSize
+    };
+    memcpy(result->result.slotErrors, cached.slotErrors, sizeof(cached.slotErrors));
+
+    tileCount = (size_t)cached.tilesWide * cached.tilesHigh;
+    result->png = (unsigned char*)malloc(cached.pngSize);
+    if (cached.maskPngSize > 0)
+        result->maskPng = (unsigned char*)malloc(cached.maskPngSize);
+    if (tileCount > 0)
+        result->result.tileSlots = (unsigned char*)malloc(tileCount);
+
+    if (result->png == NULL || (cached.maskPngSize > 0 && result->maskPng == NULL) || (tileCount > 0 && result->result.tileSlots == NULL)
+        || fread(result->png, 1, cached.pngSize, file) != cached.pngSize
+        || fread(result->maskPng, 1, cached.maskPngSize, file) != cached.maskPngSize
+        || fread(result->result.tileSlots, 1, tileCount, file) != tileCount) {
+        remap_png_result_free(result);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Looks up the outputs stored under key. On a hit results hold the encoded
+ * outputs and the report of each, but no indices or alpha.
+ */
+int output_cache_get(OutputCache* outputCache, uint64_t key, int outputCount, remap_png_result results[]) {
+    char fileName[PATH_MAX];
+    CacheFileHeader header;
+    int readCount = 0;
+
+    get_entry_file_name(outputCache, key, fileName, sizeof(fileName));
+
+    FILE* file = fopen(fileName, "rb");
+
+    if (file != NULL && fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, cacheHeader, sizeof(cacheHeader)) == 0
+        && header.version == OUTPUT_CACHE_FORMAT_VERSION && header.key == key && header.outputCount == (uint32_t)outputCount) {
+        while (readCount < outputCount && read_cached_output(file, &results[readCount]) == EXIT_SUCCESS)
+            readCount++;
+    }
+
+    if (file != NULL)
+        fclose(file);
+
+    pthread_mutex_lock(&outputCache->lock);
+
+    if (readCount == outputCount) {
+        outputCache->stats.hits++;
+        // the entry's time is when it was last used
+        utimensat(AT_FDCWD, fileName, NULL, 0);
+    } else {
+        outputCache->stats.misses++;
+    }
+
+    pthread_mutex_unlock(&outputCache->lock);
+
+    if (readCount != outputCount) {
+        for (int i = 0; i < readCount; i++)
+            remap_png_result_free(&results[i]);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int output_cache_put(OutputCache* outputCache, uint64_t key, int outputCount, const remap_png_result results[]) {
+    char fileName[PATH_MAX], tempFileName[PATH_MAX + 32];
+    uint64_t entrySize = sizeof(CacheFileHeader);
+
+    get_entry_file_name(outputCache, key, fileName, sizeof(fileName));
+    snprintf(tempFileName, sizeof(tempFileName), "%s.%ld.%lx.tmp", fileName, (long)getpid(), (unsigned long)pthread_self());
+
+    FILE* file = fopen(tempFileName, "wb");
+
+    if (file == NULL)
+        return EXIT_FAILURE;
+
+    CacheFileHeader header = { .version = OUTPUT_CACHE_FORMAT_VERSION, .key = key, .outputCount = outputCount };
+    memcpy(header.magic, cacheHeader, sizeof(cacheHeader));
+
+    int written = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    for (int i = 0; i < outputCount && written; i++) {
+        const remap_result* result = &results[i].result;
+        size_t tileCount = (result->tileSlots != NULL ? (size_t)result->tilesWide * result->tilesHigh : 0);
+        CachedOutput cached = {
+            .inputColorType = results[i].inputColorType,
+            .inputBitDepth = results[i].inputBitDepth,
+            .width = result->width,
+            .height = result->height,
+            .rangeMin = result->rangeMin,
+            .rangeMax = result->rangeMax,
+            .paletteSlot = result->paletteSlot,
+            .slotCount = result->slotCount,
+            .tileSize = result->tileSize,
+            .tilesWide = (tileCount > 0 ? result->tilesWide : 0),
+            .tilesHigh = (tileCount > 0 ? result->tilesHigh : 0),
+            .inputColors = result->inputColors,
+            .quality = result->quality,
+            .mse = result->mse,
+            .pngSize = results[i].pngSize,
+            .maskPngSize = (results[i].maskPng != NULL ? results[i].maskPngSize : 0)
+        };
+        memcpy(cached.slotErrors, result->slotErrors, sizeof(cached.slotErrors));
+
+        written = fwrite(&cached, sizeof(cached), 1, file) == 1
+            && fwrite(results[i].png, 1, cached.pngSize, file) == cached.pngSize
+            && (cached.maskPngSize == 0 || fwrite(results[i].maskPng, 1, cached.maskPngSize, file) == cached.maskPngSize)
+            && (tileCount == 0 || fwrite(result->tileSlots, 1, tileCount, file) == tileCount);
+        entrySize += sizeof(cached) + cached.pngSize + cached.maskPngSize + tileCount;
+    }
+
+    if (fclose(file) != 0 || !written || rename(tempFileName, fileName) != 0) {
+        remove(tempFileName);
+        return EXIT_FAILURE;
+    }
+
+    pthread_mutex_lock(&outputCache->lock);
+
+    outputCache->stats.size += entrySize;
+    if (outputCache->stats.size > outputCache->maxSize)
+        evict_entries(outputCache);
+
+    pthread_mutex_unlock(&outputCache->lock);
+
+    return EXIT_SUCCESS;
+}
+
+void output_cache_get_stats(OutputCache* outputCache, OutputCacheStats* stats) {
+    pthread_mutex_lock(&outputCache->lock);
+    *stats = outputCache->stats;
+    pthread_mutex_unlock(&outputCache->lock);
+}
+
+void close_output_cache(OutputCache* outputCache) {
+    if (outputCache == NULL)
+        return;
+
+    pthread_mutex_destroy(&outputCache->lock);
+    free(outputCache->directory);
+    free(outputCache);
+}
@@ -31,27 +31,26 @@ int starts_with(const unsigned char* thisBytes, const unsigned char* thatBytes,
     return 1;
 }
 
-int read_png(const char* fileName, Color** colorPalette, int* paletteCount) {
+int read_png_memory(const unsigned char* png, size_t size, Color** colorPalette, int* paletteCount) {
     *colorPalette = (Color*)malloc(256 * sizeof(Color));
 
     if (*colorPalette == NULL)
         return EXIT_FAILURE;
 
     LodePNGState state;
-    unsigned char* png = NULL;
-    size_t size;
-    unsigned char* buffer;
+    unsigned char* buffer = NULL;
     unsigned width, height;
 
     lodepng_state_init(&state);
 
     state.decoder.color_convert = 0;
     
-    lodepng_load_file(&png, &size, fileName);
     int result = lodepng_decode(&buffer, &width, &height, &state, png, size);
+    free(buffer);
 
     if(result) {
         printf("Decoder error %u: %s\n", result, lodepng_error_text(result));
+        lodepng_state_cleanup(&state);
         free(*colorPalette);
         *colorPalette = NULL;
         return EXIT_FAILURE;
@@ -61,6 +60,7 @@ int read_png(const char* fileName, Color** colorPalette, int* paletteCount) {
     
     if(color->colortype != LCT_PALETTE) {
         printf("Error: PNG is not paletted\n");
+        lodepng_state_cleanup(&state);
         free(*colorPalette);
         *colorPalette = NULL;
         return EXIT_FAILURE;
@@ -75,9 +75,26 @@ int read_png(const char* fileName, Color** colorPalette, int* paletteCount) {
         (*colorPalette)[i].A = color->palette[i * 4 + 3];
     }
 
+    lodepng_state_cleanup(&state);
+
     return EXIT_SUCCESS;
 }
 
+int read_png(const char* fileName, Color** colorPalette, int* paletteCount) {
+    unsigned char* png = NULL;
+    size_t size = 0;
+
+    if (lodepng_load_file(&png, &size, fileName)) {
+        free(png);
+        return EXIT_FAILURE;
+    }
+
+    int result = read_png_memory(png, size, colorPalette, paletteCount);
+    free(png);
+
+    return result;
+}
+
 int read_ms_pal(FILE* file, Color** colorPalette, int* paletteCount) {
     int fileLength;
     unsigned char riffType[4];
@@ -268,23 +285,8 @@ int read_paintnet_pal(FILE* file, Color** colorPalette) {
     return EXIT_SUCCESS;
 }
 
-int read_palette(const char* fileName, Color** colorPalette, int* paletteCount, int* transparentIndex) {
+static int read_palette_file(FILE* file, const unsigned char* magicBytes, int bytesRead, Color** colorPalette, int* paletteCount, int* transparentIndex) {
     int result = EXIT_FAILURE;
-    FILE* file = fopen(fileName, "rb");
-
-    if (file == NULL)
-        return EXIT_FAILURE;
-
-    int maxMagicBytesLength = 0;
-    unsigned char magicBytes[256];
-    int bytesRead = fread(magicBytes, sizeof(unsigned char), 256, file);
-
-    for (int i = 0; i < bytesRead; i++) {
-        if (magicBytes[i] == '\0') {
-            maxMagicBytesLength = i;
-            break;
-        }
-    }
 
     if (starts_with(magicBytes, msPalHeader, bytesRead, 4)) {
         fseek(file, 4, SEEK_CUR);
@@ -303,20 +305,60 @@ int read_palette(const char* fileName, Color** colorPalette, int* paletteCount,
     } else if (starts_with(magicBytes, paintNetPalHeader, bytesRead, 1)) {
         fseek(file, 1, SEEK_CUR);
         result = read_paintnet_pal(file, colorPalette);
-    } else if (starts_with(magicBytes, pngHeader, bytesRead, 8)) {
-        fclose(file);
-        result = read_png(fileName, colorPalette, paletteCount);
     } else {
         fseek(file, 0, SEEK_SET);
         result = read_act_pal(file, colorPalette, paletteCount, transparentIndex);
     }
 
-    if (file != NULL)
+    return result;
+}
+
+int read_palette(const char* fileName, Color** colorPalette, int* paletteCount, int* transparentIndex) {
+    int result = EXIT_FAILURE;
+    FILE* file = fopen(fileName, "rb");
+
+    if (file == NULL)
+        return EXIT_FAILURE;
+
+    unsigned char magicBytes[256];
+    int bytesRead = fread(magicBytes, sizeof(unsigned char), 256, file);
+
+    if (starts_with(magicBytes, pngHeader, bytesRead, 8)) {
         fclose(file);
+        return read_png(fileName, colorPalette, paletteCount);
+    }
+
+    result = read_palette_file(file, magicBytes, bytesRead, colorPalette, paletteCount, transparentIndex);
+
+    fclose(file);
     
     return result;
 }
 
+/*
+ * Same as read_palette, for palette file contents that are already in memory.
+ */
+int read_palette_memory(const unsigned char* data, size_t size, Color** colorPalette, int* paletteCount, int* transparentIndex) {
+    int result = EXIT_FAILURE;
+
+    if (starts_with(data, pngHeader, size, 8))
+        return read_png_memory(data, size, colorPalette, paletteCount);
+
+    FILE* file = fmemopen((void*)data, size, "rb");
+
+    if (file == NULL)
+        return EXIT_FAILURE;
+
+    unsigned char magicBytes[256];
+    int bytesRead = fread(magicBytes, sizeof(unsigned char), 256, file);
+
+    result = read_palette_file(file, magicBytes, bytesRead, colorPalette, paletteCount, transparentIndex);
+
+    fclose(file);
+
+    return result;
+}
+
 int write_act_pal(const char *fileName, Color *colorPalette, int paletteCount, int transparentIndex) {
     FILE *file = fopen(fileName, "wb");
     
@@ -15,26 +15,173 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 
 #include "libimagequant.h"
 #include "pam.h"
-#include "mempool.h"
 
-LIQ_PRIVATE bool pam_computeacolorhash(struct acolorhash_table *acht, const rgba_pixel *const pixels[], unsigned int cols, unsigned int rows, const unsigned char *importance_map)
+/*
+ Slots are picked with the murmur3 finalizer of the color, so every bit of it counts. The seed comes
+ from the table's address, so crafted images can't predict which colors collide. The histogram doesn't
+ depend on it: items are kept in the order colors were found.
+ */
+inline static unsigned int pam_hash(const unsigned int color, const unsigned int seed)
+{
+    unsigned int h = color ^ seed;
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+static bool pam_resizeacolorhash(struct acolorhash_table *acht, const unsigned int slots_count)
+{
+    struct acolorhash_slot *const slots = acht->malloc(slots_count * sizeof(slots[0]));
+    if (!slots) return false;
+    memset(slots, 0, slots_count * sizeof(slots[0]));
+
+    const unsigned int mask = slots_count - 1;
+    for(unsigned int i=0; i < acht->colors; i++) {
+        unsigned int h = pam_hash(acht->items[i].color.l, acht->hash_seed) & mask;
+        while (slots[h].index) {
+            h = (h+1) & mask;
+        }
+        slots[h] = (struct acolorhash_slot){
+            .color = acht->items[i].color,
+            .index = i+1,
+        };
+    }
+
+    acht->free(acht->slots);
+    acht->slots = slots;
+    acht->hash_mask = mask;
+    return true;
+}
+
+static bool pam_growacolorhash_items(struct acolorhash_table *acht)
+{
+    const unsigned int capacity = MIN(acht->capacity * 2, acht->maxcolors);
+    struct acolorhist_arr_item *const items = acht->malloc(capacity * sizeof(items[0]));
+    if (!items) return false;
+
+    memcpy(items, acht->items, acht->colors * sizeof(items[0]));
+    acht->free(acht->items);
+    acht->items = items;
+    acht->capacity = capacity;
+    return true;
+}
+
+#define PAM_HASH_NO_MEMORY UINT_MAX
+
+/*
+ Adds boost to the weight of color px, adding the color if it's new.
+ Returns 1 + the position of the color in items, 0 if there would be more than maxcolors colors,
+ or PAM_HASH_NO_MEMORY if the table couldn't grow, in which case the color isn't added.
+ */
+inline static unsigned int pam_add_to_hash(struct acolorhash_table *acht, const union rgba_as_int px, const float boost)
+{
+    const struct acolorhash_slot *const slots = acht->slots;
+    const unsigned int mask = acht->hash_mask;
+
+    // linear probing: at most half of the slots are used, so runs are short and stay within a cache line or two
+    unsigned int h = pam_hash(px.l, acht->hash_seed) & mask;
+    while (slots[h].index) {
+        if (slots[h].color.l == px.l) {
+            acht->items[slots[h].index-1].perceptual_weight += boost;
+            return slots[h].index;
+        }
+        h = (h+1) & mask;
+    }
+
+    if (acht->colors >= acht->maxcolors) {
+        return 0;
+    }
+
+    // room is made before the color goes in, so a failed allocation leaves the table as it was
+    if (acht->colors == acht->capacity && !pam_growacolorhash_items(acht)) {
+        return PAM_HASH_NO_MEMORY;
+    }
+    if ((acht->colors+1)*2 > mask+1) {
+        if (!pam_resizeacolorhash(acht, (mask+1)*2)) {
+            return PAM_HASH_NO_MEMORY;
+        }
+        h = pam_hash(px.l, acht->hash_seed) & acht->hash_mask;
+        while (acht->slots[h].index) {
+            h = (h+1) & acht->hash_mask;
+        }
+    }
+
+    const unsigned int index = ++acht->colors;
+    acht->items[index-1] = (struct acolorhist_arr_item){
+        .color = px,
+        .perceptual_weight = boost,
+    };
+    acht->slots[h] = (struct acolorhash_slot){
+        .color = px,
+        .index = index,
+    };
+    return index;
+}
+
+/*
+ Posterizes every color in the table by one more bit, merging colors that become the same.
+ Colors keep the order they were first seen in, so the table is the same as if it had been computed
+ at the coarser level to begin with (up to float rounding of the merged weights).
+ That holds up to 4 bits: beyond that the colors no longer keep the high bits that the coarser level
+ copies into the low ones, and false is returned.
+ */
+LIQ_PRIVATE bool pam_reposterizeacolorhash(struct acolorhash_table *acht)
 {
-    const unsigned int maxacolors = acht->maxcolors, ignorebits = acht->ignorebits;
-    const unsigned int channel_mask = 255U>>ignorebits<<ignorebits;
-    const unsigned int channel_hmask = (255U>>ignorebits) ^ 0xFFU;
-    const unsigned int posterize_mask = channel_mask << 24 | channel_mask << 16 | channel_mask << 8 | channel_mask;
-    const unsigned int posterize_high_mask = channel_hmask << 24 | channel_hmask << 16 | channel_hmask << 8 | channel_hmask;
-    struct acolorhist_arr_head *const buckets = acht->buckets;
+    const unsigned int ignorebits = acht->ignorebits + 1;
+    if (ignorebits > 4) {
+        return false;
+    }
 
-    unsigned int colors = acht->colors;
-    const unsigned int hash_size = acht->hash_size;
+    struct acolorhash_slot *const slots = acht->slots;
+    const unsigned int mask = acht->hash_mask;
+    const unsigned int colors = acht->colors;
+    memset(slots, 0, (mask+1) * sizeof(slots[0]));
 
-    const unsigned int stacksize = sizeof(acht->freestack)/sizeof(acht->freestack[0]);
-    struct acolorhist_arr_item **freestack = acht->freestack;
-    unsigned int freestackp=acht->freestackp;
+    // merged colors only ever move to a lower position, so items can be rewritten as they're read
+    acht->colors = 0;
+    for(unsigned int i=0; i < colors; i++) {
+        const union rgba_as_int px = {.l = pam_posterize(acht->items[i].color.l, ignorebits)};
+        const float weight = acht->items[i].perceptual_weight;
+
+        unsigned int h = pam_hash(px.l, acht->hash_seed) & mask;
+        while (slots[h].index && slots[h].color.l != px.l) {
+            h = (h+1) & mask;
+        }
+        if (slots[h].index) {
+            acht->items[slots[h].index-1].perceptual_weight += weight;
+        } else {
+            acht->items[acht->colors] = (struct acolorhist_arr_item){
+                .color = px,
+                .perceptual_weight = weight,
+            };
+            slots[h] = (struct acolorhash_slot){
+                .color = px,
+                .index = ++acht->colors,
+            };
+        }
+    }
+
+    acht->ignorebits = ignorebits;
+    return true;
+}
+
+/*
+ When the table fills up it's re-posterized in place and the scan carries on from the same pixel,
+ instead of starting over. false if even that isn't enough, or if there's no memory, which sets out_of_memory.
+ */
+LIQ_PRIVATE bool pam_computeacolorhash(struct acolorhash_table *acht, const rgba_pixel *const pixels[], unsigned int cols, unsigned int rows, const unsigned char *importance_map)
+{
+    // neighbouring pixels often have the same color, which then needs no lookup
+    union rgba_as_int last_px = {{0,0,0,0}};
+    unsigned int last_index = 0;
 
     /* Go through the entire image, building a hash table of colors. */
     for(unsigned int row = 0; row < rows; ++row) {
@@ -47,141 +194,110 @@ LIQ_PRIVATE bool pam_computeacolorhash(struct acolorhash_table *acht, const rgba
 
             // RGBA color is casted to long for easier hasing/comparisons
             union rgba_as_int px = {pixels[row][col]};
-            unsigned int hash;
             if (!px.rgba.a) {
                 // "dirty alpha" has different RGBA values that end up being the same fully transparent color
-                px.l=0; hash=0;
+                px.l=0;
             } else {
-                // mask posterizes all 4 channels in one go
-                px.l = (px.l & posterize_mask) | ((px.l & posterize_high_mask) >> (8-ignorebits));
-                // fancier hashing algorithms didn't improve much
-                hash = px.l % hash_size;
+                px.l = pam_posterize(px.l, acht->ignorebits);
             }
 
-            /* head of the hash function stores first 2 colors inline (achl->used = 1..2),
-               to reduce number of allocations of achl->other_items.
-             */
-            struct acolorhist_arr_head *achl = &buckets[hash];
-            if (achl->inline1.color.l == px.l && achl->used) {
-                achl->inline1.perceptual_weight += boost;
+            if (last_index && px.l == last_px.l) {
+                acht->items[last_index-1].perceptual_weight += boost;
                 continue;
             }
-            if (achl->used) {
-                if (achl->used > 1) {
-                    if (achl->inline2.color.l == px.l) {
-                        achl->inline2.perceptual_weight += boost;
-                        continue;
-                    }
-                    // other items are stored as an array (which gets reallocated if needed)
-                    struct acolorhist_arr_item *other_items = achl->other_items;
-                    unsigned int i = 0;
-                    for (; i < achl->used-2; i++) {
-                        if (other_items[i].color.l == px.l) {
-                            other_items[i].perceptual_weight += boost;
-                            goto continue_outer_loop;
-                        }
-                    }
-
-                    // the array was allocated with spare items
-                    if (i < achl->capacity) {
-                        other_items[i] = (struct acolorhist_arr_item){
-                            .color = px,
-                            .perceptual_weight = boost,
-                        };
-                        achl->used++;
-                        ++colors;
-                        continue;
-                    }
-
-                    if (++colors > maxacolors) {
-                        acht->colors = colors;
-                        acht->freestackp = freestackp;
-                        return false;
-                    }
-
-                    struct acolorhist_arr_item *new_items;
-                    unsigned int capacity;
-                    if (!other_items) { // there was no array previously, alloc "small" array
-                        capacity = 8;
-                        if (freestackp <= 0) {
-                            // estimate how many colors are going to be + headroom
-                            const int mempool_size = ((acht->rows + rows-row) * 2 * colors / (acht->rows + row + 1) + 1024) * sizeof(struct acolorhist_arr_item);
-                            new_items = mempool_alloc(&acht->mempool, sizeof(struct acolorhist_arr_item)*capacity, mempool_size);
-                        } else {
-                            // freestack stores previously freed (reallocated) arrays that can be reused
-                            // (all pesimistically assumed to be capacity = 8)
-                            new_items = freestack[--freestackp];
-                        }
-                    } else {
-                        // simply reallocs and copies array to larger capacity
-                        capacity = achl->capacity*2 + 16;
-                        if (freestackp < stacksize-1) {
-                            freestack[freestackp++] = other_items;
-                        }
-                        const int mempool_size = ((acht->rows + rows-row) * 2 * colors / (acht->rows + row + 1) + 32*capacity) * sizeof(struct acolorhist_arr_item);
-                        new_items = mempool_alloc(&acht->mempool, sizeof(struct acolorhist_arr_item)*capacity, mempool_size);
-                        if (!new_items) return false;
-                        memcpy(new_items, other_items, sizeof(other_items[0])*achl->capacity);
-                    }
-
-                    achl->other_items = new_items;
-                    achl->capacity = capacity;
-                    new_items[i] = (struct acolorhist_arr_item){
-                        .color = px,
-                        .perceptual_weight = boost,
-                    };
-                    achl->used++;
-                } else {
-                    // these are elses for first checks whether first and second inline-stored colors are used
-                    achl->inline2.color.l = px.l;
-                    achl->inline2.perceptual_weight = boost;
-                    achl->used = 2;
-                    ++colors;
+
+            while (!(last_index = pam_add_to_hash(acht, px, boost))) {
+                if (!pam_reposterizeacolorhash(acht)) {
+                    return false;
                 }
-            } else {
-                achl->inline1.color.l = px.l;
-                achl->inline1.perceptual_weight = boost;
-                achl->used = 1;
-                ++colors;
+                px.l = pam_posterize(px.l, acht->ignorebits);
             }
-
-            continue_outer_loop:;
+            if (last_index == PAM_HASH_NO_MEMORY) {
+                acht->out_of_memory = true;
+                return false;
+            }
+            last_px = px;
         }
 
     }
-    acht->colors = colors;
     acht->cols = cols;
     acht->rows += rows;
-    acht->freestackp = freestackp;
     return true;
 }
 
+/*
+ Adds all colors of src (a table of later rows of the same image) to acht.
+ Colors new to acht are added in the order they were found in src, so merging the tables of consecutive
+ row bands in order gives the same histogram as computing one table over all of the rows.
+ Whichever table is posterized less is brought to the other's level first.
+ */
+LIQ_PRIVATE bool pam_mergeacolorhash(struct acolorhash_table *acht, const struct acolorhash_table *src)
+{
+    while (acht->ignorebits < src->ignorebits) {
+        if (!pam_reposterizeacolorhash(acht)) return false;
+    }
+
+    for(unsigned int i=0; i < src->colors; ++i) {
+        // colors are posterized again only if acht has gone further, which is exact as it's at most 4 bits
+        union rgba_as_int px = src->items[i].color;
+        if (acht->ignorebits > src->ignorebits) {
+            px.l = pam_posterize(px.l, acht->ignorebits);
+        }
+        unsigned int index;
+        while (!(index = pam_add_to_hash(acht, px, src->items[i].perceptual_weight))) {
+            if (!pam_reposterizeacolorhash(acht)) return false;
+            px.l = pam_posterize(px.l, acht->ignorebits);
+        }
+        if (index == PAM_HASH_NO_MEMORY) {
+            acht->out_of_memory = true;
+            return false;
+        }
+    }
+
+    acht->cols = src->cols;
+    acht->rows += src->rows;
+    return true;
+}
+
+/* Forgets all colors, keeping the memory for the next ones */
+LIQ_PRIVATE void pam_clearacolorhash(struct acolorhash_table *acht)
+{
+    memset(acht->slots, 0, (acht->hash_mask+1) * sizeof(acht->slots[0]));
+    acht->colors = 0;
+}
+
 LIQ_PRIVATE struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors, unsigned int surface, unsigned int ignorebits, void* (*malloc)(size_t), void (*free)(void*))
 {
     const unsigned int estimated_colors = MIN(maxcolors, surface/(ignorebits + (surface > 512*512 ? 5 : 4)));
-    const unsigned int hash_size = estimated_colors < 66000 ? 6673 : (estimated_colors < 200000 ? 12011 : 24019);
+    // the table grows when needed, so a big guess (made for every thread's table) isn't allocated up front
+    const unsigned int initial_colors = MAX(1, MIN(MIN(estimated_colors, 1<<16), maxcolors));
+    unsigned int slots_count = 64;
+    while (slots_count < initial_colors*2) {
+        slots_count *= 2;
+    }
 
-    mempool m = NULL;
-    const unsigned int buckets_size = hash_size * sizeof(struct acolorhist_arr_head);
-    const unsigned int mempool_size = sizeof(struct acolorhash_table) + buckets_size + estimated_colors * sizeof(struct acolorhist_arr_item);
-    struct acolorhash_table *t = mempool_create(&m, sizeof(*t) + buckets_size, mempool_size, malloc, free);
+    struct acolorhash_table *t = malloc(sizeof(*t));
     if (!t) return NULL;
+    const uint64_t address = (uintptr_t)t;
     *t = (struct acolorhash_table){
-        .mempool = m,
-        .hash_size = hash_size,
+        .malloc = malloc,
+        .free = free,
         .maxcolors = maxcolors,
         .ignorebits = ignorebits,
+        .hash_mask = slots_count - 1,
+        .hash_seed = (unsigned int)(address ^ address >> 32) * 0x9E3779B1U,
+        .capacity = initial_colors,
+        .slots = malloc(slots_count * sizeof(t->slots[0])),
+        .items = malloc(initial_colors * sizeof(t->items[0])),
     };
-    memset(t->buckets, 0, hash_size * sizeof(struct acolorhist_arr_head));
+    if (!t->slots || !t->items) {
+        pam_freeacolorhash(t);
+        return NULL;
+    }
+    memset(t->slots, 0, slots_count * sizeof(t->slots[0]));
     return t;
 }
 
-#define PAM_ADD_TO_HIST(entry) { \
-    hist->achv[j].acolor = to_f(gamma_lut, entry.color.rgba); \
-    total_weight += hist->achv[j].adjusted_weight = hist->achv[j].perceptual_weight = MIN(entry.perceptual_weight, max_perceptual_weight); \
-    ++j; \
-}
-
 LIQ_PRIVATE histogram *pam_acolorhashtoacolorhist(const struct acolorhash_table *acht, const double gamma, const float gamma_lut[256], void* (*malloc)(size_t), void (*free)(void*))
 {
     histogram *hist = malloc(sizeof(hist[0]));
@@ -199,19 +315,10 @@ LIQ_PRIVATE histogram *pam_acolorhashtoacolorhist(const struct acolorhash_table
     float max_perceptual_weight = 0.1f * acht->cols * acht->rows;
     double total_weight = 0;
 
-    for(unsigned int j=0, i=0; i < acht->hash_size; ++i) {
-        const struct acolorhist_arr_head *const achl = &acht->buckets[i];
-        if (achl->used) {
-            PAM_ADD_TO_HIST(achl->inline1);
-
-            if (achl->used > 1) {
-                PAM_ADD_TO_HIST(achl->inline2);
-
-                for(unsigned int k=0; k < achl->used-2; k++) {
-                    PAM_ADD_TO_HIST(achl->other_items[k]);
-                }
-            }
-        }
+    for(unsigned int j=0; j < acht->colors; ++j) {
+        const struct acolorhist_arr_item *const entry = &acht->items[j];
+        hist->achv[j].acolor = to_f(gamma_lut, entry->color.rgba);
+        total_weight += hist->achv[j].adjusted_weight = hist->achv[j].perceptual_weight = MIN(entry->perceptual_weight, max_perceptual_weight);
     }
 
     hist->total_perceptual_weight = total_weight;
@@ -221,7 +328,9 @@ LIQ_PRIVATE histogram *pam_acolorhashtoacolorhist(const struct acolorhash_table
 
 LIQ_PRIVATE void pam_freeacolorhash(struct acolorhash_table *acht)
 {
-    mempool_destroy(acht->mempool);
+    if (acht->slots) acht->free(acht->slots);
+    if (acht->items) acht->free(acht->items);
+    acht->free(acht);
 }
 
 LIQ_PRIVATE void pam_freeacolorhist(histogram *hist)
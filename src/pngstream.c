@@ -0,0 +1,472 @@
+/*
+ * pngstream.c
+ *
+ *  Row by row PNG reading and writing, so images never have to fit in memory.
+ *
+ *  The reader inflates IDAT data one scanline at a time, unfilters it against
+ *  the previous scanline and converts it to RGBA with lodepng_convert. Only
+ *  non-interlaced images can be read this way. The writer deflates scanlines
+ *  as they arrive and emits an IDAT chunk whenever its output buffer fills up.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pngstream.h"
+
+#define PNG_STREAM_BUFFER_SIZE 65536
+#define PNG_MAX_CHUNK_LENGTH 0x7FFFFFFFU
+
+static unsigned char pngHeader[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+static unsigned int read_uint32(const unsigned char* bytes) {
+    return ((unsigned int)bytes[0] << 24) | ((unsigned int)bytes[1] << 16) | ((unsigned int)bytes[2] << 8) | bytes[3];
+}
+
+static void write_uint32(unsigned char* bytes, unsigned int value) {
+    bytes[0] = (unsigned char)(value >> 24);
+    bytes[1] = (unsigned char)(value >> 16);
+    bytes[2] = (unsigned char)(value >> 8);
+    bytes[3] = (unsigned char)value;
+}
+
+static int read_chunk_header(FILE* file, unsigned int* length, char type[4]) {
+    unsigned char header[8];
+
+    if (fread(header, 1, sizeof(header), file) != sizeof(header))
+        return EXIT_FAILURE;
+
+    *length = read_uint32(header);
+    memcpy(type, header + 4, 4);
+
+    // the PNG specification limits chunks to 2^31 - 1 bytes
+    if (*length > PNG_MAX_CHUNK_LENGTH)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+/* checks the IHDR chunk the way lodepng_inspect does, and takes its size and color type */
+static int read_image_header(PngReader* reader, const unsigned char* data) {
+    unsigned char header[33];
+    LodePNGState state;
+    unsigned int width, height;
+
+    // lodepng inspects the signature and the whole chunk, the CRC isn't checked for the other chunks either
+    memcpy(header, pngHeader, sizeof(pngHeader));
+    write_uint32(header + 8, 13);
+    memcpy(header + 12, "IHDR", 4);
+    memcpy(header + 16, data, 17);
+
+    lodepng_state_init(&state);
+    state.decoder.ignore_crc = 1;
+    unsigned error = lodepng_inspect(&width, &height, &state, header, sizeof(header));
+    const int interlaced = state.info_png.interlace_method != 0;
+    lodepng_state_cleanup(&state);
+
+    if (error)
+        return EXIT_FAILURE;
+
+    if (interlaced) {
+        fprintf(stderr, "Interlaced PNG images can't be streamed\n");
+        return EXIT_FAILURE;
+    }
+
+    reader->width = width;
+    reader->height = height;
+    reader->color.bitdepth = data[8];
+    reader->color.colortype = (LodePNGColorType)data[9];
+
+    return EXIT_SUCCESS;
+}
+
+static int read_header_chunks(PngReader* reader) {
+    unsigned char* data = NULL;
+    unsigned int length;
+    char type[4];
+    int sawHeader = 0;
+
+    while (read_chunk_header(reader->file, &length, type) == EXIT_SUCCESS) {
+        const int isHeader = memcmp(type, "IHDR", 4) == 0;
+
+        // IHDR comes first and only once
+        if (isHeader == sawHeader)
+            break;
+
+        if (memcmp(type, "IDAT", 4) == 0) {
+            free(data);
+            // a palette image can't be converted without its palette
+            if (reader->color.colortype == LCT_PALETTE && reader->color.palettesize == 0)
+                return EXIT_FAILURE;
+            reader->chunkRemaining = length;
+            return EXIT_SUCCESS;
+        }
+
+        const int isPalette = memcmp(type, "PLTE", 4) == 0;
+        const int isTransparency = memcmp(type, "tRNS", 4) == 0;
+
+        // chunks that don't describe the pixels are skipped along with their CRC
+        if (!isHeader && !isPalette && !isTransparency) {
+            if (fseek(reader->file, (long)length, SEEK_CUR) != 0 || fseek(reader->file, 4, SEEK_CUR) != 0)
+                break;
+            continue;
+        }
+
+        if (isHeader && length != 13)
+            break;
+        if (isPalette && (length == 0 || length % 3 != 0 || length > 256 * 3 || (size_t)length / 3 > (1u << reader->color.bitdepth)))
+            break;
+        if (isTransparency && !(reader->color.colortype == LCT_PALETTE ? length <= reader->color.palettesize
+                : reader->color.colortype == LCT_GREY ? length == 2 : reader->color.colortype == LCT_RGB && length == 6))
+            break;
+
+        unsigned char* newData = (unsigned char*)realloc(data, length + 4);
+        if (newData == NULL)
+            break;
+        data = newData;
+
+        // the chunk's CRC is read along with its data and not checked, zlib's checksum covers the pixels
+        if (fread(data, 1, length + 4, reader->file) != length + 4)
+            break;
+
+        if (isHeader) {
+            if (read_image_header(reader, data) == EXIT_FAILURE)
+                break;
+
+            sawHeader = 1;
+        } else if (isPalette) {
+            lodepng_palette_clear(&reader->color);
+            for (unsigned int i = 0; i < length; i += 3) {
+                lodepng_palette_add(&reader->color, data[i], data[i + 1], data[i + 2], 255);
+            }
+        } else if (reader->color.colortype == LCT_PALETTE) {
+            for (unsigned int i = 0; i < length; i++) {
+                reader->color.palette[i * 4 + 3] = data[i];
+            }
+        } else if (reader->color.colortype == LCT_GREY) {
+            reader->color.key_defined = 1;
+            reader->color.key_r = reader->color.key_g = reader->color.key_b = (data[0] << 8) | data[1];
+        } else {
+            reader->color.key_defined = 1;
+            reader->color.key_r = (data[0] << 8) | data[1];
+            reader->color.key_g = (data[2] << 8) | data[3];
+            reader->color.key_b = (data[4] << 8) | data[5];
+        }
+    }
+
+    free(data);
+
+    return EXIT_FAILURE;
+}
+
+static int fill_reader_input(PngReader* reader) {
+    while (reader->chunkRemaining == 0) {
+        unsigned char crc[4];
+        unsigned int length;
+        char type[4];
+
+        if (reader->streamEnded || fread(crc, 1, sizeof(crc), reader->file) != sizeof(crc) || read_chunk_header(reader->file, &length, type) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+
+        if (memcmp(type, "IDAT", 4) != 0) {
+            reader->streamEnded = 1;
+            return EXIT_FAILURE;
+        }
+
+        reader->chunkRemaining = length;
+    }
+
+    size_t readSize = reader->chunkRemaining < PNG_STREAM_BUFFER_SIZE ? reader->chunkRemaining : PNG_STREAM_BUFFER_SIZE;
+    size_t bytesRead = fread(reader->input, 1, readSize, reader->file);
+
+    if (bytesRead == 0)
+        return EXIT_FAILURE;
+
+    reader->chunkRemaining -= bytesRead;
+    reader->zstream.next_in = reader->input;
+    reader->zstream.avail_in = bytesRead;
+
+    return EXIT_SUCCESS;
+}
+
+static int paeth_predictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+
+    return pb <= pc ? b : c;
+}
+
+static int unfilter_scanline(unsigned char* scanline, const unsigned char* previous, size_t rowSize, size_t byteWidth) {
+    unsigned char* row = scanline + 1;
+
+    switch (scanline[0]) {
+    case 0:
+        break;
+    case 1:
+        for (size_t i = byteWidth; i < rowSize; i++)
+            row[i] += row[i - byteWidth];
+        break;
+    case 2:
+        for (size_t i = 0; i < rowSize; i++)
+            row[i] += previous[i];
+        break;
+    case 3:
+        for (size_t i = 0; i < rowSize; i++)
+            row[i] += ((i >= byteWidth ? row[i - byteWidth] : 0) + previous[i]) >> 1;
+        break;
+    case 4:
+        for (size_t i = 0; i < rowSize; i++) {
+            int left = i >= byteWidth ? row[i - byteWidth] : 0;
+            int upperLeft = i >= byteWidth ? previous[i - byteWidth] : 0;
+            row[i] += paeth_predictor(left, previous[i], upperLeft);
+        }
+        break;
+    default:
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int png_reader_open(const char* fileName, PngReader** reader) {
+    unsigned char signature[sizeof(pngHeader)];
+
+    *reader = (PngReader*)calloc(1, sizeof(PngReader));
+
+    if (*reader == NULL)
+        return EXIT_FAILURE;
+
+    lodepng_color_mode_init(&(*reader)->color);
+
+    (*reader)->file = fopen(fileName, "rb");
+
+    if ((*reader)->file == NULL) {
+        perror(fileName);
+        goto png_reader_open_error;
+    }
+
+    if (fread(signature, 1, sizeof(signature), (*reader)->file) != sizeof(signature) || memcmp(signature, pngHeader, sizeof(pngHeader)) != 0
+        || read_header_chunks(*reader) == EXIT_FAILURE) {
+        fprintf(stderr, "Failed to read PNG header of %s\n", fileName);
+        goto png_reader_open_error;
+    }
+
+    (*reader)->rowSize = lodepng_get_raw_size((*reader)->width, 1, &(*reader)->color);
+    (*reader)->scanline = (unsigned char*)malloc((*reader)->rowSize + 1);
+    (*reader)->previousScanline = (unsigned char*)calloc((*reader)->rowSize + 1, 1);
+    (*reader)->input = (unsigned char*)malloc(PNG_STREAM_BUFFER_SIZE);
+
+    if ((*reader)->scanline == NULL || (*reader)->previousScanline == NULL || (*reader)->input == NULL || inflateInit(&(*reader)->zstream) != Z_OK)
+        goto png_reader_open_error;
+
+    return EXIT_SUCCESS;
+
+png_reader_open_error:
+    png_reader_close(*reader);
+    *reader = NULL;
+
+    return EXIT_FAILURE;
+}
+
+int png_reader_read_rgba_rows(PngReader* reader, unsigned char* rgbaRows, unsigned int rowCount) {
+    LodePNGColorMode rgbaMode = lodepng_color_mode_make(LCT_RGBA, 8);
+    size_t byteWidth = (lodepng_get_bpp(&reader->color) + 7) / 8;
+
+    if (rowCount > reader->height - reader->rowsRead)
+        return EXIT_FAILURE;
+
+    for (unsigned int row = 0; row < rowCount; row++) {
+        reader->zstream.next_out = reader->scanline;
+        reader->zstream.avail_out = reader->rowSize + 1;
+
+        while (reader->zstream.avail_out > 0) {
+            if (reader->zstream.avail_in == 0 && fill_reader_input(reader) == EXIT_FAILURE)
+                return EXIT_FAILURE;
+
+            int status = inflate(&reader->zstream, Z_NO_FLUSH);
+
+            if (status == Z_STREAM_END && reader->zstream.avail_out > 0)
+                return EXIT_FAILURE;
+
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+                return EXIT_FAILURE;
+        }
+
+        if (unfilter_scanline(reader->scanline, reader->previousScanline + 1, reader->rowSize, byteWidth) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+
+        if (lodepng_convert(rgbaRows + (size_t)row * reader->width * 4, reader->scanline + 1, &rgbaMode, &reader->color, reader->width, 1))
+            return EXIT_FAILURE;
+
+        unsigned char* previous = reader->previousScanline;
+        reader->previousScanline = reader->scanline;
+        reader->scanline = previous;
+        reader->rowsRead++;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void png_reader_close(PngReader* reader) {
+    if (reader == NULL)
+        return;
+
+    inflateEnd(&reader->zstream);
+
+    if (reader->file != NULL)
+        fclose(reader->file);
+
+    lodepng_color_mode_cleanup(&reader->color);
+    free(reader->scanline);
+    free(reader->previousScanline);
+    free(reader->input);
+    free(reader);
+}
+
+static int write_chunk(FILE* file, const char* type, const unsigned char* data, unsigned int length) {
+    unsigned char header[8], crc[4];
+
+    write_uint32(header, length);
+    memcpy(header + 4, type, 4);
+
+    uLong checksum = crc32(0L, header + 4, 4);
+    if (length > 0)
+        checksum = crc32(checksum, data, length);
+    write_uint32(crc, (unsigned int)checksum);
+
+    if (fwrite(header, 1, sizeof(header), file) != sizeof(header) || (length > 0 && fwrite(data, 1, length, file) != length)
+        || fwrite(crc, 1, sizeof(crc), file) != sizeof(crc))
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+static int flush_writer_output(PngWriter* writer) {
+    unsigned int length = PNG_STREAM_BUFFER_SIZE - writer->zstream.avail_out;
+
+    if (length > 0 && write_chunk(writer->file, "IDAT", writer->output, length) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    writer->zstream.next_out = writer->output;
+    writer->zstream.avail_out = PNG_STREAM_BUFFER_SIZE;
+
+    return EXIT_SUCCESS;
+}
+
+static int write_header_chunks(PngWriter* writer, unsigned int width, unsigned int height, const LodePNGColorMode* color) {
+    unsigned char header[13];
+
+    write_uint32(header, width);
+    write_uint32(header + 4, height);
+    header[8] = (unsigned char)color->bitdepth;
+    header[9] = (unsigned char)color->colortype;
+    header[10] = header[11] = header[12] = 0;
+
+    if (fwrite(pngHeader, 1, sizeof(pngHeader), writer->file) != sizeof(pngHeader) || write_chunk(writer->file, "IHDR", header, sizeof(header)) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    if (color->colortype != LCT_PALETTE)
+        return EXIT_SUCCESS;
+
+    unsigned char palette[256 * 3], alpha[256];
+    unsigned int alphaCount = 0;
+
+    for (size_t i = 0; i < color->palettesize; i++) {
+        memcpy(palette + i * 3, color->palette + i * 4, 3);
+        alpha[i] = color->palette[i * 4 + 3];
+        if (alpha[i] != 255)
+            alphaCount = i + 1;
+    }
+
+    if (write_chunk(writer->file, "PLTE", palette, color->palettesize * 3) == EXIT_FAILURE
+        || (alphaCount > 0 && write_chunk(writer->file, "tRNS", alpha, alphaCount) == EXIT_FAILURE))
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+int png_writer_open(const char* fileName, unsigned int width, unsigned int height, const LodePNGColorMode* color, PngWriter** writer) {
+    *writer = (PngWriter*)calloc(1, sizeof(PngWriter));
+
+    if (*writer == NULL)
+        return EXIT_FAILURE;
+
+    (*writer)->rowSize = lodepng_get_raw_size(width, 1, color);
+    (*writer)->scanline = (unsigned char*)malloc((*writer)->rowSize + 1);
+    (*writer)->output = (unsigned char*)malloc(PNG_STREAM_BUFFER_SIZE);
+    (*writer)->file = fopen(fileName, "wb");
+
+    if ((*writer)->file == NULL) {
+        perror(fileName);
+        goto png_writer_open_error;
+    }
+
+    if ((*writer)->scanline == NULL || (*writer)->output == NULL || deflateInit(&(*writer)->zstream, Z_DEFAULT_COMPRESSION) != Z_OK
+        || write_header_chunks(*writer, width, height, color) == EXIT_FAILURE)
+        goto png_writer_open_error;
+
+    (*writer)->zstream.next_out = (*writer)->output;
+    (*writer)->zstream.avail_out = PNG_STREAM_BUFFER_SIZE;
+
+    return EXIT_SUCCESS;
+
+png_writer_open_error:
+    png_writer_close(*writer);
+    *writer = NULL;
+
+    return EXIT_FAILURE;
+}
+
+/*
+ * Rows are PNG scanlines without the filter byte, sub-byte pixels padded to a
+ * whole byte at the end of each row. They are always written unfiltered, like
+ * lodepng does for palette images.
+ */
+int png_writer_write_row(PngWriter* writer, const unsigned char* row) {
+    writer->scanline[0] = 0;
+    memcpy(writer->scanline + 1, row, writer->rowSize);
+
+    writer->zstream.next_in = writer->scanline;
+    writer->zstream.avail_in = writer->rowSize + 1;
+
+    while (writer->zstream.avail_in > 0) {
+        if (deflate(&writer->zstream, Z_NO_FLUSH) == Z_STREAM_ERROR)
+            return EXIT_FAILURE;
+
+        if (writer->zstream.avail_out == 0 && flush_writer_output(writer) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int png_writer_close(PngWriter* writer) {
+    int result = EXIT_FAILURE;
+
+    if (writer == NULL)
+        return EXIT_FAILURE;
+
+    if (writer->file != NULL && writer->output != NULL && writer->zstream.state != NULL) {
+        int status;
+
+        do {
+            status = deflate(&writer->zstream, Z_FINISH);
+        } while (status == Z_OK && flush_writer_output(writer) == EXIT_SUCCESS);
+
+        if (status == Z_STREAM_END && flush_writer_output(writer) == EXIT_SUCCESS && write_chunk(writer->file, "IEND", NULL, 0) == EXIT_SUCCESS)
+            result = EXIT_SUCCESS;
+    }
+
+    deflateEnd(&writer->zstream);
+
+    if (writer->file != NULL && fclose(writer->file) != 0)
+        result = EXIT_FAILURE;
+
+    free(writer->scanline);
+    free(writer->output);
+    free(writer);
+
+    return result;
+}
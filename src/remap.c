@@ -3,14 +3,27 @@
 #include <unistd.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <limits.h>
 #include <float.h>
 #include <getopt.h>
+#include <glob.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "convert.h"
 #include "diff.h"
 #include "palette.h"
+#include "output_cache.h"
+#include "pngstream.h"
+#include "remap_job.h"
+#include "remap_server.h"
+#include "remap_sequence.h"
 #include "lodepng.h"
 #include "libimagequant.h"
 
+#define STREAM_BAND_ROWS 64
+
 static struct options {
     const char* inputFilename;
     const char* paletteFilename;
@@ -21,8 +34,69 @@ static struct options {
     int paletteSlot;
     bool autoPaletteSlot;
     bool mask;
+    int maskBits;
+    bool batch;
+    bool sequence;
+    int jobs;
+    int threads;
+    const char* lutDirectory;
+    bool countColors;
+    bool stream;
+    const char* serveSocket;
+    const char* connectSocket;
+    int paletteCacheSize;
+    int idleTimeout;
+    bool jsonStats;
+    const char* outputSpecs[REMAP_MAX_OUTPUTS];
+    int outputSpecCount;
+    int tileSize;
+    const char* cacheDirectory;
+    int cacheSizeMb;
+    int format;
+    int dither;
 } options;
 
+static OutputCache* outputCache = NULL;
+
+typedef struct {
+    char** inputFilenames;
+    int inputCount;
+    int nextInput;
+    int failures;
+    pthread_mutex_t lock;
+    remap_palette* remapPalette;
+} batch_queue;
+
+static const char* formatNames[] = { "png", "raw", "snes", "gba", "genesis" };
+
+int parse_format(const char* name)
+{
+    for (int i = 0; i < (int)(sizeof(formatNames) / sizeof(formatNames[0])); i++) {
+        if (strcmp(name, formatNames[i]) == 0) {
+            return i;
+        }
+    }
+
+    fprintf(stderr, "Unknown output format %s, use png, raw, snes, gba or genesis\n", name);
+
+    return -1;
+}
+
+static const char* ditherNames[] = { "none", "bayer2", "bayer4", "bayer8", "bluenoise" };
+
+int parse_dither(const char* name)
+{
+    for (int i = 0; i < (int)(sizeof(ditherNames) / sizeof(ditherNames[0])); i++) {
+        if (strcmp(name, ditherNames[i]) == 0) {
+            return i;
+        }
+    }
+
+    fprintf(stderr, "Unknown dithering %s, use none, bayer2, bayer4, bayer8 or bluenoise\n", name);
+
+    return -1;
+}
+
 const char* get_filename_ext(const char* filename) {
     const char* dot = strrchr(filename, '.');
     if (!dot || dot == filename) {
@@ -31,305 +105,1051 @@ const char* get_filename_ext(const char* filename) {
     return dot + 1;
 }
 
-int perfectHashRgbcolor(const void* key) {
-    rgbcolor* rgb = (rgbcolor*) key;
-	unsigned char R = (unsigned char) rgb->R;
-    unsigned char G = (unsigned char) rgb->G;
-    unsigned char B = (unsigned char) rgb->B;
-	return ((R & 0xff) << 16) + ((G & 0xff) << 8) + (B & 0xff);
+/*
+ * Names a file written next to the output, e.g. output_mask.png for output.png.
+ */
+char* get_sibling_filename(const char* outputFilename, const char* suffix)
+{
+    char* siblingFilename = (char*)malloc(strlen(outputFilename) + strlen(suffix) + 1);
+    if (siblingFilename == NULL) {
+        return NULL;
+    }
+    strcpy(siblingFilename, outputFilename);
+    char* siblingFilenameExt = strrchr(siblingFilename, '.');
+    if (siblingFilenameExt != NULL) {
+        strcpy(siblingFilenameExt, suffix);
+    } else {
+        strcat(siblingFilename, suffix);
+    }
+    return siblingFilename;
+}
+
+char* get_mask_filename(const char* outputFilename)
+{
+    return get_sibling_filename(outputFilename, "_mask.png");
+}
+
+int save_png(const char* fileName, const unsigned char* png, size_t pngSize)
+{
+    if (lodepng_save_file(png, pngSize, fileName)) {
+        fprintf(stderr, "Error saving PNG file\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+remap_options get_remap_options(const struct options* opts)
+{
+    remap_options remapOptions;
+
+    remap_options_init(&remapOptions);
+    remapOptions.rangeMin = opts->rangeMin;
+    remapOptions.rangeMax = opts->rangeMax;
+    remapOptions.paletteSlot = opts->autoPaletteSlot ? REMAP_SLOT_AUTO : opts->paletteSlot;
+    remapOptions.countColors = opts->countColors;
+    remapOptions.tileSize = opts->tileSize;
+    remapOptions.threads = opts->threads;
+    remapOptions.dither = opts->dither;
+
+    return remapOptions;
 }
 
-int compareRgbcolor(const void* a, const void* b) {
-    rgbcolor* rgb1 = (rgbcolor*) a;
-    rgbcolor* rgb2 = (rgbcolor*) b;
-    return perfectHashRgbcolor(rgb1) - perfectHashRgbcolor(rgb2);
+void print_remap_result(const remap_result* remapResult)
+{
+    if (remapResult->slotCount > 0) {
+        printf("paletteSlot errors:");
+        for (int i = 0; i < remapResult->slotCount; i++) {
+            printf(" %d=%.3f", i, remapResult->slotErrors[i]);
+        }
+        printf("\n");
+    }
+
+    if (remapResult->paletteSlot != -1) {
+        printf("paletteSlot: %d\n", remapResult->paletteSlot);
+    }
+
+    if (remapResult->tileSlots != NULL) {
+        int tileCounts[REMAP_MAX_SLOTS] = { 0 };
+        for (int i = 0; i < remapResult->tilesWide * remapResult->tilesHigh; i++) {
+            tileCounts[remapResult->tileSlots[i] % REMAP_MAX_SLOTS]++;
+        }
+
+        printf("tiles: %dx%d of %dx%d pixels, by slot:", remapResult->tilesWide, remapResult->tilesHigh, remapResult->tileSize, remapResult->tileSize);
+        for (int i = 0; i < REMAP_MAX_SLOTS; i++) {
+            if (tileCounts[i] > 0) {
+                printf(" %d=%d", i, tileCounts[i]);
+            }
+        }
+        printf("\n");
+    }
+
+    int colorCount = remapResult->rangeMax - remapResult->rangeMin + 1;
+
+    if (remapResult->inputColors >= 0) {
+        printf("remapped image from %d to %d colors...MSE=%.3f (Q=%d)\n", remapResult->inputColors, colorCount, remapResult->mse, remapResult->quality);
+    } else {
+        printf("remapped image to %d colors...MSE=%.3f (Q=%d)\n", colorCount, remapResult->mse, remapResult->quality);
+    }
 }
 
-void libimagequant_log(const liq_attr*, const char *message, void* user_info) {
-    //fprintf(stderr, "%s\n", message);
+const char *get_color_type(LodePNGColorType colorType);
+
+void print_json_string(const char* text)
+{
+    putchar('"');
+    for (const unsigned char* c = (const unsigned char*)text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        } else if (*c < 0x20) {
+            printf("\\u%04x", *c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
 }
 
-int write_image(unsigned char* quantizedImage, int inputWidth, int inputHeight, rgbcolor* palette, int paletteCount)
+void print_json_stats(const struct options* opts, LodePNGColorType colorType, unsigned int bitDepth, const remap_result* remapResult)
+{
+    stage_time total = stats_total(&remapResult->stats);
+
+    printf("{\"type\": \"image\", \"input\": ");
+    print_json_string(opts->inputFilename);
+    printf(", \"output\": ");
+    print_json_string(opts->outputFilename);
+    printf(", \"format\": \"%s\", \"bits\": %u", get_color_type(colorType), bitDepth);
+    printf(", \"width\": %d, \"height\": %d, \"pixels\": %lld", remapResult->width, remapResult->height, (long long)remapResult->width * remapResult->height);
+    printf(", \"inputColors\": %d, \"paletteColors\": %d", remapResult->inputColors, remapResult->rangeMax - remapResult->rangeMin + 1);
+    printf(", \"rangeMin\": %d, \"rangeMax\": %d, \"paletteSlot\": %d", remapResult->rangeMin, remapResult->rangeMax, remapResult->paletteSlot);
+    printf(", \"mse\": %.6f, \"quality\": %d", remapResult->mse, remapResult->quality);
+    if (remapResult->tileSlots != NULL) {
+        printf(", \"tileSize\": %d, \"tilesWide\": %d, \"tilesHigh\": %d", remapResult->tileSize, remapResult->tilesWide, remapResult->tilesHigh);
+    }
+
+    printf(", \"stages\": {");
+    for (int i = 0; i < REMAP_STAGE_LAST; i++) {
+        printf("%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f}", i ? ", " : "", stats_stage_name(i), remapResult->stats.stages[i].wall, remapResult->stats.stages[i].cpu);
+    }
+    printf("}, \"total\": {\"wall\": %.6f, \"cpu\": %.6f}", total.wall, total.cpu);
+    printf(", \"peakMemoryKb\": %ld}\n", stats_peak_memory_kb());
+}
+
+/*
+ * Prints what happened to one image, as text or as one line of JSON. Batch
+ * workers report concurrently, so the whole report is written under the
+ * stdout lock.
+ */
+void print_image_report(const struct options* opts, LodePNGColorType colorType, unsigned int bitDepth, const remap_result* remapResult)
+{
+    flockfile(stdout);
+
+    if (opts->jsonStats) {
+        print_json_stats(opts, colorType, bitDepth, remapResult);
+    } else {
+        printf("input: %s %dx%d (%s format, %d bits)\n", opts->inputFilename, remapResult->width, remapResult->height, get_color_type(colorType), bitDepth);
+        print_remap_result(remapResult);
+    }
+
+    funlockfile(stdout);
+}
+
+/*
+ * Tile attributes are one byte per tile, the tile's slot, row by row.
+ */
+int save_tile_slots(const char* fileName, const remap_result* remapResult)
+{
+    FILE* file = fopen(fileName, "wb");
+    size_t tileCount = (size_t)remapResult->tilesWide * remapResult->tilesHigh;
+
+    if (file == NULL) {
+        perror(fileName);
+        return EXIT_FAILURE;
+    }
+
+    if (fwrite(remapResult->tileSlots, 1, tileCount, file) != tileCount) {
+        fprintf(stderr, "Error saving tile attributes\n");
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    return fclose(file) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int save_outputs(const struct options* opts, remap_png_result* output)
 {
     int result = EXIT_SUCCESS;
-    LodePNGState state;
-    lodepng_state_init(&state);
-    unsigned char* outputImage = NULL, *pngOutput = NULL;
+    char* maskFilename = NULL, *attrFilename = NULL;
+    stage_time stageStart;
 
-    if (options.bitDepth == 4)
-    {
-        for (int i = options.rangeMin; i <= options.rangeMax; i++) {
-            lodepng_palette_add(&state.info_png.color, palette[i].R, palette[i].G, palette[i].B, 255);
-            lodepng_palette_add(&state.info_raw, palette[i].R, palette[i].G, palette[i].B, 255);
+    stats_start(&stageStart);
+
+    if (save_png(opts->outputFilename, output->png, output->pngSize) == EXIT_FAILURE) {
+        result = EXIT_FAILURE;
+    } else if (opts->mask) {
+        maskFilename = get_mask_filename(opts->outputFilename);
+        if (maskFilename == NULL || save_png(maskFilename, output->maskPng, output->maskPngSize) == EXIT_FAILURE) {
+            result = EXIT_FAILURE;
         }
     }
-    else if (options.bitDepth == 8)
-    {
-        for (int i = 0; i < paletteCount; i++) {
-            lodepng_palette_add(&state.info_png.color, palette[i].R, palette[i].G, palette[i].B, 255);
-            lodepng_palette_add(&state.info_raw, palette[i].R, palette[i].G, palette[i].B, 255);
+
+    if (result == EXIT_SUCCESS && output->result.tileSlots != NULL) {
+        attrFilename = get_sibling_filename(opts->outputFilename, "_attr.bin");
+        if (attrFilename == NULL || save_tile_slots(attrFilename, &output->result) == EXIT_FAILURE) {
+            result = EXIT_FAILURE;
         }
     }
 
-    state.info_png.color.colortype = LCT_PALETTE;
-    state.info_png.color.bitdepth = options.bitDepth;
-    state.info_raw.colortype = LCT_PALETTE;
-    state.info_raw.bitdepth = options.bitDepth;
-    state.encoder.auto_convert = 0;
+    stats_stop(&output->result.stats, REMAP_STAGE_SAVE, &stageStart);
+
+    free(maskFilename);
+    free(attrFilename);
+
+    return result;
+}
+
+const char *get_color_type(LodePNGColorType colorType)
+{
+    switch(colorType)
+    {
+    case LCT_GREY:
+        return "GREY";
+    case LCT_RGB:
+        return "RGB";
+    case LCT_PALETTE:
+        return "PALETTE";
+    case LCT_GREY_ALPHA:
+        return "GREY_ALPHA";
+    case LCT_RGBA:
+        return "RGBA";
+    }
+
+    return "UNKNOWN";
+}
+
+/*
+ * Streams the image through in bands of STREAM_BAND_ROWS rows: each band is
+ * decoded, remapped as a job of its own and written before the next is read,
+ * so memory use depends on the image width only. The result is the same as
+ * remap_file, except that the PNG data may be compressed differently. Bands
+ * start at multiples of every dithering matrix size, so dithering lines up too.
+ */
+int remap_file_stream(const struct options* opts, remap_palette* remapPalette)
+{
+    int result = EXIT_SUCCESS;
+    PngReader* reader = NULL;
+    PngWriter* writer = NULL, *maskWriter = NULL;
+    LodePNGColorMode outputMode, maskMode;
+    unsigned char* bandImage = NULL, *outputRow = NULL, *maskRow = NULL;
+    char* maskFilename = NULL;
+    color_counter counter = { 0 };
+    remap_options remapOptions = get_remap_options(opts);
+    remap_result imageResult = { .paletteSlot = -1, .inputColors = -1 };
+    double remappingError = 0;
+    remap_stats stats = { 0 };
+    stage_time stageStart;
+
+    lodepng_color_mode_init(&outputMode);
+    lodepng_color_mode_init(&maskMode);
+
+    // bands are counted here, across the whole image
+    remapOptions.countColors = false;
+    remapOptions.alpha = (opts->mask && opts->maskBits != REMAP_MASK_RGBA);
+    if (remap_options_resolve(remapPalette, &remapOptions) == EXIT_FAILURE) {
+        result = EXIT_FAILURE;
+        goto remap_file_stream_exit;
+    }
+
+    if (png_reader_open(opts->inputFilename, &reader) == EXIT_FAILURE) {
+        result = EXIT_FAILURE;
+        goto remap_file_stream_exit;
+    }
+
+    unsigned int inputWidth = reader->width, inputHeight = reader->height;
+    int countColors = (reader->color.colortype != LCT_PALETTE && opts->countColors);
 
-    int bpp = lodepng_get_bpp(&state.info_raw);
-    int imageSize = (inputWidth * inputHeight * bpp + 7) / 8;
-    outputImage = (unsigned char*)calloc(imageSize, sizeof(unsigned char));
-    if (!outputImage) {
+    bandImage = (unsigned char*)malloc((size_t)inputWidth * STREAM_BAND_ROWS * 4);
+    outputRow = (unsigned char*)malloc(inputWidth);
+    maskRow = (unsigned char*)malloc((size_t)inputWidth * 4);
+    if (bandImage == NULL || outputRow == NULL || maskRow == NULL || (countColors && color_counter_init(&counter) == EXIT_FAILURE)) {
         perror("Failed to allocate memory for image");
         result = EXIT_FAILURE;
-        goto png_exit;
+        goto remap_file_stream_exit;
     }
-    if (options.bitDepth == 4)
-    {
-        for (int i = 0; i < inputWidth * inputHeight; i++) {
-            size_t byte_index = i / 2;
-            int byte_half = i % 2 == 1;
-            int colorIndex = quantizedImage[i];
 
-            outputImage[byte_index] |= (unsigned char)(colorIndex << (byte_half ? 0 : 4));
+    // like remap_job_run_png, slots are written at 4 bits
+    int bitDepth = (remapOptions.paletteSlot != -1 ? 4 : opts->bitDepth);
+
+    remap_set_output_palette(remapPalette, remapOptions.rangeMin, remapOptions.rangeMax, bitDepth, &outputMode);
+
+    if (png_writer_open(opts->outputFilename, inputWidth, inputHeight, &outputMode, &writer) == EXIT_FAILURE) {
+        result = EXIT_FAILURE;
+        goto remap_file_stream_exit;
+    }
+
+    if (opts->mask) {
+        remap_set_mask_mode(opts->maskBits, &maskMode);
+        maskFilename = get_mask_filename(opts->outputFilename);
+        if (maskFilename == NULL || png_writer_open(maskFilename, inputWidth, inputHeight, &maskMode, &maskWriter) == EXIT_FAILURE) {
+            result = EXIT_FAILURE;
+            goto remap_file_stream_exit;
         }
     }
-    else if(options.bitDepth == 8)
-    {
-        for (int i = 0; i < inputWidth * inputHeight; i++) {
-            outputImage[i] = quantizedImage[i] + options.rangeMin;
+
+    for (unsigned int bandStart = 0; bandStart < inputHeight; bandStart += STREAM_BAND_ROWS) {
+        unsigned int bandHeight = MIN(STREAM_BAND_ROWS, inputHeight - bandStart);
+        remap_result bandResult;
+
+        stats_start(&stageStart);
+        if (png_reader_read_rgba_rows(reader, bandImage, bandHeight) == EXIT_FAILURE) {
+            fprintf(stderr, "Decoder error in %s at row %u\n", opts->inputFilename, bandStart);
+            result = EXIT_FAILURE;
+            goto remap_file_stream_exit;
+        }
+        stats_stop(&stats, REMAP_STAGE_DECODE, &stageStart);
+
+        stats_start(&stageStart);
+        if (countColors && color_counter_add(&counter, bandImage, (size_t)inputWidth * bandHeight) == EXIT_FAILURE) {
+            countColors = 0;
+        }
+        stats_stop(&stats, REMAP_STAGE_COUNT_COLORS, &stageStart);
+
+        if (remap_job_run(remapPalette, &remapOptions, bandImage, inputWidth, bandHeight, &bandResult) == EXIT_FAILURE) {
+            result = EXIT_FAILURE;
+            goto remap_file_stream_exit;
+        }
+
+        imageResult = bandResult;
+        imageResult.indices = NULL;
+        remappingError += bandResult.mse * bandHeight;
+        stats_add(&stats, &bandResult.stats);
+
+        // rows are compressed and written as they are encoded
+        stats_start(&stageStart);
+        for (unsigned int row = 0; row < bandHeight && result == EXIT_SUCCESS; row++) {
+            remap_pack_row(bandResult.indices + (size_t)row * inputWidth, inputWidth, remapOptions.rangeMin, bitDepth, outputRow);
+            if (png_writer_write_row(writer, outputRow) == EXIT_FAILURE) {
+                result = EXIT_FAILURE;
+            }
+
+            if (maskWriter != NULL) {
+                if (remapOptions.alpha) {
+                    remap_pack_mask_row(bandResult.alpha + (size_t)row * inputWidth, inputWidth, opts->maskBits, maskRow);
+                } else {
+                    remap_mask_pixels(bandImage + (size_t)row * inputWidth * 4, maskRow, inputWidth);
+                }
+                if (png_writer_write_row(maskWriter, maskRow) == EXIT_FAILURE) {
+                    result = EXIT_FAILURE;
+                }
+            }
+        }
+
+        stats_stop(&stats, REMAP_STAGE_ENCODE, &stageStart);
+        remap_result_free(&bandResult);
+
+        if (result == EXIT_FAILURE) {
+            goto remap_file_stream_exit;
         }
     }
 
-    size_t pngOutputSize;
-    if (lodepng_encode(&pngOutput, &pngOutputSize, outputImage, inputWidth, inputHeight, &state)) {
-        fprintf(stderr, "Encoder error: %s\n", lodepng_error_text(state.error));
+    imageResult.height = inputHeight;
+    imageResult.mse = remappingError / inputHeight;
+    imageResult.quality = liq_mse_to_quality(imageResult.mse);
+    imageResult.inputColors = (reader->color.colortype == LCT_PALETTE ? (int)reader->color.palettesize : countColors ? counter.count : -1);
+
+remap_file_stream_exit:
+
+    stats_start(&stageStart);
+
+    if (writer != NULL && png_writer_close(writer) == EXIT_FAILURE && result == EXIT_SUCCESS) {
+        fprintf(stderr, "Error saving PNG file\n");
         result = EXIT_FAILURE;
-        goto png_exit;
     }
 
-    if (lodepng_save_file(pngOutput, pngOutputSize, options.outputFilename)) {
+    if (maskWriter != NULL && png_writer_close(maskWriter) == EXIT_FAILURE && result == EXIT_SUCCESS) {
         fprintf(stderr, "Error saving PNG file\n");
         result = EXIT_FAILURE;
-        goto png_exit;
     }
 
-png_exit:
-    if (pngOutput != NULL)
-    {
-        free(pngOutput);
+    stats_stop(&stats, REMAP_STAGE_SAVE, &stageStart);
 
-        if (outputImage != NULL)
-        {
-            lodepng_state_cleanup(&state);
+    if (result == EXIT_SUCCESS) {
+        imageResult.stats = stats;
+        print_image_report(opts, reader->color.colortype, reader->color.bitdepth, &imageResult);
+    }
 
-            free(outputImage);
+    // a partially streamed image is worse than none
+    if (result == EXIT_FAILURE && writer != NULL) {
+        remove(opts->outputFilename);
+        if (maskWriter != NULL) {
+            remove(maskFilename);
         }
     }
 
+    png_reader_close(reader);
+    lodepng_color_mode_cleanup(&outputMode);
+    lodepng_color_mode_cleanup(&maskMode);
+    color_counter_free(&counter);
+
+    free(maskFilename);
+    free(bandImage);
+    free(outputRow);
+    free(maskRow);
+
     return result;
 }
 
-int write_image_mask(unsigned char *inputImage, int inputWidth, int inputHeight)
+/*
+ * An output spec is a file name, optionally followed by a colon and comma
+ * separated settings that override the command line options for that output:
+ * bits=n, format=name, range=min-max, slot=n|auto, tiles=n and mask or mask=1|8|32.
+ */
+int parse_output_spec(const char* spec, const struct options* defaults, struct options* output, char** outputFilename)
+{
+    const char* settings = strchr(spec, ':');
+    size_t nameLength = (settings != NULL ? (size_t)(settings - spec) : strlen(spec));
+
+    *output = *defaults;
+    output->outputSpecCount = 0;
+
+    *outputFilename = strndup(spec, nameLength);
+    if (*outputFilename == NULL) {
+        return EXIT_FAILURE;
+    }
+    output->outputFilename = *outputFilename;
+
+    if (nameLength == 0) {
+        fprintf(stderr, "The output %s has no file name\n", spec);
+        return EXIT_FAILURE;
+    }
+
+    while (settings != NULL) {
+        const char* setting = settings + 1;
+        const char* value = NULL;
+        settings = strchr(setting, ',');
+        size_t length = (settings != NULL ? (size_t)(settings - setting) : strlen(setting));
+        const char* equals = memchr(setting, '=', length);
+        size_t keyLength = (equals != NULL ? (size_t)(equals - setting) : length);
+
+        if (equals != NULL) {
+            value = equals + 1;
+        }
+
+        if (keyLength == 4 && strncmp(setting, "bits", 4) == 0 && value != NULL) {
+            output->bitDepth = atoi(value);
+        } else if (keyLength == 5 && strncmp(setting, "range", 5) == 0 && value != NULL && sscanf(value, "%d-%d", &output->rangeMin, &output->rangeMax) == 2) {
+            output->paletteSlot = -1;
+            output->autoPaletteSlot = false;
+            output->tileSize = 0;
+        } else if (keyLength == 4 && strncmp(setting, "slot", 4) == 0 && value != NULL) {
+            output->autoPaletteSlot = (strncmp(value, "auto", 4) == 0);
+            output->paletteSlot = (output->autoPaletteSlot ? -1 : atoi(value));
+            output->tileSize = 0;
+        } else if (keyLength == 5 && strncmp(setting, "tiles", 5) == 0 && value != NULL) {
+            output->tileSize = atoi(value);
+            output->paletteSlot = -1;
+            output->autoPaletteSlot = false;
+        } else if (keyLength == 6 && strncmp(setting, "format", 6) == 0 && value != NULL) {
+            char name[16];
+            snprintf(name, sizeof(name), "%.*s", (int)(length - keyLength - 1), value);
+            output->format = parse_format(name);
+            if (output->format == -1) {
+                return EXIT_FAILURE;
+            }
+        } else if (keyLength == 6 && strncmp(setting, "dither", 6) == 0 && value != NULL) {
+            char name[16];
+            snprintf(name, sizeof(name), "%.*s", (int)(length - keyLength - 1), value);
+            output->dither = parse_dither(name);
+            if (output->dither == -1) {
+                return EXIT_FAILURE;
+            }
+        } else if (keyLength == 4 && strncmp(setting, "mask", 4) == 0) {
+            output->mask = true;
+            if (value != NULL) {
+                output->maskBits = atoi(value);
+            }
+        } else {
+            fprintf(stderr, "Unknown setting \"%.*s\" for output %s\n", (int)length, setting, *outputFilename);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (output->format == REMAP_FORMAT_RAW ? (output->bitDepth != 1 && output->bitDepth != 2 && output->bitDepth != 4 && output->bitDepth != 8)
+        : (output->bitDepth != 4 && output->bitDepth != 8)) {
+        fprintf(stderr, "Output %s can only have %s bits\n", *outputFilename, output->format == REMAP_FORMAT_RAW ? "1, 2, 4 or 8" : "4 or 8");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int remap_file_remote(const struct options* opts)
 {
     int result = EXIT_SUCCESS;
-    LodePNGState state;
-    lodepng_state_init(&state);
-    unsigned char* outputImage = NULL, *pngOutput = NULL;
-    unsigned char* maskFilename = NULL;
-
-    state.info_png.color.colortype = LCT_RGBA;
-    state.info_png.color.bitdepth = 8;
-    state.info_raw.colortype = LCT_RGBA;
-    state.info_raw.bitdepth = 8;
-    state.encoder.auto_convert = 0;
-
-    int bpp = lodepng_get_bpp(&state.info_raw);
-    int imageSize = (inputWidth * inputHeight * bpp + 7) / 8;
-    outputImage = (unsigned char*)calloc(imageSize, sizeof(unsigned char));
-    if (!outputImage) {
-        perror("Failed to allocate memory for image");
+    int clientSocket = -1;
+    unsigned char* paletteInput = NULL, *pngInput = NULL;
+    size_t paletteInputSize = 0, pngInputSize = 0;
+    remap_response response = { 0 };
+    stage_time stageStart;
+    remap_stats loadStats = { 0 };
+
+    if (lodepng_load_file(&paletteInput, &paletteInputSize, opts->paletteFilename)) {
+        fprintf(stderr, "Failed to read %s\n", opts->paletteFilename);
         result = EXIT_FAILURE;
-        goto mask_exit;
+        goto remap_file_remote_exit;
     }
 
-    // Iterate over the pixels in the input image
-    for (int i = 0; i < inputWidth * inputHeight * 4; i += 4) {
-        // If the pixel is not alpha (i.e., it has some color), make it white
-        if (inputImage[i + 3] != 0) {
-            outputImage[i] = 255;     // Red
-            outputImage[i + 1] = 255; // Green
-            outputImage[i + 2] = 255; // Blue
-            outputImage[i + 3] = inputImage[i + 3]; // Alpha
-        } else {
-            // If the pixel is alpha, keep it as is
-            outputImage[i] = inputImage[i];     // Red
-            outputImage[i + 1] = inputImage[i + 1]; // Green
-            outputImage[i + 2] = inputImage[i + 2]; // Blue
-            outputImage[i + 3] = inputImage[i + 3]; // Alpha
+    stats_start(&stageStart);
+    if (lodepng_load_file(&pngInput, &pngInputSize, opts->inputFilename)) {
+        fprintf(stderr, "Failed to read %s\n", opts->inputFilename);
+        result = EXIT_FAILURE;
+        goto remap_file_remote_exit;
+    }
+    stats_stop(&loadStats, REMAP_STAGE_LOAD, &stageStart);
+
+    clientSocket = remap_client_connect(opts->connectSocket);
+    if (clientSocket == -1) {
+        result = EXIT_FAILURE;
+        goto remap_file_remote_exit;
+    }
+
+    // ask by id first, the palette only has to be sent when the server hasn't seen it
+    remap_request request = {
+        .options = get_remap_options(opts),
+        .bitDepth = opts->bitDepth,
+        .maskBits = opts->mask ? opts->maskBits : REMAP_MASK_NONE,
+        .paletteId = remap_palette_id(paletteInput, paletteInputSize),
+        .png = pngInput,
+        .pngSize = pngInputSize
+    };
+
+    if (remap_client_request(clientSocket, &request, &response) == EXIT_SUCCESS && response.status == REMAP_SERVER_UNKNOWN_PALETTE) {
+        remap_response_free(&response);
+        request.paletteData = paletteInput;
+        request.paletteSize = paletteInputSize;
+        if (remap_client_request(clientSocket, &request, &response) == EXIT_FAILURE) {
+            response.status = REMAP_SERVER_ERROR;
+            strcpy(response.message, "lost connection");
         }
     }
 
-    size_t outputSize;
-    if (lodepng_encode(&pngOutput, &outputSize, outputImage, inputWidth, inputHeight, &state)) {
-        fprintf(stderr, "Encoder error: %s\n", lodepng_error_text(state.error));
+    if (response.status != REMAP_SERVER_OK) {
+        fprintf(stderr, "%s: %s\n", opts->inputFilename, response.message[0] ? response.message : "lost connection");
         result = EXIT_FAILURE;
-        goto mask_exit;
+        goto remap_file_remote_exit;
     }
 
-    maskFilename = strdup((const char *)options.outputFilename);
-    char* maskFilenameExt = strrchr(maskFilename, '.');
-    if (maskFilenameExt != NULL) {
-        strcpy(maskFilenameExt, "_mask.png");
+    stats_add(&response.output.result.stats, &loadStats);
+
+    if (save_outputs(opts, &response.output) == EXIT_FAILURE) {
+        result = EXIT_FAILURE;
+        goto remap_file_remote_exit;
     }
 
-    if (lodepng_save_file(pngOutput, outputSize, maskFilename)) {
-        fprintf(stderr, "Error saving PNG file\n");
+    print_image_report(opts, response.output.inputColorType, response.output.inputBitDepth, &response.output.result);
+
+remap_file_remote_exit:
+
+    if (clientSocket != -1) {
+        close(clientSocket);
+    }
+
+    remap_response_free(&response);
+    free(pngInput);
+    free(paletteInput);
+
+    return result;
+}
+
+int remap_file(const struct options* opts, remap_palette* remapPalette)
+{
+    if (opts->connectSocket != NULL) {
+        return remap_file_remote(opts);
+    }
+
+    if (opts->stream) {
+        return remap_file_stream(opts, remapPalette);
+    }
+
+    int result = EXIT_SUCCESS;
+    unsigned char* pngInput = NULL;
+    size_t pngInputSize = 0;
+    struct options outputOptions[REMAP_MAX_OUTPUTS];
+    char* outputFilenames[REMAP_MAX_OUTPUTS] = { NULL };
+    remap_output outputs[REMAP_MAX_OUTPUTS];
+    remap_png_result pngResults[REMAP_MAX_OUTPUTS];
+    int outputCount = 0;
+    uint64_t cacheKey = 0;
+    bool cached = false;
+    stage_time stageStart;
+    remap_stats loadStats = { 0 };
+
+    if (opts->outputFilename != NULL) {
+        outputOptions[outputCount++] = *opts;
+    }
+
+    for (int i = 0; i < opts->outputSpecCount; i++, outputCount++) {
+        if (parse_output_spec(opts->outputSpecs[i], opts, &outputOptions[outputCount], &outputFilenames[outputCount]) == EXIT_FAILURE) {
+            result = EXIT_FAILURE;
+            goto remap_file_exit;
+        }
+    }
+
+    for (int i = 0; i < outputCount; i++) {
+        outputs[i] = (remap_output) {
+            .options = get_remap_options(&outputOptions[i]),
+            .bitDepth = outputOptions[i].bitDepth,
+            .maskBits = outputOptions[i].mask ? outputOptions[i].maskBits : REMAP_MASK_NONE,
+            .format = outputOptions[i].format
+        };
+    }
+
+    stats_start(&stageStart);
+    if (lodepng_load_file(&pngInput, &pngInputSize, opts->inputFilename)) {
+        fprintf(stderr, "Failed to read %s\n", opts->inputFilename);
         result = EXIT_FAILURE;
-        goto mask_exit;
+        goto remap_file_exit;
     }
 
-mask_exit:
-    if (pngOutput != NULL)
-    {
-        free(pngOutput);
+    if (outputCache != NULL) {
+        cacheKey = output_cache_key(outputCache, outputs, outputCount, pngInput, pngInputSize);
+        cached = (output_cache_get(outputCache, cacheKey, outputCount, pngResults) == EXIT_SUCCESS);
+    }
+    stats_stop(&loadStats, REMAP_STAGE_LOAD, &stageStart);
+
+    // every output shares one decode
+    if (!cached) {
+        if (remap_job_run_png_outputs(remapPalette, outputs, outputCount, pngInput, pngInputSize, pngResults) == EXIT_FAILURE) {
+            result = EXIT_FAILURE;
+            goto remap_file_exit;
+        }
 
-        if (outputImage != NULL)
-        {
-            lodepng_state_cleanup(&state);
+        // a cache that can't be written only costs the next run a remap
+        if (outputCache != NULL && output_cache_put(outputCache, cacheKey, outputCount, pngResults) == EXIT_FAILURE) {
+            fprintf(stderr, "Warning: could not cache the outputs of %s\n", opts->inputFilename);
+        }
+    }
 
-            free(outputImage);
+    stats_add(&pngResults[0].result.stats, &loadStats);
+
+    for (int i = 0; i < outputCount; i++) {
+        if (save_outputs(&outputOptions[i], &pngResults[i]) == EXIT_FAILURE) {
+            result = EXIT_FAILURE;
+        } else {
+            print_image_report(&outputOptions[i], pngResults[i].inputColorType, pngResults[i].inputBitDepth, &pngResults[i].result);
         }
+        remap_png_result_free(&pngResults[i]);
     }
-    
-    if (maskFilename != NULL)
-    {
-        free(maskFilename);
+
+remap_file_exit:
+
+    for (int i = 0; i < outputCount; i++) {
+        free(outputFilenames[i]);
+    }
+    free(pngInput);
+
+    return result;
+}
+
+int compareFilename(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+int add_batch_input(char*** filenames, int* count, int* capacity, const char* filename)
+{
+    if (*count == *capacity) {
+        int newCapacity = *capacity ? *capacity * 2 : 64;
+        char** newFilenames = (char**)realloc(*filenames, newCapacity * sizeof(char*));
+        if (newFilenames == NULL) {
+            return EXIT_FAILURE;
+        }
+        *filenames = newFilenames;
+        *capacity = newCapacity;
+    }
+
+    (*filenames)[*count] = strdup(filename);
+    if ((*filenames)[*count] == NULL) {
+        return EXIT_FAILURE;
     }
+    (*count)++;
+
+    return EXIT_SUCCESS;
+}
+
+const char* get_output_name(const char* filename) {
+    const char* slash = strrchr(filename, '/');
+    return slash != NULL ? slash + 1 : filename;
+}
+
+int compareOutputName(const void* a, const void* b) {
+    return strcmp(get_output_name(*(char* const*) a), get_output_name(*(char* const*) b));
+}
+
+/*
+ * Every input is written to the output directory under its own file name, so
+ * two inputs with the same name would overwrite each other's outputs.
+ */
+int check_batch_output_names(char** filenames, int count)
+{
+    int result = EXIT_SUCCESS;
+
+    if (count < 2) {
+        return EXIT_SUCCESS;
+    }
+
+    char** sorted = (char**)malloc(count * sizeof(char*));
+    if (sorted == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    memcpy(sorted, filenames, count * sizeof(char*));
+    qsort(sorted, count, sizeof(char*), compareOutputName);
+
+    for (int i = 1; i < count; i++) {
+        if (compareOutputName(&sorted[i - 1], &sorted[i]) == 0) {
+            fprintf(stderr, "%s and %s would both be written to %s\n", sorted[i - 1], sorted[i], get_output_name(sorted[i]));
+            result = EXIT_FAILURE;
+        }
+    }
+
+    free(sorted);
 
     return result;
 }
 
-int quantize_image(unsigned char* inputImage, int inputWidth, int inputHeight, rgbcolor* palette, liq_image **inputLiqImage, liq_result **quantizationResult)
+/*
+ * Batch inputs are a directory (every .png inside it), a list file (one
+ * filename per line) or a glob pattern.
+ */
+int collect_batch_inputs(const char* source, char*** filenames, int* count)
 {
     int result = EXIT_SUCCESS;
+    int capacity = 0;
+    struct stat sourceStat;
 
-    liq_attr *attr = liq_attr_create();
-    if (liq_set_max_colors(attr, options.rangeMax-options.rangeMin+1) != LIQ_OK)
-    {
-        fprintf(stderr, "Failed to set max colors\n");
+    *filenames = NULL;
+    *count = 0;
+
+    if (stat(source, &sourceStat) == 0 && S_ISDIR(sourceStat.st_mode)) {
+        DIR* dir = opendir(source);
+        if (dir == NULL) {
+            perror(source);
+            return EXIT_FAILURE;
+        }
+
+        struct dirent* entry;
+        while (result == EXIT_SUCCESS && (entry = readdir(dir)) != NULL) {
+            if (strcasecmp(get_filename_ext(entry->d_name), "png") != 0) {
+                continue;
+            }
+
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+            result = add_batch_input(filenames, count, &capacity, path);
+        }
+
+        closedir(dir);
+    } else if (stat(source, &sourceStat) == 0 && strcasecmp(get_filename_ext(source), "png") != 0) {
+        FILE* file = fopen(source, "r");
+        if (file == NULL) {
+            perror(source);
+            return EXIT_FAILURE;
+        }
+
+        char line[PATH_MAX];
+        while (result == EXIT_SUCCESS && fgets(line, sizeof(line), file) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0' || line[0] == '#') {
+                continue;
+            }
+            result = add_batch_input(filenames, count, &capacity, line);
+        }
+
+        fclose(file);
+    } else {
+        glob_t globResult;
+        if (glob(source, 0, NULL, &globResult) == 0) {
+            for (size_t i = 0; result == EXIT_SUCCESS && i < globResult.gl_pathc; i++) {
+                result = add_batch_input(filenames, count, &capacity, globResult.gl_pathv[i]);
+            }
+        }
+        globfree(&globResult);
+    }
+
+    if (*count > 0) {
+        qsort(*filenames, *count, sizeof(char*), compareFilename);
+    }
+
+    if (result == EXIT_SUCCESS) {
+        result = check_batch_output_names(*filenames, *count);
+    }
+
+    return result;
+}
+
+void* batch_worker(void* arg)
+{
+    batch_queue* queue = (batch_queue*) arg;
+
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        int index = queue->nextInput++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (index >= queue->inputCount) {
+            break;
+        }
+
+        struct options imageOptions = options;
+        char outputFilename[PATH_MAX];
+
+        snprintf(outputFilename, sizeof(outputFilename), "%s/%s", options.outputFilename, get_output_name(queue->inputFilenames[index]));
+        imageOptions.inputFilename = queue->inputFilenames[index];
+        imageOptions.outputFilename = outputFilename;
+
+        int result = remap_file(&imageOptions, queue->remapPalette);
+
+        if (result == EXIT_FAILURE) {
+            pthread_mutex_lock(&queue->lock);
+            queue->failures++;
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+
+    return NULL;
+}
+
+int remap_batch(remap_palette* remapPalette)
+{
+    int result = EXIT_SUCCESS;
+    batch_queue queue = {
+        .remapPalette = remapPalette,
+    };
+    pthread_t* workers = NULL;
+    int workerCount = 0;
+    stage_time batchStart, batchEnd;
+
+    stats_start(&batchStart);
+
+    if (collect_batch_inputs(options.inputFilename, &queue.inputFilenames, &queue.inputCount) == EXIT_FAILURE) {
+        fprintf(stderr, "Failed to collect batch inputs from %s\n", options.inputFilename);
         result = EXIT_FAILURE;
-        goto quantize_image_exit;
+        goto batch_exit;
     }
 
-    if (liq_set_quality(attr, 0, 100) != LIQ_OK)
-    {
-        fprintf(stderr, "Failed to set quality\n");
+    if (queue.inputCount == 0) {
+        fprintf(stderr, "No input images found for %s\n", options.inputFilename);
         result = EXIT_FAILURE;
-        goto quantize_image_exit;
+        goto batch_exit;
     }
 
-    liq_set_log_callback(attr, libimagequant_log, NULL);
+    if (mkdir(options.outputFilename, 0755) == -1 && errno != EEXIST) {
+        perror(options.outputFilename);
+        result = EXIT_FAILURE;
+        goto batch_exit;
+    }
 
-    *inputLiqImage = liq_image_create_rgba(attr, inputImage, inputWidth, inputHeight, 0);
-    for (int i = options.rangeMin; i <= options.rangeMax; i++) {
-        if (liq_image_add_fixed_color(*inputLiqImage, (liq_color){palette[i].R, palette[i].G, palette[i].B, 255}) != LIQ_OK) {
-            fprintf(stderr, "Failed to add color to image\n");
-            result = EXIT_FAILURE;
-            goto quantize_image_exit;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    int jobs = MIN(options.jobs, queue.inputCount);
+    workers = (pthread_t*)malloc(jobs * sizeof(pthread_t));
+    if (workers == NULL) {
+        perror("Failed to allocate memory for workers");
+        result = EXIT_FAILURE;
+        goto batch_exit;
+    }
+
+    // unless told otherwise the workers split the cores between them
+    if (options.threads <= 0) {
+        options.threads = MAX(1, (int)sysconf(_SC_NPROCESSORS_ONLN) / jobs);
+    }
+
+    for (; workerCount < jobs; workerCount++) {
+        if (pthread_create(&workers[workerCount], NULL, batch_worker, &queue) != 0) {
+            fprintf(stderr, "Failed to start worker thread\n");
+            break;
         }
     }
 
-    if (liq_image_quantize(*inputLiqImage, attr, quantizationResult) != LIQ_OK) {
-        fprintf(stderr, "Failed to quantize image\n");
+    if (workerCount == 0) {
+        batch_worker(&queue);
+    }
+
+    for (int i = 0; i < workerCount; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&queue.lock);
+
+    stats_start(&batchEnd);
+
+    if (options.jsonStats) {
+        printf("{\"type\": \"batch\", \"images\": %d, \"remapped\": %d, \"workers\": %d", queue.inputCount, queue.inputCount - queue.failures, MAX(workerCount, 1));
+        printf(", \"total\": {\"wall\": %.6f, \"cpu\": %.6f}, \"peakMemoryKb\": %ld}\n", batchEnd.wall - batchStart.wall, batchEnd.cpu - batchStart.cpu, stats_peak_memory_kb());
+    } else {
+        printf("batch: remapped %d of %d images using %d workers\n", queue.inputCount - queue.failures, queue.inputCount, MAX(workerCount, 1));
+    }
+
+    if (queue.failures > 0) {
         result = EXIT_FAILURE;
-        goto quantize_image_exit;
     }
 
-quantize_image_exit:
+batch_exit:
+
+    free(workers);
+
+    for (int i = 0; i < queue.inputCount; i++) {
+        free(queue.inputFilenames[i]);
+    }
+    free(queue.inputFilenames);
 
     return result;
 }
 
-int get_unique_color_palette(unsigned char* image, int width, int height, int format, rgbcolor **uniquePalette)
+/*
+ * Remaps the frames of an animation in order, each one looking up only the
+ * pixels that changed since the frame before it. The frames are collected like
+ * batch inputs, so file names must sort in frame order.
+ */
+int remap_sequence_files(remap_palette* remapPalette)
 {
-    rgbcolor *palette = (rgbcolor*) malloc(width * height * sizeof(rgbcolor));
+    int result = EXIT_SUCCESS;
+    char** inputFilenames = NULL;
+    int inputCount = 0, failures = 0;
+    remap_sequence* sequence = NULL;
+    long long pixelCount = 0, changedCount = 0;
+    stage_time sequenceStart, sequenceEnd;
 
-    for (int i = 0; i < width * height; i++) {
-        float R = (float) image[i * format + 0];
-        float G = (float) image[i * format + 1];
-        float B = (float) image[i * format + 2];
+    stats_start(&sequenceStart);
 
-        if (format == 4) {
-            float A = (float) image[i * format + 3] / 255.0f;
-            rgbacolor rgba;
-            rgbacolor_init(&rgba, R, G, B, A);
-            rgbcolor rgb;
-            rgba_to_rgb(&rgba, &rgb, NULL);
-            R = rgb.R;
-            G = rgb.G;
-            B = rgb.B;
-        }
+    if (collect_batch_inputs(options.inputFilename, &inputFilenames, &inputCount) == EXIT_FAILURE) {
+        fprintf(stderr, "Failed to collect sequence frames from %s\n", options.inputFilename);
+        result = EXIT_FAILURE;
+        goto sequence_exit;
+    }
+
+    if (inputCount == 0) {
+        fprintf(stderr, "No input images found for %s\n", options.inputFilename);
+        result = EXIT_FAILURE;
+        goto sequence_exit;
+    }
+
+    if (mkdir(options.outputFilename, 0755) == -1 && errno != EEXIST) {
+        perror(options.outputFilename);
+        result = EXIT_FAILURE;
+        goto sequence_exit;
+    }
 
-        rgbcolor_init(palette + i, R, G, B);
+    remap_options remapOptions = get_remap_options(&options);
+    sequence = remap_sequence_create(remapPalette, &remapOptions);
+    if (sequence == NULL) {
+        result = EXIT_FAILURE;
+        goto sequence_exit;
     }
 
-    qsort(palette, width * height, sizeof(rgbcolor), compareRgbcolor);
+    for (int i = 0; i < inputCount; i++) {
+        struct options frameOptions = options;
+        char outputFilename[PATH_MAX];
+        unsigned char* pngInput = NULL;
+        size_t pngInputSize = 0, changedPixels = 0;
+        remap_png_result pngResult;
+        remap_stats loadStats = { 0 };
+        stage_time stageStart;
+
+        snprintf(outputFilename, sizeof(outputFilename), "%s/%s", options.outputFilename, get_output_name(inputFilenames[i]));
+        frameOptions.inputFilename = inputFilenames[i];
+        frameOptions.outputFilename = outputFilename;
+
+        stats_start(&stageStart);
+        if (lodepng_load_file(&pngInput, &pngInputSize, frameOptions.inputFilename)) {
+            fprintf(stderr, "Failed to read %s\n", frameOptions.inputFilename);
+            failures++;
+            continue;
+        }
+        stats_stop(&loadStats, REMAP_STAGE_LOAD, &stageStart);
 
-    int paletteCount = 0;
+        if (remap_sequence_next_png(sequence, options.bitDepth, options.mask ? options.maskBits : REMAP_MASK_NONE, pngInput, pngInputSize, &pngResult, &changedPixels) == EXIT_FAILURE) {
+            free(pngInput);
+            failures++;
+            continue;
+        }
 
-    *uniquePalette = (rgbcolor*) malloc(width * height * sizeof(rgbcolor));
+        free(pngInput);
+        stats_add(&pngResult.result.stats, &loadStats);
 
-    for (int i = 0; i < width * height; i++) {
-        rgbcolor* color = palette + i;
-        float R = color->R;
-        float G = color->G;
-        float B = color->B;
-        if (i == 0) {
-            rgbcolor_init(*uniquePalette + paletteCount++, R, G, B);
+        if (save_outputs(&frameOptions, &pngResult) == EXIT_FAILURE) {
+            failures++;
         } else {
-            rgbcolor* lastColor = *uniquePalette + paletteCount - 1;
-            if (R != lastColor->R || G != lastColor->G || B != lastColor->B) {
-                rgbcolor_init(*uniquePalette + paletteCount++, R, G, B);
+            print_image_report(&frameOptions, pngResult.inputColorType, pngResult.inputBitDepth, &pngResult.result);
+            if (!options.jsonStats) {
+                printf("looked up %zu of %lld pixels\n", changedPixels, (long long)pngResult.result.width * pngResult.result.height);
             }
+            pixelCount += (long long)pngResult.result.width * pngResult.result.height;
+            changedCount += changedPixels;
         }
+
+        remap_png_result_free(&pngResult);
+    }
+
+    stats_start(&sequenceEnd);
+
+    if (options.jsonStats) {
+        printf("{\"type\": \"sequence\", \"frames\": %d, \"remapped\": %d, \"pixels\": %lld, \"lookedUp\": %lld", inputCount, inputCount - failures, pixelCount, changedCount);
+        printf(", \"total\": {\"wall\": %.6f, \"cpu\": %.6f}, \"peakMemoryKb\": %ld}\n", sequenceEnd.wall - sequenceStart.wall, sequenceEnd.cpu - sequenceStart.cpu, stats_peak_memory_kb());
+    } else {
+        printf("sequence: remapped %d of %d frames, looked up %lld of %lld pixels\n", inputCount - failures, inputCount, changedCount, pixelCount);
     }
 
-    free(palette);
+    if (failures > 0) {
+        result = EXIT_FAILURE;
+    }
+
+sequence_exit:
+
+    remap_sequence_destroy(sequence);
+
+    for (int i = 0; i < inputCount; i++) {
+        free(inputFilenames[i]);
+    }
+    free(inputFilenames);
 
-    return paletteCount;
+    return result;
 }
 
-int get_unique_color_palette_count(unsigned char* image, int width, int height, int format)
+/*
+ * The cache is keyed by the palette file's bytes, so an edited palette misses
+ * even when it parses to the same colors.
+ */
+int open_cache(const char* cacheDirectory, int cacheSizeMb)
 {
-    int paletteCount = 0;
-    rgbcolor *uniquePalette;
+    unsigned char* paletteInput = NULL;
+    size_t paletteInputSize = 0;
+
+    if (lodepng_load_file(&paletteInput, &paletteInputSize, options.paletteFilename)) {
+        fprintf(stderr, "Failed to read %s\n", options.paletteFilename);
+        return EXIT_FAILURE;
+    }
 
-    paletteCount = get_unique_color_palette(image, width, height, format, &uniquePalette);
+    int result = open_output_cache(cacheDirectory, (uint64_t)MAX(cacheSizeMb, 0) << 20, paletteInput, paletteInputSize, &outputCache);
 
-    free(uniquePalette);
+    free(paletteInput);
 
-    return paletteCount;
+    return result;
 }
 
-const char *get_color_type(LodePNGColorType colorType)
+void print_cache_stats(void)
 {
-    switch(colorType)
-    {
-    case LCT_GREY:
-        return "GREY";
-    case LCT_RGB:
-        return "RGB";
-    case LCT_PALETTE:
-        return "PALETTE";
-    case LCT_GREY_ALPHA:
-        return "GREY_ALPHA";
-    case LCT_RGBA:
-        return "RGBA";
-    }
+    OutputCacheStats cacheStats;
 
-    return "UNKNOWN";
+    output_cache_get_stats(outputCache, &cacheStats);
+
+    if (options.jsonStats) {
+        printf("{\"type\": \"cache\", \"hits\": %d, \"misses\": %d, \"evictions\": %d, \"sizeKb\": %llu}\n",
+            cacheStats.hits, cacheStats.misses, cacheStats.evictions, (unsigned long long)(cacheStats.size >> 10));
+    } else {
+        printf("cache: %d hits, %d misses, %d evicted, %llu KB used\n",
+            cacheStats.hits, cacheStats.misses, cacheStats.evictions, (unsigned long long)(cacheStats.size >> 10));
+    }
 }
 
 int main(int argc, char** argv) {
@@ -344,7 +1164,26 @@ int main(int argc, char** argv) {
         .bitDepth = 8,
         .paletteSlot = -1,
         .autoPaletteSlot = false,
-        .mask = false
+        .mask = false,
+        .maskBits = REMAP_MASK_RGBA,
+        .batch = false,
+        .sequence = false,
+        .jobs = 0,
+        .threads = 0,
+        .lutDirectory = NULL,
+        .countColors = true,
+        .stream = false,
+        .serveSocket = NULL,
+        .connectSocket = NULL,
+        .paletteCacheSize = 16,
+        .idleTimeout = 10,
+        .jsonStats = false,
+        .outputSpecCount = 0,
+        .tileSize = 0,
+        .cacheDirectory = NULL,
+        .cacheSizeMb = 1024,
+        .format = REMAP_FORMAT_PNG,
+        .dither = REMAP_DITHER_NONE
     };
 
     static struct option long_options[] = {
@@ -352,18 +1191,61 @@ int main(int argc, char** argv) {
         {"bits", required_argument, 0, 'b'},
         {"slot", required_argument, 0, 's'},
         {"mask", no_argument, 0, 'm'},
+        {"mask-bits", required_argument, 0, 'M'},
+        {"batch", no_argument, 0, 'B'},
+        {"sequence", no_argument, 0, 'Q'},
+        {"jobs", required_argument, 0, 'j'},
+        {"threads", required_argument, 0, 'J'},
+        {"lut", required_argument, 0, 'l'},
+        {"no-count", no_argument, 0, 'n'},
+        {"stream", no_argument, 0, 'S'},
+        {"serve", required_argument, 0, 'L'},
+        {"connect", required_argument, 0, 'c'},
+        {"palette-cache", required_argument, 0, 'C'},
+        {"idle-timeout", required_argument, 0, 'I'},
+        {"stats", required_argument, 0, 'T'},
+        {"output", required_argument, 0, 'o'},
+        {"tiles", required_argument, 0, 't'},
+        {"format", required_argument, 0, 'f'},
+        {"dither", required_argument, 0, 'd'},
+        {"cache", required_argument, 0, 'k'},
+        {"cache-size", required_argument, 0, 'K'},
         {0, 0, 0, 0}
     };
 
     const char *usage_str = 
         "Usage: %s [options] <inputFilename> <paletteFilename> <outputFilename>\n"
+        "       %s [options] <inputFilename> <paletteFilename> [outputFilename] -o <output[:settings]>...\n"
+        "       %s [options] --batch <inputDirectory|listFile|glob> <paletteFilename> <outputDirectory>\n"
+        "       %s [options] --sequence <inputDirectory|listFile|glob> <paletteFilename> <outputDirectory>\n"
+        "       %s [options] --serve <socketPath>\n"
         "  -r --range min-max  Use a range of colors from the palette\n"
-        "  -b --bits 4|8       Bit depth of png output (default 8)\n"
+        "  -b --bits n         Bit depth of the output, 4 or 8 (default 8), raw also 1 or 2\n"
+        "  -f --format name    Output format: png (default), raw, or snes, gba or genesis 4 bit tiles\n"
         "  -s --slot n|auto    16 color palette slot\n"
-        "  -m --mask           Generate a mask file\n";
+        "  -t --tiles n        Pick the best slot for every n x n tile and write the slots to <output>_attr.bin\n"
+        "  -d --dither name    Ordered dithering: none (default), bayer2, bayer4, bayer8 or bluenoise\n"
+        "  -m --mask           Generate a mask file\n"
+        "  -M --mask-bits 1|8|32  Write the mask as 1 or 8 bit grey, or RGBA (default 32)\n"
+        "  -B --batch          Remap many images against one palette\n"
+        "  -Q --sequence       Remap animation frames in order, reusing unchanged pixels of the previous frame\n"
+        "  -j --jobs n         Number of batch worker threads (default: number of cores)\n"
+        "  -J --threads n      Threads each image may use (default: the cores divided between the jobs)\n"
+        "  -l --lut dir        Cache per-palette color lookup tables in dir\n"
+        "  -n --no-count       Don't count the colors of the input image\n"
+        "  -S --stream         Remap band by band with bounded memory (fixed palettes only)\n"
+        "  -L --serve path     Serve remap requests on a Unix domain socket\n"
+        "  -c --connect path   Remap through a server instead of in this process\n"
+        "  -C --palette-cache n  Number of palettes a server keeps parsed (default 16)\n"
+        "  -I --idle-timeout s  Seconds a server waits for the next request on a connection (default 10, 0 forever)\n"
+        "  -k --cache dir      Reuse the outputs of inputs remapped before with the same palette and options\n"
+        "  -K --cache-size mb  Size the output cache is kept under (default 1024)\n"
+        "  -T --stats json     Report each image as a line of JSON with per-stage timings\n"
+        "  -o --output file[:settings]  Write another output of the same input, settings are\n"
+        "                      bits=n, format=name, dither=name, range=min-max, slot=n|auto, tiles=n and mask[=1|8|32], comma separated\n";
 
     int option;
-    while ((option = getopt_long(argc, argv, "r:b:s:m", long_options, NULL)) != -1) {
+    while ((option = getopt_long(argc, argv, "r:b:s:t:d:mM:BQj:J:l:nSL:c:C:I:T:o:k:K:f:", long_options, NULL)) != -1) {
         switch (option) {
             case 'r':
                 sscanf(optarg, "%d-%d", &options.rangeMin, &options.rangeMax);
@@ -377,23 +1259,113 @@ int main(int argc, char** argv) {
                 } else
                     options.paletteSlot = atoi(optarg);
                 break;
+            case 't':
+                options.tileSize = atoi(optarg);
+                break;
+            case 'd':
+                options.dither = parse_dither(optarg);
+                if (options.dither == -1) {
+                    return EXIT_FAILURE;
+                }
+                break;
             case 'm':
                 options.mask = true;
                 break;
+            case 'M':
+                options.mask = true;
+                options.maskBits = atoi(optarg);
+                if (options.maskBits != 1 && options.maskBits != 8 && options.maskBits != REMAP_MASK_RGBA) {
+                    fprintf(stderr, "Mask bits must be 1, 8 or 32\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'B':
+                options.batch = true;
+                break;
+            case 'Q':
+                options.sequence = true;
+                break;
+            case 'j':
+                options.jobs = atoi(optarg);
+                break;
+            case 'J':
+                options.threads = atoi(optarg);
+                break;
+            case 'l':
+                options.lutDirectory = optarg;
+                break;
+            case 'n':
+                options.countColors = false;
+                break;
+            case 'S':
+                options.stream = true;
+                break;
+            case 'L':
+                options.serveSocket = optarg;
+                break;
+            case 'c':
+                options.connectSocket = optarg;
+                break;
+            case 'C':
+                options.paletteCacheSize = atoi(optarg);
+                break;
+            case 'I':
+                options.idleTimeout = atoi(optarg);
+                break;
+            case 'o':
+                if (options.outputSpecCount == REMAP_MAX_OUTPUTS) {
+                    fprintf(stderr, "At most %d outputs can be written at once\n", REMAP_MAX_OUTPUTS);
+                    return EXIT_FAILURE;
+                }
+                options.outputSpecs[options.outputSpecCount++] = optarg;
+                break;
+            case 'f':
+                options.format = parse_format(optarg);
+                if (options.format == -1) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'k':
+                options.cacheDirectory = optarg;
+                break;
+            case 'K':
+                options.cacheSizeMb = atoi(optarg);
+                break;
+            case 'T':
+                if (strcmp(optarg, "json") != 0) {
+                    fprintf(stderr, "Unknown stats format %s, only json is supported\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                options.jsonStats = true;
+                break;
             default:
-                fprintf(stderr, usage_str, argv[0], argv[0]);
+                fprintf(stderr, usage_str, argv[0], argv[0], argv[0], argv[0], argv[0]);
                 return EXIT_FAILURE;
         }
     }
 
-    if (argc - optind < 3) {
-        fprintf(stderr, usage_str, argv[0]);
+    if (options.format == REMAP_FORMAT_RAW ? (options.bitDepth != 1 && options.bitDepth != 2 && options.bitDepth != 4 && options.bitDepth != 8)
+        : (options.bitDepth != 4 && options.bitDepth != 8)) {
+        fprintf(stderr, "Bit depth must be %s\n", options.format == REMAP_FORMAT_RAW ? "1, 2, 4 or 8" : "4 or 8");
+        return EXIT_FAILURE;
+    }
+
+    if (options.jobs <= 0) {
+        options.jobs = MAX(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    }
+
+    if (options.serveSocket != NULL) {
+        return remap_server_run(options.serveSocket, options.jobs, options.threads, options.paletteCacheSize, options.lutDirectory, options.idleTimeout);
+    }
+
+    if (argc - optind < (options.outputSpecCount > 0 ? 2 : 3)) {
+        fprintf(stderr, usage_str, argv[0], argv[0], argv[0], argv[0], argv[0]);
 
         return EXIT_FAILURE;
     }
 
     options.inputFilename = argv[optind];
-    if (access(options.inputFilename, F_OK) == -1) {
+    if (!options.batch && !options.sequence && access(options.inputFilename, F_OK) == -1) {
         fprintf(stderr, "%s cannot be found\n", options.inputFilename);
         return EXIT_FAILURE;
     }
@@ -404,43 +1376,42 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
     }
 
-    options.outputFilename = argv[optind + 2];
-    const char* paletteFileExtension = get_filename_ext(options.paletteFilename);
-    const char* outputFileExtension = get_filename_ext(options.outputFilename);
-
-    unsigned char* inputImage = NULL, *paletteImage = NULL, *outputImage = NULL, *quantizedImage = NULL;
-    unsigned char* pngInput = NULL, *pngPalette = NULL, *pngOutput = NULL;
-    int inputWidth, inputHeight;
-    size_t pngInputSize = 0;
-    LodePNGState inputState, paletteState;
-    Color* colorPalette = NULL;
-    int paletteCount = 0, transparentIndex = -1;
-    rgbcolor *outputColorPalette = NULL;
-    liq_image *inputLiqImage = NULL;
-    liq_result *quantizationResult = NULL;
+    options.outputFilename = (argc - optind > 2 ? argv[optind + 2] : NULL);
 
-    lodepng_state_init(&inputState);
+    if (options.outputSpecCount > 0 && (options.batch || options.sequence || options.stream || options.connectSocket != NULL)) {
+        fprintf(stderr, "Extra outputs can't be combined with --batch, --sequence, --stream or --connect\n");
+        return EXIT_FAILURE;
+    }
 
-    inputState.info_raw.colortype = LCT_RGBA;
-    inputState.info_raw.bitdepth = 8;
+    if (options.sequence && (options.batch || options.stream || options.connectSocket != NULL || options.tileSize != 0)) {
+        fprintf(stderr, "--sequence can't be combined with --batch, --stream, --connect or --tiles\n");
+        return EXIT_FAILURE;
+    }
 
-    inputState.decoder.color_convert = 1;
+    if (options.sequence && options.dither != REMAP_DITHER_NONE) {
+        fprintf(stderr, "--sequence can't be combined with --dither\n");
+        return EXIT_FAILURE;
+    }
 
-    lodepng_load_file(&pngInput, &pngInputSize, options.inputFilename);
-    result = lodepng_decode(&inputImage, &inputWidth, &inputHeight, &inputState, pngInput, pngInputSize);
+    if (options.format != REMAP_FORMAT_PNG && (options.sequence || options.stream || options.connectSocket != NULL)) {
+        fprintf(stderr, "--format can't be combined with --sequence, --stream or --connect\n");
+        return EXIT_FAILURE;
+    }
 
-    if(result)
-    {
-        printf("Decoder error %u: %s\n", result, lodepng_error_text(result));
-        result = EXIT_FAILURE;
-        goto main_exit;
+    if (options.cacheDirectory != NULL && (options.sequence || options.stream || options.connectSocket != NULL)) {
+        fprintf(stderr, "--cache can't be combined with --sequence, --stream or --connect\n");
+        return EXIT_FAILURE;
     }
 
-    LodePNGColorMode* color = &inputState.info_png.color;
-    const char *colorType = get_color_type(color->colortype);
-    int inputPaletteCount = (color->colortype == LCT_PALETTE ? color->palettesize : get_unique_color_palette_count(inputImage, inputWidth, inputHeight, 4));
+    if (options.outputSpecCount + (options.outputFilename != NULL) > REMAP_MAX_OUTPUTS) {
+        fprintf(stderr, "At most %d outputs can be written at once\n", REMAP_MAX_OUTPUTS);
+        return EXIT_FAILURE;
+    }
+    const char* paletteFileExtension = get_filename_ext(options.paletteFilename);
 
-    printf("input: %s %dx%d (%s format, %d bits)\n", options.inputFilename, inputWidth, inputHeight, colorType, color->bitdepth);
+    Color* colorPalette = NULL;
+    int paletteCount = 0, transparentIndex = -1;
+    remap_palette *remapPalette = NULL;
 
 	if (strcmp(paletteFileExtension, "act") == 0) {
 		read_palette(options.paletteFilename, &colorPalette, &paletteCount, &transparentIndex);
@@ -458,120 +1429,59 @@ int main(int argc, char** argv) {
         goto main_exit;
 	}
 
-    int outputColorPaletteCount = paletteCount;
-
-    outputColorPalette = (rgbcolor*)malloc(paletteCount * sizeof(rgbcolor));
-    for (int i = 0; i < paletteCount; i++) {
-        float R = (float) colorPalette[i].R;
-        float G = (float) colorPalette[i].G;
-        float B = (float) colorPalette[i].B;
-        rgbcolor_init(outputColorPalette + i, R, G, B);
-    }
-
-    double min_error = DBL_MAX;
-
-    if (options.autoPaletteSlot) {
-        options.bitDepth = 4;
-
-        for (int i = 0; i < 16; i++) {
-            options.rangeMin = i * 16;
-            options.rangeMax = options.rangeMin + 15;
-            
-            if (quantize_image(inputImage, inputWidth, inputHeight, outputColorPalette, &inputLiqImage, &quantizationResult) == EXIT_FAILURE) {
-                result = EXIT_FAILURE;
-                goto main_exit;
-            }
-
-            if (quantizationResult->palette_error < min_error) {
-                min_error = quantizationResult->palette_error;
-                options.paletteSlot = i;
-            }
-
-            liq_result_destroy(quantizationResult);
-            liq_image_destroy(inputLiqImage);
-
-            quantizationResult = NULL;
-            inputLiqImage = NULL;
+    // the server parses the palette and checks the options
+    if (options.connectSocket != NULL) {
+        if (options.stream) {
+            fprintf(stderr, "Streaming isn't supported through a server\n");
+            result = EXIT_FAILURE;
+        } else {
+            result = options.batch ? remap_batch(NULL) : remap_file(&options, NULL);
         }
+        goto main_exit;
     }
 
-    if (options.paletteSlot != -1)
-    {
-        options.bitDepth = 4;
-        options.rangeMin = options.paletteSlot * 16;
-        options.rangeMax = options.rangeMin + 15;
-
-        printf("paletteSlot: %d\n", options.paletteSlot);
-    }
-
-    if (options.rangeMax == -1) {
-        options.rangeMax = outputColorPaletteCount - 1;
+    // the palette and its fixed palette searches are shared read-only by every image
+    remapPalette = remap_palette_create(colorPalette, paletteCount);
+    if (remapPalette == NULL || remap_palette_set_lut_directory(remapPalette, options.lutDirectory) == EXIT_FAILURE) {
+        result = EXIT_FAILURE;
+        goto main_exit;
     }
 
-    if (quantize_image(inputImage, inputWidth, inputHeight, outputColorPalette, &inputLiqImage, &quantizationResult) == EXIT_FAILURE) {
+    remap_options remapOptions = get_remap_options(&options);
+    if (remap_options_resolve(remapPalette, &remapOptions) == EXIT_FAILURE) {
         result = EXIT_FAILURE;
         goto main_exit;
     }
 
-    quantizedImage = (unsigned char*)malloc(inputWidth * inputHeight);
-
-    if (liq_write_remapped_image(quantizationResult, inputLiqImage, quantizedImage, inputWidth * inputHeight) != LIQ_OK) {
-        fprintf(stderr, "Failed to write remapped image\n");
+    if (options.stream && (options.autoPaletteSlot || options.tileSize != 0)) {
+        fprintf(stderr, "Automatic palette slots and tiles need the whole image and can't be streamed\n");
         result = EXIT_FAILURE;
         goto main_exit;
     }
 
-    const liq_palette *palette = liq_get_palette(quantizationResult);
-    const liq_remapping_result *mappingResult = quantizationResult->remapping;
-    int quality_percent = liq_get_quantization_quality(quantizationResult);
-
-    printf("remapped image from %d to %d colors...MSE=%.3f (Q=%d)\n", inputPaletteCount, palette->count, mappingResult->palette_error, quality_percent);
-
-    if (write_image(quantizedImage, inputWidth, inputHeight, outputColorPalette, outputColorPaletteCount) == EXIT_FAILURE) {
+    if (options.cacheDirectory != NULL && open_cache(options.cacheDirectory, options.cacheSizeMb) == EXIT_FAILURE) {
         result = EXIT_FAILURE;
         goto main_exit;
     }
 
-    if (options.mask) {
-        if (write_image_mask(inputImage, inputWidth, inputHeight) == EXIT_FAILURE) {
-            result = EXIT_FAILURE;
-            goto main_exit;
-        }
+    if (options.sequence) {
+        result = remap_sequence_files(remapPalette);
+    } else if (options.batch) {
+        result = remap_batch(remapPalette);
+    } else {
+        result = remap_file(&options, remapPalette);
     }
 
-main_exit:
-
-    free(quantizedImage);
-    free(colorPalette);
-    free(outputColorPalette);
-
-    liq_result_destroy(quantizationResult);
-    liq_image_destroy(inputLiqImage);
-
-    if (pngInput != NULL)
-    {
-        free(pngInput);
-
-        if (inputImage != NULL)
-        {
-            lodepng_state_cleanup(&inputState);
-
-            free(inputImage);
-        }
+    if (outputCache != NULL) {
+        print_cache_stats();
     }
 
-    if (pngPalette != NULL)
-    {
-        free(pngPalette);
-
-        if (paletteImage != NULL)
-        {
-            lodepng_state_cleanup(&paletteState);
+main_exit:
 
-            free(paletteImage);
-        }
-    }
+    close_output_cache(outputCache);
+    free(colorPalette);
 
+    remap_palette_destroy(remapPalette);
 
-    return EXIT_SUCCESS;
+    return result;
 }
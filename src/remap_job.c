@@ -0,0 +1,1299 @@
+/*
+ * remap_job.c
+ *
+ *  Reentrant remapping of in-memory RGBA images to a fixed palette.
+ *
+ *  The palette keeps one libimagequant fixed result (and optionally a lookup
+ *  table) per color range and dithering mode, created on first use under the palette's lock and
+ *  read-only afterwards, so jobs on the same palette share them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "remap_job.h"
+#include "libimagequant.h"
+#include "lut.h"
+
+typedef struct remap_fixed_palette {
+    int rangeMin;
+    int rangeMax;
+    int dither;
+    liq_result* result;
+    PaletteLut* lut;
+    struct remap_fixed_palette* next;
+} remap_fixed_palette;
+
+struct remap_palette {
+    Color* colors;
+    int colorCount;
+    liq_attr* attr;
+    char* lutDirectory;
+    pthread_mutex_t lock;
+    remap_fixed_palette* fixedPalettes;
+};
+
+remap_palette* remap_palette_create(const Color* colors, int colorCount)
+{
+    if (colors == NULL || colorCount < 1 || colorCount > 256) {
+        fprintf(stderr, "A palette must have 1-256 colors\n");
+        return NULL;
+    }
+
+    remap_palette* palette = (remap_palette*)calloc(1, sizeof(remap_palette));
+    if (palette == NULL) {
+        return NULL;
+    }
+
+    palette->colors = (Color*)malloc(colorCount * sizeof(Color));
+    palette->colorCount = colorCount;
+    palette->attr = liq_attr_create();
+
+    if (palette->colors == NULL || palette->attr == NULL || liq_set_quality(palette->attr, 0, 100) != LIQ_OK) {
+        fprintf(stderr, "Failed to create quantization attributes\n");
+        liq_attr_destroy(palette->attr);
+        free(palette->colors);
+        free(palette);
+        return NULL;
+    }
+
+    memcpy(palette->colors, colors, colorCount * sizeof(Color));
+    pthread_mutex_init(&palette->lock, NULL);
+
+    return palette;
+}
+
+/*
+ * Opaque pixels are then remapped through per-range lookup tables that are
+ * built once and memory-mapped from the cache directory afterwards.
+ */
+int remap_palette_set_lut_directory(remap_palette* palette, const char* cacheDirectory)
+{
+    char* lutDirectory = NULL;
+
+    if (cacheDirectory != NULL && (lutDirectory = strdup(cacheDirectory)) == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    pthread_mutex_lock(&palette->lock);
+    free(palette->lutDirectory);
+    palette->lutDirectory = lutDirectory;
+    pthread_mutex_unlock(&palette->lock);
+
+    return EXIT_SUCCESS;
+}
+
+void remap_palette_destroy(remap_palette* palette)
+{
+    if (palette == NULL) {
+        return;
+    }
+
+    remap_fixed_palette* fixedPalette = palette->fixedPalettes;
+    while (fixedPalette != NULL) {
+        remap_fixed_palette* next = fixedPalette->next;
+        liq_result_destroy(fixedPalette->result);
+        close_palette_lut(fixedPalette->lut);
+        free(fixedPalette);
+        fixedPalette = next;
+    }
+
+    pthread_mutex_destroy(&palette->lock);
+    liq_attr_destroy(palette->attr);
+    free(palette->lutDirectory);
+    free(palette->colors);
+    free(palette);
+}
+
+static const liq_dither_mode ditherModes[] = {
+    [REMAP_DITHER_BAYER2] = LIQ_DITHER_BAYER_2X2,
+    [REMAP_DITHER_BAYER4] = LIQ_DITHER_BAYER_4X4,
+    [REMAP_DITHER_BAYER8] = LIQ_DITHER_BAYER_8X8,
+    [REMAP_DITHER_BLUE_NOISE] = LIQ_DITHER_BLUE_NOISE
+};
+
+static remap_fixed_palette* create_fixed_palette(remap_palette* palette, int rangeMin, int rangeMax, int dither)
+{
+    liq_color colors[256];
+    int colorCount = rangeMax - rangeMin + 1;
+
+    for (int i = 0; i < colorCount; i++) {
+        const Color* color = palette->colors + rangeMin + i;
+        colors[i] = (liq_color){color->R, color->G, color->B, 255};
+    }
+
+    remap_fixed_palette* fixedPalette = (remap_fixed_palette*)calloc(1, sizeof(remap_fixed_palette));
+    if (fixedPalette == NULL) {
+        return NULL;
+    }
+
+    fixedPalette->rangeMin = rangeMin;
+    fixedPalette->rangeMax = rangeMax;
+    fixedPalette->dither = dither;
+    fixedPalette->result = liq_result_create_fixed(palette->attr, colors, colorCount, 0);
+
+    if (fixedPalette->result == NULL) {
+        fprintf(stderr, "Failed to create fixed palette\n");
+        free(fixedPalette);
+        return NULL;
+    }
+
+    // the result is shared read-only once published, so its dithering is set now
+    if (dither != REMAP_DITHER_NONE
+        && (liq_set_dithering_mode(fixedPalette->result, ditherModes[dither]) != LIQ_OK || liq_set_dithering_level(fixedPalette->result, 1.0f) != LIQ_OK)) {
+        fprintf(stderr, "Failed to set up dithering\n");
+        liq_result_destroy(fixedPalette->result);
+        free(fixedPalette);
+        return NULL;
+    }
+
+    // dithered pixels aren't looked up, so they don't need a table
+    if (palette->lutDirectory != NULL && dither == REMAP_DITHER_NONE) {
+        if (open_palette_lut(palette->lutDirectory, fixedPalette->result, &fixedPalette->lut) == EXIT_FAILURE) {
+            fprintf(stderr, "Failed to open lookup table in %s\n", palette->lutDirectory);
+            liq_result_destroy(fixedPalette->result);
+            free(fixedPalette);
+            return NULL;
+        }
+
+        liq_result_set_lut(fixedPalette->result, fixedPalette->lut->table, LIQ_LUT_SIZE);
+    }
+
+    return fixedPalette;
+}
+
+static liq_result* get_fixed_result(remap_palette* palette, int rangeMin, int rangeMax, int dither)
+{
+    remap_fixed_palette* fixedPalette;
+
+    pthread_mutex_lock(&palette->lock);
+
+    for (fixedPalette = palette->fixedPalettes; fixedPalette != NULL; fixedPalette = fixedPalette->next) {
+        if (fixedPalette->rangeMin == rangeMin && fixedPalette->rangeMax == rangeMax && fixedPalette->dither == dither) {
+            break;
+        }
+    }
+
+    if (fixedPalette == NULL && (fixedPalette = create_fixed_palette(palette, rangeMin, rangeMax, dither)) != NULL) {
+        fixedPalette->next = palette->fixedPalettes;
+        palette->fixedPalettes = fixedPalette;
+    }
+
+    pthread_mutex_unlock(&palette->lock);
+
+    return fixedPalette != NULL ? fixedPalette->result : NULL;
+}
+
+void remap_options_init(remap_options* options)
+{
+    *options = (remap_options) {
+        .rangeMin = 0,
+        .rangeMax = -1,
+        .paletteSlot = -1,
+        .countColors = true,
+        .tileSize = 0,
+        .threads = 0,
+        .dither = REMAP_DITHER_NONE
+    };
+}
+
+/*
+ * Checks the options against the palette and resolves them: the end of the
+ * range is filled in and a fixed slot replaces the range.
+ */
+int remap_options_resolve(const remap_palette* palette, remap_options* options)
+{
+    if (options->rangeMax == -1) {
+        options->rangeMax = palette->colorCount - 1;
+    }
+
+    if (options->dither < REMAP_DITHER_NONE || options->dither > REMAP_DITHER_BLUE_NOISE) {
+        fprintf(stderr, "Unknown dithering mode %d\n", options->dither);
+        return EXIT_FAILURE;
+    }
+
+    if (options->tileSize != 0) {
+        if (options->tileSize < 1 || options->tileSize > REMAP_MAX_TILE_SIZE) {
+            fprintf(stderr, "Tiles must be between 1 and %d pixels\n", REMAP_MAX_TILE_SIZE);
+            return EXIT_FAILURE;
+        }
+        if (palette->colorCount < REMAP_SLOT_SIZE) {
+            fprintf(stderr, "The palette needs at least 16 colors to select a slot\n");
+            return EXIT_FAILURE;
+        }
+        if (options->paletteSlot != -1) {
+            fprintf(stderr, "Tiles select their own slots and can't be given one\n");
+            return EXIT_FAILURE;
+        }
+
+        // tiles can use any of the slots
+        options->rangeMin = 0;
+        options->rangeMax = MIN(REMAP_MAX_SLOTS, palette->colorCount / REMAP_SLOT_SIZE) * REMAP_SLOT_SIZE - 1;
+        return EXIT_SUCCESS;
+    }
+
+    if (options->paletteSlot == REMAP_SLOT_AUTO && palette->colorCount < REMAP_SLOT_SIZE) {
+        fprintf(stderr, "The palette needs at least 16 colors to select a slot\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options->paletteSlot != -1 && options->paletteSlot != REMAP_SLOT_AUTO
+        && (options->paletteSlot < 0 || options->paletteSlot * REMAP_SLOT_SIZE + REMAP_SLOT_SIZE - 1 >= palette->colorCount)) {
+        fprintf(stderr, "Palette slot %d is outside of the %d color palette\n", options->paletteSlot, palette->colorCount);
+        return EXIT_FAILURE;
+    }
+
+    if (options->rangeMin < 0 || options->rangeMax >= palette->colorCount || options->rangeMin >= options->rangeMax) {
+        fprintf(stderr, "Range %d-%d is outside of the %d color palette\n", options->rangeMin, options->rangeMax, palette->colorCount);
+        return EXIT_FAILURE;
+    }
+
+    if (options->paletteSlot >= 0) {
+        options->rangeMin = options->paletteSlot * REMAP_SLOT_SIZE;
+        options->rangeMax = options->rangeMin + REMAP_SLOT_SIZE - 1;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Scores every 16 color slot of the palette against one histogram of the image
+ * and picks the first one with the lowest error.
+ */
+static int select_palette_slot(remap_palette* palette, liq_image* image, remap_result* result)
+{
+    liq_color slotColors[REMAP_MAX_SLOTS * REMAP_SLOT_SIZE];
+    int slotCount = MIN(REMAP_MAX_SLOTS, palette->colorCount / REMAP_SLOT_SIZE);
+
+    for (int i = 0; i < slotCount * REMAP_SLOT_SIZE; i++) {
+        slotColors[i] = (liq_color){palette->colors[i].R, palette->colors[i].G, palette->colors[i].B, 255};
+    }
+
+    if (liq_image_score_fixed_palettes(image, palette->attr, slotColors, REMAP_SLOT_SIZE, slotCount, result->slotErrors) != LIQ_OK) {
+        fprintf(stderr, "Failed to score palette slots\n");
+        return EXIT_FAILURE;
+    }
+
+    double minError = DBL_MAX;
+
+    result->slotCount = slotCount;
+    for (int i = 0; i < slotCount; i++) {
+        if (result->slotErrors[i] < minError) {
+            minError = result->slotErrors[i];
+            result->paletteSlot = i;
+        }
+    }
+
+    result->rangeMin = result->paletteSlot * REMAP_SLOT_SIZE;
+    result->rangeMax = result->rangeMin + REMAP_SLOT_SIZE - 1;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Runs task on count argument structs laid out argSize bytes apart, each on a
+ * thread of its own except the first, which runs on the calling thread. Tasks
+ * whose thread can't be started run on the calling thread too.
+ */
+static void run_in_parallel(void* (*task)(void*), void* args, size_t argSize, int count)
+{
+    pthread_t* threads = (count > 1 ? (pthread_t*)malloc(count * sizeof(pthread_t)) : NULL);
+    bool* started = (count > 1 ? (bool*)calloc(count, sizeof(bool)) : NULL);
+
+    for (int i = 1; i < count && threads != NULL && started != NULL; i++) {
+        started[i] = (pthread_create(&threads[i], NULL, task, (char*)args + i * argSize) == 0);
+    }
+
+    task(args);
+
+    for (int i = 1; i < count; i++) {
+        if (threads != NULL && started != NULL && started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            task((char*)args + i * argSize);
+        }
+    }
+
+    free(threads);
+    free(started);
+}
+
+typedef struct {
+    remap_palette* palette;
+    liq_image* image;
+    const unsigned char* rgbaImage;
+    remap_options options;
+    remap_result* result;
+    int status;
+} remap_task;
+
+typedef struct {
+    remap_palette* palette;
+    const unsigned char* rgbaImage;
+    remap_result* result;
+    int dither;
+    int slotCount;
+    int firstTileRow;
+    int tileRowStep;
+    double error;
+    int status;
+} tile_task;
+
+/*
+ * Picks the slot of every tile in rows firstTileRow, firstTileRow + tileRowStep,
+ * ... by scoring all slots against the tile's own histogram, like
+ * REMAP_SLOT_AUTO does for a whole image, then remaps the tile to that slot.
+ * Tiles are libimagequant images whose rows point into the whole image, so
+ * ordered dithering starts over at the corner of every tile.
+ */
+static void* tile_task_run(void* arg)
+{
+    tile_task* task = (tile_task*)arg;
+    remap_result* result = task->result;
+    int tileSize = result->tileSize, width = result->width;
+    liq_color slotColors[REMAP_MAX_SLOTS * REMAP_SLOT_SIZE];
+    liq_result* slotResults[REMAP_MAX_SLOTS] = { NULL };
+    void* tileRows[REMAP_MAX_TILE_SIZE];
+    unsigned char* outputRows[REMAP_MAX_TILE_SIZE];
+    double tileErrors[REMAP_MAX_SLOTS];
+
+    task->status = EXIT_FAILURE;
+    task->error = 0;
+
+    for (int i = 0; i < task->slotCount * REMAP_SLOT_SIZE; i++) {
+        slotColors[i] = (liq_color){task->palette->colors[i].R, task->palette->colors[i].G, task->palette->colors[i].B, 255};
+    }
+
+    for (int tileY = task->firstTileRow; tileY < result->tilesHigh; tileY += task->tileRowStep) {
+        int top = tileY * tileSize;
+        int tileHeight = MIN(tileSize, result->height - top);
+
+        for (int tileX = 0; tileX < result->tilesWide; tileX++) {
+            int left = tileX * tileSize;
+            int tileWidth = MIN(tileSize, width - left);
+            double tileError;
+
+            for (int row = 0; row < tileHeight; row++) {
+                tileRows[row] = (void*)(task->rgbaImage + ((size_t)(top + row) * width + left) * 4);
+                outputRows[row] = result->indices + (size_t)(top + row) * width + left;
+            }
+
+            // tiles are already spread over threads, one tile doesn't need more
+            liq_image* tile = liq_image_create_rgba_rows(task->palette->attr, tileRows, tileWidth, tileHeight, 0);
+            if (tile == NULL || liq_image_set_max_threads(tile, 1) != LIQ_OK || liq_image_score_fixed_palettes(tile, task->palette->attr, slotColors, REMAP_SLOT_SIZE, task->slotCount, tileErrors) != LIQ_OK) {
+                fprintf(stderr, "Failed to score palette slots of tile %d,%d\n", tileX, tileY);
+                liq_image_destroy(tile);
+                return NULL;
+            }
+
+            int slot = 0;
+            for (int i = 1; i < task->slotCount; i++) {
+                if (tileErrors[i] < tileErrors[slot]) {
+                    slot = i;
+                }
+            }
+
+            if (slotResults[slot] == NULL) {
+                slotResults[slot] = get_fixed_result(task->palette, slot * REMAP_SLOT_SIZE, slot * REMAP_SLOT_SIZE + REMAP_SLOT_SIZE - 1, task->dither);
+            }
+
+            if (slotResults[slot] == NULL || liq_write_remapped_image_fixed_rows(slotResults[slot], tile, outputRows, &tileError) != LIQ_OK) {
+                fprintf(stderr, "Failed to write remapped tile %d,%d\n", tileX, tileY);
+                liq_image_destroy(tile);
+                return NULL;
+            }
+
+            liq_image_destroy(tile);
+
+            // indices are relative to rangeMin, which is 0 for tiles
+            for (int row = 0; row < tileHeight; row++) {
+                for (int col = 0; col < tileWidth; col++) {
+                    outputRows[row][col] += slot * REMAP_SLOT_SIZE;
+                }
+            }
+
+            result->tileSlots[tileY * result->tilesWide + tileX] = slot;
+            task->error += tileError * tileWidth * tileHeight;
+        }
+    }
+
+    task->status = EXIT_SUCCESS;
+
+    return NULL;
+}
+
+/*
+ * Remaps an image tile by tile, each tile to the slot that suits it best.
+ * Rows of tiles are shared out between threads.
+ */
+static int remap_tiles(remap_palette* palette, const remap_options* options, const unsigned char* rgbaImage, remap_result* result)
+{
+    size_t pixelCount = (size_t)result->width * result->height;
+    tile_task* tasks;
+    int threadCount;
+
+    result->tileSize = options->tileSize;
+    result->tilesWide = (result->width + options->tileSize - 1) / options->tileSize;
+    result->tilesHigh = (result->height + options->tileSize - 1) / options->tileSize;
+
+    result->indices = (unsigned char*)malloc(pixelCount);
+    result->tileSlots = (unsigned char*)malloc((size_t)result->tilesWide * result->tilesHigh);
+    if (options->alpha) {
+        result->alpha = (unsigned char*)malloc(pixelCount);
+    }
+    if (result->indices == NULL || result->tileSlots == NULL || (options->alpha && result->alpha == NULL)) {
+        fprintf(stderr, "Failed to allocate memory for image\n");
+        return EXIT_FAILURE;
+    }
+
+    threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (options->threads > 0) {
+        threadCount = MIN(threadCount, options->threads);
+    }
+    threadCount = MAX(1, MIN(threadCount, result->tilesHigh));
+
+    tasks = (tile_task*)malloc(threadCount * sizeof(tile_task));
+    if (tasks == NULL) {
+        fprintf(stderr, "Failed to allocate memory for tiles\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < threadCount; i++) {
+        tasks[i] = (tile_task) {
+            .palette = palette,
+            .rgbaImage = rgbaImage,
+            .result = result,
+            .dither = options->dither,
+            .slotCount = MIN(REMAP_MAX_SLOTS, palette->colorCount / REMAP_SLOT_SIZE),
+            .firstTileRow = i,
+            .tileRowStep = threadCount,
+            .status = EXIT_FAILURE
+        };
+    }
+
+    run_in_parallel(tile_task_run, tasks, sizeof(tasks[0]), threadCount);
+
+    double remappingError = 0;
+    int status = EXIT_SUCCESS;
+    for (int i = 0; i < threadCount; i++) {
+        if (tasks[i].status == EXIT_FAILURE) {
+            status = EXIT_FAILURE;
+        }
+        remappingError += tasks[i].error;
+    }
+
+    free(tasks);
+
+    if (status == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    result->mse = remappingError / pixelCount;
+    result->quality = liq_mse_to_quality(result->mse);
+
+    if (options->alpha) {
+        for (size_t i = 0; i < pixelCount; i++) {
+            result->alpha[i] = rgbaImage[i * 4 + 3];
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static void* remap_task_run(void* arg)
+{
+    remap_task* task = (remap_task*)arg;
+    remap_result* result = task->result;
+    size_t pixelCount = (size_t)result->width * result->height;
+    stage_time stageStart;
+
+    task->status = EXIT_FAILURE;
+
+    if (task->options.tileSize != 0) {
+        stats_start(&stageStart);
+        task->status = remap_tiles(task->palette, &task->options, task->rgbaImage, result);
+        stats_stop(&result->stats, REMAP_STAGE_REMAP, &stageStart);
+        return NULL;
+    }
+
+    stats_start(&stageStart);
+    liq_result* fixedResult = get_fixed_result(task->palette, result->rangeMin, result->rangeMax, task->options.dither);
+    if (fixedResult == NULL) {
+        return NULL;
+    }
+    stats_stop(&result->stats, REMAP_STAGE_QUANTIZE, &stageStart);
+
+    stats_start(&stageStart);
+
+    result->indices = (unsigned char*)malloc(pixelCount);
+    if (task->options.alpha) {
+        result->alpha = (unsigned char*)malloc(pixelCount);
+    }
+    if (result->indices == NULL || (task->options.alpha && result->alpha == NULL)) {
+        fprintf(stderr, "Failed to allocate memory for image\n");
+        return NULL;
+    }
+
+    if (liq_write_remapped_image_fixed_alpha(fixedResult, task->image, result->indices, pixelCount, result->alpha, pixelCount, &result->mse) != LIQ_OK) {
+        fprintf(stderr, "Failed to write remapped image\n");
+        return NULL;
+    }
+
+    result->quality = liq_mse_to_quality(result->mse);
+    stats_stop(&result->stats, REMAP_STAGE_REMAP, &stageStart);
+
+    task->status = EXIT_SUCCESS;
+
+    return NULL;
+}
+
+/*
+ * Remaps one RGBA image. On success result->indices must be released with
+ * remap_result_free. Safe to call concurrently with the same palette.
+ */
+int remap_job_run(remap_palette* palette, const remap_options* options, const unsigned char* rgbaImage, int width, int height, remap_result* result)
+{
+    return remap_job_run_multi(palette, options, 1, rgbaImage, width, height, result);
+}
+
+/*
+ * Remaps one RGBA image once for each of count sets of options, into results.
+ * The color count, the slot scores and the conversion of the pixels are shared
+ * and their time is counted in the first result; the remaps themselves run in
+ * parallel, sharing the threads of the first options between them. On failure
+ * no results are returned.
+ */
+int remap_job_run_multi(remap_palette* palette, const remap_options options[], int count, const unsigned char* rgbaImage, int width, int height, remap_result results[])
+{
+    int status = EXIT_SUCCESS;
+    remap_task tasks[REMAP_MAX_OUTPUTS];
+    remap_result slotResult = { .paletteSlot = -1 };
+    liq_image* image = NULL;
+    bool countColors = false, autoSlot = false;
+    int inputColors = -1;
+    stage_time stageStart;
+
+    if (count < 1 || count > REMAP_MAX_OUTPUTS) {
+        fprintf(stderr, "Between 1 and %d outputs can be remapped at once\n", REMAP_MAX_OUTPUTS);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < count; i++) {
+        results[i] = (remap_result) {
+            .width = width,
+            .height = height,
+            .paletteSlot = -1,
+            .inputColors = -1
+        };
+    }
+
+    for (int i = 0; i < count; i++) {
+        tasks[i] = (remap_task) {
+            .palette = palette,
+            .options = options[i],
+            .result = &results[i],
+            .status = EXIT_FAILURE
+        };
+
+        if (remap_options_resolve(palette, &tasks[i].options) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+
+        results[i].rangeMin = tasks[i].options.rangeMin;
+        results[i].rangeMax = tasks[i].options.rangeMax;
+        if (tasks[i].options.paletteSlot >= 0) {
+            results[i].paletteSlot = tasks[i].options.paletteSlot;
+        }
+
+        countColors |= tasks[i].options.countColors;
+        autoSlot |= (tasks[i].options.paletteSlot == REMAP_SLOT_AUTO);
+    }
+
+    if (countColors) {
+        color_counter counter;
+        stats_start(&stageStart);
+        if (color_counter_init(&counter) == EXIT_SUCCESS && color_counter_add(&counter, rgbaImage, (size_t)width * height) == EXIT_SUCCESS) {
+            inputColors = counter.count;
+        }
+        color_counter_free(&counter);
+        stats_stop(&results[0].stats, REMAP_STAGE_COUNT_COLORS, &stageStart);
+    }
+
+    // fixed palettes need no histogram, picking the slot and the search is all the quantizing there is
+    stats_start(&stageStart);
+
+    // libimagequant only reads the pixels
+    image = liq_image_create_rgba(palette->attr, (void*)rgbaImage, width, height, 0);
+    if (image == NULL) {
+        fprintf(stderr, "Failed to create image\n");
+        status = EXIT_FAILURE;
+        goto remap_job_run_multi_exit;
+    }
+
+    // the outputs are remapped at the same time, so they split the threads
+    int threads = (options[0].threads > 0 ? options[0].threads : (int)sysconf(_SC_NPROCESSORS_ONLN));
+    liq_image_set_max_threads(image, MAX(1, threads / count));
+
+    // lookup tables skip the conversion for opaque pixels, and too large images are converted row by row
+    if (count > 1 && palette->lutDirectory == NULL) {
+        liq_image_convert_f_pixels(image);
+    }
+
+    if (autoSlot) {
+        // the histogram the slots are scored against has a stage of its own
+        stats_stop(&results[0].stats, REMAP_STAGE_QUANTIZE, &stageStart);
+        stats_start(&stageStart);
+        if (liq_image_make_histogram(image, palette->attr) != LIQ_OK) {
+            fprintf(stderr, "Failed to make the histogram of the image\n");
+            status = EXIT_FAILURE;
+            goto remap_job_run_multi_exit;
+        }
+        stats_stop(&results[0].stats, REMAP_STAGE_HISTOGRAM, &stageStart);
+        stats_start(&stageStart);
+
+        if (select_palette_slot(palette, image, &slotResult) == EXIT_FAILURE) {
+            status = EXIT_FAILURE;
+            goto remap_job_run_multi_exit;
+        }
+    }
+
+    stats_stop(&results[0].stats, REMAP_STAGE_QUANTIZE, &stageStart);
+
+    for (int i = 0; i < count; i++) {
+        tasks[i].image = image;
+        tasks[i].rgbaImage = rgbaImage;
+
+        if (tasks[i].options.countColors) {
+            results[i].inputColors = inputColors;
+        }
+
+        if (tasks[i].options.paletteSlot == REMAP_SLOT_AUTO) {
+            results[i].paletteSlot = slotResult.paletteSlot;
+            results[i].rangeMin = slotResult.rangeMin;
+            results[i].rangeMax = slotResult.rangeMax;
+            results[i].slotCount = slotResult.slotCount;
+            memcpy(results[i].slotErrors, slotResult.slotErrors, sizeof(slotResult.slotErrors));
+        }
+    }
+
+    run_in_parallel(remap_task_run, tasks, sizeof(tasks[0]), count);
+
+    for (int i = 0; i < count; i++) {
+        if (tasks[i].status == EXIT_FAILURE) {
+            status = EXIT_FAILURE;
+        }
+    }
+
+remap_job_run_multi_exit:
+
+    liq_image_destroy(image);
+
+    if (status == EXIT_FAILURE) {
+        for (int i = 0; i < count; i++) {
+            remap_result_free(&results[i]);
+        }
+    }
+
+    return status;
+}
+
+void remap_result_free(remap_result* result)
+{
+    free(result->indices);
+    free(result->alpha);
+    free(result->tileSlots);
+    result->indices = NULL;
+    result->alpha = NULL;
+    result->tileSlots = NULL;
+}
+
+typedef struct {
+    const remap_palette* palette;
+    const remap_output* output;
+    const unsigned char* rgbaImage;
+    remap_png_result* result;
+    int status;
+} encode_task;
+
+static void* encode_task_run(void* arg)
+{
+    encode_task* task = (encode_task*)arg;
+    remap_png_result* result = task->result;
+    int width = result->result.width, height = result->result.height;
+    int format = task->output->format;
+    int bitDepth = (result->result.paletteSlot != -1 || (format != REMAP_FORMAT_PNG && format != REMAP_FORMAT_RAW) ? 4 : task->output->bitDepth);
+    int maskBits = task->output->maskBits;
+    stage_time stageStart;
+
+    task->status = EXIT_FAILURE;
+
+    stats_start(&stageStart);
+
+    if (format == REMAP_FORMAT_PNG) {
+        if (remap_encode_png(task->palette, &result->result, bitDepth, &result->png, &result->pngSize) == EXIT_FAILURE) {
+            return NULL;
+        }
+    } else if (remap_encode_raw(task->palette, &result->result, format, bitDepth, &result->png, &result->pngSize) == EXIT_FAILURE) {
+        return NULL;
+    }
+
+    if (maskBits == REMAP_MASK_RGBA && remap_encode_mask_png(task->rgbaImage, width, height, &result->maskPng, &result->maskPngSize) == EXIT_FAILURE) {
+        return NULL;
+    }
+
+    if (result->result.alpha != NULL && remap_encode_alpha_mask_png(result->result.alpha, width, height, maskBits, &result->maskPng, &result->maskPngSize) == EXIT_FAILURE) {
+        return NULL;
+    }
+
+    stats_stop(&result->result.stats, REMAP_STAGE_ENCODE, &stageStart);
+
+    task->status = EXIT_SUCCESS;
+
+    return NULL;
+}
+
+/*
+ * Decodes a PNG, remaps it and encodes the result (and optionally the mask) as
+ * PNGs, all in memory. Slots are always written at 4 bits per pixel.
+ */
+int remap_job_run_png(remap_palette* palette, const remap_options* options, int bitDepth, int maskBits, const unsigned char* png, size_t pngSize, remap_png_result* result)
+{
+    remap_output output = {
+        .options = *options,
+        .bitDepth = bitDepth,
+        .maskBits = maskBits
+    };
+
+    return remap_job_run_png_outputs(palette, &output, 1, png, pngSize, result);
+}
+
+/*
+ * Like remap_job_run_png for several outputs of one PNG, which is decoded once.
+ * The outputs are remapped and encoded in parallel; the decode time is counted
+ * in the first result.
+ */
+int remap_job_run_png_outputs(remap_palette* palette, const remap_output outputs[], int outputCount, const unsigned char* png, size_t pngSize, remap_png_result results[])
+{
+    int status = EXIT_FAILURE;
+    remap_options jobOptions[REMAP_MAX_OUTPUTS];
+    remap_result jobResults[REMAP_MAX_OUTPUTS];
+    encode_task tasks[REMAP_MAX_OUTPUTS];
+    unsigned char* inputImage = NULL;
+    unsigned int inputWidth, inputHeight;
+    LodePNGState inputState;
+    remap_stats decodeStats = { 0 };
+    stage_time stageStart;
+
+    if (outputCount < 1 || outputCount > REMAP_MAX_OUTPUTS) {
+        fprintf(stderr, "Between 1 and %d outputs can be remapped at once\n", REMAP_MAX_OUTPUTS);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < outputCount; i++) {
+        results[i] = (remap_png_result) { .result = { .paletteSlot = -1, .inputColors = -1 } };
+
+        int maskBits = outputs[i].maskBits;
+        if (maskBits != REMAP_MASK_NONE && maskBits != 1 && maskBits != 8 && maskBits != REMAP_MASK_RGBA) {
+            fprintf(stderr, "Masks can only have 1, 8 or 32 bits\n");
+            return EXIT_FAILURE;
+        }
+
+        if (outputs[i].format < REMAP_FORMAT_PNG || outputs[i].format > REMAP_FORMAT_GENESIS) {
+            fprintf(stderr, "Unknown output format %d\n", outputs[i].format);
+            return EXIT_FAILURE;
+        }
+
+        if (outputs[i].format == REMAP_FORMAT_PNG && outputs[i].bitDepth != 4 && outputs[i].bitDepth != 8) {
+            fprintf(stderr, "PNG outputs can only have 4 or 8 bits per pixel\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    lodepng_state_init(&inputState);
+
+    inputState.info_raw.colortype = LCT_RGBA;
+    inputState.info_raw.bitdepth = 8;
+
+    stats_start(&stageStart);
+    unsigned int error = lodepng_decode(&inputImage, &inputWidth, &inputHeight, &inputState, png, pngSize);
+    stats_stop(&decodeStats, REMAP_STAGE_DECODE, &stageStart);
+
+    if (error) {
+        fprintf(stderr, "Decoder error %u: %s\n", error, lodepng_error_text(error));
+        goto remap_job_run_png_outputs_exit;
+    }
+
+    LodePNGColorMode* color = &inputState.info_png.color;
+
+    for (int i = 0; i < outputCount; i++) {
+        jobOptions[i] = outputs[i].options;
+
+        // a palette image's color count is known without counting
+        if (color->colortype == LCT_PALETTE) {
+            jobOptions[i].countColors = false;
+        }
+
+        // grey masks only need the alpha, which the remap picks up on its way
+        jobOptions[i].alpha = (outputs[i].maskBits != REMAP_MASK_NONE && outputs[i].maskBits != REMAP_MASK_RGBA);
+    }
+
+    if (remap_job_run_multi(palette, jobOptions, outputCount, inputImage, inputWidth, inputHeight, jobResults) == EXIT_FAILURE) {
+        goto remap_job_run_png_outputs_exit;
+    }
+
+    stats_add(&jobResults[0].stats, &decodeStats);
+
+    for (int i = 0; i < outputCount; i++) {
+        results[i].inputColorType = color->colortype;
+        results[i].inputBitDepth = color->bitdepth;
+        results[i].result = jobResults[i];
+
+        if (color->colortype == LCT_PALETTE && outputs[i].options.countColors) {
+            results[i].result.inputColors = color->palettesize;
+        }
+
+        tasks[i] = (encode_task) {
+            .palette = palette,
+            .output = &outputs[i],
+            .rgbaImage = inputImage,
+            .result = &results[i],
+            .status = EXIT_FAILURE
+        };
+    }
+
+    run_in_parallel(encode_task_run, tasks, sizeof(tasks[0]), outputCount);
+
+    status = EXIT_SUCCESS;
+    for (int i = 0; i < outputCount; i++) {
+        if (tasks[i].status == EXIT_FAILURE) {
+            status = EXIT_FAILURE;
+        }
+    }
+
+remap_job_run_png_outputs_exit:
+
+    lodepng_state_cleanup(&inputState);
+    free(inputImage);
+
+    if (status == EXIT_FAILURE) {
+        for (int i = 0; i < outputCount; i++) {
+            remap_png_result_free(&results[i]);
+        }
+    }
+
+    return status;
+}
+
+void remap_png_result_free(remap_png_result* result)
+{
+    remap_result_free(&result->result);
+    free(result->png);
+    free(result->maskPng);
+    result->png = NULL;
+    result->maskPng = NULL;
+}
+
+/*
+ * 4 bit images get just the colors of their range, 8 bit images the whole
+ * palette with indices offset by rangeMin.
+ */
+void remap_set_output_palette(const remap_palette* palette, int rangeMin, int rangeMax, int bitDepth, LodePNGColorMode* colorMode)
+{
+    int first = (bitDepth == 4 ? rangeMin : 0);
+    int last = (bitDepth == 4 ? rangeMax : palette->colorCount - 1);
+
+    for (int i = first; i <= last; i++) {
+        lodepng_palette_add(colorMode, palette->colors[i].R, palette->colors[i].G, palette->colors[i].B, 255);
+    }
+
+    colorMode->colortype = LCT_PALETTE;
+    colorMode->bitdepth = bitDepth;
+}
+
+/*
+ * Packs one row of indices into a PNG scanline, two pixels per byte (high
+ * nibble first) at 4 bits, padded to a whole byte at the end of the row.
+ * 4 bits keep the index within the slot, which is all tiles need.
+ */
+void remap_pack_row(const unsigned char* indices, int width, int rangeMin, int bitDepth, unsigned char* outputRow)
+{
+    if (bitDepth == 4) {
+        memset(outputRow, 0, (width + 1) / 2);
+        for (int i = 0; i < width; i++) {
+            outputRow[i / 2] |= (unsigned char)((indices[i] & 0x0F) << (i % 2 == 1 ? 0 : 4));
+        }
+    } else if (bitDepth == 8) {
+        for (int i = 0; i < width; i++) {
+            outputRow[i] = indices[i] + rangeMin;
+        }
+    }
+}
+
+void remap_mask_pixels(const unsigned char* rgbaPixels, unsigned char* maskPixels, size_t pixelCount)
+{
+    // Iterate over the pixels in the input image
+    for (size_t i = 0; i < pixelCount * 4; i += 4) {
+        // If the pixel is not alpha (i.e., it has some color), make it white
+        if (rgbaPixels[i + 3] != 0) {
+            maskPixels[i] = 255;     // Red
+            maskPixels[i + 1] = 255; // Green
+            maskPixels[i + 2] = 255; // Blue
+            maskPixels[i + 3] = rgbaPixels[i + 3]; // Alpha
+        } else {
+            // If the pixel is alpha, keep it as is
+            maskPixels[i] = rgbaPixels[i];     // Red
+            maskPixels[i + 1] = rgbaPixels[i + 1]; // Green
+            maskPixels[i + 2] = rgbaPixels[i + 2]; // Blue
+            maskPixels[i + 3] = rgbaPixels[i + 3]; // Alpha
+        }
+    }
+}
+
+/*
+ * Grey masks are 1 bit (visible or not) or 8 bits (the alpha itself), masks of
+ * REMAP_MASK_RGBA keep the layout remap_mask_pixels writes.
+ */
+void remap_set_mask_mode(int maskBits, LodePNGColorMode* colorMode)
+{
+    colorMode->colortype = (maskBits == REMAP_MASK_RGBA ? LCT_RGBA : LCT_GREY);
+    colorMode->bitdepth = (maskBits == 1 ? 1 : 8);
+}
+
+/*
+ * Packs one row of alpha values into a grey mask scanline, eight pixels per
+ * byte (highest bit first) at 1 bit, padded to a whole byte at the end of the row.
+ */
+void remap_pack_mask_row(const unsigned char* alpha, int width, int maskBits, unsigned char* outputRow)
+{
+    if (maskBits == 1) {
+        memset(outputRow, 0, (width + 7) / 8);
+        for (int i = 0; i < width; i++) {
+            if (alpha[i] != 0) {
+                outputRow[i / 8] |= (unsigned char)(0x80 >> (i % 8));
+            }
+        }
+    } else {
+        memcpy(outputRow, alpha, width);
+    }
+}
+
+int remap_encode_png(const remap_palette* palette, const remap_result* result, int bitDepth, unsigned char** png, size_t* pngSize)
+{
+    int status = EXIT_SUCCESS;
+    LodePNGState state;
+    size_t pixelCount = (size_t)result->width * result->height;
+    unsigned char* outputImage = NULL;
+
+    *png = NULL;
+    *pngSize = 0;
+
+    // 4 bit tiles only have room for the colors of the first slot, their attributes say which slot is meant
+    int rangeMax = (result->tileSlots != NULL && bitDepth == 4 ? result->rangeMin + REMAP_SLOT_SIZE - 1 : result->rangeMax);
+
+    lodepng_state_init(&state);
+    remap_set_output_palette(palette, result->rangeMin, rangeMax, bitDepth, &state.info_png.color);
+    remap_set_output_palette(palette, result->rangeMin, rangeMax, bitDepth, &state.info_raw);
+    state.encoder.auto_convert = 0;
+
+    // lodepng takes sub-byte pixels without padding at the end of rows
+    outputImage = (unsigned char*)calloc((pixelCount * lodepng_get_bpp(&state.info_raw) + 7) / 8, sizeof(unsigned char));
+    if (outputImage == NULL) {
+        fprintf(stderr, "Failed to allocate memory for image\n");
+        status = EXIT_FAILURE;
+        goto remap_encode_png_exit;
+    }
+
+    remap_pack_row(result->indices, pixelCount, result->rangeMin, bitDepth, outputImage);
+
+    if (lodepng_encode(png, pngSize, outputImage, result->width, result->height, &state)) {
+        fprintf(stderr, "Encoder error: %s\n", lodepng_error_text(state.error));
+        status = EXIT_FAILURE;
+    }
+
+remap_encode_png_exit:
+
+    lodepng_state_cleanup(&state);
+    free(outputImage);
+
+    return status;
+}
+
+int remap_encode_mask_png(const unsigned char* rgbaImage, int width, int height, unsigned char** png, size_t* pngSize)
+{
+    int status = EXIT_SUCCESS;
+    LodePNGState state;
+    size_t pixelCount = (size_t)width * height;
+    unsigned char* outputImage = NULL;
+
+    *png = NULL;
+    *pngSize = 0;
+
+    lodepng_state_init(&state);
+    state.info_png.color.colortype = LCT_RGBA;
+    state.info_png.color.bitdepth = 8;
+    state.info_raw.colortype = LCT_RGBA;
+    state.info_raw.bitdepth = 8;
+    state.encoder.auto_convert = 0;
+
+    outputImage = (unsigned char*)malloc(pixelCount * 4);
+    if (outputImage == NULL) {
+        fprintf(stderr, "Failed to allocate memory for image\n");
+        status = EXIT_FAILURE;
+        goto remap_encode_mask_png_exit;
+    }
+
+    remap_mask_pixels(rgbaImage, outputImage, pixelCount);
+
+    if (lodepng_encode(png, pngSize, outputImage, width, height, &state)) {
+        fprintf(stderr, "Encoder error: %s\n", lodepng_error_text(state.error));
+        status = EXIT_FAILURE;
+    }
+
+remap_encode_mask_png_exit:
+
+    lodepng_state_cleanup(&state);
+    free(outputImage);
+
+    return status;
+}
+
+int remap_encode_alpha_mask_png(const unsigned char* alpha, int width, int height, int maskBits, unsigned char** png, size_t* pngSize)
+{
+    int status = EXIT_SUCCESS;
+    LodePNGState state;
+    size_t pixelCount = (size_t)width * height;
+    unsigned char* outputImage = NULL;
+
+    *png = NULL;
+    *pngSize = 0;
+
+    lodepng_state_init(&state);
+    remap_set_mask_mode(maskBits, &state.info_png.color);
+    remap_set_mask_mode(maskBits, &state.info_raw);
+    state.encoder.auto_convert = 0;
+
+    // lodepng takes sub-byte pixels without padding at the end of rows
+    outputImage = (unsigned char*)malloc((pixelCount * maskBits + 7) / 8);
+    if (outputImage == NULL) {
+        fprintf(stderr, "Failed to allocate memory for image\n");
+        status = EXIT_FAILURE;
+        goto remap_encode_alpha_mask_png_exit;
+    }
+
+    remap_pack_mask_row(alpha, pixelCount, maskBits, outputImage);
+
+    if (lodepng_encode(png, pngSize, outputImage, width, height, &state)) {
+        fprintf(stderr, "Encoder error: %s\n", lodepng_error_text(state.error));
+        status = EXIT_FAILURE;
+    }
+
+remap_encode_alpha_mask_png_exit:
+
+    lodepng_state_cleanup(&state);
+    free(outputImage);
+
+    return status;
+}
+
+static void write_le16(unsigned char* bytes, unsigned int value)
+{
+    bytes[0] = (unsigned char)value;
+    bytes[1] = (unsigned char)(value >> 8);
+}
+
+static void write_le32(unsigned char* bytes, unsigned int value)
+{
+    write_le16(bytes, value & 0xFFFF);
+    write_le16(bytes + 2, value >> 16);
+}
+
+/*
+ * Packs one 8x8 tile of 4 bit indices. SNES tiles hold bit planes 0 and 1
+ * interleaved row by row followed by planes 2 and 3, GBA tiles two pixels per
+ * byte with the left one in the low nibble, and Genesis tiles two pixels per
+ * byte with the left one in the high nibble. Pixels past the edge of the image
+ * are index 0.
+ */
+static void pack_tile(const remap_result* result, int format, int tileX, int tileY, unsigned char* tile)
+{
+    memset(tile, 0, REMAP_RAW_TILE_BYTES);
+
+    for (int y = 0; y < 8; y++) {
+        int imageY = tileY * 8 + y;
+
+        for (int x = 0; x < 8; x++) {
+            int imageX = tileX * 8 + x;
+            int index = 0;
+
+            if (imageX < result->width && imageY < result->height) {
+                index = result->indices[(size_t)imageY * result->width + imageX] & 0x0F;
+            }
+
+            switch (format) {
+            case REMAP_FORMAT_SNES:
+                for (int plane = 0; plane < 4; plane++) {
+                    if (index & (1 << plane)) {
+                        tile[(plane / 2) * 16 + y * 2 + (plane % 2)] |= (unsigned char)(0x80 >> x);
+                    }
+                }
+                break;
+            case REMAP_FORMAT_GBA:
+                tile[y * 4 + x / 2] |= (unsigned char)(index << (x % 2 == 1 ? 4 : 0));
+                break;
+            case REMAP_FORMAT_GENESIS:
+                tile[y * 4 + x / 2] |= (unsigned char)(index << (x % 2 == 1 ? 0 : 4));
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Writes the indices without PNG encoding: a REMAP_RAW_HEADER_SIZE byte header,
+ * the RGB palette and the pixel data. REMAP_FORMAT_RAW packs rows of 1, 2, 4 or
+ * 8 bits per pixel, highest bits first, each row starting on a whole byte. The
+ * tile formats are always 4 bits, 8x8 tiles row by row. Below 8 bits the
+ * palette and the indices are those of the range (or of the slot, for tiles),
+ * at 8 bits they are the whole palette's, like remap_encode_png.
+ */
+int remap_encode_raw(const remap_palette* palette, const remap_result* result, int format, int bitDepth, unsigned char** data, size_t* dataSize)
+{
+    int first = (bitDepth == 8 ? 0 : result->rangeMin);
+    int last = (bitDepth == 8 ? palette->colorCount - 1 : result->tileSlots != NULL ? result->rangeMin + REMAP_SLOT_SIZE - 1 : result->rangeMax);
+    int tilesWide = (result->width + 7) / 8, tilesHigh = (result->height + 7) / 8;
+    size_t rowSize = ((size_t)result->width * bitDepth + 7) / 8;
+    size_t pixelSize = (format == REMAP_FORMAT_RAW ? rowSize * result->height : (size_t)tilesWide * tilesHigh * REMAP_RAW_TILE_BYTES);
+
+    *data = NULL;
+    *dataSize = 0;
+
+    if (format < REMAP_FORMAT_RAW || format > REMAP_FORMAT_GENESIS || (format == REMAP_FORMAT_RAW ? (bitDepth != 1 && bitDepth != 2 && bitDepth != 4 && bitDepth != 8) : bitDepth != 4)) {
+        fprintf(stderr, "Raw outputs can have 1, 2, 4 or 8 bits and tiles only 4\n");
+        return EXIT_FAILURE;
+    }
+
+    if (last - first + 1 > (1 << bitDepth)) {
+        fprintf(stderr, "%d colors don't fit in %d bits\n", last - first + 1, bitDepth);
+        return EXIT_FAILURE;
+    }
+
+    int colorCount = last - first + 1;
+    size_t headerSize = REMAP_RAW_HEADER_SIZE + (size_t)colorCount * 3;
+
+    *data = (unsigned char*)calloc(headerSize + pixelSize, 1);
+    if (*data == NULL) {
+        fprintf(stderr, "Failed to allocate memory for image\n");
+        return EXIT_FAILURE;
+    }
+
+    unsigned char* header = *data;
+    memcpy(header, "RMAP", 4);
+    header[4] = REMAP_RAW_VERSION;
+    header[5] = (unsigned char)format;
+    header[6] = (unsigned char)bitDepth;
+    write_le32(header + 8, result->width);
+    write_le32(header + 12, result->height);
+    write_le16(header + 16, colorCount);
+    write_le16(header + 18, first);
+
+    for (int i = 0; i < colorCount; i++) {
+        const Color* color = &palette->colors[first + i];
+        header[REMAP_RAW_HEADER_SIZE + i * 3] = color->R;
+        header[REMAP_RAW_HEADER_SIZE + i * 3 + 1] = color->G;
+        header[REMAP_RAW_HEADER_SIZE + i * 3 + 2] = color->B;
+    }
+
+    unsigned char* pixels = *data + headerSize;
+
+    if (format == REMAP_FORMAT_RAW) {
+        int mask = (1 << bitDepth) - 1, pixelsPerByte = 8 / bitDepth;
+
+        for (int y = 0; y < result->height; y++) {
+            const unsigned char* indices = result->indices + (size_t)y * result->width;
+            unsigned char* row = pixels + (size_t)y * rowSize;
+
+            if (bitDepth == 8) {
+                for (int x = 0; x < result->width; x++) {
+                    row[x] = indices[x] + result->rangeMin;
+                }
+                continue;
+            }
+
+            for (int x = 0; x < result->width; x++) {
+                int shift = 8 - bitDepth * (x % pixelsPerByte + 1);
+                row[x / pixelsPerByte] |= (unsigned char)((indices[x] & mask) << shift);
+            }
+        }
+    } else {
+        for (int tileY = 0; tileY < tilesHigh; tileY++) {
+            for (int tileX = 0; tileX < tilesWide; tileX++) {
+                pack_tile(result, format, tileX, tileY, pixels + ((size_t)tileY * tilesWide + tileX) * REMAP_RAW_TILE_BYTES);
+            }
+        }
+    }
+
+    *dataSize = headerSize + pixelSize;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Counts the distinct colors of RGBA pixels after compositing them over white,
+ * using one bit per RGB24 color. Translucent pixels are composited through a
+ * table built on first use, so opaque images never touch floating point.
+ * Pixels can be added in several calls, e.g. band by band.
+ */
+int color_counter_init(color_counter* counter)
+{
+    counter->seen = (unsigned int*)calloc((1 << 24) / 32, sizeof(unsigned int));
+    counter->composite = NULL;
+    counter->count = 0;
+
+    return counter->seen != NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int color_counter_add(color_counter* counter, const unsigned char* pixels, size_t pixelCount)
+{
+    for (size_t i = 0; i < pixelCount; i++) {
+        const unsigned char* pixel = pixels + i * 4;
+        unsigned int R = pixel[0], G = pixel[1], B = pixel[2], A = pixel[3];
+
+        if (A != 255) {
+            if (counter->composite == NULL) {
+                counter->composite = (unsigned char (*)[256])malloc(256 * 256);
+                if (counter->composite == NULL) {
+                    return EXIT_FAILURE;
+                }
+                for (int a = 0; a < 256; a++) {
+                    for (int c = 0; c < 256; c++) {
+                        counter->composite[a][c] = (unsigned char)(255.0f + (c - 255.0f) * (a / 255.0f));
+                    }
+                }
+            }
+            R = counter->composite[A][R];
+            G = counter->composite[A][G];
+            B = counter->composite[A][B];
+        }
+
+        unsigned int color = (R << 16) | (G << 8) | B;
+        unsigned int bit = 1u << (color & 31);
+
+        if (!(counter->seen[color >> 5] & bit)) {
+            counter->seen[color >> 5] |= bit;
+            counter->count++;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void color_counter_free(color_counter* counter)
+{
+    free(counter->composite);
+    free(counter->seen);
+    counter->composite = NULL;
+    counter->seen = NULL;
+}
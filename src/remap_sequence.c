@@ -0,0 +1,324 @@
+/*
+ * remap_sequence.c
+ *
+ *  Remapping of animation frames that reuses the previous frame's indices.
+ *
+ *  The changed pixels of a frame are gathered into a one row image and
+ *  remapped as a job of their own, then scattered back into the previous
+ *  frame's indices. A pixel's index doesn't depend on its neighbours, so this
+ *  gives the same indices as remapping the whole frame. The frame's error is
+ *  kept up to date by also remapping the old colors of the changed pixels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "remap_sequence.h"
+#include "libimagequant.h"
+
+struct remap_sequence {
+    remap_palette* palette;
+    remap_options options;
+    bool countColors;
+    int width;
+    int height;
+    unsigned char* previousImage;
+    unsigned char* previousIndices;
+    double errorSum;
+    uint32_t* changedPositions;
+    unsigned char* changedColors;
+    unsigned char* previousColors;
+};
+
+remap_sequence* remap_sequence_create(remap_palette* palette, const remap_options* options)
+{
+    remap_sequence* sequence = (remap_sequence*)calloc(1, sizeof(remap_sequence));
+
+    if (sequence == NULL) {
+        return NULL;
+    }
+
+    sequence->palette = palette;
+    sequence->options = *options;
+    sequence->countColors = options->countColors;
+
+    if (options->tileSize != 0) {
+        fprintf(stderr, "Tiles can't be remapped as a sequence\n");
+        free(sequence);
+        return NULL;
+    }
+
+    // changed pixels are remapped without their positions, which dithering depends on
+    if (options->dither != REMAP_DITHER_NONE) {
+        fprintf(stderr, "Dithered images can't be remapped as a sequence\n");
+        free(sequence);
+        return NULL;
+    }
+
+    return sequence;
+}
+
+void remap_sequence_destroy(remap_sequence* sequence)
+{
+    if (sequence == NULL) {
+        return;
+    }
+
+    free(sequence->previousImage);
+    free(sequence->previousIndices);
+    free(sequence->changedPositions);
+    free(sequence->changedColors);
+    free(sequence->previousColors);
+    free(sequence);
+}
+
+/*
+ * Remaps the whole frame and makes it the one the next frame is compared to.
+ */
+static int remap_full_frame(remap_sequence* sequence, const unsigned char* rgbaImage, int width, int height, remap_result* result)
+{
+    size_t pixelCount = (size_t)width * height;
+
+    if (remap_job_run(sequence->palette, &sequence->options, rgbaImage, width, height, result) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    if (sequence->width != width || sequence->height != height) {
+        free(sequence->previousImage);
+        free(sequence->previousIndices);
+        free(sequence->changedPositions);
+        free(sequence->changedColors);
+        free(sequence->previousColors);
+
+        // frames with more changes than this are remapped whole
+        size_t maxChanged = pixelCount / 2;
+
+        sequence->previousImage = (unsigned char*)malloc(pixelCount * 4);
+        sequence->previousIndices = (unsigned char*)malloc(pixelCount);
+        sequence->changedPositions = (uint32_t*)malloc(maxChanged * sizeof(uint32_t));
+        sequence->changedColors = (unsigned char*)malloc(maxChanged * 4);
+        sequence->previousColors = (unsigned char*)malloc(maxChanged * 4);
+        sequence->width = width;
+        sequence->height = height;
+
+        if (sequence->previousImage == NULL || sequence->previousIndices == NULL || sequence->changedPositions == NULL
+            || sequence->changedColors == NULL || sequence->previousColors == NULL) {
+            fprintf(stderr, "Failed to allocate memory for the sequence\n");
+            sequence->width = sequence->height = 0;
+            remap_result_free(result);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the slot picked for the first frame is kept for the whole sequence
+    if (sequence->options.paletteSlot == REMAP_SLOT_AUTO) {
+        sequence->options.paletteSlot = result->paletteSlot;
+    }
+
+    memcpy(sequence->previousImage, rgbaImage, pixelCount * 4);
+    memcpy(sequence->previousIndices, result->indices, pixelCount);
+    sequence->errorSum = result->mse * pixelCount;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Remaps the next frame of the sequence. changedPixels receives how many
+ * pixels had to be looked up, which is all of them when the frame is remapped
+ * whole: the first frame, a change of size, or more than half the pixels changed.
+ */
+int remap_sequence_next(remap_sequence* sequence, const unsigned char* rgbaImage, int width, int height, remap_result* result, size_t* changedPixels)
+{
+    size_t pixelCount = (size_t)width * height;
+    size_t maxChanged = pixelCount / 2, changedCount = 0;
+    const uint32_t* pixels = (const uint32_t*)rgbaImage;
+    const uint32_t* previousPixels = (const uint32_t*)sequence->previousImage;
+    remap_options changedOptions = sequence->options;
+    remap_result changedResult, previousResult;
+    stage_time stageStart;
+
+    *changedPixels = pixelCount;
+
+    if (sequence->previousImage == NULL || sequence->width != width || sequence->height != height || pixelCount > UINT32_MAX) {
+        return remap_full_frame(sequence, rgbaImage, width, height, result);
+    }
+
+    stats_start(&stageStart);
+
+    for (size_t i = 0; i < pixelCount; i++) {
+        if (pixels[i] != previousPixels[i]) {
+            if (changedCount == maxChanged) {
+                return remap_full_frame(sequence, rgbaImage, width, height, result);
+            }
+            sequence->changedPositions[changedCount] = (uint32_t)i;
+            memcpy(sequence->changedColors + changedCount * 4, &pixels[i], 4);
+            memcpy(sequence->previousColors + changedCount * 4, &previousPixels[i], 4);
+            changedCount++;
+        }
+    }
+
+    *result = (remap_result) {
+        .width = width,
+        .height = height,
+        .paletteSlot = -1,
+        .inputColors = -1
+    };
+
+    if (remap_options_resolve(sequence->palette, &changedOptions) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    result->rangeMin = changedOptions.rangeMin;
+    result->rangeMax = changedOptions.rangeMax;
+    if (changedOptions.paletteSlot >= 0) {
+        result->paletteSlot = changedOptions.paletteSlot;
+    }
+
+    changedOptions.countColors = false;
+    changedOptions.alpha = false;
+
+    if (changedCount > 0) {
+        if (remap_job_run(sequence->palette, &changedOptions, sequence->changedColors, changedCount, 1, &changedResult) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+
+        if (remap_job_run(sequence->palette, &changedOptions, sequence->previousColors, changedCount, 1, &previousResult) == EXIT_FAILURE) {
+            remap_result_free(&changedResult);
+            return EXIT_FAILURE;
+        }
+
+        for (size_t i = 0; i < changedCount; i++) {
+            uint32_t position = sequence->changedPositions[i];
+            sequence->previousIndices[position] = changedResult.indices[i];
+            memcpy(sequence->previousImage + (size_t)position * 4, sequence->changedColors + i * 4, 4);
+        }
+
+        sequence->errorSum += (changedResult.mse - previousResult.mse) * changedCount;
+
+        remap_result_free(&changedResult);
+        remap_result_free(&previousResult);
+    }
+
+    result->indices = (unsigned char*)malloc(pixelCount);
+    if (sequence->options.alpha) {
+        result->alpha = (unsigned char*)malloc(pixelCount);
+    }
+    if (result->indices == NULL || (sequence->options.alpha && result->alpha == NULL)) {
+        fprintf(stderr, "Failed to allocate memory for image\n");
+        remap_result_free(result);
+        return EXIT_FAILURE;
+    }
+
+    memcpy(result->indices, sequence->previousIndices, pixelCount);
+    if (result->alpha != NULL) {
+        for (size_t i = 0; i < pixelCount; i++) {
+            result->alpha[i] = rgbaImage[i * 4 + 3];
+        }
+    }
+
+    result->mse = (sequence->errorSum > 0 ? sequence->errorSum : 0) / pixelCount;
+    result->quality = liq_mse_to_quality(result->mse);
+    stats_stop(&result->stats, REMAP_STAGE_REMAP, &stageStart);
+
+    if (sequence->options.countColors) {
+        color_counter counter;
+        stats_start(&stageStart);
+        if (color_counter_init(&counter) == EXIT_SUCCESS && color_counter_add(&counter, rgbaImage, pixelCount) == EXIT_SUCCESS) {
+            result->inputColors = counter.count;
+        }
+        color_counter_free(&counter);
+        stats_stop(&result->stats, REMAP_STAGE_COUNT_COLORS, &stageStart);
+    }
+
+    *changedPixels = changedCount;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Like remap_sequence_next for a PNG frame, decoded and encoded like
+ * remap_job_run_png does.
+ */
+int remap_sequence_next_png(remap_sequence* sequence, int bitDepth, int maskBits, const unsigned char* png, size_t pngSize, remap_png_result* result, size_t* changedPixels)
+{
+    int status = EXIT_FAILURE;
+    unsigned char* inputImage = NULL;
+    unsigned int inputWidth, inputHeight;
+    LodePNGState inputState;
+    remap_stats decodeStats = { 0 };
+    stage_time stageStart;
+
+    *result = (remap_png_result) { .result = { .paletteSlot = -1, .inputColors = -1 } };
+
+    if (maskBits != REMAP_MASK_NONE && maskBits != 1 && maskBits != 8 && maskBits != REMAP_MASK_RGBA) {
+        fprintf(stderr, "Masks can only have 1, 8 or 32 bits\n");
+        return EXIT_FAILURE;
+    }
+
+    lodepng_state_init(&inputState);
+
+    inputState.info_raw.colortype = LCT_RGBA;
+    inputState.info_raw.bitdepth = 8;
+
+    stats_start(&stageStart);
+    unsigned int error = lodepng_decode(&inputImage, &inputWidth, &inputHeight, &inputState, png, pngSize);
+    stats_stop(&decodeStats, REMAP_STAGE_DECODE, &stageStart);
+
+    if (error) {
+        fprintf(stderr, "Decoder error %u: %s\n", error, lodepng_error_text(error));
+        goto remap_sequence_next_png_exit;
+    }
+
+    LodePNGColorMode* color = &inputState.info_png.color;
+
+    // a palette image's color count is known without counting
+    sequence->options.countColors = (sequence->countColors && color->colortype != LCT_PALETTE);
+    sequence->options.alpha = (maskBits != REMAP_MASK_NONE && maskBits != REMAP_MASK_RGBA);
+
+    if (remap_sequence_next(sequence, inputImage, inputWidth, inputHeight, &result->result, changedPixels) == EXIT_FAILURE) {
+        goto remap_sequence_next_png_exit;
+    }
+
+    stats_add(&result->result.stats, &decodeStats);
+
+    result->inputColorType = color->colortype;
+    result->inputBitDepth = color->bitdepth;
+
+    if (color->colortype == LCT_PALETTE && sequence->countColors) {
+        result->result.inputColors = color->palettesize;
+    }
+
+    if (result->result.paletteSlot != -1) {
+        bitDepth = 4;
+    }
+
+    stats_start(&stageStart);
+
+    if (remap_encode_png(sequence->palette, &result->result, bitDepth, &result->png, &result->pngSize) == EXIT_FAILURE) {
+        goto remap_sequence_next_png_exit;
+    }
+
+    if (maskBits == REMAP_MASK_RGBA && remap_encode_mask_png(inputImage, inputWidth, inputHeight, &result->maskPng, &result->maskPngSize) == EXIT_FAILURE) {
+        goto remap_sequence_next_png_exit;
+    }
+
+    if (result->result.alpha != NULL && remap_encode_alpha_mask_png(result->result.alpha, inputWidth, inputHeight, maskBits, &result->maskPng, &result->maskPngSize) == EXIT_FAILURE) {
+        goto remap_sequence_next_png_exit;
+    }
+
+    stats_stop(&result->result.stats, REMAP_STAGE_ENCODE, &stageStart);
+
+    status = EXIT_SUCCESS;
+
+remap_sequence_next_png_exit:
+
+    lodepng_state_cleanup(&inputState);
+    free(inputImage);
+
+    if (status == EXIT_FAILURE) {
+        remap_png_result_free(result);
+    }
+
+    return status;
+}
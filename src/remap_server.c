@@ -0,0 +1,768 @@
+/*
+ * remap_server.c
+ *
+ *  A long-running remap service on a Unix domain socket, and its client.
+ *
+ *  Every message starts with "RMAP" and uses big-endian 32 bit integers:
+ *
+ *  request:  magic, version, rangeMin, rangeMax, paletteSlot, tileSize,
+ *            dither, bitDepth, maskBits, flags, paletteId (2 words), paletteSize,
+ *            palette, pngSize, png
+ *  response: magic, status, paletteId (2 words), width, height, colorType,
+ *            bitDepth, rangeMin, rangeMax, paletteSlot, inputColors, quality,
+ *            mse (2 words), slotCount, slot errors (2 words each),
+ *            wall and cpu seconds per stage (2 words each), tileSize,
+ *            tilesWide, tilesHigh, messageSize, message, pngSize, png,
+ *            maskSize, mask, tileSlotsSize, tileSlots
+ *
+ *  A connection can carry any number of requests, answered in order. Each
+ *  worker thread accepts a connection and serves it until the client hangs up,
+ *  or leaves it idle for longer than the server's idle timeout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "remap_server.h"
+
+#define REMAP_PROTOCOL_VERSION 5
+#define REMAP_FLAG_COUNT_COLORS 1
+#define REMAP_MAX_PALETTE_SIZE (1 << 20)
+#define REMAP_MAX_PNG_SIZE (1u << 30)
+
+static unsigned char remapMagic[] = { 'R', 'M', 'A', 'P' };
+
+typedef struct cached_palette {
+    uint64_t id;
+    remap_palette* palette;
+    int references;
+    unsigned long lastUsed;
+    struct cached_palette* next;
+} cached_palette;
+
+typedef struct remap_server remap_server;
+
+typedef struct {
+    remap_server* server;
+    pthread_t thread;
+    int clientSocket;
+} server_worker;
+
+struct remap_server {
+    int listenSocket;
+    int cacheSize;
+    const char* lutDirectory;
+    pthread_mutex_t lock;
+    cached_palette* palettes;
+    int paletteCount;
+    unsigned long useCounter;
+    int stopping;
+    server_worker* workers;
+    int workerCount;
+    int threadsPerJob;
+    int idleTimeout;
+};
+
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+} message_buffer;
+
+uint64_t remap_palette_id(const unsigned char* paletteData, size_t paletteSize)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < paletteSize; i++) {
+        hash ^= paletteData[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    // 0 means "no palette id"
+    return hash != 0 ? hash : 1;
+}
+
+static int put_bytes(message_buffer* buffer, const void* data, size_t size)
+{
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 256;
+        while (capacity < buffer->size + size) {
+            capacity *= 2;
+        }
+
+        unsigned char* newData = (unsigned char*)realloc(buffer->data, capacity);
+        if (newData == NULL) {
+            return EXIT_FAILURE;
+        }
+        buffer->data = newData;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+
+    return EXIT_SUCCESS;
+}
+
+static int put_uint32(message_buffer* buffer, uint32_t value)
+{
+    unsigned char bytes[4] = { value >> 24, value >> 16, value >> 8, value };
+
+    return put_bytes(buffer, bytes, sizeof(bytes));
+}
+
+static int put_uint64(message_buffer* buffer, uint64_t value)
+{
+    return put_uint32(buffer, (uint32_t)(value >> 32)) == EXIT_SUCCESS ? put_uint32(buffer, (uint32_t)value) : EXIT_FAILURE;
+}
+
+static int put_double(message_buffer* buffer, double value)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+
+    return put_uint64(buffer, bits);
+}
+
+static int put_block(message_buffer* buffer, const unsigned char* data, size_t size)
+{
+    return put_uint32(buffer, (uint32_t)size) == EXIT_SUCCESS ? put_bytes(buffer, data, size) : EXIT_FAILURE;
+}
+
+static int send_buffer(int socket, const message_buffer* buffer)
+{
+    size_t sent = 0;
+
+    while (sent < buffer->size) {
+        ssize_t count = send(socket, buffer->data + sent, buffer->size - sent, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return EXIT_FAILURE;
+        }
+        sent += count;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Returns EXIT_SUCCESS when all bytes arrived, EXIT_FAILURE on errors and
+ * -1 when the peer hung up before sending anything.
+ */
+static int receive_bytes(int socket, void* data, size_t size)
+{
+    size_t received = 0;
+
+    while (received < size) {
+        ssize_t count = recv(socket, (unsigned char*)data + received, size - received, 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count == 0 && received == 0) {
+            return -1;
+        }
+        if (count <= 0) {
+            return EXIT_FAILURE;
+        }
+        received += count;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int receive_uint32(int socket, uint32_t* value)
+{
+    unsigned char bytes[4];
+
+    if (receive_bytes(socket, bytes, sizeof(bytes)) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    *value = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+
+    return EXIT_SUCCESS;
+}
+
+static int receive_uint64(int socket, uint64_t* value)
+{
+    uint32_t high, low;
+
+    if (receive_uint32(socket, &high) == EXIT_FAILURE || receive_uint32(socket, &low) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    *value = ((uint64_t)high << 32) | low;
+
+    return EXIT_SUCCESS;
+}
+
+static int receive_int(int socket, int* value)
+{
+    uint32_t bits;
+
+    if (receive_uint32(socket, &bits) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    *value = (int32_t)bits;
+
+    return EXIT_SUCCESS;
+}
+
+static int receive_double(int socket, double* value)
+{
+    uint64_t bits;
+
+    if (receive_uint64(socket, &bits) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    memcpy(value, &bits, sizeof(bits));
+
+    return EXIT_SUCCESS;
+}
+
+static int receive_block(int socket, size_t maxSize, unsigned char** data, size_t* size)
+{
+    uint32_t blockSize;
+
+    *data = NULL;
+    *size = 0;
+
+    if (receive_uint32(socket, &blockSize) == EXIT_FAILURE || blockSize > maxSize) {
+        return EXIT_FAILURE;
+    }
+
+    if (blockSize == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    *data = (unsigned char*)malloc(blockSize);
+    if (*data == NULL || receive_bytes(socket, *data, blockSize) != EXIT_SUCCESS) {
+        free(*data);
+        *data = NULL;
+        return EXIT_FAILURE;
+    }
+
+    *size = blockSize;
+
+    return EXIT_SUCCESS;
+}
+
+static int receive_magic(int socket)
+{
+    unsigned char magic[sizeof(remapMagic)];
+    int status = receive_bytes(socket, magic, sizeof(magic));
+
+    if (status != EXIT_SUCCESS) {
+        return status;
+    }
+
+    return memcmp(magic, remapMagic, sizeof(remapMagic)) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void evict_palettes(remap_server* server)
+{
+    while (server->paletteCount > server->cacheSize) {
+        cached_palette** oldest = NULL;
+
+        for (cached_palette** entry = &server->palettes; *entry != NULL; entry = &(*entry)->next) {
+            if ((*entry)->references == 0 && (oldest == NULL || (*entry)->lastUsed < (*oldest)->lastUsed)) {
+                oldest = entry;
+            }
+        }
+
+        // palettes in use stay until they're released
+        if (oldest == NULL) {
+            break;
+        }
+
+        cached_palette* evicted = *oldest;
+        *oldest = evicted->next;
+        remap_palette_destroy(evicted->palette);
+        free(evicted);
+        server->paletteCount--;
+    }
+}
+
+static cached_palette* find_palette(remap_server* server, uint64_t id)
+{
+    for (cached_palette* entry = server->palettes; entry != NULL; entry = entry->next) {
+        if (entry->id == id) {
+            entry->references++;
+            entry->lastUsed = ++server->useCounter;
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static cached_palette* acquire_palette(remap_server* server, uint64_t id, const unsigned char* paletteData, size_t paletteSize)
+{
+    pthread_mutex_lock(&server->lock);
+    cached_palette* entry = find_palette(server, id);
+    pthread_mutex_unlock(&server->lock);
+
+    if (entry != NULL || paletteData == NULL) {
+        return entry;
+    }
+
+    // palettes are parsed outside the lock so other requests aren't held up
+    Color* colors = NULL;
+    int colorCount = 0, transparentIndex = -1;
+    remap_palette* palette = NULL;
+
+    if (read_palette_memory(paletteData, paletteSize, &colors, &colorCount, &transparentIndex) == EXIT_SUCCESS) {
+        palette = remap_palette_create(colors, colorCount);
+    }
+    free(colors);
+
+    if (palette == NULL || remap_palette_set_lut_directory(palette, server->lutDirectory) == EXIT_FAILURE) {
+        remap_palette_destroy(palette);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&server->lock);
+
+    entry = find_palette(server, id);
+    if (entry != NULL) {
+        remap_palette_destroy(palette);
+    } else if ((entry = (cached_palette*)malloc(sizeof(cached_palette))) != NULL) {
+        *entry = (cached_palette) {
+            .id = id,
+            .palette = palette,
+            .references = 1,
+            .lastUsed = ++server->useCounter,
+            .next = server->palettes
+        };
+        server->palettes = entry;
+        server->paletteCount++;
+        evict_palettes(server);
+    } else {
+        remap_palette_destroy(palette);
+    }
+
+    pthread_mutex_unlock(&server->lock);
+
+    return entry;
+}
+
+static void release_palette(remap_server* server, cached_palette* entry)
+{
+    pthread_mutex_lock(&server->lock);
+    entry->references--;
+    evict_palettes(server);
+    pthread_mutex_unlock(&server->lock);
+}
+
+static int send_response(int socket, const remap_response* response)
+{
+    int status = EXIT_SUCCESS;
+    message_buffer buffer = { 0 };
+    const remap_result* result = &response->output.result;
+
+    status |= put_bytes(&buffer, remapMagic, sizeof(remapMagic));
+    status |= put_uint32(&buffer, response->status);
+    status |= put_uint64(&buffer, response->paletteId);
+    status |= put_uint32(&buffer, result->width);
+    status |= put_uint32(&buffer, result->height);
+    status |= put_uint32(&buffer, response->output.inputColorType);
+    status |= put_uint32(&buffer, response->output.inputBitDepth);
+    status |= put_uint32(&buffer, result->rangeMin);
+    status |= put_uint32(&buffer, result->rangeMax);
+    status |= put_uint32(&buffer, result->paletteSlot);
+    status |= put_uint32(&buffer, result->inputColors);
+    status |= put_uint32(&buffer, result->quality);
+    status |= put_double(&buffer, result->mse);
+    status |= put_uint32(&buffer, result->slotCount);
+    for (int i = 0; i < result->slotCount; i++) {
+        status |= put_double(&buffer, result->slotErrors[i]);
+    }
+    for (int i = 0; i < REMAP_STAGE_LAST; i++) {
+        status |= put_double(&buffer, result->stats.stages[i].wall);
+        status |= put_double(&buffer, result->stats.stages[i].cpu);
+    }
+    status |= put_uint32(&buffer, result->tileSize);
+    status |= put_uint32(&buffer, result->tilesWide);
+    status |= put_uint32(&buffer, result->tilesHigh);
+    status |= put_block(&buffer, (const unsigned char*)response->message, strlen(response->message));
+    status |= put_block(&buffer, response->output.png, response->output.pngSize);
+    status |= put_block(&buffer, response->output.maskPng, response->output.maskPngSize);
+    status |= put_block(&buffer, result->tileSlots, result->tileSlots != NULL ? (size_t)result->tilesWide * result->tilesHigh : 0);
+
+    if (status == EXIT_SUCCESS) {
+        status = send_buffer(socket, &buffer);
+    }
+
+    free(buffer.data);
+
+    return status;
+}
+
+/*
+ * Reads and answers one request. Returns -1 once the client has hung up.
+ */
+static int serve_request(remap_server* server, int socket)
+{
+    int status = receive_magic(socket);
+    uint32_t version, flags;
+    remap_request request;
+    unsigned char* paletteData = NULL, *png = NULL;
+    remap_response response = { .status = REMAP_SERVER_ERROR, .output = { .result = { .paletteSlot = -1, .inputColors = -1 } } };
+
+    if (status != EXIT_SUCCESS) {
+        return status;
+    }
+
+    remap_options_init(&request.options);
+
+    if (receive_uint32(socket, &version) == EXIT_FAILURE || version != REMAP_PROTOCOL_VERSION
+        || receive_int(socket, &request.options.rangeMin) == EXIT_FAILURE
+        || receive_int(socket, &request.options.rangeMax) == EXIT_FAILURE
+        || receive_int(socket, &request.options.paletteSlot) == EXIT_FAILURE
+        || receive_int(socket, &request.options.tileSize) == EXIT_FAILURE
+        || receive_int(socket, &request.options.dither) == EXIT_FAILURE
+        || receive_int(socket, &request.bitDepth) == EXIT_FAILURE
+        || receive_int(socket, &request.maskBits) == EXIT_FAILURE
+        || receive_uint32(socket, &flags) == EXIT_FAILURE
+        || receive_uint64(socket, &request.paletteId) == EXIT_FAILURE
+        || receive_block(socket, REMAP_MAX_PALETTE_SIZE, &paletteData, &request.paletteSize) == EXIT_FAILURE
+        || receive_block(socket, REMAP_MAX_PNG_SIZE, &png, &request.pngSize) == EXIT_FAILURE) {
+        // the stream can't be resynchronized after a bad request
+        free(paletteData);
+        return EXIT_FAILURE;
+    }
+
+    request.options.countColors = (flags & REMAP_FLAG_COUNT_COLORS) != 0;
+    request.options.threads = server->threadsPerJob;
+
+    response.paletteId = (paletteData != NULL ? remap_palette_id(paletteData, request.paletteSize) : request.paletteId);
+
+    cached_palette* entry = acquire_palette(server, response.paletteId, paletteData, request.paletteSize);
+
+    if (entry == NULL) {
+        response.status = (paletteData == NULL ? REMAP_SERVER_UNKNOWN_PALETTE : REMAP_SERVER_ERROR);
+        snprintf(response.message, sizeof(response.message), paletteData == NULL ? "unknown palette" : "failed to read palette");
+    } else {
+        if (remap_job_run_png(entry->palette, &request.options, request.bitDepth, request.maskBits, png, request.pngSize, &response.output) == EXIT_SUCCESS) {
+            response.status = REMAP_SERVER_OK;
+            // the indices are already in the PNG
+            free(response.output.result.indices);
+            free(response.output.result.alpha);
+            response.output.result.indices = NULL;
+            response.output.result.alpha = NULL;
+        } else {
+            snprintf(response.message, sizeof(response.message), "failed to remap image");
+        }
+
+        release_palette(server, entry);
+    }
+
+    status = send_response(socket, &response);
+
+    remap_png_result_free(&response.output);
+    free(paletteData);
+    free(png);
+
+    return status;
+}
+
+static void* server_worker_run(void* arg)
+{
+    server_worker* worker = (server_worker*)arg;
+    remap_server* server = worker->server;
+
+    while (1) {
+        int clientSocket = accept(server->listenSocket, NULL, NULL);
+
+        if (clientSocket == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        pthread_mutex_lock(&server->lock);
+        if (server->stopping) {
+            pthread_mutex_unlock(&server->lock);
+            close(clientSocket);
+            break;
+        }
+        worker->clientSocket = clientSocket;
+        pthread_mutex_unlock(&server->lock);
+
+        // an idle client would keep the worker from everyone else, so reads give up after a while
+        struct timeval timeout = { .tv_sec = server->idleTimeout };
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        while (serve_request(server, clientSocket) == EXIT_SUCCESS) {
+        }
+
+        pthread_mutex_lock(&server->lock);
+        worker->clientSocket = -1;
+        pthread_mutex_unlock(&server->lock);
+
+        close(clientSocket);
+    }
+
+    return NULL;
+}
+
+static int open_server_socket(const char* socketPath)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    struct stat socketStat;
+
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", socketPath);
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    // a socket left behind by a previous server would make bind fail
+    if (stat(socketPath, &socketStat) == 0 && S_ISSOCK(socketStat.st_mode)) {
+        unlink(socketPath);
+    }
+
+    int listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (listenSocket == -1 || bind(listenSocket, (struct sockaddr*)&address, sizeof(address)) == -1 || listen(listenSocket, 64) == -1) {
+        perror(socketPath);
+        if (listenSocket != -1) {
+            close(listenSocket);
+        }
+        return -1;
+    }
+
+    return listenSocket;
+}
+
+/*
+ * Serves requests until SIGINT, SIGTERM or SIGHUP arrives, then finishes the
+ * requests in flight and removes the socket. A connection that sends nothing
+ * for idleTimeout seconds is closed, 0 waits forever.
+ */
+int remap_server_run(const char* socketPath, int workerCount, int threadsPerJob, int cacheSize, const char* lutDirectory, int idleTimeout)
+{
+    int result = EXIT_SUCCESS;
+    remap_server server = {
+        .cacheSize = cacheSize > 0 ? cacheSize : 1,
+        .lutDirectory = lutDirectory,
+        .workerCount = 0,
+        .threadsPerJob = threadsPerJob,
+        .idleTimeout = idleTimeout > 0 ? idleTimeout : 0,
+    };
+    sigset_t stopSignals, previousSignals;
+    int signal;
+
+    // workers run requests side by side, so by default they split the cores
+    if (server.threadsPerJob <= 0 && workerCount > 0) {
+        server.threadsPerJob = (int)sysconf(_SC_NPROCESSORS_ONLN) / workerCount;
+        if (server.threadsPerJob < 1) {
+            server.threadsPerJob = 1;
+        }
+    }
+
+    server.listenSocket = open_server_socket(socketPath);
+    if (server.listenSocket == -1) {
+        return EXIT_FAILURE;
+    }
+
+    server.workers = (server_worker*)calloc(workerCount, sizeof(server_worker));
+    if (server.workers == NULL) {
+        close(server.listenSocket);
+        unlink(socketPath);
+        return EXIT_FAILURE;
+    }
+
+    pthread_mutex_init(&server.lock, NULL);
+
+    // workers inherit the blocked signals, so only sigwait below sees them
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    sigaddset(&stopSignals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, &previousSignals);
+
+    for (; server.workerCount < workerCount; server.workerCount++) {
+        server_worker* worker = &server.workers[server.workerCount];
+        worker->server = &server;
+        worker->clientSocket = -1;
+        if (pthread_create(&worker->thread, NULL, server_worker_run, worker) != 0) {
+            fprintf(stderr, "Failed to start worker thread\n");
+            break;
+        }
+    }
+
+    if (server.workerCount == 0) {
+        result = EXIT_FAILURE;
+    } else {
+        printf("serving on %s with %d workers\n", socketPath, server.workerCount);
+        fflush(stdout);
+        sigwait(&stopSignals, &signal);
+    }
+
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    shutdown(server.listenSocket, SHUT_RDWR);
+    for (int i = 0; i < server.workerCount; i++) {
+        if (server.workers[i].clientSocket != -1) {
+            shutdown(server.workers[i].clientSocket, SHUT_RD);
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    for (int i = 0; i < server.workerCount; i++) {
+        pthread_join(server.workers[i].thread, NULL);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previousSignals, NULL);
+
+    close(server.listenSocket);
+    unlink(socketPath);
+
+    while (server.palettes != NULL) {
+        cached_palette* next = server.palettes->next;
+        remap_palette_destroy(server.palettes->palette);
+        free(server.palettes);
+        server.palettes = next;
+    }
+
+    pthread_mutex_destroy(&server.lock);
+    free(server.workers);
+
+    return result;
+}
+
+int remap_client_connect(const char* socketPath)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", socketPath);
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    int clientSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (clientSocket == -1 || connect(clientSocket, (struct sockaddr*)&address, sizeof(address)) == -1) {
+        perror(socketPath);
+        if (clientSocket != -1) {
+            close(clientSocket);
+        }
+        return -1;
+    }
+
+    return clientSocket;
+}
+
+int remap_client_request(int clientSocket, const remap_request* request, remap_response* response)
+{
+    int status = EXIT_SUCCESS;
+    message_buffer buffer = { 0 };
+    uint32_t flags = (request->options.countColors ? REMAP_FLAG_COUNT_COLORS : 0);
+    uint32_t responseStatus, colorType, bitDepth, slotCount;
+    unsigned char* message = NULL;
+    size_t messageSize, tileSlotsSize;
+    remap_result* result = &response->output.result;
+
+    *response = (remap_response) { .status = REMAP_SERVER_ERROR };
+
+    status |= put_bytes(&buffer, remapMagic, sizeof(remapMagic));
+    status |= put_uint32(&buffer, REMAP_PROTOCOL_VERSION);
+    status |= put_uint32(&buffer, request->options.rangeMin);
+    status |= put_uint32(&buffer, request->options.rangeMax);
+    status |= put_uint32(&buffer, request->options.paletteSlot);
+    status |= put_uint32(&buffer, request->options.tileSize);
+    status |= put_uint32(&buffer, request->options.dither);
+    status |= put_uint32(&buffer, request->bitDepth);
+    status |= put_uint32(&buffer, request->maskBits);
+    status |= put_uint32(&buffer, flags);
+    status |= put_uint64(&buffer, request->paletteId);
+    status |= put_block(&buffer, request->paletteData, request->paletteData != NULL ? request->paletteSize : 0);
+    status |= put_block(&buffer, request->png, request->pngSize);
+
+    if (status == EXIT_FAILURE || send_buffer(clientSocket, &buffer) == EXIT_FAILURE) {
+        free(buffer.data);
+        return EXIT_FAILURE;
+    }
+
+    free(buffer.data);
+
+    if (receive_magic(clientSocket) != EXIT_SUCCESS
+        || receive_uint32(clientSocket, &responseStatus) == EXIT_FAILURE
+        || receive_uint64(clientSocket, &response->paletteId) == EXIT_FAILURE
+        || receive_int(clientSocket, &result->width) == EXIT_FAILURE
+        || receive_int(clientSocket, &result->height) == EXIT_FAILURE
+        || receive_uint32(clientSocket, &colorType) == EXIT_FAILURE
+        || receive_uint32(clientSocket, &bitDepth) == EXIT_FAILURE
+        || receive_int(clientSocket, &result->rangeMin) == EXIT_FAILURE
+        || receive_int(clientSocket, &result->rangeMax) == EXIT_FAILURE
+        || receive_int(clientSocket, &result->paletteSlot) == EXIT_FAILURE
+        || receive_int(clientSocket, &result->inputColors) == EXIT_FAILURE
+        || receive_int(clientSocket, &result->quality) == EXIT_FAILURE
+        || receive_double(clientSocket, &result->mse) == EXIT_FAILURE
+        || receive_uint32(clientSocket, &slotCount) == EXIT_FAILURE || slotCount > REMAP_MAX_SLOTS) {
+        return EXIT_FAILURE;
+    }
+
+    response->status = responseStatus;
+    response->output.inputColorType = (LodePNGColorType)colorType;
+    response->output.inputBitDepth = bitDepth;
+    result->slotCount = slotCount;
+
+    for (uint32_t i = 0; i < slotCount; i++) {
+        if (receive_double(clientSocket, &result->slotErrors[i]) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = 0; i < REMAP_STAGE_LAST; i++) {
+        if (receive_double(clientSocket, &result->stats.stages[i].wall) == EXIT_FAILURE
+            || receive_double(clientSocket, &result->stats.stages[i].cpu) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (receive_int(clientSocket, &result->tileSize) == EXIT_FAILURE
+        || receive_int(clientSocket, &result->tilesWide) == EXIT_FAILURE
+        || receive_int(clientSocket, &result->tilesHigh) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    if (receive_block(clientSocket, sizeof(response->message) - 1, &message, &messageSize) == EXIT_FAILURE
+        || receive_block(clientSocket, REMAP_MAX_PNG_SIZE, &response->output.png, &response->output.pngSize) == EXIT_FAILURE
+        || receive_block(clientSocket, REMAP_MAX_PNG_SIZE, &response->output.maskPng, &response->output.maskPngSize) == EXIT_FAILURE
+        || receive_block(clientSocket, REMAP_MAX_PNG_SIZE, &response->output.result.tileSlots, &tileSlotsSize) == EXIT_FAILURE
+        || (tileSlotsSize != 0 && tileSlotsSize != (size_t)result->tilesWide * result->tilesHigh)) {
+        free(message);
+        remap_response_free(response);
+        return EXIT_FAILURE;
+    }
+
+    if (message != NULL) {
+        memcpy(response->message, message, messageSize);
+        response->message[messageSize] = '\0';
+        free(message);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void remap_response_free(remap_response* response)
+{
+    remap_png_result_free(&response->output);
+}
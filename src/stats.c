@@ -0,0 +1,76 @@
+/*
+ * stats.c
+ *
+ *  Wall and CPU time per remap stage, and peak memory use.
+ *
+ *  CPU time is the process's, so it includes every thread working on a stage,
+ *  and also any other job running concurrently in the same process.
+ */
+
+#include <time.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+static const char* stageNames[REMAP_STAGE_LAST] = {
+    "load", "decode", "count", "histogram", "quantize", "remap", "encode", "save"
+};
+
+const char* stats_stage_name(remap_stage stage)
+{
+    return stage >= 0 && stage < REMAP_STAGE_LAST ? stageNames[stage] : "unknown";
+}
+
+static double clock_seconds(clockid_t clock)
+{
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void stats_start(stage_time* start)
+{
+    start->wall = clock_seconds(CLOCK_MONOTONIC);
+    start->cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void stats_stop(remap_stats* stats, remap_stage stage, const stage_time* start)
+{
+    stats->stages[stage].wall += clock_seconds(CLOCK_MONOTONIC) - start->wall;
+    stats->stages[stage].cpu += clock_seconds(CLOCK_PROCESS_CPUTIME_ID) - start->cpu;
+}
+
+void stats_add(remap_stats* total, const remap_stats* stats)
+{
+    for (int i = 0; i < REMAP_STAGE_LAST; i++) {
+        total->stages[i].wall += stats->stages[i].wall;
+        total->stages[i].cpu += stats->stages[i].cpu;
+    }
+}
+
+stage_time stats_total(const remap_stats* stats)
+{
+    stage_time total = { 0 };
+
+    for (int i = 0; i < REMAP_STAGE_LAST; i++) {
+        total.wall += stats->stages[i].wall;
+        total.cpu += stats->stages[i].cpu;
+    }
+
+    return total;
+}
+
+/*
+ * Peak resident set size of the process so far, in kilobytes.
+ */
+long stats_peak_memory_kb(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == -1) {
+        return -1;
+    }
+
+    return usage.ru_maxrss;
+}
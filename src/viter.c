@@ -9,7 +9,6 @@
 #ifdef _OPENMP
 #include <omp.h>
 #else
-#define omp_get_max_threads() 1
 #define omp_get_thread_num() 0
 #endif
 
@@ -61,9 +60,8 @@ LIQ_PRIVATE void viter_finalize(colormap *map, const unsigned int max_threads, c
     }
 }
 
-LIQ_PRIVATE double viter_do_iteration(histogram *hist, colormap *const map, const float min_opaque_val, viter_callback callback, const bool fast_palette)
+LIQ_PRIVATE double viter_do_iteration(histogram *hist, colormap *const map, const float min_opaque_val, viter_callback callback, const bool fast_palette, const unsigned int max_threads)
 {
-    const unsigned int max_threads = omp_get_max_threads();
     viter_state average_color[(VITER_CACHE_LINE_GAP+map->colors) * max_threads];
     viter_init(map, max_threads, average_color);
     struct nearest_map *const n = nearest_init(map, fast_palette);
@@ -72,7 +70,7 @@ LIQ_PRIVATE double viter_do_iteration(histogram *hist, colormap *const map, cons
 
     double total_diff=0;
     #if __GNUC__ >= 9
-    #pragma omp parallel for if (hist_size > 3000) \
+    #pragma omp parallel for if (hist_size > 3000) num_threads(max_threads) \
         schedule(static) default(none) shared(map,min_opaque_val,callback,average_color,n,achv,hist_size) reduction(+:total_diff)
     #endif
     for(int j=0; j < hist_size; j++) {
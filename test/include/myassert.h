@@ -3,6 +3,7 @@
 
 #include "color.h"
 
+void assertEqualsInt(const char* message, int expected, int actual);
 void assertEqualsFloat(const char* message, float expected, float actual, float epsilon);
 void assertEqualsLabcolor(const char* message, labcolor* expected, labcolor* actual, float epsilon);
 
@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "myassert.h"
+#include "libimagequant.h"
+
+#define COLS 768
+#define ROWS 512
+#define THREADS 4
+#define SEED 12345
+
+static rgba_pixel pixels[COLS * ROWS];
+
+typedef struct {
+    int threads;
+    unsigned int seed;
+    unsigned char indices[COLS * ROWS];
+} dither_job;
+
+/* quantizes at one thread, so the palette is the same whatever the remap uses, then dithers with Floyd-Steinberg */
+static void *dither(void *arg) {
+    dither_job *job = arg;
+
+#ifdef _OPENMP
+    // stripes are dithered by as many threads as OpenMP allows the calling thread, which may be one on this machine
+    omp_set_num_threads(THREADS);
+#endif
+
+    liq_attr *attr = liq_attr_create();
+    assertEqualsInt("should create the attributes", 1, attr != NULL);
+    // no dither map, which would be made by a remap whose error depends on the thread count
+    assertEqualsInt("should set the speed", LIQ_OK, liq_set_speed(attr, 10));
+    assertEqualsInt("should set the colors", LIQ_OK, liq_set_max_colors(attr, 16));
+    liq_image *image = liq_image_create_rgba(attr, pixels, COLS, ROWS, 0);
+    assertEqualsInt("should create the image", 1, image != NULL);
+    assertEqualsInt("should set the threads", LIQ_OK, liq_image_set_max_threads(image, 1));
+    liq_result *result = liq_quantize_image(attr, image);
+    assertEqualsInt("should quantize the image", 1, result != NULL);
+
+    assertEqualsInt("should set the threads", LIQ_OK, liq_image_set_max_threads(image, job->threads));
+    assertEqualsInt("should dither fully", LIQ_OK, liq_set_dithering_level(result, 1.0f));
+    assertEqualsInt("should set the seed", LIQ_OK, liq_set_dithering_seed(result, job->seed));
+    assertEqualsInt("should remap the image", LIQ_OK, liq_write_remapped_image(result, image, job->indices, sizeof(job->indices)));
+
+    liq_result_destroy(result);
+    liq_image_destroy(image);
+    liq_attr_destroy(attr);
+    return NULL;
+}
+
+static void dither_concurrently(dither_job *jobs) {
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) {
+        assertEqualsInt("should start the thread", 0, pthread_create(&threads[i], NULL, dither, &jobs[i]));
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+int main() {
+    static dither_job expected, actual, jobs[2];
+
+    // smooth gradients, which 16 colors can only show dithered
+    for (unsigned int y = 0; y < ROWS; y++) {
+        for (unsigned int x = 0; x < COLS; x++) {
+            pixels[y * COLS + x] = (rgba_pixel){
+                .r = (unsigned char)(x * 255 / COLS),
+                .g = (unsigned char)(y * 255 / ROWS),
+                .b = (unsigned char)((x + y) * 255 / (COLS + ROWS)),
+                .a = 255,
+            };
+        }
+    }
+
+    // one thread is one stripe, which is the whole image dithered in one pass
+    expected = (dither_job){ .threads = 1, .seed = SEED };
+    dither(&expected);
+    actual = (dither_job){ .threads = 1, .seed = SEED };
+    dither(&actual);
+    assertEqualsInt("the same seed should dither the same", 0, memcmp(expected.indices, actual.indices, sizeof(expected.indices)));
+
+    // the first stripe has no stripe above it, so its rows are those of the single pass
+    actual = (dither_job){ .threads = THREADS, .seed = SEED };
+    dither(&actual);
+    assertEqualsInt("the first stripe should match the single pass", 0, memcmp(expected.indices, actual.indices, COLS * (ROWS / THREADS)));
+    assertEqualsInt("later stripes should differ from the single pass", 1, memcmp(expected.indices, actual.indices, sizeof(expected.indices)) != 0);
+
+    // remaps on other threads don't share the noise, whether one stripe or several each
+    for (int i = 0; i < 2; i++) {
+        jobs[i] = (dither_job){ .threads = 1, .seed = SEED };
+    }
+    dither_concurrently(jobs);
+    for (int i = 0; i < 2; i++) {
+        assertEqualsInt("concurrent remaps should dither the same", 0, memcmp(expected.indices, jobs[i].indices, sizeof(expected.indices)));
+    }
+    for (int i = 0; i < 2; i++) {
+        jobs[i] = (dither_job){ .threads = THREADS, .seed = SEED };
+    }
+    dither_concurrently(jobs);
+    for (int i = 0; i < 2; i++) {
+        assertEqualsInt("concurrent striped remaps should dither the same", 0, memcmp(actual.indices, jobs[i].indices, sizeof(actual.indices)));
+    }
+
+    actual = (dither_job){ .threads = 1, .seed = SEED + 1 };
+    dither(&actual);
+    assertEqualsInt("another seed should dither differently", 1, memcmp(expected.indices, actual.indices, sizeof(expected.indices)) != 0);
+
+    printf("All tests passed!\n");
+
+    return EXIT_SUCCESS;
+}
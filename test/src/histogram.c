@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "myassert.h"
+#include "libimagequant.h"
+
+#define COLS 640
+#define ROWS 600
+#define THREADS 4
+
+static unsigned int seed = 1;
+
+static unsigned int random_int(unsigned int max) {
+    seed = seed * 1103515245U + 12345U;
+    return (seed >> 8) % max;
+}
+
+static histogram *make_histogram(liq_attr *attr, rgba_pixel *pixels, int threads) {
+    liq_image *image = liq_image_create_rgba(attr, pixels, COLS, ROWS, 0);
+    assertEqualsInt("should create the image", 1, image != NULL);
+    assertEqualsInt("should set the threads", LIQ_OK, liq_image_set_max_threads(image, threads));
+    assertEqualsInt("should make the histogram", LIQ_OK, liq_image_make_histogram(image, attr));
+
+    // the histogram is taken from the image, which would free it
+    histogram *hist = image->hist;
+    image->hist = NULL;
+    liq_image_destroy(image);
+    return hist;
+}
+
+/* counting bands of rows in parallel and merging them in order must give the histogram of one pass */
+static void test_threads(liq_attr *attr, rgba_pixel *pixels, unsigned int expectedIgnorebits) {
+    histogram *expected = make_histogram(attr, pixels, 1);
+    printf("%u colors at %u bits\n", expected->size, expected->ignorebits);
+    assertEqualsInt("serial histogram should be posterized as much as expected", 1, expected->ignorebits >= expectedIgnorebits);
+    assertEqualsInt("serial histogram should fit", 1, expected->size <= attr->max_histogram_entries);
+
+    for (int threads = 2; threads <= THREADS; threads++) {
+        histogram *actual = make_histogram(attr, pixels, threads);
+        assertEqualsInt("threads should give the same ignorebits", expected->ignorebits, actual->ignorebits);
+        assertEqualsInt("threads should give the same colors", expected->size, actual->size);
+        for (unsigned int i = 0; i < expected->size; i++) {
+            assertEqualsInt("threads should give the colors in the same order", 0, memcmp(&expected->achv[i].acolor, &actual->achv[i].acolor, sizeof(f_pixel)));
+            // weights summed in another order may differ in the last bits
+            const float weight = expected->achv[i].perceptual_weight;
+            assertEqualsFloat("threads should give the same weights", weight, actual->achv[i].perceptual_weight, 1e-3f + weight * 1e-5f);
+        }
+        pam_freeacolorhist(actual);
+    }
+
+    pam_freeacolorhist(expected);
+}
+
+int main() {
+    static rgba_pixel pixels[COLS * ROWS];
+
+#ifdef _OPENMP
+    // bands are counted by as many threads as OpenMP allows, which may be one on this machine
+    omp_set_num_threads(THREADS);
+#endif
+
+    // gradients with noise, a few repeated colors, and some transparent pixels with leftover colors
+    for (unsigned int y = 0; y < ROWS; y++) {
+        for (unsigned int x = 0; x < COLS; x++) {
+            const unsigned int c = random_int(8) ? random_int(1 << 24) : random_int(32);
+            pixels[y * COLS + x] = (rgba_pixel){
+                .r = (unsigned char)(x * 255 / COLS + (c & 15)),
+                .g = (unsigned char)(y * 255 / ROWS + (c >> 4 & 15)),
+                .b = (unsigned char)(c >> 8),
+                .a = random_int(16) ? 255 : random_int(2) * 128,
+            };
+        }
+    }
+
+    liq_attr *attr = liq_attr_create();
+    assertEqualsInt("should create the attributes", 1, attr != NULL);
+    attr->max_histogram_entries = 1 << 20;
+    test_threads(attr, pixels, 0);
+
+    // too many colors, posterized in place while counting and merging, by a few bits and by all 4
+    attr->max_histogram_entries = 50000;
+    test_threads(attr, pixels, 1);
+    attr->max_histogram_entries = 10000;
+    test_threads(attr, pixels, 4);
+
+    liq_attr_destroy(attr);
+
+    printf("All tests passed!\n");
+
+    return EXIT_SUCCESS;
+}
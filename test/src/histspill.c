@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "myassert.h"
+#include "libimagequant.h"
+
+#define COLS 512
+#define ROWS 512
+
+static unsigned int seed = 1;
+
+static unsigned int random_int(unsigned int max) {
+    seed = seed * 1103515245U + 12345U;
+    return (seed >> 8) % max;
+}
+
+static int allocations_left;
+
+/* malloc that fails once allocations_left runs out */
+static void *limited_malloc(size_t size) {
+    return allocations_left-- > 0 ? malloc(size) : NULL;
+}
+
+static int compare_hist_items(const void *a, const void *b) {
+    return memcmp(&((const hist_item*)a)->acolor, &((const hist_item*)b)->acolor, sizeof(f_pixel));
+}
+
+/* counts the image like liq_set_histogram_memory_limit does, with a table that only holds two rows */
+static histogram *spilled_histogram(rgba_pixel *pixels, unsigned int maxcolors, const float gamma_lut[256], size_t memory_limit) {
+    struct acolorhash_table *acht = pam_allocacolorhash(2 * COLS, COLS * ROWS, 0, malloc, free);
+    struct histspill *spill = histspill_create(malloc, free);
+    assertEqualsInt("should create the spill file", 1, acht != NULL && spill != NULL);
+
+    for (unsigned int row = 0; row < ROWS; row++) {
+        if (acht->colors + COLS > acht->maxcolors) {
+            assertEqualsInt("should spill the table", 1, histspill_write(spill, acht));
+        }
+        const rgba_pixel *rows_p[1] = { &pixels[row * COLS] };
+        assertEqualsInt("should count the row", 1, pam_computeacolorhash(acht, rows_p, COLS, 1, NULL));
+    }
+    assertEqualsInt("should spill the last table", 1, histspill_write(spill, acht));
+    pam_freeacolorhash(acht);
+
+    histogram *hist = histspill_to_hist(spill, maxcolors, 0, 0.1f * COLS * ROWS, gamma_lut, memory_limit);
+    assertEqualsInt("should merge the spilled runs", 1, hist != NULL);
+    histspill_destroy(spill);
+    return hist;
+}
+
+static void assertSameHistogram(const char *message, histogram *expected, histogram *actual) {
+    assertEqualsInt(message, expected->size, actual->size);
+    assertEqualsInt(message, expected->ignorebits, actual->ignorebits);
+    assertEqualsInt(message, 1, expected->total_perceptual_weight == actual->total_perceptual_weight);
+
+    qsort(expected->achv, expected->size, sizeof(expected->achv[0]), compare_hist_items);
+    qsort(actual->achv, actual->size, sizeof(actual->achv[0]), compare_hist_items);
+    for (unsigned int i = 0; i < expected->size; i++) {
+        assertEqualsInt(message, 0, compare_hist_items(&expected->achv[i], &actual->achv[i]));
+        assertEqualsFloat(message, expected->achv[i].perceptual_weight, actual->achv[i].perceptual_weight, 1e-3f);
+    }
+}
+
+/* a table that can't grow reports it, and isn't posterized as if it were full */
+static void test_out_of_memory(const rgba_pixel *const rows_p[]) {
+    // the table, its slots and items, then nothing
+    allocations_left = 3;
+    struct acolorhash_table *acht = pam_allocacolorhash(1 << 22, COLS * ROWS, 0, limited_malloc, free);
+    assertEqualsInt("should create the table", 1, acht != NULL);
+    assertEqualsInt("should fail to count the image", 0, pam_computeacolorhash(acht, rows_p, COLS, ROWS, NULL));
+    assertEqualsInt("should report running out of memory", 1, acht->out_of_memory);
+    assertEqualsInt("should not posterize the table", 0, acht->ignorebits);
+
+    // the pixel that didn't fit isn't counted, nor any after it
+    double weight = 0;
+    for (unsigned int i = 0; i < acht->colors; i++) {
+        weight += acht->items[i].perceptual_weight;
+    }
+    assertEqualsInt("should count every pixel before the failure once", 1, weight < COLS * ROWS && acht->colors <= weight);
+    pam_freeacolorhash(acht);
+}
+
+int main() {
+    static rgba_pixel pixels[COLS * ROWS];
+    float gamma_lut[256];
+    to_f_set_gamma(gamma_lut, 0.45455);
+
+    // mostly distinct colors, some repeated all over the image, some transparent with leftover colors
+    for (unsigned int i = 0; i < COLS * ROWS; i++) {
+        const unsigned int c = random_int(4) ? random_int(1 << 24) : random_int(64);
+        pixels[i] = (rgba_pixel){.r = c, .g = c >> 8, .b = c >> 16, .a = random_int(16) ? 255 : random_int(2) * 128};
+    }
+
+    const rgba_pixel *rows_p[ROWS];
+    for (unsigned int row = 0; row < ROWS; row++) {
+        rows_p[row] = &pixels[row * COLS];
+    }
+    struct acolorhash_table *acht = pam_allocacolorhash(1 << 22, COLS * ROWS, 0, malloc, free);
+    assertEqualsInt("should count the whole image", 1, acht != NULL && pam_computeacolorhash(acht, rows_p, COLS, ROWS, NULL));
+    histogram *expected = pam_acolorhashtoacolorhist(acht, 0.45455, gamma_lut, malloc, free);
+    pam_freeacolorhash(acht);
+    printf("%u colors in %u runs\n", expected->size, (ROWS + 1) / 2);
+
+    // every run merged at once
+    histogram *actual = spilled_histogram(pixels, 1 << 22, gamma_lut, 64 << 20);
+    assertSameHistogram("merging all runs at once should give the same histogram", expected, actual);
+    pam_freeacolorhist(actual);
+
+    // a limit with read buffers for only 2 runs at a time, so runs get merged over many passes
+    actual = spilled_histogram(pixels, 1 << 22, gamma_lut, 128 << 10);
+    assertSameHistogram("merging runs in several passes should give the same histogram", expected, actual);
+    pam_freeacolorhist(actual);
+
+    // fewer colors than the image has are posterized while merging, keeping all the weight
+    actual = spilled_histogram(pixels, expected->size / 4, gamma_lut, 128 << 10);
+    assertEqualsInt("posterized histogram should fit", 1, actual->size <= expected->size / 4 && actual->ignorebits > 0);
+    assertEqualsInt("posterized histogram should keep the weight", 1, actual->total_perceptual_weight == expected->total_perceptual_weight);
+    pam_freeacolorhist(actual);
+
+    pam_freeacolorhist(expected);
+
+    test_out_of_memory(rows_p);
+
+    printf("All tests passed!\n");
+
+    return EXIT_SUCCESS;
+}
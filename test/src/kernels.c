@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "myassert.h"
+#include "libimagequant.h"
+
+static unsigned int seed = 1;
+
+static unsigned int random_int(unsigned int max) {
+    seed = seed * 1103515245U + 12345U;
+    return (seed >> 8) % max;
+}
+
+static float random_float() {
+    return random_int(1 << 16) / 65535.f;
+}
+
+static f_pixel random_color() {
+    const float a = random_int(4) ? 1.f : random_float();
+    return (f_pixel){.a = a, .r = random_float() * a, .g = random_float() * a, .b = random_float() * a};
+}
+
+/* all kernels must give bit for bit the same results as the plain C ones */
+static void assertSameFloat(const char* message, float expected, float actual) {
+    assertEqualsInt(message, 0, memcmp(&expected, &actual, sizeof(float)));
+}
+
+static void test_nearest_candidate(const struct liq_kernels *plain, const struct liq_kernels *kernels) {
+    static const unsigned int counts[] = {1, 5, 8, 13, 16, 24, 31, 64, 200, 256};
+    float *const buffer = malloc((4 * 256 + 4) * sizeof(float));
+    float *const a = (float*)(((uintptr_t)buffer + 15) & ~(uintptr_t)15), *const r = a + 256, *const g = a + 512, *const b = a + 768;
+
+    for (unsigned int c = 0; c < sizeof(counts)/sizeof(counts[0]); c++) {
+        const unsigned int count = counts[c];
+        for (unsigned int i = 0; i < 256; i++) {
+            // some colors repeat, so ties must go to the lower position, the rest is padding that never matches
+            const f_pixel color = i >= count ? (f_pixel){.a = 0, .r = 1e3f, .g = 1e3f, .b = 1e3f} :
+                                  i > 0 && !random_int(8) ? (f_pixel){.a = a[i-1], .r = r[i-1], .g = g[i-1], .b = b[i-1]} : random_color();
+            a[i] = color.a; r[i] = color.r; g[i] = color.g; b[i] = color.b;
+        }
+
+        for (unsigned int n = 0; n < 2000; n++) {
+            const unsigned int copy = random_int(count);
+            const f_pixel px = n & 1 ? random_color() : (f_pixel){.a = a[copy], .r = r[copy], .g = g[copy], .b = b[copy]};
+            float expected_diff, actual_diff;
+            const unsigned int expected = plain->nearest_candidate(a, r, g, b, count, px, &expected_diff);
+            const unsigned int actual = kernels->nearest_candidate(a, r, g, b, count, px, &actual_diff);
+            assertEqualsInt("nearest_candidate() should pick the same color", expected, actual);
+            assertSameFloat("nearest_candidate() should give the same difference", expected_diff, actual_diff);
+        }
+    }
+    free(buffer);
+}
+
+static void test_to_f_row(const struct liq_kernels *plain, const struct liq_kernels *kernels) {
+    float gamma_lut[256];
+    to_f_set_gamma(gamma_lut, 0.45455);
+
+    rgba_pixel in[1000];
+    f_pixel expected[1000], actual[1000];
+    for (unsigned int i = 0; i < 1000; i++) {
+        in[i] = (rgba_pixel){.r = random_int(256), .g = random_int(256), .b = random_int(256), .a = random_int(3) ? 255 : random_int(256)};
+    }
+
+    for (unsigned int width = 0; width <= 1000; width += width < 40 ? 1 : 321) {
+        plain->to_f_row(gamma_lut, expected, in, width);
+        kernels->to_f_row(gamma_lut, actual, in, width);
+        for (unsigned int i = 0; i < width; i++) {
+            assertSameFloat("to_f_row() should give the same alpha", expected[i].a, actual[i].a);
+            assertSameFloat("to_f_row() should give the same red", expected[i].r, actual[i].r);
+            assertSameFloat("to_f_row() should give the same green", expected[i].g, actual[i].g);
+            assertSameFloat("to_f_row() should give the same blue", expected[i].b, actual[i].b);
+        }
+    }
+}
+
+static void test_contrast_maps_row(const struct liq_kernels *plain, const struct liq_kernels *kernels) {
+    f_pixel rows[3][333];
+    unsigned char expected_noise[333], expected_edges[333], actual_noise[333], actual_edges[333];
+
+    for (unsigned int pattern = 0; pattern < 3; pattern++) {
+        for (unsigned int j = 0; j < 3; j++) {
+            for (unsigned int i = 0; i < 333; i++) {
+                // flat areas, noise, and black and white stripes with more contrast than the maps can hold
+                const float v = pattern == 2 ? ((i + j) & 1) : random_float();
+                rows[j][i] = pattern == 0 ? (f_pixel){.a = 1.f, .r = .5f, .g = .5f, .b = v < .9f ? .5f : v} :
+                             pattern == 1 ? random_color() : (f_pixel){.a = 1.f, .r = v, .g = v, .b = v};
+            }
+        }
+
+        for (unsigned int cols = 1; cols <= 333; cols += cols < 40 ? 1 : 98) {
+            plain->contrast_maps_row(rows[0], rows[1], rows[2], cols, expected_noise, expected_edges);
+            kernels->contrast_maps_row(rows[0], rows[1], rows[2], cols, actual_noise, actual_edges);
+            for (unsigned int i = 0; i < cols; i++) {
+                assertEqualsInt("contrast_maps_row() should give the same noise", expected_noise[i], actual_noise[i]);
+                assertEqualsInt("contrast_maps_row() should give the same edges", expected_edges[i], actual_edges[i]);
+            }
+        }
+    }
+}
+
+static void test_extreme3_row(const struct liq_kernels *plain, const struct liq_kernels *kernels) {
+    unsigned char rows[3][1000], expected[1000], actual[1000];
+    for (unsigned int j = 0; j < 3; j++) {
+        for (unsigned int i = 0; i < 1000; i++) {
+            rows[j][i] = random_int(256);
+        }
+    }
+
+    for (unsigned int width = 1; width <= 1000; width += width < 150 ? 1 : 283) {
+        plain->max3_row(rows[0], rows[1], rows[2], expected, width);
+        kernels->max3_row(rows[0], rows[1], rows[2], actual, width);
+        for (unsigned int i = 0; i < width; i++) {
+            assertEqualsInt("max3_row() should give the same pixels", expected[i], actual[i]);
+        }
+
+        plain->min3_row(rows[0], rows[1], rows[2], expected, width);
+        kernels->min3_row(rows[0], rows[1], rows[2], actual, width);
+        for (unsigned int i = 0; i < width; i++) {
+            assertEqualsInt("min3_row() should give the same pixels", expected[i], actual[i]);
+        }
+    }
+}
+
+int main() {
+    static const char *const names[] = {"none", "sse", "avx2", "avx512"};
+    const struct liq_kernels *const plain = liq_kernels_for_level(LIQ_SIMD_NONE);
+
+    for (int level = LIQ_SIMD_SSE; level <= LIQ_SIMD_AVX512; level++) {
+        const struct liq_kernels *const kernels = liq_kernels_for_level(level);
+        if (!kernels) {
+            printf("%s kernels: not supported here, skipped\n", names[level]);
+            continue;
+        }
+
+        test_nearest_candidate(plain, kernels);
+        test_to_f_row(plain, kernels);
+        test_contrast_maps_row(plain, kernels);
+        test_extreme3_row(plain, kernels);
+        printf("%s kernels: ok\n", names[level]);
+    }
+
+    printf("using %s kernels\n", liq_kernels()->name);
+    return 0;
+}
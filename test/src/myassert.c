@@ -3,6 +3,13 @@
 #include <math.h>
 #include "myassert.h"
 
+void assertEqualsInt(const char* message, int expected, int actual) {
+    if (expected != actual) {
+        fprintf(stderr, "Test failed! %s: %d is expected to be equal to %d\n", message, actual, expected);
+        exit(EXIT_FAILURE);
+    }
+}
+
 void assertEqualsFloat(const char* message, float expected, float actual, float epsilon) {
     if (fabsf(expected - actual) >= epsilon) {
         fprintf(stderr, "Test failed! %s: %.2f is expected to be equal to %.2f\n", message, actual, expected);
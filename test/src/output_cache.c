@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "myassert.h"
+#include "output_cache.h"
+
+#define PNG_SIZE 1000
+
+static char cacheDirectory[64];
+
+static void get_entry_file_name(uint64_t key, char* fileName, size_t fileNameLength) {
+    snprintf(fileName, fileNameLength, "%s/%016llx.rmc", cacheDirectory, (unsigned long long)key);
+}
+
+/* ages an entry, file times being what the cache goes by to pick what to evict */
+static void set_entry_age(uint64_t key, time_t age, long nanoseconds) {
+    char fileName[PATH_MAX];
+    struct timespec times[2] = { { .tv_sec = time(NULL) - age, .tv_nsec = nanoseconds }, { .tv_sec = time(NULL) - age, .tv_nsec = nanoseconds } };
+
+    get_entry_file_name(key, fileName, sizeof(fileName));
+    assertEqualsInt("entry time should be set", 0, utimensat(AT_FDCWD, fileName, times, 0));
+}
+
+static void remove_cache_directory(void) {
+    DIR* dir = opendir(cacheDirectory);
+    struct dirent* entry;
+
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        char fileName[PATH_MAX];
+        if (entry->d_name[0] != '.') {
+            snprintf(fileName, sizeof(fileName), "%s/%s", cacheDirectory, entry->d_name);
+            remove(fileName);
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    rmdir(cacheDirectory);
+}
+
+/* an output only needs to look like one, the cache doesn't decode it */
+static void make_result(remap_png_result* result, unsigned char fill) {
+    *result = (remap_png_result) {
+        .inputColorType = LCT_RGBA,
+        .inputBitDepth = 8,
+        .result = {
+            .width = 40, .height = 24,
+            .rangeMin = 16, .rangeMax = 31,
+            .paletteSlot = 1, .slotCount = 3, .slotErrors = { 5.5, 1.25, 9.0 },
+            .tileSize = 8, .tilesWide = 5, .tilesHigh = 3,
+            .inputColors = 123, .mse = 0.75, .quality = 88
+        },
+        .png = malloc(PNG_SIZE), .pngSize = PNG_SIZE,
+        .maskPng = malloc(PNG_SIZE / 2), .maskPngSize = PNG_SIZE / 2
+    };
+    result->result.tileSlots = malloc(15);
+    memset(result->png, fill, PNG_SIZE);
+    memset(result->maskPng, fill ^ 0xFF, PNG_SIZE / 2);
+    for (int i = 0; i < 15; i++) {
+        result->result.tileSlots[i] = (unsigned char)(i % 3);
+    }
+}
+
+static void assertSameResult(const remap_png_result* expected, const remap_png_result* actual) {
+    assertEqualsInt("cached output should keep the input format", expected->inputColorType, actual->inputColorType);
+    assertEqualsInt("cached output should keep the input depth", expected->inputBitDepth, actual->inputBitDepth);
+    assertEqualsInt("cached output should keep the width", expected->result.width, actual->result.width);
+    assertEqualsInt("cached output should keep the height", expected->result.height, actual->result.height);
+    assertEqualsInt("cached output should keep the range", expected->result.rangeMin, actual->result.rangeMin);
+    assertEqualsInt("cached output should keep the range", expected->result.rangeMax, actual->result.rangeMax);
+    assertEqualsInt("cached output should keep the slot", expected->result.paletteSlot, actual->result.paletteSlot);
+    assertEqualsInt("cached output should keep the slot errors", expected->result.slotCount, actual->result.slotCount);
+    for (int i = 0; i < expected->result.slotCount; i++) {
+        assertEqualsFloat("cached output should keep the slot errors", expected->result.slotErrors[i], actual->result.slotErrors[i], 1e-9f);
+    }
+    assertEqualsInt("cached output should keep the color count", expected->result.inputColors, actual->result.inputColors);
+    assertEqualsInt("cached output should keep the quality", expected->result.quality, actual->result.quality);
+    assertEqualsFloat("cached output should keep the MSE", expected->result.mse, actual->result.mse, 1e-9f);
+    assertEqualsInt("cached output should keep the PNG", (int)expected->pngSize, (int)actual->pngSize);
+    assertEqualsInt("cached output should keep the PNG", 0, memcmp(expected->png, actual->png, expected->pngSize));
+    assertEqualsInt("cached output should keep the mask", (int)expected->maskPngSize, (int)actual->maskPngSize);
+    assertEqualsInt("cached output should keep the mask", 0, memcmp(expected->maskPng, actual->maskPng, expected->maskPngSize));
+    assertEqualsInt("cached output should keep the tiles", expected->result.tilesWide, actual->result.tilesWide);
+    assertEqualsInt("cached output should keep the tiles", expected->result.tilesHigh, actual->result.tilesHigh);
+    assertEqualsInt("cached output should keep the tile slots", 0, memcmp(expected->result.tileSlots, actual->result.tileSlots, 15));
+    assertEqualsInt("cached output should have no indices", 1, actual->result.indices == NULL);
+}
+
+static void test_key(OutputCache* outputCache, const unsigned char* palette, size_t paletteSize) {
+    unsigned char input[64];
+    remap_output outputs[2];
+    OutputCache* otherCache;
+
+    for (int i = 0; i < 64; i++) {
+        input[i] = (unsigned char)(i * 13);
+    }
+    for (int i = 0; i < 2; i++) {
+        outputs[i] = (remap_output) { .bitDepth = 8, .maskBits = REMAP_MASK_NONE, .format = REMAP_FORMAT_PNG };
+        remap_options_init(&outputs[i].options);
+    }
+    outputs[1].bitDepth = 4;
+
+    const uint64_t key = output_cache_key(outputCache, outputs, 2, input, sizeof(input));
+    assertEqualsInt("same input and options should give the same key", 1, key == output_cache_key(outputCache, outputs, 2, input, sizeof(input)));
+
+    input[40] ^= 1;
+    assertEqualsInt("another input should give another key", 1, key != output_cache_key(outputCache, outputs, 2, input, sizeof(input)));
+    input[40] ^= 1;
+    assertEqualsInt("a shorter input should give another key", 1, key != output_cache_key(outputCache, outputs, 2, input, sizeof(input) - 1));
+    assertEqualsInt("fewer outputs should give another key", 1, key != output_cache_key(outputCache, outputs, 1, input, sizeof(input)));
+
+    // every setting that changes an output
+    for (int setting = 0; setting < 9; setting++) {
+        remap_output changed[2] = { outputs[0], outputs[1] };
+        switch (setting) {
+            case 0: changed[0].options.rangeMin = 1; break;
+            case 1: changed[0].options.rangeMax = 15; break;
+            case 2: changed[0].options.paletteSlot = REMAP_SLOT_AUTO; break;
+            case 3: changed[0].options.countColors = !changed[0].options.countColors; break;
+            case 4: changed[0].options.tileSize = 8; break;
+            case 5: changed[0].bitDepth = 4; break;
+            case 6: changed[0].maskBits = 8; break;
+            case 7: changed[0].format = REMAP_FORMAT_RAW; break;
+            case 8: changed[0].options.dither = REMAP_DITHER_BAYER4; break;
+        }
+        assertEqualsInt("another output setting should give another key", 1, key != output_cache_key(outputCache, changed, 2, input, sizeof(input)));
+    }
+
+    // threads only change how fast an output is made
+    remap_output sameOutputs[2] = { outputs[0], outputs[1] };
+    sameOutputs[0].options.threads = 3;
+    assertEqualsInt("the thread count should not change the key", 1, key == output_cache_key(outputCache, sameOutputs, 2, input, sizeof(input)));
+
+    remap_output swapped[2] = { outputs[1], outputs[0] };
+    assertEqualsInt("outputs in another order should give another key", 1, key != output_cache_key(outputCache, swapped, 2, input, sizeof(input)));
+
+    assertEqualsInt("cache should open", EXIT_SUCCESS, open_output_cache(cacheDirectory, 1 << 20, palette, paletteSize - 1, &otherCache));
+    assertEqualsInt("another palette should give another key", 1, key != output_cache_key(otherCache, outputs, 2, input, sizeof(input)));
+    close_output_cache(otherCache);
+}
+
+static void test_hit(OutputCache* outputCache) {
+    remap_png_result stored[2], loaded[2], other;
+    OutputCacheStats stats;
+
+    make_result(&stored[0], 0x11);
+    make_result(&stored[1], 0x22);
+    free(stored[1].maskPng);
+    stored[1].maskPng = NULL;
+    stored[1].maskPngSize = 0;
+
+    assertEqualsInt("an empty cache should miss", EXIT_FAILURE, output_cache_get(outputCache, 1, 2, loaded));
+    assertEqualsInt("outputs should be stored", EXIT_SUCCESS, output_cache_put(outputCache, 1, 2, stored));
+    assertEqualsInt("a stored key should hit", EXIT_SUCCESS, output_cache_get(outputCache, 1, 2, loaded));
+    assertSameResult(&stored[0], &loaded[0]);
+    assertSameResult(&stored[1], &loaded[1]);
+    assertEqualsInt("another output count should miss", EXIT_FAILURE, output_cache_get(outputCache, 1, 1, &other));
+
+    output_cache_get_stats(outputCache, &stats);
+    assertEqualsInt("hits should be counted", 1, stats.hits);
+    assertEqualsInt("misses should be counted", 2, stats.misses);
+
+    for (int i = 0; i < 2; i++) {
+        remap_png_result_free(&stored[i]);
+        remap_png_result_free(&loaded[i]);
+    }
+}
+
+/* the cache holds two entries, and drops the least recently used one for a third */
+static void test_eviction(const unsigned char* palette, size_t paletteSize) {
+    OutputCache* outputCache;
+    OutputCacheStats stats;
+    remap_png_result stored, loaded;
+    struct stat entryStat;
+    char fileName[PATH_MAX];
+
+    remove_cache_directory();
+    make_result(&stored, 0x33);
+
+    assertEqualsInt("cache should open", EXIT_SUCCESS, open_output_cache(cacheDirectory, 1 << 20, palette, paletteSize, &outputCache));
+    assertEqualsInt("entry should be stored", EXIT_SUCCESS, output_cache_put(outputCache, 10, 1, &stored));
+    get_entry_file_name(10, fileName, sizeof(fileName));
+    assertEqualsInt("entry should be a file", 0, stat(fileName, &entryStat));
+    close_output_cache(outputCache);
+    remove(fileName);
+
+    const uint64_t maxSize = entryStat.st_size * 5 / 2;
+    assertEqualsInt("cache should open", EXIT_SUCCESS, open_output_cache(cacheDirectory, maxSize, palette, paletteSize, &outputCache));
+
+    assertEqualsInt("first entry should be stored", EXIT_SUCCESS, output_cache_put(outputCache, 1, 1, &stored));
+    set_entry_age(1, 100, 0);
+    assertEqualsInt("second entry should be stored", EXIT_SUCCESS, output_cache_put(outputCache, 2, 1, &stored));
+    set_entry_age(2, 50, 0);
+
+    // a hit makes the first entry the most recently used one
+    assertEqualsInt("first entry should hit", EXIT_SUCCESS, output_cache_get(outputCache, 1, 1, &loaded));
+    remap_png_result_free(&loaded);
+
+    assertEqualsInt("third entry should be stored", EXIT_SUCCESS, output_cache_put(outputCache, 3, 1, &stored));
+
+    output_cache_get_stats(outputCache, &stats);
+    assertEqualsInt("one entry should be evicted", 1, stats.evictions);
+    assertEqualsInt("cache should be kept under its size", 1, stats.size <= maxSize);
+
+    assertEqualsInt("least recently used entry should be evicted", EXIT_FAILURE, output_cache_get(outputCache, 2, 1, &loaded));
+    assertEqualsInt("recently used entry should stay", EXIT_SUCCESS, output_cache_get(outputCache, 1, 1, &loaded));
+    remap_png_result_free(&loaded);
+    assertEqualsInt("newest entry should stay", EXIT_SUCCESS, output_cache_get(outputCache, 3, 1, &loaded));
+    remap_png_result_free(&loaded);
+
+    close_output_cache(outputCache);
+
+    // entries used within the same second are evicted by use, not by name
+    remove_cache_directory();
+    assertEqualsInt("cache should open", EXIT_SUCCESS, open_output_cache(cacheDirectory, maxSize, palette, paletteSize, &outputCache));
+    assertEqualsInt("first entry should be stored", EXIT_SUCCESS, output_cache_put(outputCache, 1, 1, &stored));
+    set_entry_age(1, 10, 900000000);
+    assertEqualsInt("second entry should be stored", EXIT_SUCCESS, output_cache_put(outputCache, 2, 1, &stored));
+    set_entry_age(2, 10, 100000000);
+
+    assertEqualsInt("third entry should be stored", EXIT_SUCCESS, output_cache_put(outputCache, 3, 1, &stored));
+    assertEqualsInt("entry used earlier in the second should be evicted", EXIT_FAILURE, output_cache_get(outputCache, 2, 1, &loaded));
+    assertEqualsInt("entry used later in the second should stay", EXIT_SUCCESS, output_cache_get(outputCache, 1, 1, &loaded));
+    remap_png_result_free(&loaded);
+
+    close_output_cache(outputCache);
+    remap_png_result_free(&stored);
+}
+
+int main() {
+    static const unsigned char palette[] = "JASC-PAL\r\n0100\r\n2\r\n0 0 0\r\n255 255 255\r\n";
+    OutputCache* outputCache;
+
+    snprintf(cacheDirectory, sizeof(cacheDirectory), "/tmp/remap-cache-test-%d", (int)getpid());
+    atexit(remove_cache_directory);
+
+    assertEqualsInt("cache should open", EXIT_SUCCESS, open_output_cache(cacheDirectory, 1 << 20, palette, sizeof(palette), &outputCache));
+
+    test_key(outputCache, palette, sizeof(palette));
+    test_hit(outputCache);
+
+    close_output_cache(outputCache);
+
+    test_eviction(palette, sizeof(palette));
+
+    printf("All tests passed!\n");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "myassert.h"
+#include "lodepng.h"
+#include "pngstream.h"
+
+#define WIDTH 5
+#define HEIGHT 3
+#define COLORS 4
+
+typedef struct {
+    const char* type;
+    const unsigned char* data;
+    unsigned int length;
+    unsigned int declaredLength;
+} chunk;
+
+static char fileName[64];
+
+static void remove_test_file(void) {
+    remove(fileName);
+}
+
+static unsigned int read_uint32(const unsigned char* bytes) {
+    return ((unsigned int)bytes[0] << 24) | ((unsigned int)bytes[1] << 16) | ((unsigned int)bytes[2] << 8) | bytes[3];
+}
+
+static void write_uint32(FILE* file, unsigned int value) {
+    const unsigned char bytes[4] = { (unsigned char)(value >> 24), (unsigned char)(value >> 16), (unsigned char)(value >> 8), (unsigned char)value };
+    fwrite(bytes, 1, 4, file);
+}
+
+/* the reader doesn't check CRCs, so they're written as zeros; a chunk written shorter than declared ends the file */
+static void write_chunks(const chunk* chunks, int count) {
+    static const unsigned char signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    FILE* file = fopen(fileName, "wb");
+    assertEqualsInt("test file should be created", 1, file != NULL);
+
+    fwrite(signature, 1, sizeof(signature), file);
+    for (int i = 0; i < count; i++) {
+        write_uint32(file, chunks[i].declaredLength);
+        fwrite(chunks[i].type, 1, 4, file);
+        fwrite(chunks[i].data, 1, chunks[i].length, file);
+        if (chunks[i].length < chunks[i].declaredLength)
+            break;
+        write_uint32(file, 0);
+    }
+
+    fclose(file);
+}
+
+static int open_chunks(const chunk* chunks, int count) {
+    PngReader* reader;
+
+    write_chunks(chunks, count);
+    int status = png_reader_open(fileName, &reader);
+    if (status == EXIT_SUCCESS) {
+        png_reader_close(reader);
+    } else {
+        assertEqualsInt("failing to open should leave no reader", 1, reader == NULL);
+    }
+    return status;
+}
+
+/* finds a chunk of the encoded image, which lodepng writes in the order IHDR, PLTE, tRNS, IDAT, IEND */
+static chunk find_chunk(const unsigned char* png, size_t size, const char* type) {
+    for (size_t position = 8; position + 12 <= size; position += 12 + read_uint32(png + position)) {
+        if (memcmp(png + position + 4, type, 4) == 0) {
+            const unsigned int length = read_uint32(png + position);
+            return (chunk){ type, png + position + 8, length, length };
+        }
+    }
+    assertEqualsInt("test image should have the chunk", 0, 1);
+    return (chunk){ type, NULL, 0, 0 };
+}
+
+static void test_valid(const chunk* chunks, const unsigned char* indices, const unsigned char* palette) {
+    unsigned char rgba[WIDTH * HEIGHT * 4];
+    PngReader* reader;
+
+    write_chunks(chunks, 5);
+    assertEqualsInt("valid image should open", EXIT_SUCCESS, png_reader_open(fileName, &reader));
+    assertEqualsInt("valid image should have its width", WIDTH, reader->width);
+    assertEqualsInt("valid image should have its height", HEIGHT, reader->height);
+    assertEqualsInt("valid image should have its palette", COLORS, reader->color.palettesize);
+    assertEqualsInt("valid image should be read", EXIT_SUCCESS, png_reader_read_rgba_rows(reader, rgba, HEIGHT));
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        assertEqualsInt("valid image should have the colors of its palette", 0, memcmp(&rgba[i * 4], &palette[indices[i] * 4], 4));
+    }
+    png_reader_close(reader);
+}
+
+static void test_header(const chunk* chunks, unsigned char bitDepth, unsigned char colorType, int expected) {
+    unsigned char header[13];
+    chunk modified[5];
+
+    memcpy(header, chunks[0].data, 13);
+    header[8] = bitDepth;
+    header[9] = colorType;
+    memcpy(modified, chunks, sizeof(modified));
+    modified[0].data = header;
+    assertEqualsInt("only the bit depths lodepng allows for the color type should open", expected, open_chunks(modified, 5));
+}
+
+int main() {
+    static const unsigned char palette[COLORS * 4] = { 255, 0, 0, 255, 0, 255, 0, 128, 0, 0, 255, 0, 255, 255, 255, 255 };
+    static const unsigned char huge[8];
+    unsigned char indices[WIDTH * HEIGHT], *png = NULL;
+    size_t size;
+    LodePNGState state;
+
+    snprintf(fileName, sizeof(fileName), "/tmp/remap-pngstream-test-%d.png", (int)getpid());
+    atexit(remove_test_file);
+
+    lodepng_state_init(&state);
+    state.info_raw.colortype = LCT_PALETTE;
+    state.info_png.color.colortype = LCT_PALETTE;
+    state.encoder.auto_convert = 0;
+    for (int i = 0; i < COLORS; i++) {
+        lodepng_palette_add(&state.info_raw, palette[i * 4], palette[i * 4 + 1], palette[i * 4 + 2], palette[i * 4 + 3]);
+        lodepng_palette_add(&state.info_png.color, palette[i * 4], palette[i * 4 + 1], palette[i * 4 + 2], palette[i * 4 + 3]);
+    }
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        indices[i] = (unsigned char)(i * 3 % COLORS);
+    }
+    assertEqualsInt("test image should encode", 0, lodepng_encode(&png, &size, indices, WIDTH, HEIGHT, &state));
+    lodepng_state_cleanup(&state);
+
+    const chunk chunks[5] = { find_chunk(png, size, "IHDR"), find_chunk(png, size, "PLTE"), find_chunk(png, size, "tRNS"), find_chunk(png, size, "IDAT"), find_chunk(png, size, "IEND") };
+    chunk modified[6];
+
+    test_valid(chunks, indices, palette);
+
+    // chunks the reader doesn't need are skipped
+    modified[0] = chunks[0];
+    modified[1] = (chunk){ "tEXt", (const unsigned char*)"Comment\0remap", 13, 13 };
+    memcpy(&modified[2], &chunks[1], 4 * sizeof(chunk));
+    assertEqualsInt("unknown chunks should be skipped", EXIT_SUCCESS, open_chunks(modified, 6));
+
+    // chunks past the 2^31 - 1 bytes PNG allows, with only a few bytes behind them
+    static const char* types[] = { "IHDR", "PLTE", "tRNS", "tEXt", "IDAT" };
+    static const unsigned int lengths[] = { 0x80000000U, 0xFFFFFFFFU, 0xFFFFFFFDU };
+    for (int type = 0; type < 5; type++) {
+        for (int i = 0; i < 3; i++) {
+            memcpy(modified, chunks, 5 * sizeof(chunk));
+            const int index = (type == 3 ? 1 : type == 4 ? 3 : type);
+            modified[index] = (chunk){ types[type], huge, sizeof(huge), lengths[i] };
+            assertEqualsInt("oversized chunks should be refused", EXIT_FAILURE, open_chunks(modified, index + 1));
+        }
+    }
+
+    // files cut off in every chunk before the pixels
+    for (int index = 0; index < 3; index++) {
+        for (unsigned int length = 0; length < chunks[index].length; length += 2) {
+            memcpy(modified, chunks, 5 * sizeof(chunk));
+            modified[index].length = length;
+            assertEqualsInt("truncated chunks should be refused", EXIT_FAILURE, open_chunks(modified, index + 1));
+        }
+    }
+
+    // chunks whose length doesn't fit what they hold
+    memcpy(modified, chunks, 5 * sizeof(chunk));
+    modified[0].length = modified[0].declaredLength = 12;
+    assertEqualsInt("IHDR should have 13 bytes", EXIT_FAILURE, open_chunks(modified, 5));
+    memcpy(modified, chunks, 5 * sizeof(chunk));
+    modified[1].length = modified[1].declaredLength = COLORS * 3 - 1;
+    assertEqualsInt("PLTE should have whole colors", EXIT_FAILURE, open_chunks(modified, 5));
+    modified[1] = (chunk){ "PLTE", huge, 0, 0 };
+    assertEqualsInt("PLTE should have a color", EXIT_FAILURE, open_chunks(modified, 5));
+    memcpy(modified, chunks, 5 * sizeof(chunk));
+    modified[2] = (chunk){ "tRNS", huge, COLORS + 1, COLORS + 1 };
+    assertEqualsInt("tRNS should have no more alphas than the palette has colors", EXIT_FAILURE, open_chunks(modified, 5));
+
+    // chunks out of place
+    memcpy(modified, chunks, 5 * sizeof(chunk));
+    modified[0] = chunks[1];
+    modified[1] = chunks[0];
+    assertEqualsInt("IHDR should come first", EXIT_FAILURE, open_chunks(modified, 5));
+    modified[0] = chunks[0];
+    assertEqualsInt("IHDR should come once", EXIT_FAILURE, open_chunks(modified, 5));
+    modified[1] = chunks[3];
+    assertEqualsInt("palette images should have a palette", EXIT_FAILURE, open_chunks(modified, 2));
+
+    // bit depths lodepng_get_bpp has a size for, but that don't exist for the color type
+    test_header(chunks, 8, LCT_PALETTE, EXIT_SUCCESS);
+    test_header(chunks, 16, LCT_PALETTE, EXIT_FAILURE);
+    test_header(chunks, 3, LCT_PALETTE, EXIT_FAILURE);
+    test_header(chunks, 4, LCT_RGB, EXIT_FAILURE);
+    test_header(chunks, 2, LCT_RGBA, EXIT_FAILURE);
+    test_header(chunks, 1, LCT_GREY_ALPHA, EXIT_FAILURE);
+    test_header(chunks, 8, 5, EXIT_FAILURE);
+
+    free(png);
+
+    printf("All tests passed!\n");
+
+    return EXIT_SUCCESS;
+}
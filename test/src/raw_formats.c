@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "myassert.h"
+#include "remap_job.h"
+
+#define WIDTH 13
+#define HEIGHT 10
+#define COLORS 40
+
+static unsigned int read_le(const unsigned char* bytes, int size) {
+    unsigned int value = 0;
+    for (int i = size - 1; i >= 0; i--) {
+        value = value << 8 | bytes[i];
+    }
+    return value;
+}
+
+/* checks the header and palette, and returns where the pixels start */
+static const unsigned char* check_header(const unsigned char* data, int format, int bitDepth, int first, int colorCount, const Color* colors) {
+    assertEqualsInt("raw output should start with RMAP", 0, memcmp(data, "RMAP", 4));
+    assertEqualsInt("raw output should have the version", REMAP_RAW_VERSION, data[4]);
+    assertEqualsInt("raw output should have the format", format, data[5]);
+    assertEqualsInt("raw output should have the bit depth", bitDepth, data[6]);
+    assertEqualsInt("raw output should have the width", WIDTH, read_le(data + 8, 4));
+    assertEqualsInt("raw output should have the height", HEIGHT, read_le(data + 12, 4));
+    assertEqualsInt("raw output should have the color count", colorCount, read_le(data + 16, 2));
+    assertEqualsInt("raw output should have the first color", first, read_le(data + 18, 2));
+
+    for (int i = 0; i < colorCount; i++) {
+        const unsigned char* rgb = data + REMAP_RAW_HEADER_SIZE + i * 3;
+        assertEqualsInt("raw palette should have the red", colors[first + i].R, rgb[0]);
+        assertEqualsInt("raw palette should have the green", colors[first + i].G, rgb[1]);
+        assertEqualsInt("raw palette should have the blue", colors[first + i].B, rgb[2]);
+    }
+
+    return data + REMAP_RAW_HEADER_SIZE + colorCount * 3;
+}
+
+static void test_packed_rows(const remap_palette* palette, const Color* colors, remap_result* result, int bitDepth) {
+    unsigned char* data;
+    size_t dataSize;
+    const int rowSize = (WIDTH * bitDepth + 7) / 8;
+    const int first = (bitDepth == 8 ? 0 : result->rangeMin);
+    const int colorCount = (bitDepth == 8 ? COLORS : result->rangeMax - result->rangeMin + 1);
+
+    assertEqualsInt("raw output should be written", EXIT_SUCCESS, remap_encode_raw(palette, result, REMAP_FORMAT_RAW, bitDepth, &data, &dataSize));
+    assertEqualsInt("raw output should have its size", REMAP_RAW_HEADER_SIZE + colorCount * 3 + rowSize * HEIGHT, (int)dataSize);
+
+    const unsigned char* pixels = check_header(data, REMAP_FORMAT_RAW, bitDepth, first, colorCount, colors);
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            // highest bits first
+            const int bit = x * bitDepth;
+            const int index = (pixels[y * rowSize + bit / 8] >> (8 - bitDepth - bit % 8)) & ((1 << bitDepth) - 1);
+            const int expected = result->indices[y * WIDTH + x] + (bitDepth == 8 ? result->rangeMin : 0);
+            assertEqualsInt("raw pixels should hold the indices", expected, index);
+        }
+        // the padding of a row is zero
+        for (int bit = WIDTH * bitDepth; bit < rowSize * 8; bit++) {
+            assertEqualsInt("raw rows should be padded with zeros", 0, (pixels[y * rowSize + bit / 8] >> (7 - bit % 8)) & 1);
+        }
+    }
+
+    free(data);
+}
+
+/* index of a pixel of an 8x8 tile, decoded the way each console reads it */
+static int tile_pixel(const unsigned char* tile, int format, int x, int y) {
+    switch (format) {
+    case REMAP_FORMAT_SNES:
+        return (tile[y * 2] >> (7 - x) & 1) | (tile[y * 2 + 1] >> (7 - x) & 1) << 1
+            | (tile[16 + y * 2] >> (7 - x) & 1) << 2 | (tile[16 + y * 2 + 1] >> (7 - x) & 1) << 3;
+    case REMAP_FORMAT_GBA:
+        return x % 2 == 0 ? tile[y * 4 + x / 2] & 0x0F : tile[y * 4 + x / 2] >> 4;
+    default:
+        return x % 2 == 0 ? tile[y * 4 + x / 2] >> 4 : tile[y * 4 + x / 2] & 0x0F;
+    }
+}
+
+static void test_tiles(const remap_palette* palette, const Color* colors, remap_result* result, int format) {
+    unsigned char* data;
+    size_t dataSize;
+    const int tilesWide = (WIDTH + 7) / 8, tilesHigh = (HEIGHT + 7) / 8;
+    const int colorCount = result->rangeMax - result->rangeMin + 1;
+
+    assertEqualsInt("tiles should be written", EXIT_SUCCESS, remap_encode_raw(palette, result, format, 4, &data, &dataSize));
+    assertEqualsInt("tiles should have their size", REMAP_RAW_HEADER_SIZE + colorCount * 3 + tilesWide * tilesHigh * REMAP_RAW_TILE_BYTES, (int)dataSize);
+
+    const unsigned char* pixels = check_header(data, format, 4, result->rangeMin, colorCount, colors);
+    for (int y = 0; y < tilesHigh * 8; y++) {
+        for (int x = 0; x < tilesWide * 8; x++) {
+            const unsigned char* tile = pixels + ((y / 8) * tilesWide + x / 8) * REMAP_RAW_TILE_BYTES;
+            // pixels past the edge of the image are index 0
+            const int expected = (x < WIDTH && y < HEIGHT ? result->indices[y * WIDTH + x] : 0);
+            assertEqualsInt("tile pixels should hold the indices", expected, tile_pixel(tile, format, x % 8, y % 8));
+        }
+    }
+
+    free(data);
+}
+
+int main() {
+    Color colors[COLORS];
+    unsigned char indices[WIDTH * HEIGHT];
+    unsigned char* data;
+    size_t dataSize;
+
+    for (int i = 0; i < COLORS; i++) {
+        colors[i] = (Color){ .R = (unsigned char)(i * 6), .G = (unsigned char)(255 - i * 3), .B = (unsigned char)(i * 37), .A = 255 };
+    }
+    remap_palette* palette = remap_palette_create(colors, COLORS);
+    assertEqualsInt("palette should be created", 1, palette != NULL);
+
+    remap_result result = { .indices = indices, .width = WIDTH, .height = HEIGHT, .rangeMin = 16, .paletteSlot = -1 };
+
+    // the range fits the depth, 2, 4 and 16 colors
+    static const int bitDepths[] = { 1, 2, 4, 8 };
+    for (int i = 0; i < 4; i++) {
+        const int bitDepth = bitDepths[i];
+        const int rangeColors = (bitDepth == 8 ? 16 : 1 << bitDepth);
+        result.rangeMax = result.rangeMin + rangeColors - 1;
+        for (int p = 0; p < WIDTH * HEIGHT; p++) {
+            indices[p] = (unsigned char)((p * 7 + p / WIDTH) % rangeColors);
+        }
+        test_packed_rows(palette, colors, &result, bitDepth);
+    }
+
+    for (int format = REMAP_FORMAT_SNES; format <= REMAP_FORMAT_GENESIS; format++) {
+        test_tiles(palette, colors, &result, format);
+    }
+
+    // ranges that don't fit, and depths the formats don't have
+    result.rangeMax = result.rangeMin + 2;
+    assertEqualsInt("3 colors should not fit in 1 bit", EXIT_FAILURE, remap_encode_raw(palette, &result, REMAP_FORMAT_RAW, 1, &data, &dataSize));
+    assertEqualsInt("raw output should not have 3 bits", EXIT_FAILURE, remap_encode_raw(palette, &result, REMAP_FORMAT_RAW, 3, &data, &dataSize));
+    assertEqualsInt("tiles should only have 4 bits", EXIT_FAILURE, remap_encode_raw(palette, &result, REMAP_FORMAT_SNES, 8, &data, &dataSize));
+    assertEqualsInt("PNG is not a raw format", EXIT_FAILURE, remap_encode_raw(palette, &result, REMAP_FORMAT_PNG, 8, &data, &dataSize));
+    assertEqualsInt("failures should leave no data", 1, data == NULL && dataSize == 0);
+
+    remap_palette_destroy(palette);
+
+    printf("All tests passed!\n");
+
+    return EXIT_SUCCESS;
+}
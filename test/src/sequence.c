@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "myassert.h"
+#include "remap_sequence.h"
+
+#define WIDTH 32
+#define HEIGHT 24
+#define PIXELS (WIDTH * HEIGHT)
+#define COLORS 64
+
+static unsigned int seed = 1;
+
+static unsigned int random_int(unsigned int max) {
+    seed = seed * 1103515245U + 12345U;
+    return (seed >> 8) % max;
+}
+
+static void random_pixel(unsigned char* pixel) {
+    pixel[0] = (unsigned char)random_int(256);
+    pixel[1] = (unsigned char)random_int(256);
+    pixel[2] = (unsigned char)random_int(256);
+    pixel[3] = (unsigned char)(random_int(4) ? 255 : random_int(256));
+}
+
+static void change_pixels(unsigned char* image, int count) {
+    for (int i = 0; i < count; i++) {
+        // a pixel changed twice still counts once, so pick distinct ones
+        random_pixel(&image[((i * 37) % PIXELS) * 4]);
+    }
+}
+
+/* a frame of the sequence must come out like the frame remapped on its own */
+static void next_frame(remap_sequence* sequence, remap_palette* palette, const remap_options* options, const unsigned char* image, int width, int height, size_t expectedChanged) {
+    remap_result expected, actual;
+    size_t changedPixels;
+
+    assertEqualsInt("frame should be remapped", EXIT_SUCCESS, remap_sequence_next(sequence, image, width, height, &actual, &changedPixels));
+    assertEqualsInt("frame should look up only the changed pixels", (int)expectedChanged, (int)changedPixels);
+
+    assertEqualsInt("frame should be remapped alone", EXIT_SUCCESS, remap_job_run(palette, options, image, width, height, &expected));
+    assertEqualsInt("sequence frame should have the same indices", 0, memcmp(expected.indices, actual.indices, (size_t)width * height));
+    assertEqualsInt("sequence frame should have alpha when asked for", expected.alpha != NULL, actual.alpha != NULL);
+    if (expected.alpha != NULL) {
+        assertEqualsInt("sequence frame should have the same alpha", 0, memcmp(expected.alpha, actual.alpha, (size_t)width * height));
+    }
+    assertEqualsInt("sequence frame should have the same range", expected.rangeMin, actual.rangeMin);
+    assertEqualsInt("sequence frame should have the same range", expected.rangeMax, actual.rangeMax);
+    assertEqualsInt("sequence frame should have the same color count", expected.inputColors, actual.inputColors);
+    assertEqualsFloat("sequence frame should have the same MSE", (float)expected.mse, (float)actual.mse, 1e-3f);
+
+    remap_result_free(&expected);
+    remap_result_free(&actual);
+}
+
+static void test_sequence(remap_palette* palette, const remap_options* options) {
+    static unsigned char image[PIXELS * 4], smallImage[(WIDTH / 2) * HEIGHT * 4];
+
+    seed = 1;
+    for (int i = 0; i < PIXELS; i++) {
+        random_pixel(&image[i * 4]);
+    }
+    for (int i = 0; i < (WIDTH / 2) * HEIGHT; i++) {
+        random_pixel(&smallImage[i * 4]);
+    }
+
+    remap_sequence* sequence = remap_sequence_create(palette, options);
+    assertEqualsInt("sequence should be created", 1, sequence != NULL);
+
+    // the first frame is remapped whole, then only what changes
+    next_frame(sequence, palette, options, image, WIDTH, HEIGHT, PIXELS);
+    change_pixels(image, 10);
+    next_frame(sequence, palette, options, image, WIDTH, HEIGHT, 10);
+    next_frame(sequence, palette, options, image, WIDTH, HEIGHT, 0);
+    change_pixels(image, PIXELS / 2);
+    next_frame(sequence, palette, options, image, WIDTH, HEIGHT, PIXELS / 2);
+
+    // more than half of the pixels changed, or another size, is a whole frame again
+    change_pixels(image, PIXELS / 2 + 1);
+    next_frame(sequence, palette, options, image, WIDTH, HEIGHT, PIXELS);
+    next_frame(sequence, palette, options, smallImage, WIDTH / 2, HEIGHT, (WIDTH / 2) * HEIGHT);
+    next_frame(sequence, palette, options, image, WIDTH, HEIGHT, PIXELS);
+    change_pixels(image, 3);
+    next_frame(sequence, palette, options, image, WIDTH, HEIGHT, 3);
+
+    remap_sequence_destroy(sequence);
+}
+
+/* an automatic slot is picked from the first frame and kept for the rest */
+static void test_auto_slot(remap_palette* palette) {
+    static unsigned char image[PIXELS * 4];
+    remap_options options;
+    remap_result result;
+    size_t changedPixels;
+
+    remap_options_init(&options);
+    options.paletteSlot = REMAP_SLOT_AUTO;
+    remap_sequence* sequence = remap_sequence_create(palette, &options);
+    assertEqualsInt("sequence should be created", 1, sequence != NULL);
+
+    for (int i = 0; i < PIXELS; i++) {
+        random_pixel(&image[i * 4]);
+    }
+    assertEqualsInt("first frame should be remapped", EXIT_SUCCESS, remap_sequence_next(sequence, image, WIDTH, HEIGHT, &result, &changedPixels));
+    const int slot = result.paletteSlot;
+    assertEqualsInt("first frame should get a slot", 1, slot >= 0 && slot < COLORS / 16);
+    remap_result_free(&result);
+
+    for (int frame = 0; frame < 3; frame++) {
+        change_pixels(image, PIXELS / 4);
+        assertEqualsInt("frame should be remapped", EXIT_SUCCESS, remap_sequence_next(sequence, image, WIDTH, HEIGHT, &result, &changedPixels));
+        assertEqualsInt("frame should keep the first frame's slot", slot, result.paletteSlot);
+        assertEqualsInt("frame should keep the first frame's range", slot * 16, result.rangeMin);
+        remap_result_free(&result);
+    }
+
+    remap_sequence_destroy(sequence);
+}
+
+int main() {
+    Color colors[COLORS];
+    remap_options options;
+
+    for (int i = 0; i < COLORS; i++) {
+        colors[i] = (Color){ .R = (unsigned char)random_int(256), .G = (unsigned char)random_int(256), .B = (unsigned char)random_int(256), .A = 255 };
+    }
+    remap_palette* palette = remap_palette_create(colors, COLORS);
+    assertEqualsInt("palette should be created", 1, palette != NULL);
+
+    remap_options_init(&options);
+    options.countColors = true;
+    options.alpha = true;
+    test_sequence(palette, &options);
+
+    options.rangeMin = 8;
+    options.rangeMax = 40;
+    test_sequence(palette, &options);
+
+    // a fixed slot, which is what an automatic one becomes after the first frame
+    remap_options_init(&options);
+    options.paletteSlot = 2;
+    test_sequence(palette, &options);
+
+    test_auto_slot(palette);
+
+    remap_options_init(&options);
+    options.tileSize = 8;
+    assertEqualsInt("tiles should not be remapped as a sequence", 1, remap_sequence_create(palette, &options) == NULL);
+    remap_options_init(&options);
+    options.dither = REMAP_DITHER_BAYER4;
+    assertEqualsInt("dithering should not be remapped as a sequence", 1, remap_sequence_create(palette, &options) == NULL);
+
+    remap_palette_destroy(palette);
+
+    printf("All tests passed!\n");
+
+    return EXIT_SUCCESS;
+}
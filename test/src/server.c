@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include "myassert.h"
+#include "lodepng.h"
+#include "palette.h"
+#include "remap_server.h"
+
+#define WIDTH 16
+#define HEIGHT 16
+
+static pid_t server = -1;
+
+// failed assertions exit, and must not leave the server behind
+static void stop_server(void) {
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+        server = -1;
+    }
+}
+
+static unsigned char* encode_image(const unsigned char* rgba, unsigned int width, unsigned int height, size_t* size) {
+    unsigned char* png = NULL;
+    assertEqualsInt("test image should encode", 0, lodepng_encode32(&png, size, rgba, width, height));
+    return png;
+}
+
+// palettes are read from paletted PNGs, one pixel per color
+static unsigned char* encode_palette(const unsigned char* rgba, unsigned int colorCount, size_t* size) {
+    unsigned char indices[256], *png = NULL;
+    LodePNGState state;
+
+    lodepng_state_init(&state);
+    state.info_raw.colortype = LCT_PALETTE;
+    state.info_png.color.colortype = LCT_PALETTE;
+    state.encoder.auto_convert = 0;
+    for (unsigned int i = 0; i < colorCount; i++) {
+        lodepng_palette_add(&state.info_raw, rgba[i * 4], rgba[i * 4 + 1], rgba[i * 4 + 2], rgba[i * 4 + 3]);
+        lodepng_palette_add(&state.info_png.color, rgba[i * 4], rgba[i * 4 + 1], rgba[i * 4 + 2], rgba[i * 4 + 3]);
+        indices[i] = (unsigned char)i;
+    }
+    assertEqualsInt("test palette should encode", 0, lodepng_encode(&png, size, indices, colorCount, 1, &state));
+    lodepng_state_cleanup(&state);
+    return png;
+}
+
+static int connect_to_server(const char* socketPath) {
+    // the server needs a moment to start listening
+    for (int attempt = 0; attempt < 100; attempt++) {
+        int clientSocket = remap_client_connect(socketPath);
+        if (clientSocket != -1) {
+            return clientSocket;
+        }
+        usleep(50000);
+    }
+    assertEqualsInt("should connect to the server", 0, 1);
+    return -1;
+}
+
+static void test_invalid_bit_depth(int clientSocket, const remap_request* valid) {
+    static const int bitDepths[] = { 0, 1, 2, 3, 16 };
+    remap_response response;
+
+    for (unsigned int i = 0; i < sizeof(bitDepths) / sizeof(bitDepths[0]); i++) {
+        remap_request request = *valid;
+        request.bitDepth = bitDepths[i];
+        assertEqualsInt("server should answer an invalid bit depth", EXIT_SUCCESS, remap_client_request(clientSocket, &request, &response));
+        assertEqualsInt("server should refuse a PNG bit depth other than 4 or 8", REMAP_SERVER_ERROR, response.status);
+        remap_response_free(&response);
+    }
+
+    // the connection is still usable after the refusals
+    assertEqualsInt("server should answer a valid request", EXIT_SUCCESS, remap_client_request(clientSocket, valid, &response));
+    assertEqualsInt("server should remap a valid request", REMAP_SERVER_OK, response.status);
+    assertEqualsInt("output should have the input's width", WIDTH, response.output.result.width);
+    assertEqualsInt("output should have the input's height", HEIGHT, response.output.result.height);
+    remap_response_free(&response);
+}
+
+static void test_same_as_local(int clientSocket, const remap_request* request) {
+    Color* colors = NULL;
+    int colorCount = 0, transparentIndex = -1;
+    remap_png_result local;
+    remap_response response;
+
+    assertEqualsInt("test palette should be read", EXIT_SUCCESS, read_palette_memory(request->paletteData, request->paletteSize, &colors, &colorCount, &transparentIndex));
+    remap_palette* palette = remap_palette_create(colors, colorCount);
+    free(colors);
+    assertEqualsInt("local remap should succeed", EXIT_SUCCESS, remap_job_run_png(palette, &request->options, request->bitDepth, request->maskBits, request->png, request->pngSize, &local));
+
+    assertEqualsInt("server should answer", EXIT_SUCCESS, remap_client_request(clientSocket, request, &response));
+    assertEqualsInt("server should remap the image", REMAP_SERVER_OK, response.status);
+    assertEqualsInt("server should name the palette by its id", 1, response.paletteId == remap_palette_id(request->paletteData, request->paletteSize));
+    assertEqualsInt("server should send the PNG the local remap writes", (int)local.pngSize, (int)response.output.pngSize);
+    assertEqualsInt("server should send the PNG the local remap writes", 0, memcmp(local.png, response.output.png, local.pngSize));
+    assertEqualsInt("server should send the mask the local remap writes", (int)local.maskPngSize, (int)response.output.maskPngSize);
+    assertEqualsInt("server should send the mask the local remap writes", 0, local.maskPng == NULL ? 0 : memcmp(local.maskPng, response.output.maskPng, local.maskPngSize));
+    assertEqualsInt("server should send the color count", local.result.inputColors, response.output.result.inputColors);
+    assertEqualsInt("server should send the quality", local.result.quality, response.output.result.quality);
+    assertEqualsFloat("server should send the MSE", (float)local.result.mse, (float)response.output.result.mse, 1e-6f);
+    assertEqualsInt("server should not send the indices", 1, response.output.result.indices == NULL);
+
+    remap_response_free(&response);
+    remap_png_result_free(&local);
+    remap_palette_destroy(palette);
+}
+
+static int request_status(int clientSocket, const remap_request* request) {
+    remap_response response;
+    assertEqualsInt("server should answer", EXIT_SUCCESS, remap_client_request(clientSocket, request, &response));
+    remap_response_free(&response);
+    return response.status;
+}
+
+/* the server keeps two palettes, and forgets the one used least recently */
+static void test_palette_cache(int clientSocket, const remap_request* valid, unsigned char* palettes[3], size_t paletteSizes[3]) {
+    remap_request byData[3], byId[3];
+
+    for (int i = 0; i < 3; i++) {
+        byData[i] = byId[i] = *valid;
+        byData[i].paletteData = palettes[i];
+        byData[i].paletteSize = paletteSizes[i];
+        byId[i].paletteData = NULL;
+        byId[i].paletteSize = 0;
+        byId[i].paletteId = remap_palette_id(palettes[i], paletteSizes[i]);
+    }
+
+    assertEqualsInt("an unseen palette id should be unknown", REMAP_SERVER_UNKNOWN_PALETTE, request_status(clientSocket, &byId[2]));
+    assertEqualsInt("a sent palette should be used", REMAP_SERVER_OK, request_status(clientSocket, &byData[0]));
+    assertEqualsInt("a sent palette should be used", REMAP_SERVER_OK, request_status(clientSocket, &byData[1]));
+    assertEqualsInt("a cached palette should be found by id", REMAP_SERVER_OK, request_status(clientSocket, &byId[0]));
+    assertEqualsInt("a third palette should be used", REMAP_SERVER_OK, request_status(clientSocket, &byData[2]));
+
+    assertEqualsInt("the least recently used palette should be evicted", REMAP_SERVER_UNKNOWN_PALETTE, request_status(clientSocket, &byId[1]));
+    assertEqualsInt("a recently used palette should stay cached", REMAP_SERVER_OK, request_status(clientSocket, &byId[0]));
+    assertEqualsInt("the newest palette should stay cached", REMAP_SERVER_OK, request_status(clientSocket, &byId[2]));
+}
+
+/* a connection that doesn't speak the protocol is dropped, without taking the server down */
+static void test_bad_magic(const char* socketPath, const remap_request* valid) {
+    static const char garbage[] = "GET / HTTP/1.0\r\n\r\n";
+    char reply;
+
+    int badSocket = connect_to_server(socketPath);
+    assertEqualsInt("garbage should be sent", (int)sizeof(garbage), (int)write(badSocket, garbage, sizeof(garbage)));
+    // the unread rest of the garbage may turn the hang up into a reset
+    assertEqualsInt("server should hang up on garbage", 1, read(badSocket, &reply, 1) <= 0);
+    close(badSocket);
+
+    int clientSocket = connect_to_server(socketPath);
+    assertEqualsInt("server should still serve requests", REMAP_SERVER_OK, request_status(clientSocket, valid));
+    close(clientSocket);
+}
+
+/* idle connections on every worker are closed after the idle timeout, so other clients get served */
+static void test_idle_timeout(const char* socketPath, const remap_request* valid) {
+    int idleSockets[2];
+    char reply;
+
+    for (int i = 0; i < 2; i++) {
+        idleSockets[i] = connect_to_server(socketPath);
+    }
+
+    // without the timeout the request would wait forever, so give up long after it
+    int clientSocket = connect_to_server(socketPath);
+    struct timeval timeout = { .tv_sec = 10 };
+    setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    assertEqualsInt("server should serve a client waiting behind idle ones", REMAP_SERVER_OK, request_status(clientSocket, valid));
+    close(clientSocket);
+
+    for (int i = 0; i < 2; i++) {
+        assertEqualsInt("server should hang up on idle clients", 0, (int)read(idleSockets[i], &reply, 1));
+        close(idleSockets[i]);
+    }
+}
+
+int main() {
+    unsigned char paletteRgba[16 * 4], imageRgba[WIDTH * HEIGHT * 4];
+    unsigned char* palettes[3];
+    size_t paletteSizes[3], pngSize;
+    char socketPath[64];
+
+    for (int p = 0; p < 3; p++) {
+        for (int i = 0; i < 16; i++) {
+            paletteRgba[i * 4] = (unsigned char)(i * 17);
+            paletteRgba[i * 4 + 1] = (unsigned char)(255 - i * 17);
+            paletteRgba[i * 4 + 2] = (unsigned char)(i * 5 + p * 60);
+            paletteRgba[i * 4 + 3] = 255;
+        }
+        palettes[p] = encode_palette(paletteRgba, 16, &paletteSizes[p]);
+    }
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        imageRgba[i * 4] = (unsigned char)(i * 7);
+        imageRgba[i * 4 + 1] = (unsigned char)(i * 3);
+        imageRgba[i * 4 + 2] = (unsigned char)(i * 11);
+        imageRgba[i * 4 + 3] = (unsigned char)(i % 5 == 0 ? 0 : 255);
+    }
+
+    unsigned char* png = encode_image(imageRgba, WIDTH, HEIGHT, &pngSize);
+
+    snprintf(socketPath, sizeof(socketPath), "/tmp/remap-test-%d.sock", (int)getpid());
+
+    server = fork();
+    if (server == 0) {
+        _exit(remap_server_run(socketPath, 2, 1, 2, NULL, 1));
+    }
+    assertEqualsInt("server process should start", 1, server > 0);
+    atexit(stop_server);
+
+    int clientSocket = connect_to_server(socketPath);
+
+    remap_request request = { .bitDepth = 8, .maskBits = 0, .paletteData = palettes[0], .paletteSize = paletteSizes[0], .png = png, .pngSize = pngSize };
+    remap_options_init(&request.options);
+
+    test_invalid_bit_depth(clientSocket, &request);
+
+    test_same_as_local(clientSocket, &request);
+    remap_request variant = request;
+    variant.bitDepth = 4;
+    variant.maskBits = 8;
+    variant.options.paletteSlot = REMAP_SLOT_AUTO;
+    test_same_as_local(clientSocket, &variant);
+
+    test_palette_cache(clientSocket, &request, palettes, paletteSizes);
+
+    close(clientSocket);
+
+    test_bad_magic(socketPath, &request);
+
+    test_idle_timeout(socketPath, &request);
+
+    stop_server();
+
+    for (int p = 0; p < 3; p++) {
+        free(palettes[p]);
+    }
+    free(png);
+
+    printf("All tests passed!\n");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "myassert.h"
+#include "remap_job.h"
+
+#define SLOTS 4
+#define TILE_SIZE 8
+#define WIDTH 44
+#define HEIGHT 148
+
+/* every slot has colors no other slot has: shades of red, green, blue and grey */
+static Color slot_color(int slot, int i) {
+    const unsigned char shade = (unsigned char)(15 + i * 16);
+    return (Color){ .R = slot == 0 || slot == 3 ? shade : 0, .G = slot == 1 || slot == 3 ? shade : 0, .B = slot == 2 || slot == 3 ? shade : 0, .A = 255 };
+}
+
+/* the slot whose colors a tile is painted with */
+static int tile_slot(int tileX, int tileY) {
+    return (tileX * 3 + tileY) % SLOTS;
+}
+
+static void test_tile_map(remap_palette* palette, const unsigned char* rgbaImage, int threads, remap_result* result) {
+    remap_options options;
+
+    remap_options_init(&options);
+    options.tileSize = TILE_SIZE;
+    options.threads = threads;
+    assertEqualsInt("tiles should be remapped", EXIT_SUCCESS, remap_job_run(palette, &options, rgbaImage, WIDTH, HEIGHT, result));
+
+    // the edge tiles are cut off, and still get a slot
+    assertEqualsInt("tile map should have the tile size", TILE_SIZE, result->tileSize);
+    assertEqualsInt("tile map should cover the width", (WIDTH + TILE_SIZE - 1) / TILE_SIZE, result->tilesWide);
+    assertEqualsInt("tile map should cover the height", (HEIGHT + TILE_SIZE - 1) / TILE_SIZE, result->tilesHigh);
+    assertEqualsInt("tile map should be returned", 1, result->tileSlots != NULL);
+
+    for (int tileY = 0; tileY < result->tilesHigh; tileY++) {
+        for (int tileX = 0; tileX < result->tilesWide; tileX++) {
+            assertEqualsInt("every tile should get the slot of its colors", tile_slot(tileX, tileY), result->tileSlots[tileY * result->tilesWide + tileX]);
+        }
+    }
+
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            const int slot = tile_slot(x / TILE_SIZE, y / TILE_SIZE);
+            assertEqualsInt("pixels should keep their exact color from their tile's slot", slot * 16 + (x + y) % 16, result->indices[y * WIDTH + x]);
+        }
+    }
+    assertEqualsFloat("exact colors should leave no error", 0.f, (float)result->mse, 1e-6f);
+}
+
+int main() {
+    Color colors[SLOTS * 16];
+    static unsigned char rgbaImage[WIDTH * HEIGHT * 4];
+    remap_result expected, actual;
+
+    for (int slot = 0; slot < SLOTS; slot++) {
+        for (int i = 0; i < 16; i++) {
+            colors[slot * 16 + i] = slot_color(slot, i);
+        }
+    }
+    remap_palette* palette = remap_palette_create(colors, SLOTS * 16);
+    assertEqualsInt("palette should be created", 1, palette != NULL);
+
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            const Color color = slot_color(tile_slot(x / TILE_SIZE, y / TILE_SIZE), (x + y) % 16);
+            unsigned char* pixel = &rgbaImage[(y * WIDTH + x) * 4];
+            pixel[0] = color.R;
+            pixel[1] = color.G;
+            pixel[2] = color.B;
+            pixel[3] = color.A;
+        }
+    }
+
+    test_tile_map(palette, rgbaImage, 1, &expected);
+
+    // rows of tiles are shared out between threads, which mustn't change the map
+    static const int threads[] = { 0, 2, 3, 32 };
+    for (int i = 0; i < 4; i++) {
+        test_tile_map(palette, rgbaImage, threads[i], &actual);
+        assertEqualsInt("threads should give the same tile map", 0, memcmp(expected.tileSlots, actual.tileSlots, (size_t)expected.tilesWide * expected.tilesHigh));
+        assertEqualsInt("threads should give the same pixels", 0, memcmp(expected.indices, actual.indices, WIDTH * HEIGHT));
+        remap_result_free(&actual);
+    }
+
+    remap_result_free(&expected);
+    remap_palette_destroy(palette);
+
+    printf("All tests passed!\n");
+
+    return EXIT_SUCCESS;
+}